@@ -0,0 +1,101 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#ifndef __LIBBTC_ADDRMAN_H__
+#define __LIBBTC_ADDRMAN_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "btc.h"
+#include "protocol.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* the "new" table holds addresses we have heard of, the "tried" table the ones
+   we have successfully connected to. Every address maps to one slot per table
+   (keyed hash of its /16 group and of the address), colliding addresses either
+   replace a stale entry or get dropped.
+*/
+#define BTC_ADDRMAN_BUCKET_SIZE 64
+#define BTC_ADDRMAN_NEW_BUCKETS 64
+#define BTC_ADDRMAN_TRIED_BUCKETS 16
+
+typedef struct btc_addrman_entry_ {
+    btc_p2p_address addr;  /* including the last seen time (addr.time) */
+    uint32_t last_try;     /* last connection attempt */
+    uint32_t last_success; /* last successful connection */
+    uint16_t attempts;     /* connection attempts since the last success */
+    btc_bool tried;
+} btc_addrman_entry;
+
+typedef struct btc_addrman_ {
+    uint8_t key[32]; /* secret bucket key, persisted with the addresses */
+    uint64_t rand_state; /* selection randomness (xorshift), seeded from the initial key */
+    btc_addrman_entry* new_table[BTC_ADDRMAN_NEW_BUCKETS * BTC_ADDRMAN_BUCKET_SIZE];
+    btc_addrman_entry* tried_table[BTC_ADDRMAN_TRIED_BUCKETS * BTC_ADDRMAN_BUCKET_SIZE];
+    size_t new_count;
+    size_t tried_count;
+    pthread_mutex_t mutex; /* the address manager can be shared across threads */
+} btc_addrman;
+
+/* create/free an address manager */
+LIBBTC_API btc_addrman* btc_addrman_new(void);
+LIBBTC_API void btc_addrman_free(btc_addrman* addrman);
+
+/* total amount of known addresses */
+LIBBTC_API size_t btc_addrman_size(btc_addrman* addrman);
+
+/* add a learned address to the new table, returns false if it was already known or has been dropped */
+LIBBTC_API btc_bool btc_addrman_add(btc_addrman* addrman, const btc_p2p_address* addr, uint32_t now);
+
+/* record a connection attempt to an address */
+LIBBTC_API void btc_addrman_attempt(btc_addrman* addrman, const btc_p2p_address* addr, uint32_t now);
+
+/* record a successful connection, moves the address to the tried table */
+LIBBTC_API void btc_addrman_good(btc_addrman* addrman, const btc_p2p_address* addr, uint32_t now);
+
+/* select an address to connect to (biased to tried and reliable addresses) that offers all of the
+   given service bits, returns false if none is available */
+LIBBTC_API btc_bool btc_addrman_select(btc_addrman* addrman, uint32_t now, uint64_t services, btc_p2p_address* addr_out);
+
+/* get a random sample of known (not terrible) addresses, returns the amount written to addrs_out */
+LIBBTC_API size_t btc_addrman_get_addr(btc_addrman* addrman, uint32_t now, btc_p2p_address* addrs_out, size_t max);
+
+/* persist the address manager to a file (written to a temporary file and renamed) */
+LIBBTC_API btc_bool btc_addrman_write(btc_addrman* addrman, const char* file_path);
+
+/* load a file written by btc_addrman_write, adds the addresses to the existing ones */
+LIBBTC_API btc_bool btc_addrman_load(btc_addrman* addrman, const char* file_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIBBTC_ADDRMAN_H__
@@ -37,6 +37,9 @@ extern "C" {
 #include "buffer.h"
 #include "cstr.h"
 #include "hash.h"
+#include "serialize.h"
+#include "threadpool.h"
+#include "tx.h"
 
 #include <stddef.h>
 
@@ -53,9 +56,48 @@ LIBBTC_API btc_block_header* btc_block_header_new();
 LIBBTC_API void btc_block_header_free(btc_block_header* header);
 LIBBTC_API int btc_block_header_deserialize(btc_block_header* header, struct const_buffer* buf);
 LIBBTC_API void btc_block_header_serialize(cstring* s, const btc_block_header* header);
+LIBBTC_API void btc_block_header_serialize_sink(btc_ser_sink* sink, const btc_block_header* header);
 LIBBTC_API void btc_block_header_copy(btc_block_header* dest, const btc_block_header* src);
 LIBBTC_API btc_bool btc_block_header_hash(btc_block_header* header, uint256 hash);
 
+/* checks if the hash satisfies the proof of work target claimed by the headers nBits */
+LIBBTC_API btc_bool btc_block_header_check_pow(const btc_block_header* header, const uint256 hash);
+
+/* expand the compact nBits representation into a little endian 256bit target
+   returns false for negative, overflowing or zero targets */
+LIBBTC_API btc_bool btc_block_bits_to_target(uint32_t bits, uint256 target);
+
+/* compact nBits representation of a little endian 256bit target (precision beyond 3 bytes is dropped) */
+LIBBTC_API uint32_t btc_block_target_to_bits(const uint256 target);
+
+/* a fully deserialized block, all transactions live in a single arena owned by the block */
+typedef struct btc_block_ {
+    btc_block_header header;
+    uint256 hash;
+    size_t tx_count;
+    btc_tx** txs;    /* read-only, see btc_tx_deserialize_arena (NULL if only the txids were deserialized) */
+    uint256* txids;  /* txids[i] is the hash of txs[i] */
+    void* arena;
+} btc_block;
+
+LIBBTC_API btc_block* btc_block_new();
+LIBBTC_API void btc_block_free(btc_block* block);
+
+/* deserializes a block into an empty block and advances buf behind it
+   the transactions are decoded and hashed on the given pool (can be NULL) */
+LIBBTC_API btc_bool btc_block_deserialize(btc_block* block, struct const_buffer* buf, btc_threadpool* pool);
+
+/* same as btc_block_deserialize but the transactions are only hashed (txs stays NULL)
+   for readers using btc_tx_view on the serialized block */
+LIBBTC_API btc_bool btc_block_deserialize_txids(btc_block* block, struct const_buffer* buf, btc_threadpool* pool);
+
+/* merkle root of count hashes (each tree level is hashed on the given pool, can be NULL)
+   mutated is set if the tree contains duplicated subtrees (CVE-2012-2459), can be NULL */
+LIBBTC_API void btc_block_merkle_root(const uint256* hashes, size_t count, btc_threadpool* pool, uint256 root, btc_bool* mutated);
+
+/* checks the merkle root of the transactions against the header, mutated trees are rejected */
+LIBBTC_API btc_bool btc_block_check_merkle_root(const btc_block* block, btc_threadpool* pool);
+
 #ifdef __cplusplus
 }
 #endif
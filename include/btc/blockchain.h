@@ -33,6 +33,9 @@ extern "C" {
 
 #include "block.h"
 #include "btc.h"
+#include "buffer.h"
+#include "chainparams.h"
+#include "threadpool.h"
 
 #include <stdint.h>
 #include <sys/types.h>
@@ -42,8 +45,38 @@ typedef struct btc_blockindex {
     uint256 hash;
     btc_block_header header;
     struct btc_blockindex* prev;
+    struct btc_blockindex* pskip; /* ancestor further back, used to find ancestors in O(log n) */
 } btc_blockindex;
 
+/* upper bound of the hashes in a block locator (dense tip entries followed by exponential steps) */
+#define BTC_BLOCK_LOCATOR_MAX 48
+
+/* size of a header inside a headers message (header plus an empty transaction count) */
+#define BTC_HEADERS_MSG_ENTRY_SIZE 81
+
+/* amount of blocks between two difficulty adjustments */
+#define BTC_DIFFICULTY_ADJUSTMENT_INTERVAL 2016
+
+/* deserializes, hashes and checks the proof of work of count entries of a headers message
+   on the given pool (can be NULL) and verifies that each header links to its predecessor
+   out gets filled with newly allocated blockindexes (height and prev are left unset)
+   returns the amount of leading valid entries, out entries behind them are NULL */
+LIBBTC_API size_t btc_blockindex_prepare_headers(btc_threadpool* pool, struct const_buffer* buf, size_t count, btc_blockindex** out);
+
+/* set the skip pointer of a blockindex with a linked prev (height needs to be set)
+   skip targets below min_height (no longer kept in memory) are left NULL */
+LIBBTC_API void btc_blockindex_build_skip(btc_blockindex* pindex, uint32_t min_height);
+
+/* returns the ancestor of pindex at the given height (or NULL)
+   all headers between height and pindex need to be in memory */
+LIBBTC_API btc_blockindex* btc_blockindex_get_ancestor(btc_blockindex* pindex, uint32_t height);
+
+/* checks the difficulty (nBits) a header at height claims on top of prev
+   the target can't exceed the chains pow limit, stays unchanged between adjustments and
+   moves by at most a factor of 4 at an adjustment (the exact retarget needs the timestamps
+   of the whole period and is not checked), a prev with unknown bits (0) only checks the limit */
+LIBBTC_API btc_bool btc_blockindex_check_bits(const btc_chainparams* params, const btc_blockindex* prev, const btc_block_header* header, uint32_t height);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,78 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#ifndef __LIBBTC_BLOCKFILTER_H__
+#define __LIBBTC_BLOCKFILTER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "btc.h"
+
+#include "buffer.h"
+#include "cstr.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* BIP158 basic filter parameters */
+#define BTC_BLOCKFILTER_TYPE_BASIC 0
+#define BTC_BLOCKFILTER_BASIC_P 19
+#define BTC_BLOCKFILTER_BASIC_M 784931
+
+/* set of elements (scripts) to test against block filters
+   matching only uses the memory allocated while adding elements
+*/
+typedef struct btc_blockfilter_matcher_ {
+    cstring* elements; /* concatenated elements */
+    uint32_t* offsets; /* start of each element, count+1 entries */
+    uint64_t* hashed;  /* hashed and sorted elements of the last match */
+    size_t count;
+    size_t alloc;
+} btc_blockfilter_matcher;
+
+LIBBTC_API uint64_t btc_siphash(uint64_t k0, uint64_t k1, const uint8_t* data, size_t len);
+
+/* create a basic filter (BIP158 golomb coded set) of the given elements */
+LIBBTC_API void btc_blockfilter_build(cstring* filter_out, const uint256 block_hash, const struct const_buffer* elements, size_t count);
+
+/* double sha256 of the serialized filter and the filter header committing to it */
+LIBBTC_API void btc_blockfilter_hash(const uint8_t* filter, size_t len, uint256 hash_out);
+LIBBTC_API void btc_blockfilter_header(const uint256 filter_hash, const uint256 prev_header, uint256 header_out);
+
+LIBBTC_API btc_blockfilter_matcher* btc_blockfilter_matcher_new();
+LIBBTC_API void btc_blockfilter_matcher_free(btc_blockfilter_matcher* matcher);
+LIBBTC_API void btc_blockfilter_matcher_add(btc_blockfilter_matcher* matcher, const uint8_t* data, size_t len);
+
+/* returns true if any element of the matcher is (probably) in the serialized filter */
+LIBBTC_API btc_bool btc_blockfilter_match_any(btc_blockfilter_matcher* matcher, const uint256 block_hash, const uint8_t* filter, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIBBTC_BLOCKFILTER_H__
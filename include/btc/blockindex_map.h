@@ -0,0 +1,73 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#ifndef __LIBBTC_BLOCKINDEX_MAP_H__
+#define __LIBBTC_BLOCKINDEX_MAP_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "btc.h"
+#include "blockchain.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* open addressing (linear probing) hash index for block indexes
+   keyed on the first 8 bytes of the block hash, lookups don't allocate
+*/
+typedef struct btc_blockindex_map_entry_ {
+    uint64_t key;
+    btc_blockindex* blockindex; /* NULL marks an empty slot */
+} btc_blockindex_map_entry;
+
+typedef struct btc_blockindex_map_ {
+    btc_blockindex_map_entry* entries;
+    size_t size; /* amount of slots, always a power of two */
+    size_t count;
+} btc_blockindex_map;
+
+/* create a new map with space for at least min_elements without rehashing */
+LIBBTC_API btc_blockindex_map* btc_blockindex_map_new(size_t min_elements);
+
+/* free the map and call free_cb (if set) on every stored block index */
+LIBBTC_API void btc_blockindex_map_free(btc_blockindex_map* map, void (*free_cb)(void*));
+
+/* add a block index, returns false if the hash is already present */
+LIBBTC_API btc_bool btc_blockindex_map_insert(btc_blockindex_map* map, btc_blockindex* blockindex);
+
+/* lookup a block index by its hash, returns NULL if not found */
+LIBBTC_API btc_blockindex* btc_blockindex_map_find(const btc_blockindex_map* map, const uint256 hash);
+
+/* remove a block index by its hash (the block index itself is not freed) */
+LIBBTC_API btc_bool btc_blockindex_map_remove(btc_blockindex_map* map, const uint256 hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIBBTC_BLOCKINDEX_MAP_H__
@@ -54,6 +54,9 @@ typedef struct btc_chainparams_ {
     const char txref_code_magic;
     const char txref_code_hrp[8];
     btc_bool txref_code_testnet;
+    uint32_t pow_limit_bits; /* compact form of the easiest allowed target */
+    btc_bool pow_allow_min_difficulty_blocks;
+    btc_bool pow_no_retargeting;
 } btc_chainparams;
 
 typedef struct btc_checkpoint_ {
@@ -54,12 +54,16 @@ typedef struct btc_headers_db_interface_
     /* loads database from filename */
     btc_bool (*load)(void *db, const char *filename);
 
-    /* fill in blocklocator up to the tip */
-    void (*fill_blocklocator_tip)(void* db, vector *blocklocators);
+    /* fill in a blocklocator (up to max hashes) starting at the tip, returns the amount of hashes */
+    size_t (*fill_blocklocator_tip)(void* db, uint256 *locator, size_t max);
 
     /* connect (append) a header */
     btc_blockindex *(*connect_hdr)(void* db, struct const_buffer *buf, btc_bool load_process, btc_bool *connected);
 
+    /* connect (append) an already deserialized and hashed header, ownership moves to the db if connected
+       for already known headers, the passed one is freed and the known index is returned */
+    btc_blockindex *(*connect_blockindex)(void* db, btc_blockindex *blockindex, btc_bool load_process, btc_bool *connected);
+
     /* get the chain tip */
     btc_blockindex* (*getchaintip)(void *db);
 
@@ -71,6 +75,12 @@ typedef struct btc_headers_db_interface_
 
     /* set that we are using a checkpoint as basepoint at given height with given hash */
     void (*set_checkpoint_start)(void *db, uint256 hash, uint32_t height);
+
+    /* start a write batch, headers connected until commit_batch are persisted at once */
+    void (*begin_batch)(void *db);
+
+    /* end a write batch and persist it according to the backends durability setting */
+    btc_bool (*commit_batch)(void *db);
 } btc_headers_db_interface;
 
 
@@ -35,22 +35,48 @@ extern "C" {
 #include "blockchain.h"
 #include "buffer.h"
 #include "chainparams.h"
+#include "cstr.h"
 
 #include "headersdb.h"
+#include "vector.h"
 
 #include <stdio.h>
 
-/* filebased headers database (including binary tree option for fast access)
+/* durability of the headers file */
+enum btc_headers_db_sync_mode {
+    BTC_HEADERS_DB_SYNC_BATCH = 0, /* commit (fsync) once per batch (default) */
+    BTC_HEADERS_DB_SYNC_PERIODIC = 1, /* commit at most every sync_interval seconds */
+    BTC_HEADERS_DB_SYNC_NONE = 2, /* never commit, leave flushing to the OS */
+};
+
+/* filebased headers database (including hash index option for fast access)
+   the file stores the main chain as fixed-stride records (height maps to
+   a file offset) followed by a small trailer, only the tip window is read
+   on load
 */
 typedef struct btc_headers_db_
 {
     FILE *headers_tree_file;
     btc_bool read_write_file;
-
-    void *tree_root;
-    btc_bool use_binary_tree;
-
-    unsigned int max_hdr_in_mem;
+    uint32_t file_base_height; /* height of the first record in the file */
+    uint32_t file_records; /* amount of records stored in the file */
+
+    enum btc_headers_db_sync_mode sync_mode;
+    unsigned int sync_interval; /* seconds between commits in periodic mode */
+    uint64_t last_sync_time;
+    unsigned int batch_depth; /* >0 while a batch is open */
+    cstring *write_buffer; /* pending records, written at the end of a batch */
+    uint32_t write_buffer_first; /* record number of the first pending record */
+    btc_bool trailer_dirty;
+
+    struct btc_blockindex_map_ *hash_index;
+    btc_bool use_hash_index;
+
+    unsigned int max_hdr_in_mem; /* size of the in-memory window, 0 keeps all headers (set before loading) */
+    btc_blockindex **window; /* main chain headers of the window, indexed by height % window_size */
+    uint32_t window_size;
+    vector **side_window; /* fork and reorganized headers of each window slot, released like the main chain headers */
+    const btc_chainparams *chainparams;
     btc_blockindex genesis;
     btc_blockindex *chaintip;
     btc_blockindex *chainbottom;
@@ -61,30 +87,50 @@ void btc_headers_db_free(btc_headers_db *db);
 
 btc_bool btc_headers_db_load(btc_headers_db* db, const char *filename);
 btc_blockindex * btc_headers_db_connect_hdr(btc_headers_db* db, struct const_buffer *buf, btc_bool load_process, btc_bool *connected);
+/* connects an already hashed blockindex, the database takes ownership if connected
+   an already known header is freed and the known index is returned (as connected) */
+btc_blockindex * btc_headers_db_connect_blockindex(btc_headers_db* db, btc_blockindex *blockindex, btc_bool load_process, btc_bool *connected);
 
-void btc_headers_db_fill_block_locator(btc_headers_db* db, vector *blocklocators);
+/* fill the caller provided locator with up to max hashes (BTC_BLOCK_LOCATOR_MAX for a full
+   locator), the last one is always the genesis block, returns the amount of hashes */
+size_t btc_headers_db_fill_block_locator(btc_headers_db* db, uint256 *locator, size_t max);
 
 btc_blockindex * btc_headersdb_find(btc_headers_db* db, uint256 hash);
 btc_blockindex * btc_headersdb_getchaintip(btc_headers_db* db);
+/* copy of the main chain header at the given height, headers outside of the in-memory
+   window are read from the headers file (prev and pskip are not set) */
+btc_bool btc_headersdb_get_main_chain_header(btc_headers_db* db, uint32_t height, btc_blockindex *out);
+/* ancestor of pindex at the given height, NULL if it is no longer in memory */
+btc_blockindex * btc_headersdb_get_ancestor(btc_headers_db* db, btc_blockindex *pindex, uint32_t height);
 btc_bool btc_headersdb_disconnect_tip(btc_headers_db* db);
 
 btc_bool btc_headersdb_has_checkpoint_start(btc_headers_db* db);
 void btc_headersdb_set_checkpoint_start(btc_headers_db* db, uint256 hash, uint32_t height);
 
+/* group commits: headers connected between begin/commit are written and
+   synced (according to the sync mode) once, batches can be nested */
+void btc_headers_db_set_sync_mode(btc_headers_db* db, enum btc_headers_db_sync_mode mode, unsigned int interval);
+void btc_headers_db_begin_batch(btc_headers_db* db);
+btc_bool btc_headers_db_commit_batch(btc_headers_db* db);
+
 
 // interface function pointer bindings
 static const btc_headers_db_interface btc_headers_db_interface_file = {
     (void* (*)(const btc_chainparams*, btc_bool))btc_headers_db_new,
     (void (*)(void *))btc_headers_db_free,
     (btc_bool (*)(void *, const char *))btc_headers_db_load,
-    (void (*)(void* , vector *))btc_headers_db_fill_block_locator,
+    (size_t (*)(void* , uint256 *, size_t))btc_headers_db_fill_block_locator,
     (btc_blockindex *(*)(void* , struct const_buffer *, btc_bool , btc_bool *))btc_headers_db_connect_hdr,
+    (btc_blockindex *(*)(void* , btc_blockindex *, btc_bool , btc_bool *))btc_headers_db_connect_blockindex,
 
     (btc_blockindex* (*)(void *))btc_headersdb_getchaintip,
     (btc_bool (*)(void *))btc_headersdb_disconnect_tip,
 
     (btc_bool (*)(void *))btc_headersdb_has_checkpoint_start,
-    (void (*)(void *, uint256, uint32_t))btc_headersdb_set_checkpoint_start
+    (void (*)(void *, uint256, uint32_t))btc_headersdb_set_checkpoint_start,
+
+    (void (*)(void *))btc_headers_db_begin_batch,
+    (btc_bool (*)(void *))btc_headers_db_commit_batch
 };
 
 #ifdef __cplusplus
@@ -33,14 +33,25 @@ extern "C" {
 
 #include <event2/event.h>
 
+#include <pthread.h>
+
+#include "addrman.h"
 #include "btc.h"
 #include "buffer.h"
 #include "chainparams.h"
 #include "cstr.h"
 #include "protocol.h"
+#include "sha2.h"
+#include "timerwheel.h"
 #include "vector.h"
 
 static const unsigned int BTC_P2P_MESSAGE_CHUNK_SIZE = 4096;
+/* amount of new payload data that triggers hashing of a partially received message */
+static const unsigned int BTC_P2P_MESSAGE_HASH_CHUNK_SIZE = 65536;
+/* default receive budgets of a single node (room for a maximum sized block and the following messages)
+   and of all nodes of a group together */
+static const unsigned int BTC_P2P_DEFAULT_RECV_BUDGET_NODE = 0x00500000;
+static const unsigned int BTC_P2P_DEFAULT_RECV_BUDGET_GROUP = 0x01400000;
 
 enum NODE_STATE {
     NODE_CONNECTING = (1 << 0),
@@ -56,24 +67,84 @@ enum NODE_STATE {
 
 /* basic group-of-nodes structure */
 struct btc_node_;
+struct btc_node_group_event_;
+struct evdns_base;
+
+/* a worker thread with its own event base, driving a subset of the groups nodes */
+typedef struct btc_node_group_shard_ {
+    struct event_base* event_base;
+    pthread_t thread;
+    btc_bool running;
+} btc_node_group_shard;
+
+/* handler for a single message command, see btc_node_group_register_cmd_handler */
+typedef void (*btc_node_cmd_handler)(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
+
 typedef struct btc_node_group_ {
     void* ctx; /* flexible context usefull in conjunction with the callbacks */
     struct event_base* event_base;
     vector* nodes; /* the groups nodes */
     char clientstr[1024];
     int desired_amount_connected_nodes;
+    uint64_t required_services; /* service bits a peer needs to offer, default BTC_NODE_NETWORK */
+    int last_nodeid; /* id of the last added node */
     const btc_chainparams* chainparams;
 
     /* callbacks */
     int (*log_write_cb)(const char* format, ...); /* log callback, default=printf */
+    /* called before the internal logic for every complete message, return false to skip it
+       (called on the nodes worker thread in threaded mode) */
     btc_bool (*parse_cmd_cb)(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
     void (*postcmd_cb)(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
     void (*node_connection_state_changed_cb)(struct btc_node_* node);
     btc_bool (*should_connect_to_more_nodes_cb)(struct btc_node_* node);
     void (*handshake_done_cb)(struct btc_node_* node);
     btc_bool (*periodic_timer_cb)(struct btc_node_* node, uint64_t* time); // return false will cancle the internal logic
+    /* check a message from its header before the payload gets buffered, return false to discard it
+       (called on the nodes worker thread in threaded mode) */
+    btc_bool (*accept_msg_cb)(struct btc_node_* node, btc_p2p_msg_hdr* hdr);
+
+    /* per command handlers, called after the internal logic and before postcmd_cb */
+    btc_node_cmd_handler cmd_handlers[BTC_CMD_MAX];
+
+    pthread_mutex_t nodes_mutex; /* guards the nodes vector */
+
+    btc_addrman* addrman;  /* known peer addresses, candidates for btc_node_group_connect_next_nodes */
+    cstring* addrman_file; /* persisted on btc_node_group_free if set */
+
+    /* threaded mode (see btc_node_group_new_threaded) */
+    btc_node_group_shard* shards;
+    unsigned int num_shards;
+    struct btc_node_group_event_* event_queue; /* lock-free callback queue, consumed on the event_base thread */
+    struct event* event_queue_ev;
+
+    /* timers of all nodes (and of the groups users), turned by a single event on event_base */
+    btc_timer_wheel timer_wheel;
+    struct event* timer_wheel_ev;
+
+    /* receive budgets: recv_budget_node is the read high watermark of each node and the largest
+       acceptable message, recv_budget_group bounds the partially received messages of all nodes
+       together (nodes pause reading until they get their share, a single message is always admitted) */
+    size_t recv_budget_node;
+    size_t recv_budget_group;
+    size_t recv_reserved; /* reserved share of recv_budget_group */
+    int recv_paused;      /* amount of nodes waiting for their share */
+    struct event* recv_resume_ev;
+
+    /* asynchronous dns seeding (see btc_node_group_seed_dns) */
+    struct evdns_base* dns_base;
+    int dns_pending; /* outstanding lookups */
 } btc_node_group;
 
+/* a serialized message that can be sent to many nodes, the header (and its checksum) is built
+   once and the payload is referenced (not copied) by the output buffers of the nodes */
+typedef struct btc_node_msg_ {
+    uint8_t header[24]; /* BTC_P2P_HDRSZ */
+    uint8_t* payload;
+    uint32_t payload_len;
+    int refcount; /* the creators reference plus one per output buffer holding the payload */
+} btc_node_msg;
+
 enum {
     NODE_CONNECTIONSTATE_DISCONNECTED = 0,
     NODE_CONNECTIONSTATE_CONNECTING = 5,
@@ -84,22 +155,40 @@ enum {
 
 /* basic node structure */
 typedef struct btc_node_ {
-    struct sockaddr addr;
+    struct sockaddr_storage addr; /* IPv4 or IPv6 */
     struct bufferevent* event_bev;
-    struct event* timer_event;
+    btc_timer timer; /* periodic node logic, on the groups timer wheel */
     btc_node_group* nodegroup;
+    btc_node_group_shard* shard; /* thread driving the nodes events, NULL in single threaded mode */
     int nodeid;
     uint64_t lastping;
     uint64_t time_started_con;
     uint64_t time_last_request;
     uint256 last_requested_inv;
 
-    cstring* recvBuffer;
+    /* latency and throughput tracking (times in milliseconds, see btc_node_time_ms) */
+    uint64_t ping_nonce;         /* nonce of the outstanding ping, 0 if none */
+    uint64_t ping_sent_ms;       /* when the outstanding ping has been sent */
+    uint64_t ping_rtt_ms;        /* smoothed ping round trip time, 0 if unknown */
+    uint64_t headers_response_ms; /* smoothed time to the first headers response, 0 if unknown */
+    uint64_t block_bytes_per_s;  /* smoothed block download throughput, 0 if unknown */
+    uint64_t last_block_ms;      /* when the last requested block has been received */
+    uint32_t blocks_expected;    /* undelivered block requests to this node, published for accept_msg_cb (atomic) */
+    uint64_t bytes_received;     /* total amount of bytes received */
+
+    SHA256_CTX recv_hash_ctx; /* running hash of the payload currently being received */
+    size_t recv_hashed;       /* amount of payload bytes already added to recv_hash_ctx */
+    size_t recv_reserved;     /* share of the groups receive budget held for the message currently being received */
+    size_t recv_skip;         /* payload bytes of a discarded message still to be dropped */
+    btc_bool recv_admitted;   /* the header of the message currently being received has been checked */
+    btc_bool recv_paused;     /* reading suspended until the groups receive budget admits the current message */
+
     uint64_t nonce;
     uint64_t services;
     uint32_t state;
     int missbehavescore;
     btc_bool version_handshake;
+    btc_bool sent_addr; /* answered a getaddr request */
 
     unsigned int bestknownheight;
 
@@ -119,18 +208,38 @@ LIBBTC_API void btc_node_free(btc_node* group);
 /* set the nodes ip address and port (ipv4 or ipv6)*/
 LIBBTC_API btc_bool btc_node_set_ipport(btc_node* node, const char* ipport);
 
+/* milliseconds clock used for the nodes latency and throughput tracking */
+LIBBTC_API uint64_t btc_node_time_ms(void);
+
+/* fold a new sample into a smoothed (exponentially weighted, 1/4) value where 0 means unknown */
+LIBBTC_API uint64_t btc_node_smooth(uint64_t smoothed, uint64_t sample);
+
 /* disconnect a node */
 LIBBTC_API void btc_node_disconnect(btc_node* node);
 
 /* mark a node missbehave and disconnect */
 LIBBTC_API btc_bool btc_node_missbehave(btc_node* node);
 
+/* read, set or clear NODE_STATE flags, the state is written by the nodes worker thread in threaded mode */
+LIBBTC_API uint32_t btc_node_get_state(const btc_node* node);
+LIBBTC_API void btc_node_set_state(btc_node* node, uint32_t flags);
+LIBBTC_API void btc_node_clear_state(btc_node* node, uint32_t flags);
+
 /* =================================== */
 /* NODE GROUPS */
 /* =================================== */
 
 /* create a new node group */
 LIBBTC_API btc_node_group* btc_node_group_new(const btc_chainparams* chainparams);
+
+/* create a new node group where the nodes are sharded across num_threads worker threads,
+   each with its own event base. Message framing and the internal protocol logic run on
+   the workers, the group callbacks (cmd handlers, postcmd, handshake done, connection
+   state changed, periodic timer) are queued and delivered on the thread running
+   btc_node_group_event_loop. parse_cmd_cb and accept_msg_cb run on the workers.
+   The nodes services and bestknownheight are written by the worker before it publishes
+   version_handshake, read them with __atomic_load_n. */
+LIBBTC_API btc_node_group* btc_node_group_new_threaded(const btc_chainparams* chainparams, unsigned int num_threads);
 LIBBTC_API void btc_node_group_free(btc_node_group* group);
 
 /* disconnect all peers */
@@ -139,6 +248,13 @@ LIBBTC_API void btc_node_group_shutdown(btc_node_group* group);
 /* add a node to a node group */
 LIBBTC_API void btc_node_group_add_node(btc_node_group* group, btc_node* node);
 
+/* register a handler for a message command (replaces a previously registered one, NULL removes it) */
+LIBBTC_API btc_bool btc_node_group_register_cmd_handler(btc_node_group* group, enum btc_p2p_command command_id, btc_node_cmd_handler handler);
+
+/* load the groups known peer addresses from a file and persist them there on btc_node_group_free,
+   returns false if the file doesn't exist (yet) or could not be read */
+LIBBTC_API btc_bool btc_node_group_set_addrman_file(btc_node_group* group, const char* file_path);
+
 /* start node groups event loop */
 LIBBTC_API void btc_node_group_event_loop(btc_node_group* group);
 
@@ -154,6 +270,21 @@ LIBBTC_API void btc_node_send_version(btc_node* node);
 /* send arbitrary data to node */
 LIBBTC_API void btc_node_send(btc_node* node, cstring* data);
 
+/* serialize a message straight into the nodes output buffer (no intermediate message copy) */
+LIBBTC_API void btc_node_send_message(btc_node* node, const char* command, const void* data, uint32_t data_len);
+
+/* create a shareable message (copies the payload once), release it with btc_node_msg_free */
+LIBBTC_API btc_node_msg* btc_node_msg_new(const unsigned char netmagic[4], const char* command, const void* data, uint32_t data_len);
+
+/* drop the creators reference, the payload lives on until all nodes have sent it */
+LIBBTC_API void btc_node_msg_free(btc_node_msg* msg);
+
+/* send a shared message to a node */
+LIBBTC_API void btc_node_send_msg(btc_node* node, btc_node_msg* msg);
+
+/* send a shared message to all nodes with a completed handshake, returns the amount of nodes */
+LIBBTC_API unsigned int btc_node_group_broadcast(btc_node_group* group, btc_node_msg* msg);
+
 LIBBTC_API int btc_node_parse_message(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
 LIBBTC_API void btc_node_connection_state_changed(btc_node* node);
 
@@ -161,7 +292,18 @@ LIBBTC_API void btc_node_connection_state_changed(btc_node* node);
 /* DNS */
 /* =================================== */
 
+/* add the comma separated peers, or (ips == NULL) seed the group from the dns seeds
+   unless enough addresses are known already */
 LIBBTC_API btc_bool btc_node_group_add_peers_by_ip_or_seed(btc_node_group *group, const char *ips);
+
+/* resolve all dns seeds of the chain (A and AAAA records) in parallel, the peers get added and
+   connected as the answers arrive while the event loop runs, returns the amount of started lookups */
+LIBBTC_API int btc_node_group_seed_dns(btc_node_group* group);
+
+/* resolve the dns seeds with the given nameserver (ip[:port]) instead of the systems resolvers */
+LIBBTC_API btc_bool btc_node_group_set_dns_nameserver(btc_node_group* group, const char* ipport);
+
+/* blocking lookup of a single seed, family is AF_INET, AF_INET6 or AF_UNSPEC (both) */
 LIBBTC_API int btc_get_peers_from_dns(const char* seed, vector* ips_out, int port, int family);
 
 #ifdef __cplusplus
@@ -29,6 +29,7 @@
 
 #include "btc.h"
 #include <btc/blockchain.h>
+#include <btc/blockfilter.h>
 #include <btc/headersdb.h>
 #include <btc/tx.h>
 
@@ -41,19 +42,74 @@ enum SPV_CLIENT_STATE {
     SPV_FULLBLOCK_SYNC_FLAG	    = (1 << 1),
 };
 
+enum btc_spv_block_request_state {
+    BTC_SPV_REQUEST_FILTER_HEADER = 0, /* waiting for the filter hash (cfheaders) */
+    BTC_SPV_REQUEST_FILTER = 1, /* filter hash known, waiting for the filter (cfilter) */
+    BTC_SPV_REQUEST_BLOCK = 2, /* full block needed */
+    BTC_SPV_REQUEST_SKIP = 3, /* filter did not match, nothing to deliver */
+};
+
+/* a block queued for download by the block download scheduler */
+typedef struct btc_spv_block_request_
+{
+    uint256 hash;
+    uint32_t height;
+    uint8_t state; /* btc_spv_block_request_state */
+    uint256 filter_hash; /* filter hash committed by the verified filter header chain */
+    btc_node *node; /* node the block is requested from, NULL if not requested */
+    btc_node *stalled_node; /* last node that failed to deliver the block in time */
+    uint64_t time_requested;
+    uint64_t time_requested_ms; /* btc_node_time_ms of the request, for the throughput measurement */
+    btc_block *block; /* received block with a verified merkle root, waiting for the blocks below to be delivered */
+    cstring *block_data; /* copy of the serialized block for sync_transaction_view, only if it has to wait for lower blocks */
+    struct const_buffer block_payload; /* the serialized block inside the message being processed (no copy) */
+} btc_spv_block_request;
+
 typedef struct btc_spv_client_
 {
     btc_node_group *nodegroup;
     uint64_t last_headersrequest_time;
+    uint64_t last_headersrequest_ms; /* btc_node_time_ms of the last getheaders, for the response time measurement */
     uint64_t oldest_item_of_interest; /* oldest key birthday (or similar) */
     btc_bool use_checkpoints; /* if false, the client will create a headers chain starting from genesis */
     const btc_chainparams *chainparams;
     int stateflags;
     uint64_t last_statecheck_time;
+    btc_timer statecheck_timer; /* on the nodegroups timer wheel */
     btc_bool called_sync_completed;
 
     void *headers_db_ctx; /* flexible headers db context */
     const btc_headers_db_interface *headers_db; /* headers db interface */
+    btc_threadpool *header_pool; /* workers hashing and checking incoming headers (NULL = event loop thread) */
+
+    /* block download scheduler */
+    /* blocks of interest are requested from all connected peers within a sliding window */
+    /* starting at the lowest undelivered height and delivered in height order */
+    btc_spv_block_request *block_requests;
+    size_t block_requests_first; /* position of the lowest undelivered block */
+    size_t block_requests_len; /* amount of queued blocks (starting at block_requests_first) */
+    size_t block_requests_alloc;
+    unsigned int max_blocks_in_flight; /* size of the download window */
+    unsigned int max_blocks_in_flight_per_node;
+
+    /* compact block filter mode (BIP157/158), needs to be set before starting the runloop */
+    /* queued blocks are only downloaded if their basic filter matches an element of the filter_matcher */
+    btc_bool use_compact_filters;
+    btc_blockfilter_matcher *filter_matcher; /* scripts of interest */
+    btc_node *cfheaders_node; /* node with a pending getcfheaders request */
+    uint64_t filter_request_time; /* time of the pending getcfheaders or getcfcheckpt request */
+    uint32_t cfheaders_start_height; /* range of the pending getcfheaders request */
+    uint32_t cfheaders_count;
+    uint256 cfheaders_stop_hash;
+    uint32_t filter_header_height; /* height of filter_header (0 = no filter header known) */
+    uint256 filter_header; /* tip of the verified filter header chain */
+    btc_node *cfcheckpt_node; /* node with a pending getcfcheckpt request */
+    uint32_t cfcheckpt_height; /* block of the pending getcfcheckpt request */
+    uint256 cfcheckpt_stop_hash;
+    uint256 *filter_checkpoints; /* filter headers at every BTC_CFCHECKPT_INTERVAL height (from a valid cfcheckpt) */
+    size_t filter_checkpoints_len;
+    uint32_t filter_checkpoints_height; /* chain height the checkpoints have been received for */
+    int filter_checkpoints_nodeid; /* node the checkpoints have been received from */
 
     /* callbacks */
     /* ========= */
@@ -69,8 +125,17 @@ typedef struct btc_spv_client_
     /* return false will abort further logic (like continue loading headers, etc.) */
     btc_bool (*header_message_processed)(struct btc_spv_client_ *client, btc_node *node, btc_blockindex *newtip);
 
+    /* callback, executed on each received block before its transactions are passed to sync_transaction
+       the merkle root has been verified, block->txids[pos] is the txid of the transaction at pos */
+    void (*sync_block)(void *ctx, const btc_block *block, btc_blockindex *blockindex);
+
     /* callback, executed on each transaction (when getting a block, merkle-block txns or inv txns) */
+    /* the transaction is read-only and only valid during the callback (copy it with btc_tx_copy to keep it) */
     void (*sync_transaction)(void *ctx, btc_tx *tx, unsigned int pos, btc_blockindex *blockindex);
+
+    /* same as sync_transaction but with a read-only view into the received block (no allocations)
+       the view is only valid during the callback, all sync callbacks share sync_transaction_ctx */
+    void (*sync_transaction_view)(void *ctx, const btc_tx_view *tx, unsigned int pos, btc_blockindex *blockindex);
     void *sync_transaction_ctx;
 } btc_spv_client;
 
@@ -90,6 +155,22 @@ LIBBTC_API void btc_spv_client_runloop(btc_spv_client *client);
 /* try to request headers from a single node in the nodegroup */
 LIBBTC_API btc_bool btc_net_spv_request_headers(btc_spv_client *client);
 
+/* fill the block download window with getdata (or getcfilters) requests across the connected nodes */
+LIBBTC_API void btc_net_spv_request_blocks(btc_spv_client *client);
+
+/* expected response time (ms) of a node for a headers request, lower is better */
+LIBBTC_API uint64_t btc_net_spv_node_headers_score(const btc_node *node);
+
+/* expected time (ms) a node needs to deliver a block, lower is better */
+LIBBTC_API uint64_t btc_net_spv_node_block_score(const btc_node *node);
+
+/* process a message received by a node of the clients nodegroup
+   the command is resolved from hdr->command (hdr->command_id gets overwritten) */
+LIBBTC_API void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf);
+
+/* check for stalled requests and continue syncing, runs every few seconds on the groups timer wheel */
+LIBBTC_API void btc_net_spv_periodic_statecheck(btc_node *node, uint64_t *now);
+
 #ifdef __cplusplus
 }
 #endif
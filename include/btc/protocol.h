@@ -55,6 +55,7 @@ static uint256 NULLHASH = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 
 enum service_bits {
     BTC_NODE_NETWORK = (1 << 0),
+    BTC_NODE_COMPACT_FILTERS = (1 << 6),
 };
 
 static const char* BTC_MSG_VERSION = "version";
@@ -67,6 +68,38 @@ static const char* BTC_MSG_HEADERS = "headers";
 static const char* BTC_MSG_BLOCK = "block";
 static const char* BTC_MSG_INV = "inv";
 static const char* BTC_MSG_TX = "tx";
+static const char* BTC_MSG_GETCFILTERS = "getcfilters";
+static const char* BTC_MSG_CFILTER = "cfilter";
+static const char* BTC_MSG_GETCFHEADERS = "getcfheaders";
+static const char* BTC_MSG_CFHEADERS = "cfheaders";
+static const char* BTC_MSG_GETCFCHECKPT = "getcfcheckpt";
+static const char* BTC_MSG_CFCHECKPT = "cfcheckpt";
+static const char* BTC_MSG_ADDR = "addr";
+static const char* BTC_MSG_GETADDR = "getaddr";
+
+/* numeric message command identifiers, resolved once from the header command string */
+enum btc_p2p_command {
+    BTC_CMD_UNKNOWN = 0,
+    BTC_CMD_VERSION,
+    BTC_CMD_VERACK,
+    BTC_CMD_PING,
+    BTC_CMD_PONG,
+    BTC_CMD_GETDATA,
+    BTC_CMD_GETHEADERS,
+    BTC_CMD_HEADERS,
+    BTC_CMD_BLOCK,
+    BTC_CMD_INV,
+    BTC_CMD_TX,
+    BTC_CMD_GETCFILTERS,
+    BTC_CMD_CFILTER,
+    BTC_CMD_GETCFHEADERS,
+    BTC_CMD_CFHEADERS,
+    BTC_CMD_GETCFCHECKPT,
+    BTC_CMD_CFCHECKPT,
+    BTC_CMD_ADDR,
+    BTC_CMD_GETADDR,
+    BTC_CMD_MAX
+};
 
 enum BTC_INV_TYPE {
     BTC_INV_TYPE_ERROR = 0,
@@ -77,11 +110,18 @@ enum BTC_INV_TYPE {
 };
 
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+static const unsigned int MAX_GETCFILTERS_SIZE = 1000;
+static const unsigned int MAX_GETCFHEADERS_SIZE = 2000;
+static const unsigned int MAX_ADDR_SIZE = 1000;
+static const unsigned int MAX_INV_SIZE = 50000;
+static const unsigned int MAX_BLOCK_SERIALIZED_SIZE = 4000000;
+static const unsigned int BTC_CFCHECKPT_INTERVAL = 1000;
 static const int BTC_PROTOCOL_VERSION = 70014;
 
 typedef struct btc_p2p_msg_hdr_ {
     unsigned char netmagic[4];
-    char command[12];
+    char command[13]; /* 12 bytes on the wire, always null terminated */
+    enum btc_p2p_command command_id; /* BTC_CMD_UNKNOWN for commands not in the registry */
     uint32_t data_len;
     unsigned char hash[4];
 } btc_p2p_msg_hdr;
@@ -164,6 +204,15 @@ LIBBTC_API void btc_p2paddr_to_addr(btc_p2p_address* p2p_addr, struct sockaddr*
 /* deserialize the p2p message header from a buffer */
 LIBBTC_API void btc_p2p_deser_msghdr(btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
 
+/* get the numeric identifier of a (null terminated) command string, BTC_CMD_UNKNOWN if not known */
+LIBBTC_API enum btc_p2p_command btc_p2p_command_id(const char* command);
+
+/* get the command string of a numeric identifier, NULL for BTC_CMD_UNKNOWN or out of range values */
+LIBBTC_API const char* btc_p2p_command_str(enum btc_p2p_command command_id);
+
+/* serialize the message header (magic, command, payload length and checksum) of a payload */
+LIBBTC_API void btc_p2p_message_header_ser(const unsigned char netmagic[4], const char* command, const void* data, uint32_t data_len, uint8_t out[24]);
+
 /* btc_p2p_message_new does malloc a cstring, needs cleanup afterwards! */
 LIBBTC_API cstring* btc_p2p_message_new(const unsigned char netmagic[4], const char* command, const void* data, uint32_t data_len);
 
@@ -175,10 +224,47 @@ LIBBTC_API cstring* btc_p2p_message_new(const unsigned char netmagic[4], const c
 /* creates a getheader message */
 LIBBTC_API void btc_p2p_msg_getheaders(vector* blocklocators, uint256 hashstop, cstring* str_out);
 
+/* creates a getheader message from a locator array (hashstop can be NULL) */
+LIBBTC_API void btc_p2p_msg_getheaders_locator(uint256* locator, size_t count, const uint256 hashstop, cstring* str_out);
+
 /* directly deserialize a getheaders message to blocklocators, hashstop */
 LIBBTC_API btc_bool btc_p2p_deser_msg_getheaders(vector* blocklocators, uint256 hashstop, struct const_buffer* buf);
 
 
+/* =================================== */
+/* ADDR MESSAGE */
+/* =================================== */
+
+/* creates an addr message (count must not exceed MAX_ADDR_SIZE) */
+LIBBTC_API void btc_p2p_msg_addr(const btc_p2p_address* addrs, size_t count, cstring* str_out);
+
+/* deserialize an addr message into addrs_out (space for MAX_ADDR_SIZE addresses required) */
+LIBBTC_API btc_bool btc_p2p_deser_msg_addr(btc_p2p_address* addrs_out, size_t* count_out, struct const_buffer* buf);
+
+
+/* =================================== */
+/* COMPACT BLOCK FILTER MESSAGES (BIP157) */
+/* =================================== */
+
+/* creates a getcfilters or getcfheaders message (both share the same layout) */
+LIBBTC_API void btc_p2p_msg_getcfilters(uint8_t filter_type, uint32_t start_height, const uint256 stop_hash, cstring* str_out);
+
+/* deserialize a getcfilters or getcfheaders message */
+LIBBTC_API btc_bool btc_p2p_deser_msg_getcfilters(uint8_t* filter_type, uint32_t* start_height, uint256 stop_hash, struct const_buffer* buf);
+
+/* creates a getcfcheckpt message */
+LIBBTC_API void btc_p2p_msg_getcfcheckpt(uint8_t filter_type, const uint256 stop_hash, cstring* str_out);
+
+/* deserialize a cfilter message, filter points into buf (no copy) */
+LIBBTC_API btc_bool btc_p2p_deser_msg_cfilter(uint8_t* filter_type, uint256 block_hash, struct const_buffer* filter, struct const_buffer* buf);
+
+/* deserialize a cfheaders message, filter_hashes points to count consecutive 32 byte hashes in buf */
+LIBBTC_API btc_bool btc_p2p_deser_msg_cfheaders(uint8_t* filter_type, uint256 stop_hash, uint256 prev_filter_header, uint32_t* count, struct const_buffer* filter_hashes, struct const_buffer* buf);
+
+/* deserialize a cfcheckpt message, filter_headers points to count consecutive 32 byte headers in buf */
+LIBBTC_API btc_bool btc_p2p_deser_msg_cfcheckpt(uint8_t* filter_type, uint256 stop_hash, uint32_t* count, struct const_buffer* filter_headers, struct const_buffer* buf);
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,6 +36,7 @@ extern "C" {
 
 #include "buffer.h"
 #include "cstr.h"
+#include "sha2.h"
 
 #include "portable_endian.h"
 
@@ -55,6 +56,28 @@ LIBBTC_API void ser_s32(cstring* s, int32_t v_);
 
 LIBBTC_API void ser_s64(cstring* s, int64_t v_);
 
+/* serialization target, the serialized bytes get appended to str, added to the running hash
+   and/or written to file (each one that is set), e.g. to hash data without materializing it
+   writers to a file need to check failed once done */
+typedef struct btc_ser_sink_ {
+    cstring* str;
+    SHA256_CTX* hash;
+    FILE* file;
+    btc_bool failed; /* a write to file came up short (full disk, io error) */
+} btc_ser_sink;
+
+LIBBTC_API void btc_ser_sink_init(btc_ser_sink* sink, cstring* str, SHA256_CTX* hash, FILE* file);
+
+LIBBTC_API void ser_sink_bytes(btc_ser_sink* sink, const void* p, size_t len);
+LIBBTC_API void ser_sink_u16(btc_ser_sink* sink, uint16_t v_);
+LIBBTC_API void ser_sink_u32(btc_ser_sink* sink, uint32_t v_);
+LIBBTC_API void ser_sink_s32(btc_ser_sink* sink, int32_t v_);
+LIBBTC_API void ser_sink_u64(btc_ser_sink* sink, uint64_t v_);
+LIBBTC_API void ser_sink_s64(btc_ser_sink* sink, int64_t v_);
+LIBBTC_API void ser_sink_u256(btc_ser_sink* sink, const unsigned char* v_);
+LIBBTC_API void ser_sink_varlen(btc_ser_sink* sink, uint32_t vlen);
+LIBBTC_API void ser_sink_varstr(btc_ser_sink* sink, const cstring* s_in);
+
 LIBBTC_API int deser_skip(struct const_buffer* buf, size_t len);
 LIBBTC_API int deser_bytes(void* po, struct const_buffer* buf, size_t len);
 LIBBTC_API int deser_u16(uint16_t* vo, struct const_buffer* buf);
@@ -0,0 +1,80 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#ifndef __LIBBTC_THREADPOOL_H__
+#define __LIBBTC_THREADPOOL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "btc.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* function processing the items [begin, end) of a job */
+typedef void (*btc_threadpool_range_fn)(void* ctx, size_t begin, size_t end);
+
+/* fixed size worker pool for data parallel jobs
+   the calling thread participates in every job and
+   only one job can run at a time
+*/
+typedef struct btc_threadpool_ {
+    pthread_t* threads;
+    unsigned int num_threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    uint64_t generation; /* increased for every new job */
+    unsigned int active; /* workers still busy with the current job */
+    btc_bool shutdown;
+
+    /* current job */
+    btc_threadpool_range_fn fn;
+    void* ctx;
+    size_t count;
+    size_t chunk;
+    size_t next;
+} btc_threadpool;
+
+/* one less than the amount of available cores, capped at max (0 = no cap) */
+LIBBTC_API unsigned int btc_threadpool_default_threads(unsigned int max);
+
+/* create a pool with num_threads workers (0 = btc_threadpool_default_threads(0)) */
+LIBBTC_API btc_threadpool* btc_threadpool_new(unsigned int num_threads);
+LIBBTC_API void btc_threadpool_free(btc_threadpool* pool);
+
+/* process count items in chunks of (at least) min_chunk items across the pool, blocks until done
+   pool can be NULL to run the job on the calling thread */
+LIBBTC_API void btc_threadpool_run(btc_threadpool* pool, size_t count, size_t min_chunk, btc_threadpool_range_fn fn, void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIBBTC_THREADPOOL_H__
@@ -0,0 +1,95 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#ifndef __LIBBTC_TIMERWHEEL_H__
+#define __LIBBTC_TIMERWHEEL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "btc.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* hierarchical timer wheel: level 0 has one slot per tick, every further level one
+   slot per full rotation of the level below. Timers far in the future get cascaded
+   down level by level as the wheel turns, scheduling and canceling are O(1) and a
+   tick only touches the expiring slot.
+   With a tick of 100ms the wheel covers ~19 days, later timers fire at the end of it.
+*/
+#define BTC_TIMER_WHEEL_LEVELS 4
+#define BTC_TIMER_WHEEL_SLOT_BITS 6
+#define BTC_TIMER_WHEEL_SLOTS (1 << BTC_TIMER_WHEEL_SLOT_BITS)
+
+struct btc_timer_;
+typedef void (*btc_timer_cb)(struct btc_timer_* timer, void* ctx);
+
+typedef struct btc_timer_ {
+    struct btc_timer_* next;
+    struct btc_timer_* prev;
+    struct btc_timer_** list; /* head of the list the timer is linked into, NULL if not pending */
+    uint64_t expires;         /* tick the timer expires at */
+    btc_timer_cb cb;
+    void* ctx;
+} btc_timer;
+
+typedef struct btc_timer_wheel_ {
+    uint64_t tick_ms;
+    uint64_t current;    /* last processed tick */
+    uint64_t start_ms;   /* time of tick 0 */
+    size_t pending;      /* amount of scheduled timers */
+    btc_timer* slots[BTC_TIMER_WHEEL_LEVELS][BTC_TIMER_WHEEL_SLOTS];
+    btc_timer* expired;  /* timers of the processed tick, waiting for their callback */
+    pthread_mutex_t mutex; /* timers can be (re)scheduled and canceled from any thread */
+} btc_timer_wheel;
+
+/* initialize a wheel turning every tick_ms milliseconds, starting at now_ms */
+LIBBTC_API void btc_timer_wheel_init(btc_timer_wheel* wheel, uint64_t tick_ms, uint64_t now_ms);
+LIBBTC_API void btc_timer_wheel_deinit(btc_timer_wheel* wheel);
+
+/* initialize a timer with its callback */
+LIBBTC_API void btc_timer_init(btc_timer* timer, btc_timer_cb cb, void* ctx);
+
+/* (re)schedule a timer to fire after delay_ms (rounded up to full ticks, at least one tick) */
+LIBBTC_API void btc_timer_schedule(btc_timer_wheel* wheel, btc_timer* timer, uint64_t delay_ms);
+
+/* cancel a pending timer (no-op if not pending) */
+LIBBTC_API void btc_timer_cancel(btc_timer_wheel* wheel, btc_timer* timer);
+
+LIBBTC_API btc_bool btc_timer_pending(btc_timer_wheel* wheel, const btc_timer* timer);
+
+/* turn the wheel up to now_ms and run the callbacks of the expired timers (without holding
+   the wheels lock, callbacks may reschedule or cancel timers), returns the amount of callbacks */
+LIBBTC_API size_t btc_timer_wheel_advance(btc_timer_wheel* wheel, uint64_t now_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__LIBBTC_TIMERWHEEL_H__
@@ -37,10 +37,13 @@ extern "C" {
 
 #include "btc.h"
 
+#include "buffer.h"
 #include "chainparams.h"
 #include "cstr.h"
 #include "hash.h"
 #include "script.h"
+#include "serialize.h"
+#include "sha2.h"
 #include "vector.h"
 
 
@@ -73,6 +76,44 @@ typedef struct btc_tx_ {
     uint32_t locktime;
 } btc_tx;
 
+/* read-only views into a serialized transaction, the buffers point into the parsed data */
+typedef struct btc_tx_in_view_ {
+    const uint8_t* prevout_hash;
+    uint32_t prevout_n;
+    struct const_buffer script_sig;
+    uint32_t sequence;
+} btc_tx_in_view;
+
+typedef struct btc_tx_out_view_ {
+    int64_t value;
+    struct const_buffer script_pubkey;
+} btc_tx_out_view;
+
+typedef struct btc_tx_view_ {
+    struct const_buffer tx; /* the serialized transaction */
+    int32_t version;
+    uint32_t vin_count;
+    uint32_t vout_count;
+    uint32_t locktime;
+
+    uint32_t* offsets; /* offsets of the inputs followed by the outputs, kept between parses */
+    size_t offsets_alloc;
+} btc_tx_view;
+
+/* data of a transaction shared by the signature hashes of all its inputs,
+   the transaction must not change while the cache is in use */
+typedef struct btc_tx_sighash_cache_ {
+    const btc_tx* tx;
+    cstring* inputs;       /* the inputs serialized with empty scripts */
+    SHA256_CTX* midstates; /* hash state after the version, the input count and the inputs in front of input i */
+    cstring* outputs;      /* the serialized output count and outputs */
+
+    /* BIP143 (segwit v0) */
+    uint256 hash_prevouts;
+    uint256 hash_sequence;
+    uint256 hash_outputs;
+} btc_tx_sighash_cache;
+
 
 //!create a new tx input
 LIBBTC_API btc_tx_in* btc_tx_in_new();
@@ -92,13 +133,34 @@ LIBBTC_API void btc_tx_copy(btc_tx* dest, const btc_tx* src);
 //!deserialize/parse a p2p serialized bitcoin transaction
 LIBBTC_API int btc_tx_deserialize(const unsigned char* tx_serialized, size_t inlen, btc_tx* tx, size_t* consumed_length);
 
+//!arena size btc_tx_deserialize_arena needs for the transaction at the start of tx_serialized, 0 if it does not parse
+LIBBTC_API size_t btc_tx_deserialize_arena_size(const unsigned char* tx_serialized, size_t inlen);
+
+//!decode a transaction with all its inputs, outputs and scripts into a single caller supplied (8 byte aligned) arena
+//!the transaction is read-only and must not be passed to btc_tx_free, releasing the arena frees it at once
+LIBBTC_API btc_tx* btc_tx_deserialize_arena(const unsigned char* tx_serialized, size_t inlen, void* arena, size_t arena_size, size_t* consumed_length);
+
 //!serialize a lbc bitcoin data structure into a p2p serialized buffer
 LIBBTC_API void btc_tx_serialize(cstring* s, const btc_tx* tx);
+LIBBTC_API void btc_tx_serialize_sink(btc_ser_sink* sink, const btc_tx* tx);
 
 LIBBTC_API void btc_tx_hash(const btc_tx* tx, uint8_t* hashout);
 
 LIBBTC_API btc_bool btc_tx_sighash(const btc_tx* tx_to, const cstring* fromPubKey, unsigned int in_num, int hashtype, uint8_t* hash);
 
+//!precompute the signature hash data of a transaction, for signing many of its inputs
+LIBBTC_API void btc_tx_sighash_cache_init(btc_tx_sighash_cache* cache, const btc_tx* tx);
+LIBBTC_API void btc_tx_sighash_cache_free(btc_tx_sighash_cache* cache);
+
+//!same as btc_tx_sighash for the caches transaction
+LIBBTC_API btc_bool btc_tx_sighash_cached(const btc_tx_sighash_cache* cache, const cstring* fromPubKey, unsigned int in_num, int hashtype, uint8_t* hash);
+
+//!BIP143 signature hash of a segwit v0 input spending amount (script_code is the P2PKH script of the key hash for P2WPKH inputs)
+LIBBTC_API btc_bool btc_tx_sighash_segwit(const btc_tx* tx_to, const cstring* script_code, unsigned int in_num, int64_t amount, int hashtype, uint8_t* hash);
+
+//!same as btc_tx_sighash_segwit with the caches hashPrevouts, hashSequence and hashOutputs (constant time per input)
+LIBBTC_API btc_bool btc_tx_sighash_segwit_cached(const btc_tx_sighash_cache* cache, const cstring* script_code, unsigned int in_num, int64_t amount, int hashtype, uint8_t* hash);
+
 LIBBTC_API btc_bool btc_tx_add_address_out(btc_tx* tx, const btc_chainparams* chain, int64_t amount, const char* address);
 LIBBTC_API btc_bool btc_tx_add_p2sh_hash160_out(btc_tx* tx, int64_t amount, uint160 hash160);
 LIBBTC_API btc_bool btc_tx_add_p2pkh_hash160_out(btc_tx* tx, int64_t amount, uint160 hash160);
@@ -107,6 +169,16 @@ LIBBTC_API btc_bool btc_tx_add_p2pkh_out(btc_tx* tx, int64_t amount, const btc_p
 LIBBTC_API btc_bool btc_tx_add_data_out(btc_tx* tx, const int64_t amount, const uint8_t *data, const size_t datalen);
 LIBBTC_API btc_bool btc_tx_add_puzzle_out(btc_tx* tx, const int64_t amount, const uint8_t *puzzle, const size_t puzzlelen);
 
+//!zero-copy transaction view, a view can be reused for many transactions
+LIBBTC_API void btc_tx_view_init(btc_tx_view* view);
+LIBBTC_API void btc_tx_view_free(btc_tx_view* view);
+
+//!index the transaction at the start of buf and advance buf behind it, buf must outlive the view
+LIBBTC_API btc_bool btc_tx_view_parse(btc_tx_view* view, struct const_buffer* buf);
+LIBBTC_API btc_bool btc_tx_view_get_input(const btc_tx_view* view, unsigned int idx, btc_tx_in_view* in);
+LIBBTC_API btc_bool btc_tx_view_get_output(const btc_tx_view* view, unsigned int idx, btc_tx_out_view* out);
+LIBBTC_API void btc_tx_view_hash(const btc_tx_view* view, uint256 hashout);
+
 LIBBTC_API btc_bool btc_tx_outpoint_is_null(btc_tx_outpoint* tx);
 LIBBTC_API btc_bool btc_tx_is_coinbase(btc_tx* tx);
 #ifdef __cplusplus
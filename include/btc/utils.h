@@ -71,7 +71,8 @@ static inline void btc_btree_tdestroy(void *root, void (*freekey)(void *))
 
     if (r == 0)
         return;
-    btc_btree_tdestroy(r->left, freekey);
+    /* newer glibc versions store the node color in the lowest bit of the left pointer */
+    btc_btree_tdestroy((struct btc_btree_node *)((uintptr_t)r->left & ~(uintptr_t)1), freekey);
     btc_btree_tdestroy(r->right, freekey);
 
     if (freekey) freekey(r->key);
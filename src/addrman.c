@@ -0,0 +1,445 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#include <btc/addrman.h>
+
+#include <btc/cstr.h>
+#include <btc/random.h>
+#include <btc/serialize.h>
+#include <btc/sha2.h>
+#include <btc/utils.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const unsigned char BTC_ADDRMAN_FILE_MAGIC[4] = {'A', 'D', 'R', 'M'};
+static const uint32_t BTC_ADDRMAN_FILE_VERSION = 1;
+static const size_t BTC_ADDRMAN_FILE_RECORD_SIZE = 41;
+
+static const uint32_t BTC_ADDRMAN_HORIZON_S = 30 * 24 * 60 * 60; /* forget addresses not seen for 30 days */
+static const uint32_t BTC_ADDRMAN_RETRIES = 3;                   /* failures before a never connected address is terrible */
+static const uint32_t BTC_ADDRMAN_MAX_FAILURES = 10;             /* failures after the last success ... */
+static const uint32_t BTC_ADDRMAN_MIN_FAIL_S = 7 * 24 * 60 * 60; /* ... in at least this time span */
+static const uint32_t BTC_ADDRMAN_RETRY_DELAY_S = 10 * 60;       /* recently tried addresses are very unlikely to be selected */
+static const unsigned int BTC_ADDRMAN_SELECT_ROUNDS = 256;
+
+/* keyed hash over a tag and the given data */
+static uint32_t btc_addrman_hash(const btc_addrman* addrman, char tag, const void* data, size_t len, uint32_t extra)
+{
+    SHA256_CTX ctx;
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    sha256_Init(&ctx);
+    sha256_Update(&ctx, addrman->key, sizeof(addrman->key));
+    sha256_Update(&ctx, (const uint8_t*)&tag, 1);
+    sha256_Update(&ctx, (const uint8_t*)&extra, sizeof(extra));
+    sha256_Update(&ctx, data, len);
+    sha256_Final(hash, &ctx);
+    return ((uint32_t)hash[0] | (uint32_t)hash[1] << 8 | (uint32_t)hash[2] << 16 | (uint32_t)hash[3] << 24);
+}
+
+static btc_bool btc_addrman_is_ipv4(const btc_p2p_address* addr)
+{
+    static const unsigned char ipv4_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    return (memcmp(addr->ip, ipv4_prefix, sizeof(ipv4_prefix)) == 0);
+}
+
+/* network group of an address (/16 for IPv4, /32 for IPv6) */
+static size_t btc_addrman_group(const btc_p2p_address* addr, uint8_t* group_out)
+{
+    if (btc_addrman_is_ipv4(addr)) {
+        group_out[0] = 4;
+        memcpy(&group_out[1], &addr->ip[12], 2);
+        return 3;
+    }
+    group_out[0] = 6;
+    memcpy(&group_out[1], addr->ip, 4);
+    return 5;
+}
+
+static size_t btc_addrman_new_slot(const btc_addrman* addrman, const btc_p2p_address* addr)
+{
+    uint8_t group[5];
+    uint32_t bucket = btc_addrman_hash(addrman, 'N', group, btc_addrman_group(addr, group), 0) % BTC_ADDRMAN_NEW_BUCKETS;
+    uint32_t pos = btc_addrman_hash(addrman, 'n', addr->ip, sizeof(addr->ip), bucket ^ ((uint32_t)addr->port << 16)) % BTC_ADDRMAN_BUCKET_SIZE;
+    return bucket * BTC_ADDRMAN_BUCKET_SIZE + pos;
+}
+
+static size_t btc_addrman_tried_slot(const btc_addrman* addrman, const btc_p2p_address* addr)
+{
+    uint32_t bucket = btc_addrman_hash(addrman, 'T', addr->ip, sizeof(addr->ip), addr->port) % BTC_ADDRMAN_TRIED_BUCKETS;
+    uint32_t pos = btc_addrman_hash(addrman, 't', addr->ip, sizeof(addr->ip), bucket ^ ((uint32_t)addr->port << 16)) % BTC_ADDRMAN_BUCKET_SIZE;
+    return bucket * BTC_ADDRMAN_BUCKET_SIZE + pos;
+}
+
+static btc_bool btc_addrman_same(const btc_p2p_address* a, const btc_p2p_address* b)
+{
+    return (a->port == b->port && memcmp(a->ip, b->ip, sizeof(a->ip)) == 0);
+}
+
+/* addresses not worth keeping (or handing out) anymore */
+static btc_bool btc_addrman_is_terrible(const btc_addrman_entry* entry, uint32_t now)
+{
+    if (entry->last_try && entry->last_try >= now - 60)
+        return false; /* never remove things tried in the last minute */
+    if (entry->addr.time > now + 10 * 60)
+        return true; /* came in a flying DeLorean */
+    if (entry->addr.time == 0 || entry->addr.time + BTC_ADDRMAN_HORIZON_S < now)
+        return true; /* not seen in recent history */
+    if (entry->last_success == 0 && entry->attempts >= BTC_ADDRMAN_RETRIES)
+        return true; /* tried N times and never a success */
+    if (entry->last_success + BTC_ADDRMAN_MIN_FAIL_S < now && entry->attempts >= BTC_ADDRMAN_MAX_FAILURES)
+        return true; /* N successive failures in the last week */
+    return false;
+}
+
+/* find the entry of an address in either table */
+static btc_addrman_entry* btc_addrman_find(btc_addrman* addrman, const btc_p2p_address* addr)
+{
+    btc_addrman_entry* entry = addrman->tried_table[btc_addrman_tried_slot(addrman, addr)];
+    if (entry && btc_addrman_same(&entry->addr, addr))
+        return entry;
+    entry = addrman->new_table[btc_addrman_new_slot(addrman, addr)];
+    if (entry && btc_addrman_same(&entry->addr, addr))
+        return entry;
+    return NULL;
+}
+
+/* place an entry in its new table slot, a stale occupant gets replaced, otherwise the entry is freed */
+static btc_bool btc_addrman_place_new(btc_addrman* addrman, btc_addrman_entry* entry, uint32_t now)
+{
+    size_t slot = btc_addrman_new_slot(addrman, &entry->addr);
+    btc_addrman_entry* occupant = addrman->new_table[slot];
+    if (occupant) {
+        if (!btc_addrman_is_terrible(occupant, now)) {
+            btc_free(entry);
+            return false;
+        }
+        btc_free(occupant);
+        addrman->new_count--;
+    }
+    entry->tried = false;
+    addrman->new_table[slot] = entry;
+    addrman->new_count++;
+    return true;
+}
+
+/* move an entry to its tried table slot, the occupant goes back to the new table */
+static void btc_addrman_place_tried(btc_addrman* addrman, btc_addrman_entry* entry, uint32_t now)
+{
+    size_t slot = btc_addrman_tried_slot(addrman, &entry->addr);
+    btc_addrman_entry* occupant = addrman->tried_table[slot];
+    addrman->tried_table[slot] = entry;
+    entry->tried = true;
+    if (occupant)
+        btc_addrman_place_new(addrman, occupant, now);
+    else
+        addrman->tried_count++;
+}
+
+btc_addrman* btc_addrman_new(void)
+{
+    btc_addrman* addrman = btc_calloc(1, sizeof(*addrman));
+    if (!btc_random_bytes(addrman->key, sizeof(addrman->key), 0))
+        btc_cheap_random_bytes(addrman->key, sizeof(addrman->key));
+    memcpy(&addrman->rand_state, addrman->key, sizeof(addrman->rand_state));
+    addrman->rand_state |= 1; /* xorshift needs a non-zero state */
+    pthread_mutex_init(&addrman->mutex, NULL);
+    return addrman;
+}
+
+void btc_addrman_free(btc_addrman* addrman)
+{
+    if (!addrman)
+        return;
+    for (size_t i = 0; i < BTC_ADDRMAN_NEW_BUCKETS * BTC_ADDRMAN_BUCKET_SIZE; i++)
+        btc_free(addrman->new_table[i]);
+    for (size_t i = 0; i < BTC_ADDRMAN_TRIED_BUCKETS * BTC_ADDRMAN_BUCKET_SIZE; i++)
+        btc_free(addrman->tried_table[i]);
+    pthread_mutex_destroy(&addrman->mutex);
+    btc_free(addrman);
+}
+
+size_t btc_addrman_size(btc_addrman* addrman)
+{
+    pthread_mutex_lock(&addrman->mutex);
+    size_t size = addrman->new_count + addrman->tried_count;
+    pthread_mutex_unlock(&addrman->mutex);
+    return size;
+}
+
+btc_bool btc_addrman_add(btc_addrman* addrman, const btc_p2p_address* addr, uint32_t now)
+{
+    static const unsigned char zero_ip[16] = {0};
+    if (addr->port == 0 || memcmp(addr->ip, zero_ip, sizeof(zero_ip)) == 0)
+        return false;
+
+    pthread_mutex_lock(&addrman->mutex);
+    btc_addrman_entry* entry = btc_addrman_find(addrman, addr);
+    if (entry) {
+        /* refresh the last seen time and the services */
+        if (addr->time > entry->addr.time && addr->time <= now + 10 * 60)
+            entry->addr.time = addr->time;
+        entry->addr.services |= addr->services;
+        pthread_mutex_unlock(&addrman->mutex);
+        return false;
+    }
+
+    entry = btc_calloc(1, sizeof(*entry));
+    entry->addr = *addr;
+    /* don't trust the advertised time too much, addresses relayed to us are at least a few hours old */
+    if (entry->addr.time == 0 || entry->addr.time > now + 10 * 60)
+        entry->addr.time = now - 5 * 24 * 60 * 60;
+    btc_bool added = btc_addrman_place_new(addrman, entry, now);
+    pthread_mutex_unlock(&addrman->mutex);
+    return added;
+}
+
+void btc_addrman_attempt(btc_addrman* addrman, const btc_p2p_address* addr, uint32_t now)
+{
+    pthread_mutex_lock(&addrman->mutex);
+    btc_addrman_entry* entry = btc_addrman_find(addrman, addr);
+    if (entry) {
+        entry->last_try = now;
+        if (entry->attempts < UINT16_MAX)
+            entry->attempts++;
+    }
+    pthread_mutex_unlock(&addrman->mutex);
+}
+
+void btc_addrman_good(btc_addrman* addrman, const btc_p2p_address* addr, uint32_t now)
+{
+    pthread_mutex_lock(&addrman->mutex);
+    btc_addrman_entry* entry = btc_addrman_find(addrman, addr);
+    if (!entry) {
+        /* connected to an address we didn't know about (e.g. a manually added peer) */
+        entry = btc_calloc(1, sizeof(*entry));
+        entry->addr = *addr;
+    } else if (!entry->tried) {
+        addrman->new_table[btc_addrman_new_slot(addrman, addr)] = NULL;
+        addrman->new_count--;
+    }
+    entry->addr.time = now;
+    entry->last_success = now;
+    entry->last_try = now;
+    entry->attempts = 0;
+    if (!entry->tried)
+        btc_addrman_place_tried(addrman, entry, now);
+    pthread_mutex_unlock(&addrman->mutex);
+}
+
+/* probability (0..1) to pick an entry when selecting addresses to connect to */
+static double btc_addrman_chance(const btc_addrman_entry* entry, uint32_t now)
+{
+    double chance = 1.0;
+    if (entry->last_try && now - entry->last_try < BTC_ADDRMAN_RETRY_DELAY_S)
+        chance *= 0.01;
+    for (unsigned int i = 0; i < entry->attempts && i < 8; i++)
+        chance *= 0.66;
+    return chance;
+}
+
+/* the callers hold the mutex (btc_cheap_random_bytes reseeds from the clock and repeats within a second) */
+static uint32_t btc_addrman_random(btc_addrman* addrman, uint32_t range)
+{
+    uint64_t x = addrman->rand_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    addrman->rand_state = x;
+    uint32_t value = (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+    return (range ? value % range : 0);
+}
+
+btc_bool btc_addrman_select(btc_addrman* addrman, uint32_t now, uint64_t services, btc_p2p_address* addr_out)
+{
+    pthread_mutex_lock(&addrman->mutex);
+    if (addrman->new_count + addrman->tried_count == 0) {
+        pthread_mutex_unlock(&addrman->mutex);
+        return false;
+    }
+
+    double chance_factor = 1.0;
+    for (unsigned int round = 0; round < BTC_ADDRMAN_SELECT_ROUNDS; round++) {
+        /* pick the tried or the new table with equal probability */
+        btc_bool use_tried = (addrman->tried_count > 0 && (addrman->new_count == 0 || btc_addrman_random(addrman, 2) == 0));
+        btc_addrman_entry** table = (use_tried ? addrman->tried_table : addrman->new_table);
+        size_t table_size = (use_tried ? BTC_ADDRMAN_TRIED_BUCKETS : BTC_ADDRMAN_NEW_BUCKETS) * BTC_ADDRMAN_BUCKET_SIZE;
+
+        /* scan from a random slot to the next occupied one */
+        size_t slot = btc_addrman_random(addrman, table_size);
+        while (!table[slot])
+            slot = (slot + 1) % table_size;
+
+        btc_addrman_entry* entry = table[slot];
+        if ((entry->addr.services & services) == services &&
+            btc_addrman_random(addrman, 1 << 30) < chance_factor * btc_addrman_chance(entry, now) * (1 << 30)) {
+            *addr_out = entry->addr;
+            pthread_mutex_unlock(&addrman->mutex);
+            return true;
+        }
+        chance_factor *= 1.2;
+    }
+    pthread_mutex_unlock(&addrman->mutex);
+    return false;
+}
+
+size_t btc_addrman_get_addr(btc_addrman* addrman, uint32_t now, btc_p2p_address* addrs_out, size_t max)
+{
+    pthread_mutex_lock(&addrman->mutex);
+    /* hand out at most 23% of the known addresses */
+    size_t wanted = (addrman->new_count + addrman->tried_count) * 23 / 100 + 1;
+    if (wanted > max)
+        wanted = max;
+
+    /* reservoir sample over both tables */
+    size_t seen = 0;
+    for (int tried = 0; tried <= 1; tried++) {
+        btc_addrman_entry** table = (tried ? addrman->tried_table : addrman->new_table);
+        size_t table_size = (tried ? BTC_ADDRMAN_TRIED_BUCKETS : BTC_ADDRMAN_NEW_BUCKETS) * BTC_ADDRMAN_BUCKET_SIZE;
+        for (size_t i = 0; i < table_size; i++) {
+            if (!table[i] || btc_addrman_is_terrible(table[i], now))
+                continue;
+            if (seen < wanted)
+                addrs_out[seen] = table[i]->addr;
+            else {
+                size_t pos = btc_addrman_random(addrman, seen + 1);
+                if (pos < wanted)
+                    addrs_out[pos] = table[i]->addr;
+            }
+            seen++;
+        }
+    }
+    pthread_mutex_unlock(&addrman->mutex);
+    return (seen < wanted ? seen : wanted);
+}
+
+static void btc_addrman_ser_entry(cstring* s, const btc_addrman_entry* entry)
+{
+    ser_bytes(s, entry->addr.ip, sizeof(entry->addr.ip));
+    ser_u16(s, entry->addr.port);
+    ser_u64(s, entry->addr.services);
+    ser_u32(s, entry->addr.time);
+    ser_u32(s, entry->last_try);
+    ser_u32(s, entry->last_success);
+    ser_u16(s, entry->attempts);
+    uint8_t tried = (entry->tried ? 1 : 0);
+    ser_bytes(s, &tried, 1);
+}
+
+btc_bool btc_addrman_write(btc_addrman* addrman, const char* file_path)
+{
+    pthread_mutex_lock(&addrman->mutex);
+    uint32_t count = (uint32_t)(addrman->new_count + addrman->tried_count);
+    cstring* s = cstr_new_sz(4 + 4 + sizeof(addrman->key) + 4 + count * BTC_ADDRMAN_FILE_RECORD_SIZE);
+    ser_bytes(s, BTC_ADDRMAN_FILE_MAGIC, sizeof(BTC_ADDRMAN_FILE_MAGIC));
+    ser_u32(s, BTC_ADDRMAN_FILE_VERSION);
+    ser_bytes(s, addrman->key, sizeof(addrman->key));
+    ser_u32(s, count);
+    for (size_t i = 0; i < BTC_ADDRMAN_TRIED_BUCKETS * BTC_ADDRMAN_BUCKET_SIZE; i++)
+        if (addrman->tried_table[i])
+            btc_addrman_ser_entry(s, addrman->tried_table[i]);
+    for (size_t i = 0; i < BTC_ADDRMAN_NEW_BUCKETS * BTC_ADDRMAN_BUCKET_SIZE; i++)
+        if (addrman->new_table[i])
+            btc_addrman_ser_entry(s, addrman->new_table[i]);
+    pthread_mutex_unlock(&addrman->mutex);
+
+    /* write to a temporary file first, a crash must not leave a truncated file behind */
+    cstring* tmp_path = cstr_new(file_path);
+    cstr_append_buf(tmp_path, ".tmp", 4);
+    btc_bool ret = false;
+    FILE* file = fopen(tmp_path->str, "wb");
+    if (file) {
+        ret = (fwrite(s->str, 1, s->len, file) == s->len);
+        ret = (fclose(file) == 0 && ret);
+        if (ret)
+            ret = (rename(tmp_path->str, file_path) == 0);
+        else
+            remove(tmp_path->str);
+    }
+    cstr_free(tmp_path, true);
+    cstr_free(s, true);
+    return ret;
+}
+
+btc_bool btc_addrman_load(btc_addrman* addrman, const char* file_path)
+{
+    FILE* file = fopen(file_path, "rb");
+    if (!file)
+        return false;
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (file_size < 0) {
+        fclose(file);
+        return false;
+    }
+    cstring* s = cstr_new_sz(file_size);
+    s->len = fread(s->str, 1, file_size, file);
+    fclose(file);
+
+    struct const_buffer buf = {s->str, s->len};
+    unsigned char magic[4];
+    uint32_t version = 0, count = 0;
+    uint8_t key[32];
+    if (!deser_bytes(magic, &buf, sizeof(magic)) || memcmp(magic, BTC_ADDRMAN_FILE_MAGIC, sizeof(magic)) != 0 ||
+        !deser_u32(&version, &buf) || version != BTC_ADDRMAN_FILE_VERSION ||
+        !deser_bytes(key, &buf, sizeof(key)) || !deser_u32(&count, &buf) ||
+        buf.len != (size_t)count * BTC_ADDRMAN_FILE_RECORD_SIZE) {
+        cstr_free(s, true);
+        return false;
+    }
+
+    pthread_mutex_lock(&addrman->mutex);
+    /* the slots of the stored addresses depend on the key, keep it if we don't have addresses yet */
+    if (addrman->new_count + addrman->tried_count == 0)
+        memcpy(addrman->key, key, sizeof(key));
+
+    uint32_t now = (uint32_t)time(NULL);
+    for (uint32_t i = 0; i < count; i++) {
+        btc_addrman_entry* entry = btc_calloc(1, sizeof(*entry));
+        uint8_t tried = 0;
+        deser_bytes(entry->addr.ip, &buf, sizeof(entry->addr.ip));
+        deser_u16(&entry->addr.port, &buf);
+        deser_u64(&entry->addr.services, &buf);
+        deser_u32(&entry->addr.time, &buf);
+        deser_u32(&entry->last_try, &buf);
+        deser_u32(&entry->last_success, &buf);
+        deser_u16(&entry->attempts, &buf);
+        deser_bytes(&tried, &buf, 1);
+        if (btc_addrman_find(addrman, &entry->addr)) {
+            btc_free(entry);
+            continue;
+        }
+        if (tried && !addrman->tried_table[btc_addrman_tried_slot(addrman, &entry->addr)])
+            btc_addrman_place_tried(addrman, entry, now);
+        else
+            btc_addrman_place_new(addrman, entry, now);
+    }
+    pthread_mutex_unlock(&addrman->mutex);
+    cstr_free(s, true);
+    return true;
+}
@@ -0,0 +1,373 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#include "libbtc-config.h"
+
+#include <btc/block.h>
+#include <btc/chainparams.h>
+#include <btc/hash.h>
+#include <btc/headersdb_file.h>
+#include <btc/memory.h>
+#include <btc/net.h>
+#include <btc/netspv.h>
+#include <btc/protocol.h>
+#include <btc/serialize.h>
+#include <btc/utils.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* replays a headers corpus (consecutive 80 byte headers starting at height 1)
+   through the headers database and the spv message processing */
+
+static const unsigned int BENCH_DEFAULT_HEADERS = 100000;
+
+static struct option long_options[] =
+    {
+        {"corpus", required_argument, NULL, 'f'},
+        {"amount", required_argument, NULL, 'n'},
+        {"write", required_argument, NULL, 'w'},
+        {"dbfile", required_argument, NULL, 'd'},
+        {"testnet", no_argument, NULL, 't'},
+        {"regtest", no_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}};
+
+static void print_usage()
+{
+    printf("Version: %s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
+    printf("Usage: bench_headers (-f|--corpus <headersfile>) (-n|--amount <int>) (-w|--write <headersfile>) (-d|--dbfile <file>) (-t[--testnet]) (-r[--regtest])\n");
+    printf("Without a corpus file, a regtest chain of <amount> headers is generated (and optionally written with -w).\n");
+    printf("A corpus file contains raw 80 byte headers starting at height 1 (mainnet unless -t or -r is given).\n\n");
+}
+
+/* allocations through the btc_* memory functions */
+static uint64_t bench_allocations = 0;
+
+static void* bench_malloc(size_t size)
+{
+    bench_allocations++;
+    return malloc(size);
+}
+
+static void* bench_calloc(size_t count, size_t size)
+{
+    bench_allocations++;
+    return calloc(count, size);
+}
+
+static void* bench_realloc(void* ptr, size_t size)
+{
+    bench_allocations++;
+    return realloc(ptr, size);
+}
+
+static void bench_free(void* ptr)
+{
+    free(ptr);
+}
+
+static uint64_t bench_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int bench_compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static cstring* bench_generate_corpus(const btc_chainparams* chain, unsigned int amount)
+{
+    cstring* corpus = cstr_new_sz((size_t)amount * 80);
+    uint256 prev;
+    memcpy(prev, chain->genesisblockhash, BTC_HASH_LENGTH);
+    for (unsigned int i = 0; i < amount; i++) {
+        btc_block_header header;
+        memset(&header, 0, sizeof(header));
+        header.version = 4;
+        memcpy(header.prev_block, prev, BTC_HASH_LENGTH);
+        header.merkle_root[0] = i & 0xff;
+        header.merkle_root[1] = (i >> 8) & 0xff;
+        header.merkle_root[2] = (i >> 16) & 0xff;
+        header.timestamp = 1296688602 + i * 600;
+        header.bits = 0x207fffff;
+        do {
+            header.nonce++;
+            btc_block_header_hash(&header, prev);
+        } while (!btc_block_header_check_pow(&header, prev));
+        btc_block_header_serialize(corpus, &header);
+    }
+    return corpus;
+}
+
+static cstring* bench_read_corpus(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    cstring* corpus = cstr_new_sz(1024 * 1024);
+    char buf[64 * 1024];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), file)) > 0)
+        cstr_append_buf(corpus, buf, len);
+    fclose(file);
+    /* ignore a trailing partial header */
+    cstr_resize(corpus, corpus->len - corpus->len % 80);
+    return corpus;
+}
+
+/* headers messages as received from a peer (24 byte framing and payload) */
+static cstring** bench_build_messages(const btc_chainparams* chain, const cstring* corpus, size_t* amount_out)
+{
+    size_t headers = corpus->len / 80;
+    size_t amount = (headers + MAX_HEADERS_RESULTS - 1) / MAX_HEADERS_RESULTS;
+    cstring** messages = btc_calloc(amount + 1, sizeof(cstring*));
+    for (size_t i = 0; i < amount; i++) {
+        size_t count = (i == amount - 1 ? headers - i * MAX_HEADERS_RESULTS : MAX_HEADERS_RESULTS);
+        cstring* payload = cstr_new_sz(count * BTC_HEADERS_MSG_ENTRY_SIZE + 3);
+        ser_varlen(payload, count);
+        for (size_t j = 0; j < count; j++) {
+            ser_bytes(payload, corpus->str + (i * MAX_HEADERS_RESULTS + j) * 80, 80);
+            ser_varlen(payload, 0);
+        }
+        messages[i] = btc_p2p_message_new(chain->netmagic, BTC_MSG_HEADERS, payload->str, payload->len);
+        cstr_free(payload, true);
+    }
+    *amount_out = amount;
+    return messages;
+}
+
+static void bench_report(const char* mode, size_t headers, uint64_t total_ns, uint64_t* latencies, size_t amount, uint64_t allocations)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    qsort(latencies, amount, sizeof(uint64_t), bench_compare_u64);
+    uint64_t p50 = (amount > 0 ? latencies[(amount - 1) / 2] : 0);
+    uint64_t p99 = (amount > 0 ? latencies[(amount - 1) * 99 / 100] : 0);
+    printf("%-22s %9zu %12.0f %10.3f %10.3f %12" PRIu64 " %10ld\n",
+           mode, headers, (total_ns > 0 ? headers * 1e9 / total_ns : 0.0),
+           p50 / 1e6, p99 / 1e6, allocations, usage.ru_maxrss);
+}
+
+/* feed the corpus in chunks of a headers message through btc_headers_db_connect_hdr */
+static int bench_connect_hdr(const btc_chainparams* chain, const cstring* corpus, const char* dbfile)
+{
+    size_t headers = corpus->len / 80;
+    size_t amount = (headers + MAX_HEADERS_RESULTS - 1) / MAX_HEADERS_RESULTS;
+    uint64_t* latencies = btc_calloc(amount + 1, sizeof(uint64_t));
+
+    btc_headers_db* db = btc_headers_db_new(chain, dbfile == NULL);
+    if (dbfile && !btc_headers_db_load(db, dbfile)) {
+        fprintf(stderr, "Could not create the headers database %s\n", dbfile);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t allocations = bench_allocations;
+    uint64_t start = bench_time_ns();
+    struct const_buffer buf = {corpus->str, corpus->len};
+    for (size_t i = 0; i < amount; i++) {
+        uint64_t msg_start = bench_time_ns();
+        size_t count = (i == amount - 1 ? headers - i * MAX_HEADERS_RESULTS : MAX_HEADERS_RESULTS);
+        btc_headers_db_begin_batch(db);
+        for (size_t j = 0; j < count; j++) {
+            btc_bool connected = false;
+            btc_headers_db_connect_hdr(db, &buf, false, &connected);
+            if (!connected) {
+                fprintf(stderr, "Connecting header at height %zu failed\n", i * MAX_HEADERS_RESULTS + j + 1);
+                return EXIT_FAILURE;
+            }
+        }
+        btc_headers_db_commit_batch(db);
+        latencies[i] = bench_time_ns() - msg_start;
+    }
+    uint64_t total = bench_time_ns() - start;
+
+    bench_report((dbfile ? "connect_hdr (file)" : "connect_hdr (memory)"), headers, total, latencies, amount, bench_allocations - allocations);
+    btc_headers_db_free(db);
+    btc_free(latencies);
+    return EXIT_SUCCESS;
+}
+
+/* feed the corpus as headers messages through btc_net_spv_post_cmd */
+static int bench_post_cmd(const btc_chainparams* chain, const cstring* corpus, const char* dbfile)
+{
+    size_t headers = corpus->len / 80;
+    size_t amount = 0;
+    cstring** messages = bench_build_messages(chain, corpus, &amount);
+    uint64_t* latencies = btc_calloc(amount + 1, sizeof(uint64_t));
+
+    btc_spv_client* client = btc_spv_client_new(chain, false, dbfile == NULL);
+    if (dbfile && !btc_spv_client_load(client, dbfile)) {
+        fprintf(stderr, "Could not create the headers database %s\n", dbfile);
+        return EXIT_FAILURE;
+    }
+    /* headers only, no block downloads */
+    client->oldest_item_of_interest = time(NULL) + 24 * 60 * 60;
+
+    /* a connected peer without socket, outgoing messages (getheaders) stay in its output buffer */
+    btc_node* node = btc_node_new();
+    btc_node_group_add_node(client->nodegroup, node);
+    btc_node_set_state(node, NODE_CONNECTED);
+    node->version_handshake = true;
+    node->event_bev = bufferevent_socket_new(client->nodegroup->event_base, -1, 0);
+    struct evbuffer* output = bufferevent_get_output(node->event_bev);
+
+    uint64_t allocations = bench_allocations;
+    uint64_t start = bench_time_ns();
+    for (size_t i = 0; i < amount; i++) {
+        uint64_t msg_start = bench_time_ns();
+        struct const_buffer buf = {messages[i]->str, messages[i]->len};
+        btc_p2p_msg_hdr hdr;
+        btc_p2p_deser_msghdr(&hdr, &buf);
+        btc_net_spv_post_cmd(node, &hdr, &buf);
+        latencies[i] = bench_time_ns() - msg_start;
+
+        evbuffer_unfreeze(output, 1);
+        evbuffer_drain(output, evbuffer_get_length(output));
+        evbuffer_freeze(output, 1);
+    }
+    uint64_t total = bench_time_ns() - start;
+
+    if (client->headers_db->getchaintip(client->headers_db_ctx)->height != headers) {
+        fprintf(stderr, "Only %u of %zu headers connected\n", client->headers_db->getchaintip(client->headers_db_ctx)->height, headers);
+        return EXIT_FAILURE;
+    }
+    bench_report((dbfile ? "post_cmd (file)" : "post_cmd (memory)"), headers, total, latencies, amount, bench_allocations - allocations);
+
+    btc_spv_client_free(client);
+    for (size_t i = 0; i < amount; i++)
+        cstr_free(messages[i], true);
+    btc_free(messages);
+    btc_free(latencies);
+    return EXIT_SUCCESS;
+}
+
+/* run each mode in its own process to get separate peak RSS values */
+static int bench_run(int (*fn)(const btc_chainparams*, const cstring*, const char*), const btc_chainparams* chain, const cstring* corpus, const char* dbfile)
+{
+    if (dbfile)
+        unlink(dbfile);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+        exit(fn(chain, corpus, dbfile));
+
+    int status = EXIT_FAILURE;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return EXIT_FAILURE;
+    if (dbfile)
+        unlink(dbfile);
+    return (WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+    int long_index = 0;
+    int opt = 0;
+    char* corpus_file = NULL;
+    char* write_file = NULL;
+    char* dbfile = "bench_headers.db";
+    unsigned int amount = BENCH_DEFAULT_HEADERS;
+    const btc_chainparams* chain = NULL;
+
+    btc_mem_mapper mapper = {bench_malloc, bench_calloc, bench_realloc, bench_free};
+    btc_mem_set_mapper(mapper);
+
+    while ((opt = getopt_long_only(argc, argv, "f:n:w:d:trh", long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'f':
+            corpus_file = optarg;
+            break;
+        case 'n':
+            amount = (unsigned int)strtoul(optarg, (char**)NULL, 10);
+            break;
+        case 'w':
+            write_file = optarg;
+            break;
+        case 'd':
+            dbfile = optarg;
+            break;
+        case 't':
+            chain = &btc_chainparams_test;
+            break;
+        case 'r':
+            chain = &btc_chainparams_regtest;
+            break;
+        default:
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    cstring* corpus = NULL;
+    if (corpus_file) {
+        if (!chain)
+            chain = &btc_chainparams_main;
+        corpus = bench_read_corpus(corpus_file);
+        if (!corpus || corpus->len == 0) {
+            fprintf(stderr, "Could not read headers from %s\n", corpus_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        chain = &btc_chainparams_regtest;
+        printf("Generating %u regtest headers...\n", amount);
+        corpus = bench_generate_corpus(chain, amount);
+        if (write_file) {
+            FILE* file = fopen(write_file, "wb");
+            if (!file || fwrite(corpus->str, corpus->len, 1, file) != 1) {
+                fprintf(stderr, "Could not write %s\n", write_file);
+                exit(EXIT_FAILURE);
+            }
+            fclose(file);
+        }
+    }
+
+    printf("%-22s %9s %12s %10s %10s %12s %10s\n", "mode", "headers", "headers/s", "p50 ms", "p99 ms", "allocations", "peak kB");
+    int ret = EXIT_SUCCESS;
+    if (bench_run(bench_connect_hdr, chain, corpus, NULL) != EXIT_SUCCESS ||
+        bench_run(bench_connect_hdr, chain, corpus, dbfile) != EXIT_SUCCESS ||
+        bench_run(bench_post_cmd, chain, corpus, NULL) != EXIT_SUCCESS ||
+        bench_run(bench_post_cmd, chain, corpus, dbfile) != EXIT_SUCCESS) {
+        ret = EXIT_FAILURE;
+    }
+    cstr_free(corpus, true);
+    return ret;
+}
@@ -76,14 +76,21 @@ int btc_block_header_deserialize(btc_block_header* header, struct const_buffer*
     return true;
 }
 
+void btc_block_header_serialize_sink(btc_ser_sink* sink, const btc_block_header* header)
+{
+    ser_sink_s32(sink, header->version);
+    ser_sink_u256(sink, header->prev_block);
+    ser_sink_u256(sink, header->merkle_root);
+    ser_sink_u32(sink, header->timestamp);
+    ser_sink_u32(sink, header->bits);
+    ser_sink_u32(sink, header->nonce);
+}
+
 void btc_block_header_serialize(cstring* s, const btc_block_header* header)
 {
-    ser_s32(s, header->version);
-    ser_u256(s, header->prev_block);
-    ser_u256(s, header->merkle_root);
-    ser_u32(s, header->timestamp);
-    ser_u32(s, header->bits);
-    ser_u32(s, header->nonce);
+    btc_ser_sink sink;
+    btc_ser_sink_init(&sink, s, NULL, NULL);
+    btc_block_header_serialize_sink(&sink, header);
 }
 
 void btc_block_header_copy(btc_block_header* dest, const btc_block_header* src)
@@ -98,13 +105,281 @@ void btc_block_header_copy(btc_block_header* dest, const btc_block_header* src)
 
 btc_bool btc_block_header_hash(btc_block_header* header, uint256 hash)
 {
-    cstring* s = cstr_new_sz(80);
-    btc_block_header_serialize(s, header);
+    SHA256_CTX ctx;
+    btc_ser_sink sink;
+    sha256_Init(&ctx);
+    btc_ser_sink_init(&sink, NULL, &ctx, NULL);
+    btc_block_header_serialize_sink(&sink, header);
 
-    sha256_Raw((const uint8_t*)s->str, s->len, hash);
+    sha256_Final(hash, &ctx);
     sha256_Raw(hash, SHA256_DIGEST_LENGTH, hash);
-    cstr_free(s, true);
 
     btc_bool ret = true;
     return ret;
 }
+
+btc_bool btc_block_bits_to_target(uint32_t bits, uint256 target)
+{
+    memset(target, 0, sizeof(uint256));
+
+    unsigned int exponent = bits >> 24;
+    uint32_t mantissa = bits & 0x007fffff;
+
+    /* negative or overflowing targets are invalid */
+    if (mantissa != 0 && (bits & 0x00800000))
+        return false;
+    if (mantissa != 0 && (exponent > 34 || (mantissa > 0xff && exponent > 33) || (mantissa > 0xffff && exponent > 32)))
+        return false;
+
+    if (exponent <= 3) {
+        mantissa >>= 8 * (3 - exponent);
+        exponent = 3;
+    }
+    for (unsigned int i = 0; i < 3; i++) {
+        unsigned int pos = exponent - 3 + i;
+        if (pos < sizeof(uint256))
+            target[pos] = (mantissa >> (8 * i)) & 0xff;
+    }
+
+    /* a zero target can't be reached */
+    for (unsigned int i = 0; i < sizeof(uint256); i++)
+        if (target[i] != 0)
+            return true;
+    return false;
+}
+
+uint32_t btc_block_target_to_bits(const uint256 target)
+{
+    unsigned int size = sizeof(uint256);
+    while (size > 0 && target[size - 1] == 0)
+        size--;
+
+    /* the three most significant bytes */
+    uint32_t mantissa = 0;
+    for (unsigned int i = 0; i < 3; i++) {
+        mantissa <<= 8;
+        if (size > i)
+            mantissa |= target[size - 1 - i];
+    }
+    /* the sign bit would make it negative */
+    if (mantissa & 0x00800000) {
+        mantissa >>= 8;
+        size++;
+    }
+    return mantissa | (size << 24);
+}
+
+btc_bool btc_block_header_check_pow(const btc_block_header* header, const uint256 hash)
+{
+    uint256 target;
+    if (!btc_block_bits_to_target(header->bits, target))
+        return false;
+
+    /* compare from the most significant byte */
+    for (int i = sizeof(target) - 1; i >= 0; i--) {
+        if (hash[i] != target[i])
+            return hash[i] < target[i];
+    }
+    return true;
+}
+
+btc_block* btc_block_new()
+{
+    btc_block* block;
+    block = btc_calloc(1, sizeof(*block));
+
+    return block;
+}
+
+void btc_block_free(btc_block* block)
+{
+    if (!block)
+        return;
+
+    btc_free(block->txs);
+    btc_free(block->txids);
+    btc_free(block->arena);
+    memset(block, 0, sizeof(*block));
+    btc_free(block);
+}
+
+/* decoded transactions are placed at 8 byte aligned offsets of the blocks arena */
+static size_t btc_block_arena_align(size_t size)
+{
+    return (size + sizeof(int64_t) - 1) & ~(sizeof(int64_t) - 1);
+}
+
+struct btc_block_deserialize_ctx {
+    btc_block* block;
+    const uint8_t* data;   /* start of the serialized block */
+    uint32_t* tx_offsets;  /* transaction i spans [tx_offsets[i], tx_offsets[i + 1]) of data */
+    size_t* arena_offsets; /* arena size of transaction i, turned into its offset once all are known (NULL = no decoding) */
+};
+
+static void btc_block_hash_txs_range(void* ctx, size_t begin, size_t end)
+{
+    struct btc_block_deserialize_ctx* deser = (struct btc_block_deserialize_ctx*)ctx;
+    for (size_t i = begin; i < end; i++) {
+        const uint8_t* tx_data = deser->data + deser->tx_offsets[i];
+        size_t tx_len = deser->tx_offsets[i + 1] - deser->tx_offsets[i];
+        /* hash the wire bytes directly instead of reserializing */
+        sha256_Raw(tx_data, tx_len, deser->block->txids[i]);
+        sha256_Raw(deser->block->txids[i], SHA256_DIGEST_LENGTH, deser->block->txids[i]);
+        if (deser->arena_offsets)
+            deser->arena_offsets[i] = btc_block_arena_align(btc_tx_deserialize_arena_size(tx_data, tx_len));
+    }
+}
+
+static void btc_block_decode_txs_range(void* ctx, size_t begin, size_t end)
+{
+    struct btc_block_deserialize_ctx* deser = (struct btc_block_deserialize_ctx*)ctx;
+    for (size_t i = begin; i < end; i++) {
+        const uint8_t* tx_data = deser->data + deser->tx_offsets[i];
+        size_t tx_len = deser->tx_offsets[i + 1] - deser->tx_offsets[i];
+        size_t arena_size = deser->arena_offsets[i + 1] - deser->arena_offsets[i];
+        deser->block->txs[i] = btc_tx_deserialize_arena(tx_data, tx_len, (uint8_t*)deser->block->arena + deser->arena_offsets[i], arena_size, NULL);
+    }
+}
+
+static btc_bool btc_block_deserialize_internal(btc_block* block, struct const_buffer* buf, btc_threadpool* pool, btc_bool decode_txs)
+{
+    struct const_buffer scan = {buf->p, buf->len};
+    uint32_t tx_count;
+    if (!btc_block_header_deserialize(&block->header, &scan) || !deser_varlen(&tx_count, &scan))
+        return false;
+    /* a transaction takes at least 10 bytes, prevents allocating for bogus counts */
+    if (tx_count > scan.len / 10)
+        return false;
+
+    /* find the transaction boundaries, the expensive work is done in parallel below */
+    struct btc_block_deserialize_ctx ctx;
+    ctx.block = block;
+    ctx.data = buf->p;
+    ctx.tx_offsets = btc_malloc(((size_t)tx_count + 1) * sizeof(uint32_t));
+    btc_tx_view view;
+    btc_tx_view_init(&view);
+    uint32_t i;
+    for (i = 0; i < tx_count; i++) {
+        ctx.tx_offsets[i] = (uint32_t)(buf->len - scan.len);
+        if (!btc_tx_view_parse(&view, &scan))
+            break;
+    }
+    ctx.tx_offsets[i] = (uint32_t)(buf->len - scan.len);
+    btc_tx_view_free(&view);
+    if (i < tx_count) {
+        btc_free(ctx.tx_offsets);
+        return false;
+    }
+
+    sha256_Raw(buf->p, 80, block->hash);
+    sha256_Raw(block->hash, SHA256_DIGEST_LENGTH, block->hash);
+
+    block->tx_count = tx_count;
+    block->txids = btc_malloc(((size_t)tx_count + 1) * sizeof(uint256));
+    ctx.arena_offsets = (decode_txs ? btc_malloc(((size_t)tx_count + 1) * sizeof(size_t)) : NULL);
+    btc_threadpool_run(pool, tx_count, 16, btc_block_hash_txs_range, &ctx);
+    if (!decode_txs) {
+        btc_free(ctx.tx_offsets);
+        *buf = scan;
+        return true;
+    }
+    block->txs = btc_calloc((size_t)tx_count + 1, sizeof(btc_tx*));
+
+    /* one arena for the whole block, each transaction gets its own aligned region */
+    size_t arena_size = 0;
+    for (i = 0; i < tx_count; i++) {
+        size_t tx_arena_size = ctx.arena_offsets[i];
+        ctx.arena_offsets[i] = arena_size;
+        arena_size += tx_arena_size;
+    }
+    ctx.arena_offsets[tx_count] = arena_size;
+    block->arena = btc_malloc(BTC_MAX(arena_size, 1));
+    btc_threadpool_run(pool, tx_count, 16, btc_block_decode_txs_range, &ctx);
+
+    btc_free(ctx.arena_offsets);
+    btc_free(ctx.tx_offsets);
+    *buf = scan;
+    return true;
+}
+
+btc_bool btc_block_deserialize(btc_block* block, struct const_buffer* buf, btc_threadpool* pool)
+{
+    return btc_block_deserialize_internal(block, buf, pool, true);
+}
+
+btc_bool btc_block_deserialize_txids(btc_block* block, struct const_buffer* buf, btc_threadpool* pool)
+{
+    return btc_block_deserialize_internal(block, buf, pool, false);
+}
+
+struct btc_block_merkle_ctx {
+    const uint8_t* in;  /* current level */
+    uint8_t* out;       /* next level */
+    size_t count;       /* hashes in the current level */
+};
+
+static void btc_block_merkle_range(void* ctx, size_t begin, size_t end)
+{
+    struct btc_block_merkle_ctx* merkle = (struct btc_block_merkle_ctx*)ctx;
+    for (size_t i = begin; i < end; i++) {
+        /* an odd last hash is paired with itself */
+        size_t right = BTC_MIN(2 * i + 1, merkle->count - 1);
+        SHA256_CTX sha;
+        sha256_Init(&sha);
+        sha256_Update(&sha, merkle->in + 2 * i * BTC_HASH_LENGTH, BTC_HASH_LENGTH);
+        sha256_Update(&sha, merkle->in + right * BTC_HASH_LENGTH, BTC_HASH_LENGTH);
+        sha256_Final(merkle->out + i * BTC_HASH_LENGTH, &sha);
+        sha256_Raw(merkle->out + i * BTC_HASH_LENGTH, SHA256_DIGEST_LENGTH, merkle->out + i * BTC_HASH_LENGTH);
+    }
+}
+
+void btc_block_merkle_root(const uint256* hashes, size_t count, btc_threadpool* pool, uint256 root, btc_bool* mutated)
+{
+    if (mutated)
+        *mutated = false;
+    if (count == 0) {
+        memset(root, 0, BTC_HASH_LENGTH);
+        return;
+    }
+
+    /* levels are hashed from one buffer into the other */
+    uint8_t* level = btc_malloc(count * BTC_HASH_LENGTH);
+    uint8_t* next = btc_malloc(((count + 1) / 2) * BTC_HASH_LENGTH);
+    memcpy(level, hashes, count * BTC_HASH_LENGTH);
+
+    struct btc_block_merkle_ctx ctx;
+    ctx.count = count;
+    while (ctx.count > 1) {
+        /* identical pairs result in the same root as a tree with fewer leaves */
+        if (mutated) {
+            for (size_t i = 0; i + 1 < ctx.count; i += 2)
+                if (memcmp(level + i * BTC_HASH_LENGTH, level + (i + 1) * BTC_HASH_LENGTH, BTC_HASH_LENGTH) == 0)
+                    *mutated = true;
+        }
+
+        ctx.in = level;
+        ctx.out = next;
+        size_t next_count = (ctx.count + 1) / 2;
+        btc_threadpool_run(pool, next_count, 256, btc_block_merkle_range, &ctx);
+
+        uint8_t* tmp = level;
+        level = next;
+        next = tmp;
+        ctx.count = next_count;
+    }
+    memcpy(root, level, BTC_HASH_LENGTH);
+
+    btc_free(next);
+    btc_free(level);
+}
+
+btc_bool btc_block_check_merkle_root(const btc_block* block, btc_threadpool* pool)
+{
+    if (block->tx_count == 0)
+        return false;
+
+    uint256 root;
+    btc_bool mutated;
+    btc_block_merkle_root((const uint256*)block->txids, block->tx_count, pool, root, &mutated);
+    return !mutated && memcmp(root, block->header.merkle_root, BTC_HASH_LENGTH) == 0;
+}
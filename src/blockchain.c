@@ -0,0 +1,193 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#include <btc/blockchain.h>
+
+#include <btc/serialize.h>
+#include <btc/sha2.h>
+#include <btc/utils.h>
+
+#include <string.h>
+
+struct btc_prepare_headers_ctx {
+    const uint8_t* data;
+    btc_blockindex** out;
+    uint8_t* valid;
+};
+
+static void btc_blockindex_prepare_range(void* ctx, size_t begin, size_t end)
+{
+    struct btc_prepare_headers_ctx* prepare = (struct btc_prepare_headers_ctx*)ctx;
+    for (size_t i = begin; i < end; i++) {
+        btc_blockindex* blockindex = prepare->out[i];
+        const uint8_t* entry = prepare->data + i * BTC_HEADERS_MSG_ENTRY_SIZE;
+        struct const_buffer buf = {entry, BTC_HEADERS_MSG_ENTRY_SIZE};
+        prepare->valid[i] = false;
+        if (!btc_block_header_deserialize(&blockindex->header, &buf))
+            continue;
+        /* headers messages never carry transactions */
+        if (*(const uint8_t*)buf.p != 0)
+            continue;
+        /* hash the wire bytes directly instead of reserializing */
+        sha256_Raw(entry, 80, blockindex->hash);
+        sha256_Raw(blockindex->hash, SHA256_DIGEST_LENGTH, blockindex->hash);
+        prepare->valid[i] = btc_block_header_check_pow(&blockindex->header, blockindex->hash);
+    }
+}
+
+size_t btc_blockindex_prepare_headers(btc_threadpool* pool, struct const_buffer* buf, size_t count, btc_blockindex** out)
+{
+    count = BTC_MIN(count, buf->len / BTC_HEADERS_MSG_ENTRY_SIZE);
+    if (count == 0)
+        return 0;
+
+    /* allocate upfront so that the workers only touch their own entries */
+    for (size_t i = 0; i < count; i++)
+        out[i] = btc_calloc(1, sizeof(btc_blockindex));
+
+    struct btc_prepare_headers_ctx ctx;
+    ctx.data = (const uint8_t*)buf->p;
+    ctx.out = out;
+    ctx.valid = btc_calloc(count, sizeof(uint8_t));
+    btc_threadpool_run(pool, count, 64, btc_blockindex_prepare_range, &ctx);
+
+    /* the linkage check needs the hash of the predecessor, do it once all hashes are known */
+    size_t valid = 0;
+    while (valid < count && ctx.valid[valid] &&
+           (valid == 0 || memcmp(out[valid]->header.prev_block, out[valid - 1]->hash, BTC_HASH_LENGTH) == 0))
+        valid++;
+
+    for (size_t i = valid; i < count; i++) {
+        btc_free(out[i]);
+        out[i] = NULL;
+    }
+    btc_free(ctx.valid);
+
+    deser_skip(buf, count * BTC_HEADERS_MSG_ENTRY_SIZE);
+    return valid;
+}
+
+/* turn the lowest set bit off */
+static uint32_t btc_blockindex_invert_lowest_one(uint32_t n)
+{
+    return n & (n - 1);
+}
+
+/* height a skip pointer of a block at the given height points to
+   (any height below works, this choice keeps ancestor lookups at O(log n)) */
+static uint32_t btc_blockindex_skip_height(uint32_t height)
+{
+    if (height < 2)
+        return 0;
+
+    /* odd heights jump less far to avoid always landing on the same heights */
+    return (height & 1) ? btc_blockindex_invert_lowest_one(btc_blockindex_invert_lowest_one(height - 1)) + 1 : btc_blockindex_invert_lowest_one(height);
+}
+
+void btc_blockindex_build_skip(btc_blockindex* pindex, uint32_t min_height)
+{
+    uint32_t skip_height = btc_blockindex_skip_height(pindex->height);
+    pindex->pskip = NULL;
+    if (pindex->prev && skip_height >= min_height)
+        pindex->pskip = btc_blockindex_get_ancestor(pindex->prev, skip_height);
+}
+
+btc_blockindex* btc_blockindex_get_ancestor(btc_blockindex* pindex, uint32_t height)
+{
+    if (!pindex || height > pindex->height)
+        return NULL;
+
+    btc_blockindex* walk = pindex;
+    uint32_t walk_height = pindex->height;
+    while (walk && walk_height > height) {
+        uint32_t skip_height = btc_blockindex_skip_height(walk_height);
+        uint32_t skip_height_prev = btc_blockindex_skip_height(walk_height - 1);
+        /* only follow the skip pointer if it doesn't overshoot and the prev's skip isn't a better choice */
+        if (walk->pskip && (skip_height == height || (skip_height > height && !(skip_height_prev + 2 < skip_height && skip_height_prev >= height)))) {
+            walk = walk->pskip;
+            walk_height = skip_height;
+        } else {
+            walk = walk->prev;
+            walk_height--;
+        }
+    }
+    return walk;
+}
+
+/* compare two little endian 256bit targets */
+static int btc_target_cmp(const uint256 a, const uint256 b)
+{
+    for (int i = sizeof(uint256) - 1; i >= 0; i--) {
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+/* returns false if the target times 4 exceeds 256 bits */
+static btc_bool btc_target_mul4(const uint256 in, uint256 out)
+{
+    if (in[sizeof(uint256) - 1] & 0xc0)
+        return false;
+    for (int i = sizeof(uint256) - 1; i >= 0; i--)
+        out[i] = (uint8_t)((in[i] << 2) | (i > 0 ? in[i - 1] >> 6 : 0));
+    return true;
+}
+
+static void btc_target_div4(const uint256 in, uint256 out)
+{
+    for (unsigned int i = 0; i < sizeof(uint256); i++)
+        out[i] = (uint8_t)((in[i] >> 2) | (i + 1 < sizeof(uint256) ? in[i + 1] << 6 : 0));
+}
+
+btc_bool btc_blockindex_check_bits(const btc_chainparams* params, const btc_blockindex* prev, const btc_block_header* header, uint32_t height)
+{
+    uint256 target, limit, prev_target, bound;
+    if (!btc_block_bits_to_target(header->bits, target) || !btc_block_bits_to_target(params->pow_limit_bits, limit))
+        return false;
+    if (btc_target_cmp(target, limit) > 0)
+        return false;
+
+    if (!prev || prev->header.bits == 0)
+        return true;
+    if (params->pow_no_retargeting)
+        return header->bits == prev->header.bits;
+    if (height % BTC_DIFFICULTY_ADJUSTMENT_INTERVAL != 0) {
+        /* testnet allows minimum difficulty blocks in between */
+        return params->pow_allow_min_difficulty_blocks || header->bits == prev->header.bits;
+    }
+
+    if (!btc_block_bits_to_target(prev->header.bits, prev_target))
+        return false;
+    /* at most 4 times easier (the pow limit was already checked) */
+    if (btc_target_mul4(prev_target, bound) && btc_target_cmp(target, bound) > 0)
+        return false;
+    /* at most 4 times harder, rounded down like the compact encoding does */
+    btc_target_div4(prev_target, bound);
+    if (btc_block_bits_to_target(btc_block_target_to_bits(bound), bound) && btc_target_cmp(target, bound) < 0)
+        return false;
+    return true;
+}
@@ -0,0 +1,328 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#include <btc/blockfilter.h>
+
+#include <btc/serialize.h>
+#include <btc/sha2.h>
+#include <btc/utils.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SIPROUND                                  \
+    do {                                          \
+        v0 += v1;                                 \
+        v1 = (v1 << 13) | (v1 >> 51);             \
+        v1 ^= v0;                                 \
+        v0 = (v0 << 32) | (v0 >> 32);             \
+        v2 += v3;                                 \
+        v3 = (v3 << 16) | (v3 >> 48);             \
+        v3 ^= v2;                                 \
+        v0 += v3;                                 \
+        v3 = (v3 << 21) | (v3 >> 43);             \
+        v3 ^= v0;                                 \
+        v2 += v1;                                 \
+        v1 = (v1 << 17) | (v1 >> 47);             \
+        v1 ^= v2;                                 \
+        v2 = (v2 << 32) | (v2 >> 32);             \
+    } while (0)
+
+static uint64_t btc_read_le64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+uint64_t btc_siphash(uint64_t k0, uint64_t k1, const uint8_t* data, size_t len)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    size_t blocks = len / 8;
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t m = btc_read_le64(data + i * 8);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    uint64_t last = ((uint64_t)len) << 56;
+    for (size_t i = 0; i < len % 8; i++)
+        last |= ((uint64_t)data[blocks * 8 + i]) << (8 * i);
+    v3 ^= last;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 btc_uint128;
+#endif
+
+/* maps a hash uniformly into [0, range) */
+static uint64_t btc_blockfilter_fastrange(uint64_t hash, uint64_t range)
+{
+#ifdef __SIZEOF_INT128__
+    return (uint64_t)(((btc_uint128)hash * range) >> 64);
+#else
+    uint64_t a_hi = hash >> 32, a_lo = hash & 0xffffffff;
+    uint64_t b_hi = range >> 32, b_lo = range & 0xffffffff;
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+    return a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+}
+
+static uint64_t btc_blockfilter_hash_element(uint64_t k0, uint64_t k1, uint64_t range, const uint8_t* data, size_t len)
+{
+    return btc_blockfilter_fastrange(btc_siphash(k0, k1, data, len), range);
+}
+
+static int btc_blockfilter_cmp_u64(const void* a, const void* b)
+{
+    uint64_t va = *(const uint64_t*)a, vb = *(const uint64_t*)b;
+    return (va > vb) - (va < vb);
+}
+
+static int btc_blockfilter_cmp_element(const void* a, const void* b)
+{
+    const struct const_buffer* ea = (const struct const_buffer*)a;
+    const struct const_buffer* eb = (const struct const_buffer*)b;
+    if (ea->len != eb->len)
+        return (ea->len > eb->len) - (ea->len < eb->len);
+    return memcmp(ea->p, eb->p, ea->len);
+}
+
+/* most significant bit first bitstream writer */
+struct btc_bitwriter {
+    cstring* out;
+    uint8_t acc;
+    unsigned int nbits;
+};
+
+static void btc_bitwriter_write(struct btc_bitwriter* w, uint64_t value, unsigned int nbits)
+{
+    while (nbits > 0) {
+        unsigned int bits = BTC_MIN(8 - w->nbits, nbits);
+        uint8_t chunk = (value >> (nbits - bits)) & ((1 << bits) - 1);
+        w->acc |= chunk << (8 - w->nbits - bits);
+        w->nbits += bits;
+        nbits -= bits;
+        if (w->nbits == 8) {
+            cstr_append_c(w->out, (char)w->acc);
+            w->acc = 0;
+            w->nbits = 0;
+        }
+    }
+}
+
+static void btc_bitwriter_flush(struct btc_bitwriter* w)
+{
+    if (w->nbits > 0)
+        cstr_append_c(w->out, (char)w->acc);
+    w->acc = 0;
+    w->nbits = 0;
+}
+
+struct btc_bitreader {
+    const uint8_t* p;
+    size_t len;
+    size_t pos; /* bit position */
+};
+
+static btc_bool btc_bitreader_read(struct btc_bitreader* r, unsigned int nbits, uint64_t* value)
+{
+    if (r->pos + nbits > r->len * 8)
+        return false;
+    uint64_t v = 0;
+    while (nbits > 0) {
+        unsigned int offset = r->pos & 7;
+        unsigned int bits = BTC_MIN(8 - offset, nbits);
+        uint8_t chunk = (r->p[r->pos >> 3] >> (8 - offset - bits)) & ((1 << bits) - 1);
+        v = (v << bits) | chunk;
+        r->pos += bits;
+        nbits -= bits;
+    }
+    *value = v;
+    return true;
+}
+
+static btc_bool btc_bitreader_golomb_decode(struct btc_bitreader* r, uint64_t* value)
+{
+    uint64_t quotient = 0, bit, remainder;
+    while (1) {
+        if (!btc_bitreader_read(r, 1, &bit))
+            return false;
+        if (!bit)
+            break;
+        quotient++;
+    }
+    if (!btc_bitreader_read(r, BTC_BLOCKFILTER_BASIC_P, &remainder))
+        return false;
+    *value = (quotient << BTC_BLOCKFILTER_BASIC_P) | remainder;
+    return true;
+}
+
+static void btc_blockfilter_key(const uint256 block_hash, uint64_t* k0, uint64_t* k1)
+{
+    *k0 = btc_read_le64(block_hash);
+    *k1 = btc_read_le64(block_hash + 8);
+}
+
+void btc_blockfilter_build(cstring* filter_out, const uint256 block_hash, const struct const_buffer* elements, size_t count)
+{
+    uint64_t k0, k1;
+    btc_blockfilter_key(block_hash, &k0, &k1);
+
+    /* duplicate elements are only committed once */
+    struct const_buffer* sorted = btc_malloc((count > 0 ? count : 1) * sizeof(struct const_buffer));
+    memcpy(sorted, elements, count * sizeof(struct const_buffer));
+    qsort(sorted, count, sizeof(struct const_buffer), btc_blockfilter_cmp_element);
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (n == 0 || btc_blockfilter_cmp_element(&sorted[n - 1], &sorted[i]) != 0)
+            sorted[n++] = sorted[i];
+    }
+
+    uint64_t range = (uint64_t)n * BTC_BLOCKFILTER_BASIC_M;
+    uint64_t* hashed = btc_malloc((n > 0 ? n : 1) * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++)
+        hashed[i] = btc_blockfilter_hash_element(k0, k1, range, sorted[i].p, sorted[i].len);
+    btc_free(sorted);
+    qsort(hashed, n, sizeof(uint64_t), btc_blockfilter_cmp_u64);
+
+    ser_varlen(filter_out, (uint32_t)n);
+    struct btc_bitwriter writer = {filter_out, 0, 0};
+    uint64_t last = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t delta = hashed[i] - last;
+        last = hashed[i];
+        for (uint64_t q = delta >> BTC_BLOCKFILTER_BASIC_P; q > 0; q--)
+            btc_bitwriter_write(&writer, 1, 1);
+        btc_bitwriter_write(&writer, 0, 1);
+        btc_bitwriter_write(&writer, delta, BTC_BLOCKFILTER_BASIC_P);
+    }
+    btc_bitwriter_flush(&writer);
+    btc_free(hashed);
+}
+
+void btc_blockfilter_hash(const uint8_t* filter, size_t len, uint256 hash_out)
+{
+    sha256_Raw(filter, len, hash_out);
+    sha256_Raw(hash_out, BTC_HASH_LENGTH, hash_out);
+}
+
+void btc_blockfilter_header(const uint256 filter_hash, const uint256 prev_header, uint256 header_out)
+{
+    uint8_t data[BTC_HASH_LENGTH * 2];
+    memcpy(data, filter_hash, BTC_HASH_LENGTH);
+    memcpy(data + BTC_HASH_LENGTH, prev_header, BTC_HASH_LENGTH);
+    sha256_Raw(data, sizeof(data), header_out);
+    sha256_Raw(header_out, BTC_HASH_LENGTH, header_out);
+}
+
+btc_blockfilter_matcher* btc_blockfilter_matcher_new()
+{
+    btc_blockfilter_matcher* matcher = btc_calloc(1, sizeof(*matcher));
+    matcher->elements = cstr_new_sz(1024);
+    matcher->alloc = 64;
+    matcher->offsets = btc_calloc(matcher->alloc + 1, sizeof(uint32_t));
+    matcher->hashed = btc_calloc(matcher->alloc, sizeof(uint64_t));
+    matcher->count = 0;
+    return matcher;
+}
+
+void btc_blockfilter_matcher_free(btc_blockfilter_matcher* matcher)
+{
+    if (!matcher)
+        return;
+    cstr_free(matcher->elements, true);
+    btc_free(matcher->offsets);
+    btc_free(matcher->hashed);
+    btc_free(matcher);
+}
+
+void btc_blockfilter_matcher_add(btc_blockfilter_matcher* matcher, const uint8_t* data, size_t len)
+{
+    if (matcher->count == matcher->alloc) {
+        matcher->alloc *= 2;
+        matcher->offsets = btc_realloc(matcher->offsets, (matcher->alloc + 1) * sizeof(uint32_t));
+        matcher->hashed = btc_realloc(matcher->hashed, matcher->alloc * sizeof(uint64_t));
+    }
+    cstr_append_buf(matcher->elements, data, len);
+    matcher->count++;
+    matcher->offsets[matcher->count] = (uint32_t)matcher->elements->len;
+}
+
+btc_bool btc_blockfilter_match_any(btc_blockfilter_matcher* matcher, const uint256 block_hash, const uint8_t* filter, size_t len)
+{
+    struct const_buffer buf = {filter, len};
+    uint32_t n;
+    if (!deser_varlen(&n, &buf) || n == 0 || matcher->count == 0)
+        return false;
+
+    /* hash the query set with the key of this block and sort it */
+    uint64_t k0, k1;
+    btc_blockfilter_key(block_hash, &k0, &k1);
+    uint64_t range = (uint64_t)n * BTC_BLOCKFILTER_BASIC_M;
+    const uint8_t* elements = (const uint8_t*)matcher->elements->str;
+    for (size_t i = 0; i < matcher->count; i++)
+        matcher->hashed[i] = btc_blockfilter_hash_element(k0, k1, range, elements + matcher->offsets[i], matcher->offsets[i + 1] - matcher->offsets[i]);
+    qsort(matcher->hashed, matcher->count, sizeof(uint64_t), btc_blockfilter_cmp_u64);
+
+    /* walk both sorted sets at once */
+    struct btc_bitreader reader = {buf.p, buf.len, 0};
+    uint64_t value = 0;
+    size_t query = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t delta;
+        if (!btc_bitreader_golomb_decode(&reader, &delta))
+            return false;
+        value += delta;
+        while (matcher->hashed[query] < value) {
+            if (++query == matcher->count)
+                return false;
+        }
+        if (matcher->hashed[query] == value)
+            return true;
+    }
+    return false;
+}
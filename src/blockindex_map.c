@@ -0,0 +1,148 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#include <btc/blockindex_map.h>
+
+#include <string.h>
+
+static const size_t BTC_BLOCKINDEX_MAP_MIN_SIZE = 64;
+
+static inline uint64_t btc_blockindex_map_key(const uint8_t* hash)
+{
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+    return key;
+}
+
+btc_blockindex_map* btc_blockindex_map_new(size_t min_elements)
+{
+    btc_blockindex_map* map = btc_calloc(1, sizeof(*map));
+
+    /* keep the load factor below 3/4 */
+    map->size = BTC_BLOCKINDEX_MAP_MIN_SIZE;
+    while (map->size * 3 < min_elements * 4)
+        map->size <<= 1;
+
+    map->entries = btc_calloc(map->size, sizeof(btc_blockindex_map_entry));
+    map->count = 0;
+    return map;
+}
+
+void btc_blockindex_map_free(btc_blockindex_map* map, void (*free_cb)(void*))
+{
+    if (!map)
+        return;
+
+    if (free_cb) {
+        for (size_t i = 0; i < map->size; i++) {
+            if (map->entries[i].blockindex)
+                free_cb(map->entries[i].blockindex);
+        }
+    }
+    btc_free(map->entries);
+    btc_free(map);
+}
+
+static void btc_blockindex_map_place(btc_blockindex_map_entry* entries, size_t mask, uint64_t key, btc_blockindex* blockindex)
+{
+    size_t idx = key & mask;
+    while (entries[idx].blockindex)
+        idx = (idx + 1) & mask;
+    entries[idx].key = key;
+    entries[idx].blockindex = blockindex;
+}
+
+static void btc_blockindex_map_grow(btc_blockindex_map* map)
+{
+    size_t new_size = map->size << 1;
+    btc_blockindex_map_entry* new_entries = btc_calloc(new_size, sizeof(btc_blockindex_map_entry));
+    for (size_t i = 0; i < map->size; i++) {
+        if (map->entries[i].blockindex)
+            btc_blockindex_map_place(new_entries, new_size - 1, map->entries[i].key, map->entries[i].blockindex);
+    }
+    btc_free(map->entries);
+    map->entries = new_entries;
+    map->size = new_size;
+}
+
+static ssize_t btc_blockindex_map_slot(const btc_blockindex_map* map, const uint8_t* hash)
+{
+    const size_t mask = map->size - 1;
+    const uint64_t key = btc_blockindex_map_key(hash);
+    size_t idx = key & mask;
+    while (map->entries[idx].blockindex) {
+        if (map->entries[idx].key == key && memcmp(map->entries[idx].blockindex->hash, hash, BTC_HASH_LENGTH) == 0)
+            return idx;
+        idx = (idx + 1) & mask;
+    }
+    return -1;
+}
+
+btc_bool btc_blockindex_map_insert(btc_blockindex_map* map, btc_blockindex* blockindex)
+{
+    if (btc_blockindex_map_slot(map, blockindex->hash) >= 0)
+        return false;
+
+    if ((map->count + 1) * 4 > map->size * 3)
+        btc_blockindex_map_grow(map);
+
+    btc_blockindex_map_place(map->entries, map->size - 1, btc_blockindex_map_key(blockindex->hash), blockindex);
+    map->count++;
+    return true;
+}
+
+btc_blockindex* btc_blockindex_map_find(const btc_blockindex_map* map, const uint256 hash)
+{
+    ssize_t idx = btc_blockindex_map_slot(map, hash);
+    return (idx >= 0 ? map->entries[idx].blockindex : NULL);
+}
+
+btc_bool btc_blockindex_map_remove(btc_blockindex_map* map, const uint256 hash)
+{
+    ssize_t found = btc_blockindex_map_slot(map, hash);
+    if (found < 0)
+        return false;
+
+    /* backward shift deletion, keeps probe sequences intact without tombstones */
+    const size_t mask = map->size - 1;
+    size_t hole = (size_t)found;
+    size_t idx = hole;
+    while (1) {
+        idx = (idx + 1) & mask;
+        if (!map->entries[idx].blockindex)
+            break;
+        size_t home = map->entries[idx].key & mask;
+        /* move the entry into the hole if its home slot is not within (hole, idx] */
+        if ((idx > hole && (home <= hole || home > idx)) || (idx < hole && (home <= hole && home > idx))) {
+            map->entries[hole] = map->entries[idx];
+            hole = idx;
+        }
+    }
+    map->entries[hole].key = 0;
+    map->entries[hole].blockindex = NULL;
+    map->count--;
+    return true;
+}
@@ -38,7 +38,10 @@ const btc_chainparams btc_chainparams_main = {
     8333,
     {{"seed.bitcoin.jonasschnelli.ch"}, 0},
     0x03,
-    "tx", false
+    "tx", false,
+    0x1d00ffff,
+    false,
+    false
 };
 const btc_chainparams btc_chainparams_test = {
     "testnet3",
@@ -52,7 +55,10 @@ const btc_chainparams btc_chainparams_test = {
     18333,
     {{"testnet-seed.bitcoin.jonasschnelli.ch"}, 0},
     0x06,
-    "txtest", true
+    "txtest", true,
+    0x1d00ffff,
+    true,
+    false
 };
 const btc_chainparams btc_chainparams_regtest = {
     "regtest",
@@ -66,7 +72,10 @@ const btc_chainparams btc_chainparams_regtest = {
     18444,
     {0},
     0x06,
-    "txtest", true
+    "txtest", true,
+    0x207fffff,
+    true,
+    true
 };
 
 
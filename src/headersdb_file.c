@@ -25,54 +25,64 @@
 */
 
 #include <btc/headersdb_file.h>
+#include <btc/blockindex_map.h>
 #include <btc/block.h>
 #include <btc/serialize.h>
 #include <btc/utils.h>
 
 #include <sys/stat.h>
-
-#include <search.h>
+#include <time.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 static const unsigned char file_hdr_magic[4] = {0xA8, 0xF0, 0x11, 0xC5}; /* header magic */
-static const uint32_t current_version = 1;
-
-int btc_header_compare(const void *l, const void *r)
-{
-    const btc_blockindex *lm = l;
-    const btc_blockindex *lr = r;
-
-    uint8_t *hashA = (uint8_t *)lm->hash;
-    uint8_t *hashB = (uint8_t *)lr->hash;
+static const unsigned char file_trailer_magic[4] = {0xA8, 0xF0, 0x11, 0x7E}; /* trailer magic */
+static const uint32_t current_version = 2;
+static const uint32_t legacy_version = 1; /* unordered, appended records */
+
+/* file layout (version 2):
+   [magic(4)|version(4)][record 0]...[record n-1][trailer]
+   record:  hash(32)|height(4)|header(80), record i is the header at file_base_height+i
+   trailer: magic(4)|base height(4)|amount of records(4)
+*/
+static const size_t FILE_HDR_SIZE = 8;
+static const size_t FILE_RECORD_SIZE = 32+4+80;
+static const size_t FILE_TRAILER_SIZE = 12;
+static const size_t MAX_PENDING_RECORDS = 2000; /* write out the buffer (without commit) if it gets larger */
 
-    /* byte per byte compare */
-    for (unsigned int i = 0; i < sizeof(uint256); i++) {
-        uint8_t iA = hashA[i];
-        uint8_t iB = hashB[i];
-        if (iA > iB)
-            return -1;
-        else if (iA < iB)
-            return 1;
-    }
-
-    return 0;
-}
+static btc_bool btc_headers_db_flush(btc_headers_db* db);
 
 btc_headers_db* btc_headers_db_new(const btc_chainparams* chainparams, btc_bool inmem_only) {
     btc_headers_db* db;
     db = btc_calloc(1, sizeof(*db));
 
     db->read_write_file = !inmem_only;
-    db->use_binary_tree = true;
+    db->use_hash_index = true;
     db->max_hdr_in_mem = 144;
-
+    db->file_base_height = 0;
+    db->file_records = 0;
+    db->sync_mode = BTC_HEADERS_DB_SYNC_BATCH;
+    db->sync_interval = 0;
+    db->last_sync_time = 0;
+    db->batch_depth = 0;
+    db->write_buffer = NULL;
+    db->trailer_dirty = false;
+    db->window = NULL;
+    db->window_size = 0;
+    db->side_window = NULL;
+
+    db->chainparams = chainparams;
     db->genesis.height = 0;
     db->genesis.prev = NULL;
+    db->genesis.header.bits = chainparams->pow_limit_bits;
     memcpy(db->genesis.hash, chainparams->genesisblockhash, BTC_HASH_LENGTH);
     db->chaintip = &db->genesis;
     db->chainbottom = &db->genesis;
 
-    if (db->use_binary_tree) {
-        db->tree_root = 0;
+    if (db->use_hash_index) {
+        db->hash_index = btc_blockindex_map_new(db->max_hdr_in_mem * 2);
     }
 
     return db;
@@ -85,18 +95,489 @@ void btc_headers_db_free(btc_headers_db* db) {
 
     if (db->headers_tree_file)
     {
+        /* write out pending records */
+        if (btc_headers_db_flush(db) && db->sync_mode != BTC_HEADERS_DB_SYNC_NONE)
+            btc_file_commit(db->headers_tree_file);
         fclose(db->headers_tree_file);
         db->headers_tree_file = NULL;
     }
 
-    if (db->tree_root) {
-        btc_btree_tdestroy(db->tree_root, btc_free);
-        db->tree_root = NULL;
+    if (db->write_buffer) {
+        cstr_free(db->write_buffer, true);
+        db->write_buffer = NULL;
+    }
+
+    if (db->hash_index) {
+        btc_blockindex_map_free(db->hash_index, btc_free);
+        db->hash_index = NULL;
+    }
+
+    btc_free(db->window);
+    db->window = NULL;
+    if (db->side_window) {
+        /* the side headers are owned by the hash index */
+        for (uint32_t i = 0; i < db->window_size; i++) {
+            if (db->side_window[i])
+                vector_free(db->side_window[i], true);
+        }
+        btc_free(db->side_window);
+        db->side_window = NULL;
     }
 
     btc_free(db);
 }
 
+static btc_bool btc_headers_db_write_file_header(FILE *file) {
+    uint8_t buf[FILE_HDR_SIZE];
+    uint32_t v = htole32(current_version);
+    memcpy(buf, file_hdr_magic, sizeof(file_hdr_magic));
+    memcpy(buf+sizeof(file_hdr_magic), &v, sizeof(v)); /* uint32_t, LE */
+    return (fseek(file, 0, SEEK_SET) == 0 && fwrite(buf, sizeof(buf), 1, file) == 1);
+}
+
+static btc_bool btc_headers_db_write_trailer(btc_headers_db* db, btc_bool truncate) {
+    uint8_t buf[FILE_TRAILER_SIZE];
+    uint32_t base = htole32(db->file_base_height);
+    uint32_t records = htole32(db->file_records);
+    memcpy(buf, file_trailer_magic, sizeof(file_trailer_magic));
+    memcpy(buf+4, &base, sizeof(base));
+    memcpy(buf+8, &records, sizeof(records));
+
+    long offset = FILE_HDR_SIZE + (long)db->file_records * FILE_RECORD_SIZE;
+    if (fseek(db->headers_tree_file, offset, SEEK_SET) != 0 || fwrite(buf, sizeof(buf), 1, db->headers_tree_file) != 1)
+        return false;
+
+    if (truncate) {
+        /* cut off stale records (and the old trailer) after a disconnect */
+        fflush(db->headers_tree_file);
+        return (ftruncate(fileno(db->headers_tree_file), offset + FILE_TRAILER_SIZE) == 0);
+    }
+    return true;
+}
+
+/* write out the pending (buffered) records and the trailer, no fsync */
+static btc_bool btc_headers_db_flush(btc_headers_db* db) {
+    btc_bool ret = true;
+    if (db->write_buffer && db->write_buffer->len > 0) {
+        long offset = FILE_HDR_SIZE + (long)db->write_buffer_first * FILE_RECORD_SIZE;
+        ret = (fseek(db->headers_tree_file, offset, SEEK_SET) == 0 &&
+               fwrite(db->write_buffer->str, db->write_buffer->len, 1, db->headers_tree_file) == 1);
+        cstr_resize(db->write_buffer, 0);
+    }
+    if (db->trailer_dirty) {
+        ret = btc_headers_db_write_trailer(db, false) && ret;
+        db->trailer_dirty = false;
+    }
+    return ret;
+}
+
+/* flush and commit according to the configured durability mode */
+static btc_bool btc_headers_db_sync(btc_headers_db* db) {
+    if (!db->headers_tree_file)
+        return true;
+
+    btc_bool ret = btc_headers_db_flush(db);
+    uint64_t now = time(NULL);
+    if (db->sync_mode == BTC_HEADERS_DB_SYNC_BATCH ||
+        (db->sync_mode == BTC_HEADERS_DB_SYNC_PERIODIC && now >= db->last_sync_time + db->sync_interval)) {
+        btc_file_commit(db->headers_tree_file);
+        db->last_sync_time = now;
+    }
+    else {
+        /* hand the data over to the OS */
+        fflush(db->headers_tree_file);
+    }
+    return ret;
+}
+
+static void btc_headers_db_window_alloc(btc_headers_db* db) {
+    if (!db->window) {
+        db->window_size = db->max_hdr_in_mem + 1;
+        db->window = btc_calloc(db->window_size, sizeof(btc_blockindex *));
+        db->side_window = btc_calloc(db->window_size, sizeof(vector *));
+    }
+}
+
+/* side headers built on a released header lose their (dangling) prev */
+static void btc_headers_db_unlink_children(btc_headers_db* db, btc_blockindex *parent) {
+    if (!db->side_window)
+        return;
+    vector *side = db->side_window[(parent->height + 1) % db->window_size];
+    for (size_t i = 0; side && i < side->len; i++) {
+        btc_blockindex *child = vector_idx(side, i);
+        if (child->prev == parent)
+            child->prev = NULL;
+    }
+}
+
+static void btc_headers_db_release(btc_headers_db* db, btc_blockindex *blockindex) {
+    btc_headers_db_unlink_children(db, blockindex);
+    if (db->use_hash_index) {
+        btc_blockindex_map_remove(db->hash_index, blockindex->hash);
+    }
+    btc_free(blockindex);
+}
+
+/* track a header that is not (or no longer) on the main chain in its height slot */
+static void btc_headers_db_side_add(btc_headers_db* db, btc_blockindex *blockindex) {
+    if (db->max_hdr_in_mem == 0)
+        return;
+    btc_headers_db_window_alloc(db);
+    vector **side = &db->side_window[blockindex->height % db->window_size];
+    if (!*side)
+        *side = vector_new(1, NULL);
+    vector_add(*side, blockindex);
+}
+
+/* put a main chain header into its height slot of the in-memory window
+   the headers falling out of the window (main chain and side headers) get released */
+static void btc_headers_db_window_set(btc_headers_db* db, btc_blockindex *blockindex) {
+    if (db->max_hdr_in_mem == 0)
+        return;
+    btc_headers_db_window_alloc(db);
+
+    uint32_t slot_idx = blockindex->height % db->window_size;
+    btc_blockindex **slot = &db->window[slot_idx];
+    btc_blockindex *evict = *slot;
+    *slot = blockindex;
+
+    /* side headers of the slot below the new header are out of the window,
+       a fork header that becomes part of the main chain is no longer a side header */
+    vector *side = db->side_window[slot_idx];
+    for (size_t i = side ? side->len : 0; i > 0; i--) {
+        btc_blockindex *scan = vector_idx(side, i - 1);
+        if (scan == blockindex) {
+            vector_remove_idx(side, i - 1);
+        }
+        else if (scan->height < blockindex->height) {
+            vector_remove_idx(side, i - 1);
+            btc_headers_db_release(db, scan);
+        }
+    }
+
+    if (!evict || evict == blockindex)
+        return;
+
+    /* a header of the same height replaced by a reorg becomes a side header */
+    if (evict->height >= blockindex->height) {
+        btc_headers_db_side_add(db, evict);
+        return;
+    }
+
+    btc_blockindex *bottom = db->window[(evict->height + 1) % db->window_size];
+    if (bottom && bottom->prev == evict) {
+        bottom->prev = NULL;
+        db->chainbottom = bottom;
+    }
+    if (evict != &db->genesis) {
+        btc_headers_db_release(db, evict);
+    }
+}
+
+/* update the window to a new tip, reorganized branch headers replace the old ones */
+static void btc_headers_db_window_connect(btc_headers_db* db, btc_blockindex *newtip) {
+    if (db->max_hdr_in_mem == 0)
+        return;
+
+    /* replace the branch first, the tip may evict the fork point */
+    btc_blockindex *scan = newtip->prev;
+    while (db->window && scan && scan->height > db->chainbottom->height && db->window[scan->height % db->window_size] != scan) {
+        btc_headers_db_window_set(db, scan);
+        scan = scan->prev;
+    }
+    btc_headers_db_window_set(db, newtip);
+}
+
+/* read the main chain header at the given height from the pending records or the file */
+static btc_bool btc_headers_db_read_record(btc_headers_db* db, uint32_t height, btc_blockindex *out) {
+    if (!db->headers_tree_file || height < db->file_base_height || height >= db->file_base_height + db->file_records)
+        return false;
+
+    uint8_t record[32+4+80];
+    uint32_t idx = height - db->file_base_height;
+    if (db->write_buffer && idx >= db->write_buffer_first && idx < db->write_buffer_first + db->write_buffer->len / FILE_RECORD_SIZE) {
+        memcpy(record, db->write_buffer->str + (size_t)(idx - db->write_buffer_first) * FILE_RECORD_SIZE, FILE_RECORD_SIZE);
+    }
+    else {
+        long offset = FILE_HDR_SIZE + (long)idx * FILE_RECORD_SIZE;
+        if (fseek(db->headers_tree_file, offset, SEEK_SET) != 0 || fread(record, FILE_RECORD_SIZE, 1, db->headers_tree_file) != 1)
+            return false;
+    }
+
+    struct const_buffer cbuf = {record, FILE_RECORD_SIZE};
+    memset(out, 0, sizeof(*out));
+    deser_u256(out->hash, &cbuf);
+    deser_u32(&out->height, &cbuf);
+    return (btc_block_header_deserialize(&out->header, &cbuf) && out->height == height);
+}
+
+/* append a record to the pending buffer, non-contiguous records flush the buffer first */
+static btc_bool btc_headers_db_write_record(btc_headers_db* db, btc_blockindex *blockindex) {
+    if (blockindex->height < db->file_base_height)
+        return false;
+
+    uint32_t idx = blockindex->height - db->file_base_height;
+    if (!db->write_buffer)
+        db->write_buffer = cstr_new_sz(FILE_RECORD_SIZE * 16);
+    if (db->write_buffer->len > 0 &&
+        (idx != db->write_buffer_first + db->write_buffer->len / FILE_RECORD_SIZE || db->write_buffer->len >= MAX_PENDING_RECORDS * FILE_RECORD_SIZE)) {
+        if (!btc_headers_db_flush(db))
+            return false;
+    }
+    if (db->write_buffer->len == 0)
+        db->write_buffer_first = idx;
+
+    ser_u256(db->write_buffer, blockindex->hash);
+    ser_u32(db->write_buffer, blockindex->height);
+    btc_block_header_serialize(db->write_buffer, &blockindex->header);
+    return true;
+}
+
+/* write the branch from newtip back to the fork point with oldtip
+   (a single record if newtip directly extends oldtip), the records
+   are buffered until the current batch gets committed */
+static btc_bool btc_headers_db_write(btc_headers_db* db, btc_blockindex *newtip, btc_blockindex *oldtip) {
+    /* find the fork point by walking both branches back to the same block */
+    btc_blockindex *scan = newtip;
+    btc_blockindex *fork = oldtip;
+    while (scan && fork && scan != fork) {
+        if (scan->height > fork->height)
+            scan = scan->prev;
+        else
+            fork = fork->prev;
+    }
+    if (scan != fork || (fork && fork->height < db->file_base_height))
+        fork = NULL;
+
+    if (db->file_records == 0) {
+        /* first record in the file, defines the base height */
+        btc_blockindex *bottom = newtip;
+        while (bottom->prev && bottom->prev != fork && bottom->prev != &db->genesis)
+            bottom = bottom->prev;
+        db->file_base_height = bottom->height;
+    }
+
+    /* collect the branch and write it in ascending order */
+    size_t branch_len = 0;
+    for (scan = newtip; scan && scan != fork && scan != &db->genesis && scan->height >= db->file_base_height; scan = scan->prev)
+        branch_len++;
+
+    btc_bool ret = true;
+    if (branch_len == 1) {
+        ret = btc_headers_db_write_record(db, newtip);
+    }
+    else if (branch_len > 1) {
+        btc_blockindex **branch = btc_malloc(branch_len * sizeof(btc_blockindex *));
+        size_t i = branch_len;
+        for (scan = newtip; i > 0; scan = scan->prev)
+            branch[--i] = scan;
+        for (i = 0; i < branch_len && ret; i++)
+            ret = btc_headers_db_write_record(db, branch[i]);
+        btc_free(branch);
+    }
+    db->file_records = newtip->height - db->file_base_height + 1;
+    db->trailer_dirty = true;
+    return ret;
+}
+
+void btc_headers_db_set_sync_mode(btc_headers_db* db, enum btc_headers_db_sync_mode mode, unsigned int interval) {
+    db->sync_mode = mode;
+    db->sync_interval = interval;
+}
+
+void btc_headers_db_begin_batch(btc_headers_db* db) {
+    db->batch_depth++;
+}
+
+btc_bool btc_headers_db_commit_batch(btc_headers_db* db) {
+    if (db->batch_depth > 0)
+        db->batch_depth--;
+    if (db->batch_depth > 0)
+        return true;
+    return btc_headers_db_sync(db);
+}
+
+/* builds the in-memory tip window from the fixed-stride records
+   only the trailer and the window records are touched */
+static btc_bool btc_headers_db_load_records(btc_headers_db* db, size_t filesize) {
+    if (filesize < FILE_HDR_SIZE + FILE_TRAILER_SIZE) {
+        fprintf(stderr, "Error reading database file\n");
+        return false;
+    }
+
+    int fd = fileno(db->headers_tree_file);
+#ifndef _WIN32
+    uint8_t *map = mmap(NULL, filesize, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping database file\n");
+        return false;
+    }
+    const uint8_t *trailer = map + filesize - FILE_TRAILER_SIZE;
+#else
+    uint8_t trailer[FILE_TRAILER_SIZE];
+    if (fseek(db->headers_tree_file, filesize - FILE_TRAILER_SIZE, SEEK_SET) != 0 ||
+        fread(trailer, sizeof(trailer), 1, db->headers_tree_file) != 1) {
+        fprintf(stderr, "Error reading database file\n");
+        return false;
+    }
+#endif
+    (void)fd;
+
+    btc_bool ret = false;
+    uint32_t base, records;
+    memcpy(&base, trailer+4, sizeof(base));
+    memcpy(&records, trailer+8, sizeof(records));
+    base = le32toh(base);
+    records = le32toh(records);
+    if (memcmp(trailer, file_trailer_magic, sizeof(file_trailer_magic)) != 0 ||
+        filesize != FILE_HDR_SIZE + (size_t)records * FILE_RECORD_SIZE + FILE_TRAILER_SIZE) {
+        fprintf(stderr, "Error: Invalid database trailer.\n");
+        goto out;
+    }
+    db->file_base_height = base;
+    db->file_records = records;
+
+    uint32_t window = records;
+    if (db->max_hdr_in_mem > 0 && window > db->max_hdr_in_mem+1)
+        window = db->max_hdr_in_mem+1;
+    size_t window_offset = FILE_HDR_SIZE + (size_t)(records - window) * FILE_RECORD_SIZE;
+
+#ifndef _WIN32
+    const uint8_t *window_buf = map + window_offset;
+#else
+    uint8_t *window_buf = btc_malloc((size_t)window * FILE_RECORD_SIZE + 1);
+    if (window > 0 && (fseek(db->headers_tree_file, window_offset, SEEK_SET) != 0 ||
+        fread(window_buf, (size_t)window * FILE_RECORD_SIZE, 1, db->headers_tree_file) != 1)) {
+        btc_free(window_buf);
+        fprintf(stderr, "Error reading database file\n");
+        goto out;
+    }
+#endif
+
+    btc_blockindex *prev = NULL;
+    for (uint32_t i = 0; i < window; i++) {
+        struct const_buffer cbuf = {window_buf + (size_t)i * FILE_RECORD_SIZE, FILE_RECORD_SIZE};
+        btc_blockindex *blockindex = btc_calloc(1, sizeof(btc_blockindex));
+        deser_u256(blockindex->hash, &cbuf);
+        deser_u32(&blockindex->height, &cbuf);
+        if (!btc_block_header_deserialize(&blockindex->header, &cbuf) ||
+            blockindex->height != base + (records - window) + i ||
+            (prev && memcmp(blockindex->header.prev_block, prev->hash, BTC_HASH_LENGTH) != 0)) {
+            btc_free(blockindex);
+            fprintf(stderr, "Error: Invalid data found.\n");
+            break;
+        }
+
+        if (!prev && blockindex->height == 1 && memcmp(blockindex->header.prev_block, db->genesis.hash, BTC_HASH_LENGTH) == 0)
+            prev = &db->genesis;
+        blockindex->prev = prev;
+        if (!blockindex->prev)
+            db->chainbottom = blockindex;
+        btc_blockindex_build_skip(blockindex, db->chainbottom->height);
+        btc_headers_db_window_set(db, blockindex);
+        if (db->use_hash_index) {
+            btc_blockindex_map_insert(db->hash_index, blockindex);
+        }
+        db->chaintip = blockindex;
+        prev = blockindex;
+        if (i == window - 1)
+            ret = true;
+    }
+    if (window == 0)
+        ret = true;
+
+#ifdef _WIN32
+    btc_free(window_buf);
+#endif
+
+out:
+#ifndef _WIN32
+    munmap(map, filesize);
+#endif
+    return ret;
+}
+
+/* one-time migration of a version 1 file (appended records, including forks)
+   records are replayed through the connect logic and the resulting main chain
+   is written to a fresh version 2 file which then replaces the legacy file */
+static btc_bool btc_headers_db_migrate_legacy(btc_headers_db* db, FILE *legacy_file, const char *file_path) {
+    cstring *tmp_path = cstr_new(file_path);
+    cstr_append_buf(tmp_path, ".migrate", 8);
+
+    db->headers_tree_file = fopen(tmp_path->str, "w+b");
+    if (!db->headers_tree_file || !btc_headers_db_write_file_header(db->headers_tree_file) || !btc_headers_db_write_trailer(db, false)) {
+        fprintf(stderr, "Error creating database file for migration\n");
+        cstr_free(tmp_path, true);
+        return false;
+    }
+
+    printf("Migrating headers database to version %d...\n", current_version);
+    btc_bool firstblock = true;
+    size_t connected_headers_count = 0;
+    while (!feof(legacy_file))
+    {
+        uint8_t buf_all[32+4+80];
+        if (fread(buf_all, sizeof(buf_all), 1, legacy_file) == 1) {
+            struct const_buffer cbuf_all = {buf_all, sizeof(buf_all)};
+
+            /* deserialize the p2p header */
+            uint256 hash;
+            uint32_t height;
+            deser_u256(hash, &cbuf_all);
+            deser_u32(&height, &cbuf_all);
+            btc_bool connected;
+            btc_blockindex *oldtip = db->chaintip;
+            if (firstblock)
+            {
+                btc_blockindex *chainheader = btc_calloc(1, sizeof(btc_blockindex));
+                chainheader->height = height;
+                if (!btc_block_header_deserialize(&chainheader->header, &cbuf_all)) {
+                    btc_free(chainheader);
+                    fprintf(stderr, "Error: Invalid data found.\n");
+                    break;
+                }
+                btc_block_header_hash(&chainheader->header, (uint8_t *)&chainheader->hash);
+                chainheader->prev = NULL;
+                if (db->use_hash_index) {
+                    btc_blockindex_map_insert(db->hash_index, chainheader);
+                }
+                db->chaintip = chainheader;
+                db->chainbottom = chainheader;
+                btc_headers_db_window_set(db, chainheader);
+                firstblock = false;
+            }
+            else {
+                btc_headers_db_connect_hdr(db, &cbuf_all, true, &connected);
+                if (!connected)
+                {
+                    printf("Connecting header failed (at height: %d)\n", db->chaintip->height);
+                }
+                else {
+                    connected_headers_count++;
+                }
+            }
+            if (db->chaintip != oldtip && !btc_headers_db_write(db, db->chaintip, oldtip)) {
+                fprintf(stderr, "Error writing blockheader to database\n");
+                break;
+            }
+        }
+    }
+    /* single commit before replacing the legacy file */
+    btc_headers_db_flush(db);
+    btc_file_commit(db->headers_tree_file);
+
+    btc_bool ret = (feof(legacy_file) && rename(tmp_path->str, file_path) == 0);
+    if (!ret) {
+        fprintf(stderr, "Error: Migration of the headers database failed\n");
+        fclose(db->headers_tree_file);
+        db->headers_tree_file = NULL;
+        remove(tmp_path->str);
+    }
+    cstr_free(tmp_path, true);
+    printf("Migrated %ld headers, now at height: %d\n",  connected_headers_count, db->chaintip->height);
+    return ret;
+}
+
 btc_bool btc_headers_db_load(btc_headers_db* db, const char *file_path) {
     if (!db->read_write_file) {
         /* stop at this point if we do inmem only */
@@ -119,103 +600,78 @@ btc_bool btc_headers_db_load(btc_headers_db* db, const char *file_path) {
     if (stat(file_path_local, &buffer) == 0)
         create = false;
 
-    db->headers_tree_file = fopen(file_path_local, create ? "a+b" : "r+b");
-    cstr_free(path_ret, true);
+    btc_bool ret = false;
+    db->headers_tree_file = fopen(file_path_local, create ? "w+b" : "r+b");
+    if (!db->headers_tree_file) {
+        cstr_free(path_ret, true);
+        return false;
+    }
     if (create) {
-        // write file-header-magic
-        fwrite(file_hdr_magic, 4, 1, db->headers_tree_file);
-        uint32_t v = htole32(current_version);
-        fwrite(&v, sizeof(v), 1, db->headers_tree_file); /* uint32_t, LE */
+        // write file-header-magic and an empty trailer
+        ret = btc_headers_db_write_file_header(db->headers_tree_file) && btc_headers_db_write_trailer(db, false);
+        btc_file_commit(db->headers_tree_file);
     }
     else {
         // check file-header-magic
         uint8_t buf[sizeof(file_hdr_magic)+sizeof(current_version)];
+        uint32_t version = 0;
         if ( (uint32_t)buffer.st_size < (uint32_t)(sizeof(file_hdr_magic)+sizeof(current_version)) ||
              fread(buf, sizeof(file_hdr_magic)+sizeof(current_version), 1, db->headers_tree_file) != 1 ||
              memcmp(buf, file_hdr_magic, sizeof(file_hdr_magic))
             )
         {
             fprintf(stderr, "Error reading database file\n");
+            cstr_free(path_ret, true);
             return false;
         }
-        if (le32toh(*(buf+sizeof(file_hdr_magic))) > current_version) {
+        memcpy(&version, buf+sizeof(file_hdr_magic), sizeof(version));
+        version = le32toh(version);
+        if (version > current_version) {
             fprintf(stderr, "Unsupported file version\n");
+            cstr_free(path_ret, true);
             return false;
         }
-    }
-    btc_bool firstblock = true;
-    size_t connected_headers_count = 0;
-    if (db->headers_tree_file && !create)
-    {
-        while (!feof(db->headers_tree_file))
-        {
-            uint8_t buf_all[32+4+80];
-            if (fread(buf_all, sizeof(buf_all), 1, db->headers_tree_file) == 1) {
-                struct const_buffer cbuf_all = {buf_all, sizeof(buf_all)};
-
-                //load all
-
-                /* deserialize the p2p header */
-                uint256 hash;
-                uint32_t height;
-                deser_u256(hash, &cbuf_all);
-                deser_u32(&height, &cbuf_all);
-                if (height >= 1120874) {
-                    //TODO: test hack, remove me
-                    continue;
-                }
-                btc_bool connected;
-                if (firstblock)
-                {
-                    btc_blockindex *chainheader = calloc(1, sizeof(btc_blockindex));
-                    chainheader->height = height;
-                    if (!btc_block_header_deserialize(&chainheader->header, &cbuf_all)) {
-                        btc_free(chainheader);
-                        fprintf(stderr, "Error: Invalid data found.\n");
-                        return -1;
-                    }
-                    btc_block_header_hash(&chainheader->header, (uint8_t *)&chainheader->hash);
-                    chainheader->prev = NULL;
-                    db->chaintip = chainheader;
-                    firstblock = false;
-                }
-                else {
-                    btc_headers_db_connect_hdr(db, &cbuf_all, true, &connected);
-                    if (!connected)
-                    {
-                        printf("Connecting header failed (at height: %d)\n", db->chaintip->height);
-                    }
-                    else {
-                        connected_headers_count++;
-                    }
-                }
-            }
+        if (version == legacy_version) {
+            FILE *legacy_file = db->headers_tree_file;
+            db->headers_tree_file = NULL;
+            ret = btc_headers_db_migrate_legacy(db, legacy_file, file_path_local);
+            fclose(legacy_file);
+        }
+        else {
+            ret = btc_headers_db_load_records(db, (size_t)buffer.st_size);
+            printf("Loaded %d headers from disk, now at height: %d\n", db->file_records, db->chaintip->height);
         }
     }
-    printf("Connected %ld headers, now at height: %d\n",  connected_headers_count, db->chaintip->height);
-    return (db->headers_tree_file != NULL);
-}
-
-btc_bool btc_headers_db_write(btc_headers_db* db, btc_blockindex *blockindex) {
-    cstring *rec = cstr_new_sz(100);
-    ser_u256(rec, blockindex->hash);
-    ser_u32(rec, blockindex->height);
-    btc_block_header_serialize(rec, &blockindex->header);
-    size_t res = fwrite(rec->str, rec->len, 1, db->headers_tree_file);
-    btc_file_commit(db->headers_tree_file);
-    cstr_free(rec, true);
-    return (res == 1);
+    cstr_free(path_ret, true);
+    return ret;
 }
 
 btc_blockindex * btc_headers_db_connect_hdr(btc_headers_db* db, struct const_buffer *buf, btc_bool load_process, btc_bool *connected) {
     *connected = false;
 
     btc_blockindex *blockindex = btc_calloc(1, sizeof(btc_blockindex));
-    if (!btc_block_header_deserialize(&blockindex->header, buf)) return NULL;
+    if (!btc_block_header_deserialize(&blockindex->header, buf)) {
+        btc_free(blockindex);
+        return NULL;
+    }
 
     /* calculate block hash */
     btc_block_header_hash(&blockindex->header, (uint8_t *)&blockindex->hash);
 
+    return btc_headers_db_connect_blockindex(db, blockindex, load_process, connected);
+}
+
+btc_blockindex * btc_headers_db_connect_blockindex(btc_headers_db* db, btc_blockindex *blockindex, btc_bool load_process, btc_bool *connected) {
+    *connected = false;
+
+    /* peers resend overlapping headers, keep the index we already have */
+    btc_blockindex *known = btc_headersdb_find(db, blockindex->hash);
+    if (known && known != blockindex) {
+        btc_free(blockindex);
+        *connected = true;
+        return known;
+    }
+
     btc_blockindex *connect_at = NULL;
     btc_blockindex *fork_from_block = NULL;
     /* try to connect it to the chain tip */
@@ -233,10 +689,19 @@ btc_blockindex * btc_headers_db_connect_hdr(btc_headers_db* db, struct const_buf
         }
     }
 
+    if (connect_at != NULL && !btc_blockindex_check_bits(db->chainparams, connect_at, &blockindex->header, connect_at->height + 1)) {
+        char hex[65] = {0};
+        utils_bin_to_hex(blockindex->hash, BTC_HASH_LENGTH, hex);
+        printf("Header at height %d claims an unexpected difficulty (%s)\n", connect_at->height + 1, hex);
+        return blockindex;
+    }
+
     if (connect_at != NULL) {
-        /* TODO: check claimed PoW */
         blockindex->prev = connect_at;
         blockindex->height = connect_at->height+1;
+        btc_blockindex_build_skip(blockindex, db->chainbottom->height);
+
+        btc_blockindex *oldtip = db->chaintip;
 
         /* TODO: check if we should switch to the fork with most work (instead of height) */
         if (blockindex->height > db->chaintip->height) {
@@ -246,39 +711,26 @@ btc_blockindex * btc_headers_db_connect_hdr(btc_headers_db* db, struct const_buf
             }
             db->chaintip = blockindex;
         }
-        /* store in db */
-        if (!load_process && db->read_write_file)
+        if (db->use_hash_index) {
+            btc_blockindex_map_insert(db->hash_index, blockindex);
+        }
+        /* store in db (only the main chain is persisted) */
+        if (!load_process && db->read_write_file && db->headers_tree_file && db->chaintip != oldtip)
         {
-            if (!btc_headers_db_write(db, blockindex)) {
+            if (!btc_headers_db_write(db, db->chaintip, oldtip)) {
+                fprintf(stderr, "Error writing blockheader to database\n");
+            }
+            /* outside of a batch, every header is its own batch */
+            if (db->batch_depth == 0 && !btc_headers_db_sync(db)) {
                 fprintf(stderr, "Error writing blockheader to database\n");
             }
         }
-        if (db->use_binary_tree) {
-            btc_blockindex *retval = tsearch(blockindex, &db->tree_root, btc_header_compare);
+        /* the window follows the main chain, fork headers are released once they fall behind it */
+        if (db->chaintip == blockindex) {
+            btc_headers_db_window_connect(db, blockindex);
         }
-
-        if (db->max_hdr_in_mem > 0) {
-            // de-allocate no longer required headers
-            // keep them only on-disk
-            btc_blockindex *scan_tip = db->chaintip;
-            for(unsigned int i = 0; i<db->max_hdr_in_mem+1;i++)
-            {
-                if (scan_tip->prev)
-                    scan_tip = scan_tip->prev;
-                else {
-                    break;
-                }
-
-                if (scan_tip && i == db->max_hdr_in_mem && scan_tip != &db->genesis) {
-                    if (scan_tip->prev && scan_tip->prev != &db->genesis) {
-                        tdelete(scan_tip->prev, &db->tree_root, btc_header_compare);
-                        btc_free(scan_tip->prev);
-
-                        scan_tip->prev = NULL;
-                        db->chainbottom = scan_tip;
-                    }
-                }
-            }
+        else {
+            btc_headers_db_side_add(db, blockindex);
         }
         *connected = true;
     }
@@ -292,37 +744,79 @@ btc_blockindex * btc_headers_db_connect_hdr(btc_headers_db* db, struct const_buf
     return blockindex;
 }
 
-void btc_headers_db_fill_block_locator(btc_headers_db* db, vector *blocklocators)
+size_t btc_headers_db_fill_block_locator(btc_headers_db* db, uint256 *locator, size_t max)
 {
     btc_blockindex *scan_tip = db->chaintip;
-    if (scan_tip->height > 0)
+    uint32_t height = scan_tip->height;
+    size_t count = 0;
+    uint32_t step = 1;
+    if (height == 0)
+        return 0;
+
+    /* headers below the in-memory window are read from the headers file */
+    uint32_t lowest = db->chainbottom->height;
+    if (db->file_records > 0 && db->file_base_height < lowest)
+        lowest = db->file_base_height;
+
+    /* the last blocks, then exponentially further back down to the lowest known block
+       one entry is kept for the genesis block, it's the common point of last resort */
+    size_t walk_max = (max > 1 ? max - 1 : max);
+    while (count < walk_max)
     {
-        for(int i = 0; i<10;i++)
-        {
-            //TODO: try to share memory and avoid heap allocation
-            uint256 *hash = btc_calloc(1, sizeof(uint256));
-            memcpy(hash, scan_tip->hash, sizeof(uint256));
-
-            vector_add(blocklocators, (void *)hash);
-            if (scan_tip->prev)
-                scan_tip = scan_tip->prev;
-            else
+        if (height >= db->chainbottom->height) {
+            scan_tip = btc_blockindex_get_ancestor(scan_tip, height);
+            if (!scan_tip)
+                break;
+            memcpy(locator[count++], scan_tip->hash, BTC_HASH_LENGTH);
+        }
+        else {
+            btc_blockindex record;
+            if (!btc_headers_db_read_record(db, height, &record))
                 break;
+            memcpy(locator[count++], record.hash, BTC_HASH_LENGTH);
         }
+        if (height <= lowest)
+            break;
+
+        height = (height > lowest + step ? height - step : lowest);
+        if (count > 10)
+            step *= 2;
+    }
+    if (count < max && (count == 0 || memcmp(locator[count - 1], db->genesis.hash, BTC_HASH_LENGTH) != 0))
+        memcpy(locator[count++], db->genesis.hash, BTC_HASH_LENGTH);
+    return count;
+}
+
+btc_bool btc_headersdb_get_main_chain_header(btc_headers_db* db, uint32_t height, btc_blockindex *out) {
+    if (height > db->chaintip->height)
+        return false;
+    if (height >= db->chainbottom->height) {
+        btc_blockindex *pindex = NULL;
+        if (db->window && db->window[height % db->window_size] && db->window[height % db->window_size]->height == height)
+            pindex = db->window[height % db->window_size];
+        else
+            pindex = btc_blockindex_get_ancestor(db->chaintip, height);
+        if (!pindex)
+            return false;
+        *out = *pindex;
+        out->prev = NULL;
+        out->pskip = NULL;
+        return true;
     }
+    return btc_headers_db_read_record(db, height, out);
+}
+
+btc_blockindex * btc_headersdb_get_ancestor(btc_headers_db* db, btc_blockindex *pindex, uint32_t height) {
+    /* headers below the in-memory window have been released */
+    if (height < db->chainbottom->height)
+        return NULL;
+    return btc_blockindex_get_ancestor(pindex, height);
 }
 
 btc_blockindex * btc_headersdb_find(btc_headers_db* db, uint256 hash) {
-    if (db->use_binary_tree)
+    if (db->use_hash_index)
     {
-        btc_blockindex *blockindex = btc_calloc(1, sizeof(btc_blockindex));
-        memcpy(blockindex->hash, hash, sizeof(uint256));
-        btc_blockindex *blockindex_f = tfind(blockindex, &db->tree_root, btc_header_compare); /* read */
-        if (blockindex_f) {
-            blockindex_f = *(btc_blockindex **)blockindex_f;
-        }
-        btc_free(blockindex);
-        return blockindex_f;
+        return btc_blockindex_map_find(db->hash_index, hash);
     }
     return NULL;
 }
@@ -337,7 +831,25 @@ btc_bool btc_headersdb_disconnect_tip(btc_headers_db* db) {
         btc_blockindex *oldtip = db->chaintip;
         db->chaintip = db->chaintip->prev;
         /* disconnect/remove the chaintip */
-        tdelete(oldtip, &db->tree_root, btc_header_compare);
+        if (db->use_hash_index) {
+            btc_blockindex_map_remove(db->hash_index, oldtip->hash);
+        }
+        if (db->window && db->window[oldtip->height % db->window_size] == oldtip) {
+            db->window[oldtip->height % db->window_size] = NULL;
+        }
+        btc_headers_db_unlink_children(db, oldtip);
+
+        /* remove the record from the file */
+        if (db->read_write_file && db->headers_tree_file && db->file_records > 0 && oldtip->height == db->file_base_height + db->file_records - 1)
+        {
+            btc_headers_db_flush(db);
+            db->file_records--;
+            if (!btc_headers_db_write_trailer(db, true)) {
+                fprintf(stderr, "Error writing database trailer\n");
+            }
+            if (db->batch_depth == 0)
+                btc_headers_db_sync(db);
+        }
         btc_free(oldtip);
         return true;
     }
@@ -353,4 +865,5 @@ void btc_headersdb_set_checkpoint_start(btc_headers_db* db, uint256 hash, uint32
     db->chainbottom->height = height;
     memcpy(db->chainbottom->hash, hash, sizeof(uint256));
     db->chaintip = db->chainbottom;
+    btc_headers_db_window_set(db, db->chainbottom);
 }
@@ -110,7 +110,7 @@ LIBLOGDB_API void logdb_set_memmapper(logdb_log_db* db, logdb_memmapper *mapper,
 /** loads given file as database (memory mapping) */
 LIBLOGDB_API logdb_bool logdb_load(logdb_log_db* handle, const char *file_path, logdb_bool create, enum logdb_error *error);
 
-/** flushes database: writes down new records */
+/** flushes database: writes down new records, returns false if a write failed */
 LIBLOGDB_API logdb_bool logdb_flush(logdb_log_db* db);
 
 /** deletes record with key */
@@ -127,8 +127,8 @@ LIBLOGDB_API cstring * logdb_find(logdb_log_db* db, cstring *key);
 LIBLOGDB_API size_t logdb_cache_size(logdb_log_db* db);
 LIBLOGDB_API size_t logdb_count_keys(logdb_log_db* db);
 
-/** writes down single record, internal */
-void logdb_write_record(logdb_log_db* db, logdb_record *rec);
+/** writes down single record, internal, returns false if the file write failed */
+logdb_bool logdb_write_record(logdb_log_db* db, logdb_record *rec);
 
 /** deserializes next logdb record from file */
 logdb_bool logdb_record_deser_from_file(logdb_record* rec, logdb_log_db *db, enum logdb_error *error);
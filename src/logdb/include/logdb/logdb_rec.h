@@ -34,6 +34,7 @@ extern "C" {
 #include <logdb/logdb_base.h>
 
 #include <btc/cstr.h>
+#include <btc/serialize.h>
 
 #include <stdint.h>
 #include <stddef.h>
@@ -70,6 +71,9 @@ LIBLOGDB_API logdb_record* logdb_record_copy(logdb_record* b_rec);
 /** serialize a record into a cstring */
 LIBLOGDB_API void logdb_record_ser(logdb_record* rec, cstring *buf);
 
+/** serialize a record into a sink (buffer, running hash and/or file) */
+LIBLOGDB_API void logdb_record_ser_sink(logdb_record* rec, btc_ser_sink *sink);
+
 /** get current height in linkes list */
 LIBLOGDB_API size_t logdb_record_height(logdb_record* head);
 
@@ -29,7 +29,6 @@
 #include <logdb/logdb_memdb_rbtree.h>
 #include <btc/serialize.h>
 
-#include <assert.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
@@ -260,7 +259,9 @@ logdb_bool logdb_flush(logdb_log_db* db)
     /* write records */
     while (flush_rec != NULL)
     {
-        logdb_write_record(db, flush_rec);
+        /* a partially written record fails the checksum on load, the unwritten ones stay cached */
+        if (!logdb_write_record(db, flush_rec))
+            return false;
         flush_rec->written = true;
         flush_rec = flush_rec->next;
     }
@@ -360,41 +361,53 @@ size_t logdb_cache_size(logdb_log_db* db)
     return logdb_record_height(db->cache_head);
 }
 
-void logdb_write_record(logdb_log_db* db, logdb_record *rec)
+logdb_bool logdb_write_record(logdb_log_db* db, logdb_record *rec)
 {
     SHA256_CTX ctx = db->hashctx;
     SHA256_CTX ctx_final;
     uint8_t hash[SHA256_DIGEST_LENGTH];
+    btc_ser_sink sink;
+    long record_start = ftell(db->file);
+    logdb_bool ok = true;
 
-    /* serialize record to buffer */
-    cstring *serbuf = cstr_new_sz(1024);
-    logdb_record_ser(rec, serbuf);
-
-    /* create hash of the body */
-    sha256_Raw((const uint8_t*)serbuf->str, serbuf->len, hash);
+    /* create hash of the body (without materializing the serialized record) */
+    SHA256_CTX body_ctx;
+    sha256_Init(&body_ctx);
+    btc_ser_sink_init(&sink, NULL, &body_ctx, NULL);
+    logdb_record_ser_sink(rec, &sink);
+    sha256_Final(hash, &body_ctx);
 
     /* write record header */
-    assert(fwrite(record_magic, 8, 1, db->file) == 1);
+    ok = ok && fwrite(record_magic, 8, 1, db->file) == 1;
     sha256_Update(&ctx, record_magic, 8);
 
     /* write partial hash as body checksum&indicator (body start) */
-    assert(fwrite(hash, db->hashlen, 1, db->file) == 1);
+    ok = ok && fwrite(hash, db->hashlen, 1, db->file) == 1;
     sha256_Update(&ctx, hash, db->hashlen);
 
     /* write the body */
-    fwrite(serbuf->str, serbuf->len, 1, db->file);
-    sha256_Update(&ctx, (uint8_t *)serbuf->str, serbuf->len);
+    if (ok) {
+        btc_ser_sink_init(&sink, NULL, &ctx, db->file);
+        logdb_record_ser_sink(rec, &sink);
+        ok = !sink.failed;
+    }
 
     /* write partial hash as body checksum&indicator (body end) */
-    assert(fwrite(hash, db->hashlen, 1, db->file) == 1);
+    ok = ok && fwrite(hash, db->hashlen, 1, db->file) == 1;
     sha256_Update(&ctx, hash, db->hashlen);
-    
-    cstr_free(serbuf, true);
 
     ctx_final = ctx;
     sha256_Final(hash, &ctx_final);
-    assert(fwrite(hash, db->hashlen, 1, db->file) == 1);
+    ok = ok && fwrite(hash, db->hashlen, 1, db->file) == 1;
+
+    if (!ok) {
+        /* the next flush overwrites the partial record */
+        if (record_start >= 0)
+            fseek(db->file, record_start, SEEK_SET);
+        return false;
+    }
     db->hashctx = ctx;
+    return true;
 }
 
 logdb_bool logdb_record_deser_from_file(logdb_record* rec, logdb_log_db *db, enum logdb_error *error)
@@ -407,8 +420,8 @@ logdb_bool logdb_record_deser_from_file(logdb_record* rec, logdb_log_db *db, enu
     unsigned char check[SHA256_DIGEST_LENGTH];
 
     /* prepate a buffer for the varint data (max 4 bytes) */
-    size_t buflen = sizeof(uint32_t);
-    uint8_t readbuf[sizeof(uint32_t)];
+    uint8_t readbuf[1 + sizeof(uint64_t)];
+    size_t buflen = sizeof(readbuf);
 
     *error = LOGDB_SUCCESS;
 
@@ -458,7 +471,7 @@ logdb_bool logdb_record_deser_from_file(logdb_record* rec, logdb_log_db *db, enu
     if (rec->mode == RECORD_TYPE_WRITE)
     {
         /* read value (not for delete mode) */
-        buflen = sizeof(uint32_t);
+        buflen = sizeof(readbuf);
         if (!deser_varlen_file(&len, db->file, readbuf, &buflen))
         {
             *error = LOGDB_ERROR_DATASTREAM_ERROR;
@@ -91,20 +91,27 @@ logdb_record* logdb_record_copy(logdb_record* b_rec)
     return a_rec;
 }
 
-void logdb_record_ser(logdb_record* rec, cstring *buf)
+void logdb_record_ser_sink(logdb_record* rec, btc_ser_sink *sink)
 {
-    ser_bytes(buf, &rec->mode, 1);
-    ser_varlen(buf, rec->key->len);
-    ser_bytes(buf, rec->key->str, rec->key->len);
+    ser_sink_bytes(sink, &rec->mode, 1);
+    ser_sink_varlen(sink, rec->key->len);
+    ser_sink_bytes(sink, rec->key->str, rec->key->len);
 
     /* write value for a WRITE operation */
     if (rec->mode == RECORD_TYPE_WRITE)
     {
-        ser_varlen(buf, rec->value->len);
-        ser_bytes(buf, rec->value->str, rec->value->len);
+        ser_sink_varlen(sink, rec->value->len);
+        ser_sink_bytes(sink, rec->value->str, rec->value->len);
     }
 }
 
+void logdb_record_ser(logdb_record* rec, cstring *buf)
+{
+    btc_ser_sink sink;
+    btc_ser_sink_init(&sink, buf, NULL, NULL);
+    logdb_record_ser_sink(rec, &sink);
+}
+
 size_t logdb_record_height(logdb_record* head)
 {
     size_t cnt = 0;
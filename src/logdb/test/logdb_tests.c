@@ -89,13 +89,21 @@ void test_logdb(logdb_log_db* (*new_func)())
     u_assert_int_eq(memcmp(value_test->str, value->str, value->len), 0);
     logdb_free(db);
 
+    /* a failing write is reported and the record stays cached */
     db = new_func();
     u_assert_int_eq(logdb_load(db, dbtmpfile, false, NULL), true);
+    logdb_append(db, NULL, key2, value2);
+    fclose(db->file);
+    db->file = fopen(dbtmpfile, "rb");
+    u_assert_int_eq(logdb_flush(db), false);
+    u_assert_int_eq(logdb_cache_size(db), 1);
+    logdb_free(db);
 
-
-
+    db = new_func();
+    u_assert_int_eq(logdb_load(db, dbtmpfile, false, NULL), true);
+    u_assert_int_eq(logdb_count_keys(db), 2);
     logdb_append(db, NULL, key2, value2);
-    logdb_flush(db);
+    u_assert_int_eq(logdb_flush(db), true);
     logdb_free(db);
 
     /* check if private key is available */
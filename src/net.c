@@ -2,7 +2,9 @@
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <event2/dns.h>
 #include <event2/event.h>
+#include <event2/thread.h>
 
 #include <btc/buffer.h>
 #include <btc/chainparams.h>
@@ -32,8 +34,14 @@
 #define UNUSED(x) (void)(x)
 
 static const int BTC_PERIODICAL_NODE_TIMER_S = 3;
+static const int BTC_TIMER_WHEEL_TICK_MS = 100;
 static const int BTC_PING_INTERVAL_S = 180;
 static const int BTC_CONNECT_TIMEOUT_S = 10;
+static const size_t BTC_ADDRMAN_GETADDR_BELOW = 1000; /* ask peers for addresses while we know less */
+static const size_t BTC_ADDRMAN_SKIP_DNS_MIN = 16;    /* known addresses to start without a DNS seed lookup */
+static const char* BTC_DNS_TIMEOUT_S = "5";           /* per attempt, evdns option value */
+static const char* BTC_DNS_ATTEMPTS = "2";
+static const uint32_t BTC_P2P_MAX_CONTROL_MSG_SIZE = 4096; /* version, ping, getheaders, ... */
 
 int net_write_log_printf(const char* format, ...)
 {
@@ -51,81 +59,388 @@ int net_write_log_null(const char* format, ...)
     return 1;
 }
 
-void read_cb(struct bufferevent* bev, void* ctx)
-{
-    struct evbuffer* input = bufferevent_get_input(bev);
-    if (!input)
-        return;
+/* =================================== */
+/* THREADED MODE */
+/* =================================== */
 
-    size_t length = evbuffer_get_length(input);
+enum btc_node_group_event_type {
+    BTC_NODE_EVENT_MESSAGE,
+    BTC_NODE_EVENT_STATE_CHANGED,
+    BTC_NODE_EVENT_HANDSHAKE_DONE,
+};
 
-    btc_node* node = (btc_node*)ctx;
+/* group callback queued by a worker for the event_base thread */
+struct btc_node_group_event_ {
+    struct btc_node_group_event_* next;
+    enum btc_node_group_event_type type;
+    btc_node* node;
+    uint32_t state;
+    btc_p2p_msg_hdr hdr;
+    cstring* payload;
+};
 
-    if ((node->state & NODE_CONNECTED) != NODE_CONNECTED) {
-        // ignore messages from disconnected peers
-        return;
-    }
-    // expand the cstring buffer if required
-    cstr_alloc_minsize(node->recvBuffer, node->recvBuffer->len + length);
+/* message queued for sending by a thread other than the nodes worker */
+struct btc_node_send_job {
+    btc_node* node;
+    cstring* data;
+    btc_node_msg* msg; /* set instead of data for shared messages */
+};
 
-    // copy direct to cstring, avoid another heap buffer
-    evbuffer_copyout(input, node->recvBuffer->str + node->recvBuffer->len, length);
-    node->recvBuffer->len += length;
+static void btc_node_dispatch_cmd(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf);
+static void btc_node_periodical_internal(btc_node* node, uint64_t now);
+static void btc_node_connect_more_nodes(btc_node* node);
+static void btc_node_send_ping(btc_node* node);
 
-    // drain the event buffer
-    evbuffer_drain(input, length);
+/* shard whose event base the calling thread runs, set by the worker before it handles any event */
+static __thread btc_node_group_shard* btc_node_current_shard = NULL;
 
-    struct const_buffer buf = {node->recvBuffer->str, node->recvBuffer->len};
-    btc_p2p_msg_hdr hdr;
-    char* read_upto = NULL;
+/* true if the caller needs to hand work for this node over to its worker thread */
+static btc_bool btc_node_on_foreign_thread(const btc_node* node)
+{
+    return (node->shard && __atomic_load_n(&node->shard->running, __ATOMIC_ACQUIRE) && btc_node_current_shard != node->shard);
+}
+
+uint32_t btc_node_get_state(const btc_node* node)
+{
+    return __atomic_load_n(&node->state, __ATOMIC_RELAXED);
+}
+
+void btc_node_set_state(btc_node* node, uint32_t flags)
+{
+    __atomic_fetch_or(&node->state, flags, __ATOMIC_RELAXED);
+}
+
+void btc_node_clear_state(btc_node* node, uint32_t flags)
+{
+    __atomic_fetch_and(&node->state, ~flags, __ATOMIC_RELAXED);
+}
 
+static void btc_node_run_on_shard(btc_node* node, event_callback_fn fn, void* ctx)
+{
+    event_base_once(node->shard->event_base, -1, EV_TIMEOUT, fn, ctx, NULL);
+}
+
+/* push a callback to the groups queue (lock-free, multiple producers) and wake up the consumer */
+static void btc_node_group_queue_push(btc_node* node, enum btc_node_group_event_type type, const btc_p2p_msg_hdr* hdr, const struct const_buffer* buf)
+{
+    btc_node_group* group = node->nodegroup;
+    struct btc_node_group_event_* ev = btc_calloc(1, sizeof(*ev));
+    ev->type = type;
+    ev->node = node;
+    ev->state = btc_node_get_state(node);
+    if (hdr)
+        ev->hdr = *hdr;
+    if (buf)
+        ev->payload = cstr_new_buf(buf->p, buf->len);
+
+    struct btc_node_group_event_* head = __atomic_load_n(&group->event_queue, __ATOMIC_RELAXED);
     do {
-        //check if message is complete
-        if (buf.len < BTC_P2P_HDRSZ) {
-            break;
+        ev->next = head;
+    } while (!__atomic_compare_exchange_n(&group->event_queue, &head, ev, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* the consumer takes the whole queue at once, only the first push needs to wake it up */
+    if (!head)
+        event_active(group->event_queue_ev, EV_READ, 0);
+}
+
+static void btc_node_group_event_free(struct btc_node_group_event_* ev)
+{
+    if (ev->payload)
+        cstr_free(ev->payload, true);
+    btc_free(ev);
+}
+
+static void btc_node_timer_internal_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_periodical_internal((btc_node*)ctx, time(NULL));
+}
+
+/* consume the queued group callbacks in the order they have been pushed */
+static void btc_node_group_queue_drain(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_group* group = (btc_node_group*)ctx;
+    struct btc_node_group_event_* ev = __atomic_exchange_n(&group->event_queue, NULL, __ATOMIC_ACQUIRE);
+
+    struct btc_node_group_event_* ordered = NULL;
+    while (ev) {
+        struct btc_node_group_event_* next = ev->next;
+        ev->next = ordered;
+        ordered = ev;
+        ev = next;
+    }
+
+    btc_bool check_exit = false;
+    while (ordered) {
+        ev = ordered;
+        ordered = ev->next;
+        btc_node* node = ev->node;
+        if (ev->type == BTC_NODE_EVENT_MESSAGE) {
+            struct const_buffer buf = {ev->payload->str, ev->payload->len};
+            btc_node_dispatch_cmd(node, &ev->hdr, &buf);
+        } else if (ev->type == BTC_NODE_EVENT_STATE_CHANGED) {
+            if (group->node_connection_state_changed_cb)
+                group->node_connection_state_changed_cb(node);
+            if ((ev->state & NODE_ERRORED) == NODE_ERRORED)
+                btc_node_connect_more_nodes(node);
+            check_exit = true;
+        } else if (ev->type == BTC_NODE_EVENT_HANDSHAKE_DONE) {
+            if (group->handshake_done_cb)
+                group->handshake_done_cb(node);
         }
+        btc_node_group_event_free(ev);
+    }
 
-        btc_p2p_deser_msghdr(&hdr, &buf);
-        if (hdr.data_len > BTC_MAX_P2P_MSG_SIZE) {
-            // check for invalid message lengths
-            btc_node_missbehave(node);
+    /* like the single threaded event loop, stop once there is no connection left */
+    if (check_exit && btc_node_group_amount_of_connected_nodes(group, NODE_CONNECTED) + btc_node_group_amount_of_connected_nodes(group, NODE_CONNECTING) == 0)
+        event_base_loopexit(group->event_base, NULL);
+}
+
+static void* btc_node_group_shard_thread(void* ctx)
+{
+    btc_node_group_shard* shard = (btc_node_group_shard*)ctx;
+    btc_node_current_shard = shard;
+    event_base_loop(shard->event_base, EVLOOP_NO_EXIT_ON_EMPTY);
+    return NULL;
+}
+
+static struct event_base* btc_node_event_base(const btc_node* node)
+{
+    return (node->shard ? node->shard->event_base : node->nodegroup->event_base);
+}
+
+/* add the received but not yet hashed payload bytes (up to payload_len) of a
+   partial message to the nodes running checksum hash */
+static void btc_node_hash_partial_payload(btc_node* node, struct evbuffer* input, size_t payload_len)
+{
+    if (node->recv_hashed == 0)
+        sha256_Init(&node->recv_hash_ctx);
+
+    while (node->recv_hashed < payload_len) {
+        struct evbuffer_ptr pos;
+        struct evbuffer_iovec vec[8];
+        if (evbuffer_ptr_set(input, &pos, BTC_P2P_HDRSZ + node->recv_hashed, EVBUFFER_PTR_SET) != 0)
+            return;
+        int n = evbuffer_peek(input, payload_len - node->recv_hashed, &pos, vec, 8);
+        if (n <= 0)
             return;
+        if (n > 8)
+            n = 8;
+        for (int i = 0; i < n && node->recv_hashed < payload_len; i++) {
+            size_t len = vec[i].iov_len;
+            if (len > payload_len - node->recv_hashed)
+                len = payload_len - node->recv_hashed;
+            sha256_Update(&node->recv_hash_ctx, vec[i].iov_base, len);
+            node->recv_hashed += len;
         }
-        if (buf.len < hdr.data_len) {
-            //if we haven't read the whole message, continue and wait for the next chunk
-            break;
+    }
+}
+
+/* largest acceptable payload of a command, 0 if only limited by the nodes receive budget */
+static uint32_t btc_node_max_payload_size(enum btc_p2p_command command_id)
+{
+    switch (command_id) {
+    case BTC_CMD_VERSION:
+    case BTC_CMD_VERACK:
+    case BTC_CMD_PING:
+    case BTC_CMD_PONG:
+    case BTC_CMD_GETADDR:
+    case BTC_CMD_GETHEADERS:
+    case BTC_CMD_GETCFILTERS:
+    case BTC_CMD_GETCFHEADERS:
+    case BTC_CMD_GETCFCHECKPT:
+        return BTC_P2P_MAX_CONTROL_MSG_SIZE;
+    case BTC_CMD_INV:
+    case BTC_CMD_GETDATA:
+        return 9 + MAX_INV_SIZE * (4 + BTC_HASH_LENGTH);
+    case BTC_CMD_HEADERS:
+        return 9 + MAX_HEADERS_RESULTS * (80 + 1);
+    case BTC_CMD_CFHEADERS:
+        return 1 + 2 * BTC_HASH_LENGTH + 9 + MAX_GETCFHEADERS_SIZE * BTC_HASH_LENGTH;
+    case BTC_CMD_ADDR:
+        return 9 + MAX_ADDR_SIZE * 30;
+    case BTC_CMD_BLOCK:
+    case BTC_CMD_TX:
+    case BTC_CMD_CFILTER:
+        return MAX_BLOCK_SERIALIZED_SIZE;
+    default:
+        return 0;
+    }
+}
+
+/* reserve a share of the groups receive budget for a partially received message */
+static btc_bool btc_node_recv_reserve(btc_node* node, size_t size)
+{
+    btc_node_group* group = node->nodegroup;
+    size_t reserved = __atomic_load_n(&group->recv_reserved, __ATOMIC_SEQ_CST);
+    do {
+        /* a single message is always admitted, the budget limits the concurrent ones */
+        if (reserved > 0 && reserved + size > group->recv_budget_group)
+            return false;
+    } while (!__atomic_compare_exchange_n(&group->recv_reserved, &reserved, reserved + size, true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    node->recv_reserved = size;
+    return true;
+}
+
+/* done with the current message, give its share back and let the paused nodes retry */
+static void btc_node_recv_release(btc_node* node)
+{
+    btc_node_group* group = node->nodegroup;
+    node->recv_admitted = false;
+    if (node->recv_reserved == 0)
+        return;
+    __atomic_sub_fetch(&group->recv_reserved, node->recv_reserved, __ATOMIC_SEQ_CST);
+    node->recv_reserved = 0;
+    if (__atomic_load_n(&group->recv_paused, __ATOMIC_SEQ_CST) > 0 && group->recv_resume_ev)
+        event_active(group->recv_resume_ev, EV_TIMEOUT, 0);
+}
+
+/* continue reading after btc_node_recv_pause, must run on the nodes thread */
+static void btc_node_recv_resume(btc_node* node)
+{
+    if (!__atomic_exchange_n(&node->recv_paused, false, __ATOMIC_SEQ_CST))
+        return;
+    __atomic_sub_fetch(&node->nodegroup->recv_paused, 1, __ATOMIC_SEQ_CST);
+    if (node->event_bev)
+        bufferevent_enable(node->event_bev, EV_READ);
+}
+
+static void btc_node_recv_resume_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_recv_resume((btc_node*)ctx);
+}
+
+/* stop reading until the groups receive budget admits a message of size bytes,
+   returns false if the message could be admitted in the meantime */
+static btc_bool btc_node_recv_pause(btc_node* node, size_t size)
+{
+    __atomic_store_n(&node->recv_paused, true, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&node->nodegroup->recv_paused, 1, __ATOMIC_SEQ_CST);
+    bufferevent_disable(node->event_bev, EV_READ);
+
+    /* a share released before the pause became visible doesn't resume this node */
+    if (!btc_node_recv_reserve(node, size))
+        return true;
+    btc_node_recv_resume(node);
+    return false;
+}
+
+/* resume the paused nodes after a share of the receive budget has been released */
+static void btc_node_group_recv_resume(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_group* group = (btc_node_group*)ctx;
+    pthread_mutex_lock(&group->nodes_mutex);
+    for (size_t i = 0; i < group->nodes->len; i++) {
+        btc_node* node = vector_idx(group->nodes, i);
+        if (!__atomic_load_n(&node->recv_paused, __ATOMIC_SEQ_CST))
+            continue;
+        if (btc_node_on_foreign_thread(node))
+            btc_node_run_on_shard(node, btc_node_recv_resume_cb, node);
+        else
+            btc_node_recv_resume(node);
+    }
+    pthread_mutex_unlock(&group->nodes_mutex);
+}
+
+void read_cb(struct bufferevent* bev, void* ctx)
+{
+    struct evbuffer* input = bufferevent_get_input(bev);
+    if (!input)
+        return;
+
+    btc_node* node = (btc_node*)ctx;
+    btc_node_group* group = node->nodegroup;
+
+    /* frame the messages directly on the input buffer, the payload gets linearized
+       (evbuffer_pullup) only once the whole message has been received */
+    size_t wait_for = 0;
+    while ((btc_node_get_state(node) & NODE_CONNECTED) == NODE_CONNECTED) {
+        size_t length = evbuffer_get_length(input);
+        if (node->recv_skip > 0) {
+            /* drop the payload of a discarded message as it arrives */
+            size_t skip = BTC_MIN(length, node->recv_skip);
+            evbuffer_drain(input, skip);
+            node->recv_skip -= skip;
+            node->bytes_received += skip;
+            if (node->recv_skip > 0)
+                break;
+            continue;
         }
-        if (buf.len >= hdr.data_len) {
-            //at least one message is complete
+        if (length < BTC_P2P_HDRSZ)
+            break;
 
-            struct const_buffer cmd_data_buf = {buf.p, buf.len};
-            if ((node->state & NODE_CONNECTED) != NODE_CONNECTED) {
-                // ignore messages from disconnected peers
+        unsigned char hdr_data[24];
+        evbuffer_copyout(input, hdr_data, BTC_P2P_HDRSZ);
+        struct const_buffer hdr_buf = {hdr_data, BTC_P2P_HDRSZ};
+        btc_p2p_msg_hdr hdr;
+        btc_p2p_deser_msghdr(&hdr, &hdr_buf);
+        if (!node->recv_admitted) {
+            /* check the message from its header, before any payload gets buffered */
+            uint32_t max_size = btc_node_max_payload_size(hdr.command_id);
+            if (hdr.data_len > BTC_MAX_P2P_MSG_SIZE || BTC_P2P_HDRSZ + (size_t)hdr.data_len > group->recv_budget_node || (max_size > 0 && hdr.data_len > max_size)) {
+                group->log_write_cb("Oversized %s message (%u bytes) from node %d\n", hdr.command, hdr.data_len, node->nodeid);
+                btc_node_missbehave(node);
                 return;
             }
-            btc_node_parse_message(node, &hdr, &cmd_data_buf);
-
-            //skip the size of the whole message
-            buf.p = (const unsigned char*)buf.p + hdr.data_len;
-            buf.len -= hdr.data_len;
-
-            read_upto = (void*)buf.p;
+            if (group->accept_msg_cb && !group->accept_msg_cb(node, &hdr)) {
+                group->log_write_cb("Discarding %s message (%u bytes) from node %d\n", hdr.command, hdr.data_len, node->nodeid);
+                evbuffer_drain(input, BTC_P2P_HDRSZ);
+                node->bytes_received += BTC_P2P_HDRSZ;
+                node->recv_skip = hdr.data_len;
+                continue;
+            }
+            if (length < BTC_P2P_HDRSZ + hdr.data_len &&
+                !btc_node_recv_reserve(node, BTC_P2P_HDRSZ + hdr.data_len) &&
+                btc_node_recv_pause(node, BTC_P2P_HDRSZ + hdr.data_len))
+                break;
+            node->recv_admitted = true;
         }
-        if (buf.len == 0) {
-            //if we have "consumed" the whole buffer
-            node->recvBuffer->len = 0;
+        if (length < BTC_P2P_HDRSZ + hdr.data_len) {
+            /* hash what we have so far (overlaps with waiting for the rest)
+               and get called again after the next chunk or once the message is complete */
+            btc_node_hash_partial_payload(node, input, length - BTC_P2P_HDRSZ);
+            wait_for = length + BTC_P2P_MESSAGE_HASH_CHUNK_SIZE;
+            if (wait_for > BTC_P2P_HDRSZ + hdr.data_len)
+                wait_for = BTC_P2P_HDRSZ + hdr.data_len;
             break;
         }
-    } while (1);
 
-    if (read_upto != NULL && node->recvBuffer->len != 0 && read_upto != (node->recvBuffer->str + node->recvBuffer->len)) {
-        char* end = node->recvBuffer->str + node->recvBuffer->len;
-        size_t available_chunk_data = end - read_upto;
-        //partial message
-        cstring* tmp = cstr_new_buf(read_upto, available_chunk_data);
-        cstr_free(node->recvBuffer, true);
-        node->recvBuffer = tmp;
+        evbuffer_drain(input, BTC_P2P_HDRSZ);
+        node->bytes_received += BTC_P2P_HDRSZ + hdr.data_len;
+        unsigned char* payload = (hdr.data_len > 0 ? evbuffer_pullup(input, hdr.data_len) : hdr_data);
+
+        /* verify the checksum (first 4 bytes of the double sha256 of the payload) */
+        uint8_t checksum[SHA256_DIGEST_LENGTH];
+        if (node->recv_hashed == 0)
+            sha256_Init(&node->recv_hash_ctx);
+        sha256_Update(&node->recv_hash_ctx, payload + node->recv_hashed, hdr.data_len - node->recv_hashed);
+        sha256_Final(checksum, &node->recv_hash_ctx);
+        sha256_Raw(checksum, SHA256_DIGEST_LENGTH, checksum);
+        node->recv_hashed = 0;
+        if (memcmp(checksum, hdr.hash, 4) != 0) {
+            btc_node_missbehave(node);
+            return;
+        }
+
+        struct const_buffer cmd_data_buf = {payload, hdr.data_len};
+        btc_node_parse_message(node, &hdr, &cmd_data_buf);
+
+        if (node->event_bev != bev) {
+            /* the node has been disconnected while processing the message */
+            return;
+        }
+        evbuffer_drain(input, hdr.data_len);
+        btc_node_recv_release(node);
     }
+    if (node->event_bev == bev)
+        bufferevent_setwatermark(bev, EV_READ, wait_for, group->recv_budget_node);
 }
 
 void write_cb(struct bufferevent* ev, void* ctx)
@@ -134,57 +449,109 @@ void write_cb(struct bufferevent* ev, void* ctx)
     UNUSED(ctx);
 }
 
-void node_periodical_timer(int fd, short event, void* ctx)
+static void btc_node_periodical_timer(btc_timer* timer, void* ctx)
 {
-    UNUSED(fd);
-    UNUSED(event);
     btc_node* node = (btc_node*)ctx;
-    uint64_t now = time(NULL);
+    uint32_t state = btc_node_get_state(node);
+    if ((state & (NODE_CONNECTED | NODE_CONNECTING)) == 0)
+        return; /* released in the meantime */
+    btc_timer_schedule(&node->nodegroup->timer_wheel, timer, BTC_PERIODICAL_NODE_TIMER_S * 1000);
 
     /* pass data to the callback and give it a chance to cancle the call */
+    uint64_t now = time(NULL);
     if (node->nodegroup->periodic_timer_cb)
         if (!node->nodegroup->periodic_timer_cb(node, &now))
             return;
 
-    if (node->time_started_con + BTC_CONNECT_TIMEOUT_S < now && ((node->state & NODE_CONNECTING) == NODE_CONNECTING)) {
-        node->state = 0;
+    /* the wheel turns on the event_base thread, the internal logic belongs to the nodes worker */
+    if (node->shard)
+        btc_node_run_on_shard(node, btc_node_timer_internal_cb, node);
+    else
+        btc_node_periodical_internal(node, now);
+}
+
+/* turn the groups timer wheel, stops once there is no connection left (so that the
+   single threaded event loop can return) */
+static void btc_node_group_timer_tick(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_group* group = (btc_node_group*)ctx;
+    btc_timer_wheel_advance(&group->timer_wheel, btc_node_time_ms());
+
+    if (btc_node_group_amount_of_connected_nodes(group, NODE_CONNECTED) + btc_node_group_amount_of_connected_nodes(group, NODE_CONNECTING) == 0)
+        event_del(group->timer_wheel_ev);
+}
+
+static void btc_node_group_timer_start(btc_node_group* group)
+{
+    if (event_pending(group->timer_wheel_ev, EV_TIMEOUT, NULL))
+        return;
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = BTC_TIMER_WHEEL_TICK_MS * 1000;
+    event_add(group->timer_wheel_ev, &tv);
+}
+
+static void btc_node_periodical_internal(btc_node* node, uint64_t now)
+{
+    if (node->time_started_con + BTC_CONNECT_TIMEOUT_S < now && ((btc_node_get_state(node) & NODE_CONNECTING) == NODE_CONNECTING)) {
+        __atomic_store_n(&node->state, NODE_ERRORED | NODE_TIMEOUT, __ATOMIC_RELAXED);
         node->time_started_con = 0;
-        node->state |= NODE_ERRORED;
-        node->state |= NODE_TIMEOUT;
         btc_node_connection_state_changed(node);
     }
 
-    if (((node->state & NODE_CONNECTED) == NODE_CONNECTED) && node->lastping + BTC_PING_INTERVAL_S < now) {
+    if (((btc_node_get_state(node) & NODE_CONNECTED) == NODE_CONNECTED) && node->lastping + BTC_PING_INTERVAL_S < now) {
         //time for a ping
-        uint64_t nonce;
-        btc_cheap_random_bytes((uint8_t*)&nonce, sizeof(nonce));
-        cstring* pingmsg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_PING, &nonce, sizeof(nonce));
-        btc_node_send(node, pingmsg);
-        cstr_free(pingmsg, true);
+        btc_node_send_ping(node);
         node->lastping = now;
     }
 }
 
+static void btc_node_send_ping(btc_node* node)
+{
+    uint64_t nonce = 0;
+    while (nonce == 0)
+        btc_cheap_random_bytes((uint8_t*)&nonce, sizeof(nonce));
+    btc_node_send_message(node, BTC_MSG_PING, &nonce, sizeof(nonce));
+
+    /* an outstanding ping that never got answered is replaced */
+    node->ping_nonce = nonce;
+    node->ping_sent_ms = btc_node_time_ms();
+}
+
+uint64_t btc_node_time_ms(void)
+{
+    struct timeval tv;
+    evutil_gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
+}
+
+uint64_t btc_node_smooth(uint64_t smoothed, uint64_t sample)
+{
+    if (sample == 0)
+        sample = 1; /* keep known values distinguishable from unknown ones */
+    if (smoothed == 0)
+        return sample;
+    return (smoothed * 3 + sample) / 4;
+}
+
 void event_cb(struct bufferevent* ev, short type, void* ctx)
 {
     UNUSED(ev);
     btc_node* node = (btc_node*)ctx;
     node->nodegroup->log_write_cb("Event callback on node %d\n", node->nodeid);
 
-    if (((type & BEV_EVENT_TIMEOUT) != 0) && ((node->state & NODE_CONNECTING) == NODE_CONNECTING)) {
+    if (((type & BEV_EVENT_TIMEOUT) != 0) && ((btc_node_get_state(node) & NODE_CONNECTING) == NODE_CONNECTING)) {
         node->nodegroup->log_write_cb("Timout connecting to node %d.\n", node->nodeid);
-        node->state = 0;
-        node->state |= NODE_ERRORED;
-        node->state |= NODE_TIMEOUT;
+        __atomic_store_n(&node->state, NODE_ERRORED | NODE_TIMEOUT, __ATOMIC_RELAXED);
         btc_node_connection_state_changed(node);
     } else if (((type & BEV_EVENT_EOF) != 0) ||
                ((type & BEV_EVENT_ERROR) != 0)) {
-        node->state = 0;
-        node->state |= NODE_ERRORED;
-        node->state |= NODE_DISCONNECTED;
+        __atomic_store_n(&node->state, NODE_ERRORED | NODE_DISCONNECTED, __ATOMIC_RELAXED);
         if ((type & BEV_EVENT_EOF) != 0) {
             node->nodegroup->log_write_cb("Disconnected from the remote peer %d.\n", node->nodeid);
-            node->state |= NODE_DISCONNECTED_FROM_REMOTE_PEER;
+            btc_node_set_state(node, NODE_DISCONNECTED_FROM_REMOTE_PEER);
         }
         else {
             node->nodegroup->log_write_cb("Error connecting to node %d.\n", node->nodeid);
@@ -192,9 +559,8 @@ void event_cb(struct bufferevent* ev, short type, void* ctx)
         btc_node_connection_state_changed(node);
     } else if (type & BEV_EVENT_CONNECTED) {
         node->nodegroup->log_write_cb("Successfull connected to node %d.\n", node->nodeid);
-        node->state |= NODE_CONNECTED;
-        node->state &= ~NODE_CONNECTING;
-        node->state &= ~NODE_ERRORED;
+        btc_node_set_state(node, NODE_CONNECTED);
+        btc_node_clear_state(node, NODE_CONNECTING | NODE_ERRORED);
         btc_node_connection_state_changed(node);
         /* if callback is set, fire */
     }
@@ -213,8 +579,18 @@ btc_node* btc_node_new()
     node->time_started_con = 0;
     node->time_last_request = 0;
     btc_hash_clear(node->last_requested_inv);
+    node->recv_hashed = 0;
+    node->recv_reserved = 0;
+    node->recv_skip = 0;
+    node->recv_admitted = false;
+    node->recv_paused = false;
+    node->ping_nonce = 0;
+    node->ping_rtt_ms = 0;
+    node->headers_response_ms = 0;
+    node->block_bytes_per_s = 0;
+    node->bytes_received = 0;
+    btc_timer_init(&node->timer, btc_node_periodical_timer, node);
 
-    node->recvBuffer = cstr_new_sz(BTC_P2P_MESSAGE_CHUNK_SIZE);
     node->hints = 0;
     return node;
 }
@@ -224,7 +600,7 @@ btc_bool btc_node_set_ipport(btc_node* node, const char* ipport)
     int outlen = (int)sizeof(node->addr);
 
     //return true in case of success (0 == no error)
-    return (evutil_parse_sockaddr_port(ipport, &node->addr, &outlen) == 0);
+    return (evutil_parse_sockaddr_port(ipport, (struct sockaddr*)&node->addr, &outlen) == 0);
 }
 
 void btc_node_release_events(btc_node* node)
@@ -233,33 +609,59 @@ void btc_node_release_events(btc_node* node)
         bufferevent_free(node->event_bev);
         node->event_bev = NULL;
     }
-
-    if (node->timer_event) {
-        event_del(node->timer_event);
-        event_free(node->timer_event);
-        node->timer_event = NULL;
+    node->recv_hashed = 0;
+    node->recv_skip = 0;
+    node->ping_nonce = 0;
+
+    if (node->nodegroup) {
+        btc_node_recv_release(node);
+        if (__atomic_exchange_n(&node->recv_paused, false, __ATOMIC_SEQ_CST))
+            __atomic_sub_fetch(&node->nodegroup->recv_paused, 1, __ATOMIC_SEQ_CST);
+        btc_timer_cancel(&node->nodegroup->timer_wheel, &node->timer);
     }
 }
 
+static void btc_node_missbehave_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_missbehave((btc_node*)ctx);
+}
+
+static void btc_node_disconnect_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    btc_node_disconnect((btc_node*)ctx);
+}
+
 btc_bool btc_node_missbehave(btc_node* node)
 {
+    if (btc_node_on_foreign_thread(node)) {
+        btc_node_run_on_shard(node, btc_node_missbehave_cb, node);
+        return 0;
+    }
     node->nodegroup->log_write_cb("Mark node %d as missbehaved\n", node->nodeid);
-    node->state |= NODE_MISSBEHAVED;
+    btc_node_set_state(node, NODE_MISSBEHAVED);
     btc_node_connection_state_changed(node);
     return 0;
 }
 
 void btc_node_disconnect(btc_node* node)
 {
-    if ((node->state & NODE_CONNECTED) == NODE_CONNECTED || (node->state & NODE_CONNECTING) == NODE_CONNECTING) {
+    if (btc_node_on_foreign_thread(node)) {
+        btc_node_run_on_shard(node, btc_node_disconnect_cb, node);
+        return;
+    }
+    if ((btc_node_get_state(node) & NODE_CONNECTED) == NODE_CONNECTED || (btc_node_get_state(node) & NODE_CONNECTING) == NODE_CONNECTING) {
         node->nodegroup->log_write_cb("Disconnect node %d\n", node->nodeid);
     }
     /* release buffer and timer event */
     btc_node_release_events(node);
 
-    node->state &= ~NODE_CONNECTING;
-    node->state &= ~NODE_CONNECTED;
-    node->state |= NODE_DISCONNECTED;
+    /* never pass through a state without any connection flag */
+    btc_node_set_state(node, NODE_DISCONNECTED);
+    btc_node_clear_state(node, NODE_CONNECTING | NODE_CONNECTED);
 
     node->time_started_con = 0;
 }
@@ -267,7 +669,6 @@ void btc_node_disconnect(btc_node* node)
 void btc_node_free(btc_node* node)
 {
     btc_node_disconnect(node);
-    cstr_free(node->recvBuffer, true);
     btc_free(node);
 }
 
@@ -287,6 +688,12 @@ btc_node_group* btc_node_group_new(const btc_chainparams* chainparams)
     };
 
     node_group->nodes = vector_new(1, btc_node_free_cb);
+    node_group->addrman = btc_addrman_new();
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&node_group->nodes_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
     node_group->chainparams = (chainparams ? chainparams : &btc_chainparams_main);
     node_group->parse_cmd_cb = NULL;
     strcpy(node_group->clientstr, "libbtc 0.1");
@@ -298,15 +705,58 @@ btc_node_group* btc_node_group_new(const btc_chainparams* chainparams)
     node_group->handshake_done_cb = NULL;
     node_group->log_write_cb = net_write_log_null;
     node_group->desired_amount_connected_nodes = 3;
+    node_group->required_services = BTC_NODE_NETWORK;
+    node_group->last_nodeid = 0;
+    node_group->accept_msg_cb = NULL;
+
+    node_group->recv_budget_node = BTC_P2P_DEFAULT_RECV_BUDGET_NODE;
+    node_group->recv_budget_group = BTC_P2P_DEFAULT_RECV_BUDGET_GROUP;
+    node_group->recv_reserved = 0;
+    node_group->recv_paused = 0;
+    node_group->recv_resume_ev = event_new(node_group->event_base, -1, 0, btc_node_group_recv_resume, node_group);
 
+    btc_timer_wheel_init(&node_group->timer_wheel, BTC_TIMER_WHEEL_TICK_MS, btc_node_time_ms());
+    node_group->timer_wheel_ev = event_new(node_group->event_base, -1, EV_PERSIST, btc_node_group_timer_tick, node_group);
+
+    return node_group;
+}
+
+btc_node_group* btc_node_group_new_threaded(const btc_chainparams* chainparams, unsigned int num_threads)
+{
+    /* event bases created from here on are lockable and can be used across threads */
+    if (evthread_use_pthreads() != 0)
+        return NULL;
+
+    btc_node_group* node_group = btc_node_group_new(chainparams);
+    if (!node_group)
+        return NULL;
+
+    node_group->event_queue_ev = event_new(node_group->event_base, -1, EV_READ, btc_node_group_queue_drain, node_group);
+    if (num_threads == 0)
+        num_threads = 1;
+    node_group->shards = btc_calloc(num_threads, sizeof(*node_group->shards));
+    for (unsigned int i = 0; i < num_threads; i++) {
+        node_group->shards[i].event_base = event_base_new();
+        if (!node_group->shards[i].event_base) {
+            btc_node_group_free(node_group);
+            return NULL;
+        }
+        node_group->num_shards++;
+    }
     return node_group;
 }
 
 void btc_node_group_shutdown(btc_node_group *group) {
+    pthread_mutex_lock(&group->nodes_mutex);
     for (size_t i = 0; i < group->nodes->len; i++) {
         btc_node* node = vector_idx(group->nodes, i);
         btc_node_disconnect(node);
     }
+    pthread_mutex_unlock(&group->nodes_mutex);
+
+    /* the event loop thread has no events of its own that could run out */
+    if (group->num_shards > 0)
+        event_base_loopexit(group->event_base, NULL);
 }
 
 void btc_node_group_free(btc_node_group* group)
@@ -314,39 +764,159 @@ void btc_node_group_free(btc_node_group* group)
     if (!group)
         return;
 
-    if (group->event_base) {
-        event_base_free(group->event_base);
-    }
-
+    /* nodes release their events, free them before the event base */
+    event_free(group->recv_resume_ev);
+    group->recv_resume_ev = NULL;
     if (group->nodes) {
+        /* the workers are stopped, run the jobs still queued on their event bases
+           so they release their payloads (sends are dropped by the disconnected nodes) */
+        for (size_t i = 0; i < group->nodes->len && group->num_shards > 0; i++) {
+            btc_node_disconnect(vector_idx(group->nodes, i));
+        }
+        for (unsigned int i = 0; i < group->num_shards; i++) {
+            event_base_loop(group->shards[i].event_base, EVLOOP_NONBLOCK);
+        }
         vector_free(group->nodes, true);
     }
+
+    if (group->addrman_file) {
+        if (!btc_addrman_write(group->addrman, group->addrman_file->str))
+            group->log_write_cb("Error writing peer addresses to %s\n", group->addrman_file->str);
+        cstr_free(group->addrman_file, true);
+    }
+    btc_addrman_free(group->addrman);
+
+    for (unsigned int i = 0; i < group->num_shards; i++) {
+        event_base_free(group->shards[i].event_base);
+    }
+    btc_free(group->shards);
+
+    struct btc_node_group_event_* ev = group->event_queue;
+    while (ev) {
+        struct btc_node_group_event_* next = ev->next;
+        btc_node_group_event_free(ev);
+        ev = next;
+    }
+    if (group->event_queue_ev) {
+        event_free(group->event_queue_ev);
+    }
+    if (group->dns_base) {
+        evdns_base_free(group->dns_base, 0);
+    }
+    event_free(group->timer_wheel_ev);
+    btc_timer_wheel_deinit(&group->timer_wheel);
+
+    if (group->event_base) {
+        event_base_free(group->event_base);
+    }
+    pthread_mutex_destroy(&group->nodes_mutex);
     btc_free(group);
 }
 
+btc_bool btc_node_group_set_addrman_file(btc_node_group* group, const char* file_path)
+{
+    if (group->addrman_file)
+        cstr_free(group->addrman_file, true);
+    group->addrman_file = cstr_new(file_path);
+    return btc_addrman_load(group->addrman, file_path);
+}
+
 void btc_node_group_event_loop(btc_node_group* group)
 {
-    event_base_dispatch(group->event_base);
+    if (group->num_shards == 0) {
+        event_base_dispatch(group->event_base);
+        return;
+    }
+
+    for (unsigned int i = 0; i < group->num_shards; i++) {
+        btc_node_group_shard* shard = &group->shards[i];
+        __atomic_store_n(&shard->running, true, __ATOMIC_RELEASE);
+        if (pthread_create(&shard->thread, NULL, btc_node_group_shard_thread, shard) != 0)
+            __atomic_store_n(&shard->running, false, __ATOMIC_RELEASE);
+    }
+
+    /* deliver the queued callbacks until the group has been shut down */
+    event_base_loop(group->event_base, EVLOOP_NO_EXIT_ON_EMPTY);
+
+    for (unsigned int i = 0; i < group->num_shards; i++) {
+        btc_node_group_shard* shard = &group->shards[i];
+        if (!shard->running)
+            continue;
+        event_base_loopbreak(shard->event_base);
+        pthread_join(shard->thread, NULL);
+        __atomic_store_n(&shard->running, false, __ATOMIC_RELEASE);
+    }
 }
 
 void btc_node_group_add_node(btc_node_group* group, btc_node* node)
 {
+    pthread_mutex_lock(&group->nodes_mutex);
     vector_add(group->nodes, node);
     node->nodegroup = group;
-    node->nodeid = group->nodes->len;
+    node->nodeid = ++group->last_nodeid;
+    if (group->num_shards > 0)
+        node->shard = &group->shards[(node->nodeid - 1) % group->num_shards];
+    pthread_mutex_unlock(&group->nodes_mutex);
 }
 
 int btc_node_group_amount_of_connected_nodes(btc_node_group* group, enum NODE_STATE state)
 {
     int cnt = 0;
+    pthread_mutex_lock(&group->nodes_mutex);
     for (size_t i = 0; i < group->nodes->len; i++) {
         btc_node* node = vector_idx(group->nodes, i);
-        if ((node->state & state) == state)
+        /* the state is written by the nodes worker thread */
+        if ((btc_node_get_state(node) & state) == state)
             cnt++;
     }
+    pthread_mutex_unlock(&group->nodes_mutex);
     return cnt;
 }
 
+/* start connecting a node, the group nodes mutex must be held */
+static btc_bool btc_node_connect(btc_node* node)
+{
+    /* setup buffer event and periodic timer (on the nodes worker event base in threaded mode),
+       the connection might get processed by the worker as soon as it has been started */
+    struct event_base* base = btc_node_event_base(node);
+    node->event_bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE | (node->shard ? BEV_OPT_THREADSAFE : 0));
+    bufferevent_setcb(node->event_bev, read_cb, write_cb, event_cb, node);
+    bufferevent_setwatermark(node->event_bev, EV_READ, 0, node->nodegroup->recv_budget_node);
+    bufferevent_enable(node->event_bev, EV_READ | EV_WRITE);
+
+    node->time_started_con = time(NULL);
+    btc_node_set_state(node, NODE_CONNECTING);
+    btc_timer_schedule(&node->nodegroup->timer_wheel, &node->timer, BTC_PERIODICAL_NODE_TIMER_S * 1000);
+    btc_node_group_timer_start(node->nodegroup);
+
+    btc_p2p_address p2p_addr;
+    btc_addr_to_p2paddr((struct sockaddr*)&node->addr, &p2p_addr);
+    btc_addrman_attempt(node->nodegroup->addrman, &p2p_addr, (uint32_t)node->time_started_con);
+
+    int addr_len = (node->addr.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    if (bufferevent_socket_connect(node->event_bev, (struct sockaddr*)&node->addr, addr_len) < 0) {
+        /* Error starting connection */
+        btc_node_clear_state(node, NODE_CONNECTING);
+        btc_node_release_events(node);
+        return false;
+    }
+    node->nodegroup->log_write_cb("Trying to connect to %d...\n", node->nodeid);
+    return true;
+}
+
+/* check if the group already has a node for an address, the group nodes mutex must be held */
+static btc_bool btc_node_group_has_addr(btc_node_group* group, const btc_p2p_address* addr)
+{
+    for (size_t i = 0; i < group->nodes->len; i++) {
+        btc_node* node = vector_idx(group->nodes, i);
+        btc_p2p_address node_addr;
+        btc_addr_to_p2paddr((struct sockaddr*)&node->addr, &node_addr);
+        if (node_addr.port == addr->port && memcmp(node_addr.ip, addr->ip, sizeof(node_addr.ip)) == 0)
+            return true;
+    }
+    return false;
+}
+
 btc_bool btc_node_group_connect_next_nodes(btc_node_group* group)
 {
     btc_bool connected_at_least_to_one_node = false;
@@ -355,81 +925,215 @@ btc_bool btc_node_group_connect_next_nodes(btc_node_group* group)
         return true;
 
     connect_amount = connect_amount*3;
+    pthread_mutex_lock(&group->nodes_mutex);
     /* search for a potential node that has not errored and is not connected or in connecting state */
     for (size_t i = 0; i < group->nodes->len; i++) {
         btc_node* node = vector_idx(group->nodes, i);
         if (
-            !((node->state & NODE_CONNECTED) == NODE_CONNECTED) &&
-            !((node->state & NODE_CONNECTING) == NODE_CONNECTING) &&
-            !((node->state & NODE_DISCONNECTED) == NODE_DISCONNECTED) &&
-            !((node->state & NODE_ERRORED) == NODE_ERRORED)) {
-            /* setup buffer event */
-            node->event_bev = bufferevent_socket_new(group->event_base, -1, BEV_OPT_CLOSE_ON_FREE);
-            bufferevent_setcb(node->event_bev, read_cb, write_cb, event_cb, node);
-            bufferevent_enable(node->event_bev, EV_READ | EV_WRITE);
-            if (bufferevent_socket_connect(node->event_bev, (struct sockaddr*)&node->addr, sizeof(node->addr)) < 0) {
-                /* Error starting connection */
-                if (node->event_bev)
-                    bufferevent_free(node->event_bev);
+            !((btc_node_get_state(node) & NODE_CONNECTED) == NODE_CONNECTED) &&
+            !((btc_node_get_state(node) & NODE_CONNECTING) == NODE_CONNECTING) &&
+            !((btc_node_get_state(node) & NODE_DISCONNECTED) == NODE_DISCONNECTED) &&
+            !((btc_node_get_state(node) & NODE_ERRORED) == NODE_ERRORED)) {
+            if (!btc_node_connect(node)) {
+                pthread_mutex_unlock(&group->nodes_mutex);
                 return false;
             }
-
-            /* setup periodic timer */
-            node->time_started_con = time(NULL);
-            struct timeval tv;
-            tv.tv_sec = BTC_PERIODICAL_NODE_TIMER_S;
-            tv.tv_usec = 0;
-            node->timer_event = event_new(group->event_base, 0, EV_TIMEOUT | EV_PERSIST, node_periodical_timer,
-                                          (void*)node);
-            event_add(node->timer_event, &tv);
-            node->state |= NODE_CONNECTING;
             connected_at_least_to_one_node = true;
 
-            node->nodegroup->log_write_cb("Trying to connect to %d...\n", node->nodeid);
-
             connect_amount--;
-            if (connect_amount <= 0)
+            if (connect_amount <= 0) {
+                pthread_mutex_unlock(&group->nodes_mutex);
                 return true;
+            }
         }
     }
+
+    /* fill up with candidates from the address manager */
+    uint32_t now = (uint32_t)time(NULL);
+    for (int tries = 0; connect_amount > 0 && tries < connect_amount * 8; tries++) {
+        btc_p2p_address candidate;
+        if (!btc_addrman_select(group->addrman, now, group->required_services, &candidate))
+            break;
+        if (btc_node_group_has_addr(group, &candidate))
+            continue;
+        /* always a fresh node, requests and queued jobs can still point to dead ones */
+        btc_node* node = btc_node_new();
+        btc_node_group_add_node(group, node);
+        btc_p2paddr_to_addr(&candidate, (struct sockaddr*)&node->addr);
+        if (btc_node_connect(node)) {
+            connected_at_least_to_one_node = true;
+            connect_amount--;
+        }
+    }
+    pthread_mutex_unlock(&group->nodes_mutex);
     /* node group misses a node to connect to */
     return connected_at_least_to_one_node;
 }
 
+static void btc_node_connect_more_nodes(btc_node* node)
+{
+    /* connect to more nodes are required */
+    btc_bool should_connect_to_more_nodes = true;
+    if (node->nodegroup->should_connect_to_more_nodes_cb)
+        should_connect_to_more_nodes = node->nodegroup->should_connect_to_more_nodes_cb(node);
+
+    if (should_connect_to_more_nodes && (btc_node_group_amount_of_connected_nodes(node->nodegroup, NODE_CONNECTED) + btc_node_group_amount_of_connected_nodes(node->nodegroup, NODE_CONNECTING) < node->nodegroup->desired_amount_connected_nodes))
+        btc_node_group_connect_next_nodes(node->nodegroup);
+}
+
 void btc_node_connection_state_changed(btc_node* node)
 {
-    if (node->nodegroup->node_connection_state_changed_cb)
+    if (!node->shard && node->nodegroup->node_connection_state_changed_cb)
         node->nodegroup->node_connection_state_changed_cb(node);
 
-    if ((node->state & NODE_ERRORED) == NODE_ERRORED) {
+    if ((btc_node_get_state(node) & NODE_ERRORED) == NODE_ERRORED) {
         btc_node_release_events(node);
 
-        /* connect to more nodes are required */
-        btc_bool should_connect_to_more_nodes = true;
-        if (node->nodegroup->should_connect_to_more_nodes_cb)
-            should_connect_to_more_nodes = node->nodegroup->should_connect_to_more_nodes_cb(node);
-
-        if (should_connect_to_more_nodes && (btc_node_group_amount_of_connected_nodes(node->nodegroup, NODE_CONNECTED) + btc_node_group_amount_of_connected_nodes(node->nodegroup, NODE_CONNECTING) < node->nodegroup->desired_amount_connected_nodes))
-            btc_node_group_connect_next_nodes(node->nodegroup);
+        /* in threaded mode, connecting more nodes is up to the event loop thread */
+        if (!node->shard)
+            btc_node_connect_more_nodes(node);
     }
-    if ((node->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED) {
-        if ((node->state & NODE_CONNECTED) == NODE_CONNECTED || (node->state & NODE_CONNECTING) == NODE_CONNECTING) {
+    if ((btc_node_get_state(node) & NODE_MISSBEHAVED) == NODE_MISSBEHAVED) {
+        if ((btc_node_get_state(node) & NODE_CONNECTED) == NODE_CONNECTED || (btc_node_get_state(node) & NODE_CONNECTING) == NODE_CONNECTING) {
             btc_node_disconnect(node);
         }
     } else
         btc_node_send_version(node);
+
+    if (node->shard)
+        btc_node_group_queue_push(node, BTC_NODE_EVENT_STATE_CHANGED, NULL, NULL);
+}
+
+static void btc_node_send_job_cb(evutil_socket_t fd, short event, void* ctx)
+{
+    UNUSED(fd);
+    UNUSED(event);
+    struct btc_node_send_job* job = (struct btc_node_send_job*)ctx;
+    if (job->msg) {
+        btc_node_send_msg(job->node, job->msg);
+        btc_node_msg_free(job->msg);
+    } else {
+        btc_node_send(job->node, job->data);
+        cstr_free(job->data, true);
+    }
+    btc_free(job);
 }
 
 void btc_node_send(btc_node* node, cstring* data)
 {
-    if ((node->state & NODE_CONNECTED) != NODE_CONNECTED)
+    if ((btc_node_get_state(node) & NODE_CONNECTED) != NODE_CONNECTED)
         return;
 
+    if (btc_node_on_foreign_thread(node)) {
+        /* the bufferevent belongs to the nodes worker thread */
+        struct btc_node_send_job* job = btc_calloc(1, sizeof(*job));
+        job->node = node;
+        job->data = cstr_new_buf(data->str, data->len);
+        btc_node_run_on_shard(node, btc_node_send_job_cb, job);
+        return;
+    }
+
     bufferevent_write(node->event_bev, data->str, data->len);
     char* dummy = data->str + 4;
     node->nodegroup->log_write_cb("sending message to node %d: %s\n", node->nodeid, dummy);
 }
 
+void btc_node_send_message(btc_node* node, const char* command, const void* data, uint32_t data_len)
+{
+    if ((btc_node_get_state(node) & NODE_CONNECTED) != NODE_CONNECTED)
+        return;
+
+    if (btc_node_on_foreign_thread(node)) {
+        /* the payload has to outlive the call, hand over a (single) copy */
+        btc_node_msg* msg = btc_node_msg_new(node->nodegroup->chainparams->netmagic, command, data, data_len);
+        btc_node_send_msg(node, msg);
+        btc_node_msg_free(msg);
+        return;
+    }
+
+    /* write header and payload into contiguous space reserved at the end of the output buffer */
+    struct evbuffer* output = bufferevent_get_output(node->event_bev);
+    struct evbuffer_iovec vec;
+    if (evbuffer_reserve_space(output, BTC_P2P_HDRSZ + data_len, &vec, 1) < 1)
+        return;
+    btc_p2p_message_header_ser(node->nodegroup->chainparams->netmagic, command, data, data_len, vec.iov_base);
+    if (data_len > 0)
+        memcpy((uint8_t*)vec.iov_base + BTC_P2P_HDRSZ, data, data_len);
+    vec.iov_len = BTC_P2P_HDRSZ + data_len;
+    evbuffer_commit_space(output, &vec, 1);
+    node->nodegroup->log_write_cb("sending message to node %d: %s\n", node->nodeid, command);
+}
+
+btc_node_msg* btc_node_msg_new(const unsigned char netmagic[4], const char* command, const void* data, uint32_t data_len)
+{
+    btc_node_msg* msg = btc_calloc(1, sizeof(*msg));
+    btc_p2p_message_header_ser(netmagic, command, data, data_len, msg->header);
+    if (data_len > 0) {
+        msg->payload = btc_malloc(data_len);
+        memcpy(msg->payload, data, data_len);
+    }
+    msg->payload_len = data_len;
+    msg->refcount = 1;
+    return msg;
+}
+
+void btc_node_msg_free(btc_node_msg* msg)
+{
+    if (!msg)
+        return;
+    /* output buffers release their reference on the nodes worker threads */
+    if (__atomic_sub_fetch(&msg->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    btc_free(msg->payload);
+    btc_free(msg);
+}
+
+static void btc_node_msg_payload_sent(const void* data, size_t datalen, void* extra)
+{
+    UNUSED(data);
+    UNUSED(datalen);
+    btc_node_msg_free((btc_node_msg*)extra);
+}
+
+void btc_node_send_msg(btc_node* node, btc_node_msg* msg)
+{
+    if ((btc_node_get_state(node) & NODE_CONNECTED) != NODE_CONNECTED)
+        return;
+
+    if (btc_node_on_foreign_thread(node)) {
+        struct btc_node_send_job* job = btc_calloc(1, sizeof(*job));
+        job->node = node;
+        job->msg = msg;
+        __atomic_add_fetch(&msg->refcount, 1, __ATOMIC_RELAXED);
+        btc_node_run_on_shard(node, btc_node_send_job_cb, job);
+        return;
+    }
+
+    struct evbuffer* output = bufferevent_get_output(node->event_bev);
+    evbuffer_add(output, msg->header, BTC_P2P_HDRSZ);
+    if (msg->payload_len > 0) {
+        __atomic_add_fetch(&msg->refcount, 1, __ATOMIC_RELAXED);
+        if (evbuffer_add_reference(output, msg->payload, msg->payload_len, btc_node_msg_payload_sent, msg) != 0)
+            btc_node_msg_free(msg);
+    }
+    node->nodegroup->log_write_cb("sending message to node %d: %.12s\n", node->nodeid, (const char*)msg->header + 4);
+}
+
+unsigned int btc_node_group_broadcast(btc_node_group* group, btc_node_msg* msg)
+{
+    unsigned int amount = 0;
+    pthread_mutex_lock(&group->nodes_mutex);
+    for (size_t i = 0; i < group->nodes->len; i++) {
+        btc_node* node = vector_idx(group->nodes, i);
+        if ((btc_node_get_state(node) & NODE_CONNECTED) == NODE_CONNECTED && __atomic_load_n(&node->version_handshake, __ATOMIC_ACQUIRE)) {
+            btc_node_send_msg(node, msg);
+            amount++;
+        }
+    }
+    pthread_mutex_unlock(&group->nodes_mutex);
+    return amount;
+}
+
 void btc_node_send_version(btc_node* node)
 {
     if (!node)
@@ -443,7 +1147,7 @@ void btc_node_send_version(btc_node* node)
     btc_p2p_address_init(&fromAddr);
     btc_p2p_address toAddr;
     btc_p2p_address_init(&toAddr);
-    btc_addr_to_p2paddr(&node->addr, &toAddr);
+    btc_addr_to_p2paddr((struct sockaddr*)&node->addr, &toAddr);
 
     /* create a version message struct */
     btc_p2p_version_msg version_msg;
@@ -453,15 +1157,137 @@ void btc_node_send_version(btc_node* node)
     btc_p2p_msg_version_init(&version_msg, &fromAddr, &toAddr, node->nodegroup->clientstr, true);
     btc_p2p_msg_version_ser(&version_msg, version_msg_cstr);
 
-    /* create p2p message */
-    cstring* p2p_msg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_VERSION, version_msg_cstr->str, version_msg_cstr->len);
-
     /* send message */
-    btc_node_send(node, p2p_msg);
+    btc_node_send_message(node, BTC_MSG_VERSION, version_msg_cstr->str, version_msg_cstr->len);
 
     /* cleanup */
     cstr_free(version_msg_cstr, true);
-    cstr_free(p2p_msg, true);
+}
+
+static int btc_node_process_version(btc_node* node, struct const_buffer* buf)
+{
+    btc_p2p_version_msg v_msg_check;
+    if (!btc_p2p_msg_version_deser(&v_msg_check, buf)) {
+        return btc_node_missbehave(node);
+    }
+    if ((v_msg_check.services & node->nodegroup->required_services) != node->nodegroup->required_services) {
+        node->nodegroup->log_write_cb("Node %d lacks the required services, disconnecting\n", node->nodeid);
+        btc_node_disconnect(node);
+        return true;
+    }
+    /* read by the event loop thread once version_handshake has been published */
+    __atomic_store_n(&node->services, v_msg_check.services, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->bestknownheight, v_msg_check.start_height, __ATOMIC_RELAXED);
+    node->nodegroup->log_write_cb("Connected to node %d: %s (%d)\n", node->nodeid, v_msg_check.useragent, v_msg_check.start_height);
+    /* confirm version via verack */
+    btc_node_send_message(node, BTC_MSG_VERACK, NULL, 0);
+    return true;
+}
+
+static int btc_node_process_verack(btc_node* node, struct const_buffer* buf)
+{
+    (void)(buf);
+    /* complete handshake if verack has been received */
+    __atomic_store_n(&node->version_handshake, true, __ATOMIC_RELEASE);
+
+    /* remember the working peer and learn more addresses if we know only a few */
+    btc_p2p_address p2p_addr;
+    btc_addr_to_p2paddr((struct sockaddr*)&node->addr, &p2p_addr);
+    p2p_addr.services = node->services;
+    btc_addrman_good(node->nodegroup->addrman, &p2p_addr, (uint32_t)time(NULL));
+    if (btc_addrman_size(node->nodegroup->addrman) < BTC_ADDRMAN_GETADDR_BELOW) {
+        btc_node_send_message(node, BTC_MSG_GETADDR, NULL, 0);
+    }
+
+    /* measure the latency right away, the sync logic ranks the peers by it */
+    btc_node_send_ping(node);
+    node->lastping = time(NULL);
+
+    /* execute callback and inform that the node is ready for custom message logic */
+    if (node->shard && node->nodegroup->handshake_done_cb)
+        btc_node_group_queue_push(node, BTC_NODE_EVENT_HANDSHAKE_DONE, NULL, NULL);
+    else if (node->nodegroup->handshake_done_cb)
+        node->nodegroup->handshake_done_cb(node);
+    return true;
+}
+
+static int btc_node_process_ping(btc_node* node, struct const_buffer* buf)
+{
+    /* response pings */
+    uint64_t nonce = 0;
+    if (!deser_u64(&nonce, buf)) {
+        return btc_node_missbehave(node);
+    }
+    btc_node_send_message(node, BTC_MSG_PONG, &nonce, 8);
+    return true;
+}
+
+static int btc_node_process_pong(btc_node* node, struct const_buffer* buf)
+{
+    uint64_t nonce = 0;
+    if (!deser_u64(&nonce, buf)) {
+        return btc_node_missbehave(node);
+    }
+    /* ignore unsolicited or outdated pongs */
+    if (node->ping_nonce == 0 || nonce != node->ping_nonce)
+        return true;
+
+    uint64_t now = btc_node_time_ms();
+    if (now >= node->ping_sent_ms)
+        node->ping_rtt_ms = btc_node_smooth(node->ping_rtt_ms, now - node->ping_sent_ms);
+    node->ping_nonce = 0;
+    return true;
+}
+
+static int btc_node_process_addr(btc_node* node, struct const_buffer* buf)
+{
+    btc_p2p_address* addrs = btc_malloc(MAX_ADDR_SIZE * sizeof(*addrs));
+    size_t count = 0;
+    if (!btc_p2p_deser_msg_addr(addrs, &count, buf)) {
+        btc_free(addrs);
+        return btc_node_missbehave(node);
+    }
+    uint32_t now = (uint32_t)time(NULL);
+    for (size_t i = 0; i < count; i++)
+        btc_addrman_add(node->nodegroup->addrman, &addrs[i], now);
+    btc_free(addrs);
+    return true;
+}
+
+static int btc_node_process_getaddr(btc_node* node, struct const_buffer* buf)
+{
+    (void)(buf);
+    /* only answer once per connection */
+    if (node->sent_addr)
+        return true;
+    node->sent_addr = true;
+
+    btc_p2p_address* addrs = btc_malloc(MAX_ADDR_SIZE * sizeof(*addrs));
+    size_t count = btc_addrman_get_addr(node->nodegroup->addrman, (uint32_t)time(NULL), addrs, MAX_ADDR_SIZE);
+    cstring* payload = cstr_new_sz(3 + count * 30);
+    btc_p2p_msg_addr(addrs, count, payload);
+    btc_node_send_message(node, BTC_MSG_ADDR, payload->str, payload->len);
+    cstr_free(payload, true);
+    btc_free(addrs);
+    return true;
+}
+
+/* internal base message logic, indexed by the message command id */
+static int (*const btc_node_internal_handlers[BTC_CMD_MAX])(btc_node* node, struct const_buffer* buf) = {
+    [BTC_CMD_VERSION] = btc_node_process_version,
+    [BTC_CMD_VERACK] = btc_node_process_verack,
+    [BTC_CMD_PING] = btc_node_process_ping,
+    [BTC_CMD_PONG] = btc_node_process_pong,
+    [BTC_CMD_ADDR] = btc_node_process_addr,
+    [BTC_CMD_GETADDR] = btc_node_process_getaddr,
+};
+
+btc_bool btc_node_group_register_cmd_handler(btc_node_group* group, enum btc_p2p_command command_id, btc_node_cmd_handler handler)
+{
+    if (command_id <= BTC_CMD_UNKNOWN || command_id >= BTC_CMD_MAX)
+        return false;
+    group->cmd_handlers[command_id] = handler;
+    return true;
 }
 
 int btc_node_parse_message(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
@@ -474,57 +1300,47 @@ int btc_node_parse_message(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_bu
     /* send the header and buffer to the possible callback */
     /* callback can decide to run the internal base message logic */
     if (!node->nodegroup->parse_cmd_cb || node->nodegroup->parse_cmd_cb(node, hdr, buf)) {
-        if (strcmp(hdr->command, BTC_MSG_VERSION) == 0) {
-            btc_p2p_version_msg v_msg_check;
-            if (!btc_p2p_msg_version_deser(&v_msg_check, buf)) {
-                return btc_node_missbehave(node);
-            }
-            if ((v_msg_check.services & BTC_NODE_NETWORK) != BTC_NODE_NETWORK) {
-                btc_node_disconnect(node);
-            }
-            node->bestknownheight = v_msg_check.start_height;
-            node->nodegroup->log_write_cb("Connected to node %d: %s (%d)\n", node->nodeid, v_msg_check.useragent, v_msg_check.start_height);
-            /* confirm version via verack */
-            cstring* verack = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_VERACK, NULL, 0);
-            btc_node_send(node, verack);
-            cstr_free(verack, true);
-        } else if (strcmp(hdr->command, BTC_MSG_VERACK) == 0) {
-            /* complete handshake if verack has been received */
-            node->version_handshake = true;
-
-            /* execute callback and inform that the node is ready for custom message logic */
-            if (node->nodegroup->handshake_done_cb)
-                node->nodegroup->handshake_done_cb(node);
-        } else if (strcmp(hdr->command, BTC_MSG_PING) == 0) {
-            /* response pings */
-            uint64_t nonce = 0;
-            if (!deser_u64(&nonce, buf)) {
-                return btc_node_missbehave(node);
-            }
-            cstring* pongmsg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_PONG, &nonce, 8);
-            btc_node_send(node, pongmsg);
-            cstr_free(pongmsg, true);
+        if (hdr->command_id < BTC_CMD_MAX && btc_node_internal_handlers[hdr->command_id]) {
+            if (!btc_node_internal_handlers[hdr->command_id](node, buf))
+                return false;
         }
     }
 
+    btc_bool has_handler = (hdr->command_id < BTC_CMD_MAX && node->nodegroup->cmd_handlers[hdr->command_id]);
+    if (node->shard && (has_handler || node->nodegroup->postcmd_cb)) {
+        /* group callbacks run on the event loop thread */
+        btc_node_group_queue_push(node, BTC_NODE_EVENT_MESSAGE, hdr, buf);
+    } else
+        btc_node_dispatch_cmd(node, hdr, buf);
+
+    return true;
+}
+
+static void btc_node_dispatch_cmd(btc_node* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
+{
+    /* pass data to the registered command handler */
+    if (hdr->command_id < BTC_CMD_MAX && node->nodegroup->cmd_handlers[hdr->command_id]) {
+        struct const_buffer cmd_buf = {buf->p, buf->len};
+        node->nodegroup->cmd_handlers[hdr->command_id](node, hdr, &cmd_buf);
+    }
+
     /* pass data to the "post command" callback */
     if (node->nodegroup->postcmd_cb)
         node->nodegroup->postcmd_cb(node, hdr, buf);
-
-    return true;
 }
 
-/* utility function to get peers (ips/port as char*) from a seed */
+/* utility function to get peers (ips/port as char*) from a seed (blocking), family can be
+   AF_INET, AF_INET6 or AF_UNSPEC for both */
 int btc_get_peers_from_dns(const char* seed, vector* ips_out, int port, int family)
 {
-    if (!seed || !ips_out || (family != AF_INET && family != AF_INET6) || port > 99999) {
+    if (!seed || !ips_out || (family != AF_INET && family != AF_INET6 && family != AF_UNSPEC) || port > 99999) {
         return 0;
     }
     char def_port[6] = {0};
     sprintf(def_port, "%d", port);
     struct evutil_addrinfo hints, *aiTrav = NULL, *aiRes = NULL;
     memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
+    hints.ai_family = family;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
 
@@ -543,7 +1359,10 @@ int btc_get_peers_from_dns(const char* seed, vector* ips_out, int port, int fami
 
         if (aiTrav->ai_family == AF_INET6) {
             assert(aiTrav->ai_addrlen >= sizeof(struct sockaddr_in6));
-            evutil_inet_ntop(aiTrav->ai_family, &((struct sockaddr_in6*)(aiTrav->ai_addr))->sin6_addr, ipaddr, maxlen);
+            /* brackets, the port gets appended */
+            ipaddr[0] = '[';
+            evutil_inet_ntop(aiTrav->ai_family, &((struct sockaddr_in6*)(aiTrav->ai_addr))->sin6_addr, ipaddr + 1, maxlen - 2);
+            memcpy(ipaddr + strlen(ipaddr), "]", 1);
         }
 
         memcpy(ipaddr + strlen(ipaddr), ":", 1);
@@ -557,29 +1376,120 @@ int btc_get_peers_from_dns(const char* seed, vector* ips_out, int port, int fami
     return ips_out->len;
 }
 
+/* add a peer learned from a dns seed to the group (and the address manager) */
+static btc_bool btc_node_group_add_seeded_peer(btc_node_group* group, const struct sockaddr* addr)
+{
+    btc_p2p_address p2p_addr;
+    btc_p2p_address_init(&p2p_addr);
+    btc_addr_to_p2paddr((struct sockaddr*)addr, &p2p_addr);
+    p2p_addr.time = (uint32_t)time(NULL);
+    p2p_addr.services = BTC_NODE_NETWORK;
+
+    pthread_mutex_lock(&group->nodes_mutex);
+    btc_bool known = btc_node_group_has_addr(group, &p2p_addr);
+    if (!known) {
+        /* remember the seeded address */
+        btc_addrman_add(group->addrman, &p2p_addr, p2p_addr.time);
+
+        btc_node* node = btc_node_new();
+        memcpy(&node->addr, addr, (addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)));
+        btc_node_group_add_node(group, node);
+    }
+    pthread_mutex_unlock(&group->nodes_mutex);
+    return !known;
+}
+
+static void btc_node_group_dns_cb(int result, char type, int count, int ttl, void* addresses, void* arg)
+{
+    UNUSED(ttl);
+    btc_node_group* group = (btc_node_group*)arg;
+    group->dns_pending--;
+
+    unsigned int added = 0;
+    if (result == DNS_ERR_NONE) {
+        for (int i = 0; i < count; i++) {
+            struct sockaddr_storage addr;
+            memset(&addr, 0, sizeof(addr));
+            if (type == DNS_IPv4_A) {
+                struct sockaddr_in* addr_in = (struct sockaddr_in*)&addr;
+                addr_in->sin_family = AF_INET;
+                addr_in->sin_port = htons(group->chainparams->default_port);
+                memcpy(&addr_in->sin_addr, (const uint8_t*)addresses + i * 4, 4);
+            } else if (type == DNS_IPv6_AAAA) {
+                struct sockaddr_in6* addr_in6 = (struct sockaddr_in6*)&addr;
+                addr_in6->sin6_family = AF_INET6;
+                addr_in6->sin6_port = htons(group->chainparams->default_port);
+                memcpy(&addr_in6->sin6_addr, (const uint8_t*)addresses + i * 16, 16);
+            } else
+                continue;
+            if (btc_node_group_add_seeded_peer(group, (struct sockaddr*)&addr))
+                added++;
+        }
+    }
+    group->log_write_cb("DNS seed lookup %s (%d pending), %d new peers\n", (result == DNS_ERR_NONE ? "done" : evdns_err_to_string(result)), group->dns_pending, added);
+
+    /* start connecting while the other lookups are still running */
+    if (added > 0 && btc_node_group_amount_of_connected_nodes(group, NODE_CONNECTED) + btc_node_group_amount_of_connected_nodes(group, NODE_CONNECTING) < group->desired_amount_connected_nodes)
+        btc_node_group_connect_next_nodes(group);
+}
+
+static btc_bool btc_node_group_dns_base(btc_node_group* group, btc_bool system_nameservers)
+{
+    if (group->dns_base)
+        return true;
+    int flags = (system_nameservers ? EVDNS_BASE_INITIALIZE_NAMESERVERS : 0);
+#ifdef EVDNS_BASE_DISABLE_WHEN_INACTIVE
+    /* don't keep the event loop alive once all lookups are done */
+    flags |= EVDNS_BASE_DISABLE_WHEN_INACTIVE;
+#endif
+    group->dns_base = evdns_base_new(group->event_base, flags);
+    if (!group->dns_base)
+        return false;
+    evdns_base_set_option(group->dns_base, "timeout:", BTC_DNS_TIMEOUT_S);
+    evdns_base_set_option(group->dns_base, "attempts:", BTC_DNS_ATTEMPTS);
+    return true;
+}
+
+btc_bool btc_node_group_set_dns_nameserver(btc_node_group* group, const char* ipport)
+{
+    if (!btc_node_group_dns_base(group, false))
+        return false;
+    return (evdns_base_nameserver_ip_add(group->dns_base, ipport) == 0);
+}
+
+int btc_node_group_seed_dns(btc_node_group* group)
+{
+    if (!btc_node_group_dns_base(group, true))
+        return 0;
+
+    int started = 0;
+    for (size_t i = 0; i < sizeof(group->chainparams->dnsseeds) / sizeof(group->chainparams->dnsseeds[0]); i++) {
+        const char* domain = group->chainparams->dnsseeds[i].domain;
+        if (strlen(domain) == 0)
+            break;
+        /* count before starting, the callback might fire right away */
+        group->dns_pending += 2;
+        if (evdns_base_resolve_ipv4(group->dns_base, domain, DNS_QUERY_NO_SEARCH, btc_node_group_dns_cb, group))
+            started++;
+        else
+            group->dns_pending--;
+        if (evdns_base_resolve_ipv6(group->dns_base, domain, DNS_QUERY_NO_SEARCH, btc_node_group_dns_cb, group))
+            started++;
+        else
+            group->dns_pending--;
+    }
+    return started;
+}
+
 btc_bool btc_node_group_add_peers_by_ip_or_seed(btc_node_group *group, const char *ips) {
     if (ips == NULL) {
+        /* enough known addresses, btc_node_group_connect_next_nodes picks from the address manager */
+        if (btc_addrman_size(group->addrman) >= BTC_ADDRMAN_SKIP_DNS_MIN)
+            return true;
+
         /* === DNS QUERY === */
-        /* get a couple of peers from a seed */
-        vector* ips_dns = vector_new(10, free);
-        const btc_dns_seed seed = group->chainparams->dnsseeds[0];
-        if (strlen(seed.domain) == 0) {
-            return false;
-        }
-        /* todo: make sure we have enought peers, eventually */
-        /* call another seeder */
-        btc_get_peers_from_dns(seed.domain, ips_dns, group->chainparams->default_port, AF_INET);
-        for (unsigned int i = 0; i < ips_dns->len; i++) {
-            char* ip = (char*)vector_idx(ips_dns, i);
-
-            /* create a node */
-            btc_node* node = btc_node_new();
-            if (btc_node_set_ipport(node, ip) > 0) {
-                /* add the node to the group */
-                btc_node_group_add_node(group, node);
-            }
-        }
-        vector_free(ips_dns, true);
+        /* query all seeds in parallel, the peers get added (and connected) by the event loop */
+        return (btc_node_group_seed_dns(group) > 0);
     } else {
         // add comma seperated ips (nodes)
         char working_str[64];
@@ -26,6 +26,7 @@
 
 #include <btc/block.h>
 #include <btc/blockchain.h>
+#include <btc/blockfilter.h>
 #include <btc/checkpoints.h>
 #include <btc/headersdb.h>
 #include <btc/headersdb_file.h>
@@ -33,6 +34,7 @@
 #include <btc/netspv.h>
 #include <btc/protocol.h>
 #include <btc/serialize.h>
+#include <btc/threadpool.h>
 #include <btc/tx.h>
 #include <btc/utils.h>
 
@@ -57,17 +59,37 @@ static const unsigned int MIN_TIME_DELTA_FOR_STATE_CHECK = 5;
 static const unsigned int BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM = 5;
 static const unsigned int BLOCKS_DELTA_IN_S = 600;
 static const unsigned int COMPLETED_WHEN_NUM_NODES_AT_SAME_HEIGHT = 2;
-
-static btc_bool btc_net_spv_node_timer_callback(btc_node *node, uint64_t *now);
+static const unsigned int BLOCK_MAX_RESPONSE_TIME = 30;
+/* peer scoring: latency/throughput assumed for peers that haven't been measured yet */
+static const uint64_t UNKNOWN_LATENCY_MS = 1000;
+static const uint64_t UNKNOWN_BLOCK_BYTES_PER_S = 1000000;
+static const uint64_t BLOCK_SIZE_ESTIMATE = 1000000;
+/* a request is considered slow once it takes <factor> times the expected time (but at least <min> ms),
+   it gets moved to a faster peer before the stall timeouts above kick in */
+static const uint64_t SLOW_RESPONSE_FACTOR = 4;
+static const uint64_t SLOW_RESPONSE_MIN_MS = 5000;
+static const unsigned int DEFAULT_MAX_BLOCKS_IN_FLIGHT = 64;
+static const unsigned int DEFAULT_MAX_BLOCKS_IN_FLIGHT_PER_NODE = 16;
+static const unsigned int HEADER_POOL_MAX_THREADS = 3; /* per client, the header batches are small */
+
+static void btc_net_spv_statecheck_timer(btc_timer *timer, void *ctx);
+void btc_net_spv_node_request_headers_or_blocks(btc_node *node, btc_bool blocks);
 void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf);
 void btc_net_spv_node_handshake_done(btc_node *node);
+static btc_bool btc_net_spv_accept_msg(btc_node *node, btc_p2p_msg_hdr *hdr);
 
 void btc_net_set_spv(btc_node_group *nodegroup)
 {
-    nodegroup->postcmd_cb = btc_net_spv_post_cmd;
+    btc_node_group_register_cmd_handler(nodegroup, BTC_CMD_INV, btc_net_spv_post_cmd);
+    btc_node_group_register_cmd_handler(nodegroup, BTC_CMD_BLOCK, btc_net_spv_post_cmd);
+    btc_node_group_register_cmd_handler(nodegroup, BTC_CMD_HEADERS, btc_net_spv_post_cmd);
+    btc_node_group_register_cmd_handler(nodegroup, BTC_CMD_CFILTER, btc_net_spv_post_cmd);
+    btc_node_group_register_cmd_handler(nodegroup, BTC_CMD_CFHEADERS, btc_net_spv_post_cmd);
+    btc_node_group_register_cmd_handler(nodegroup, BTC_CMD_CFCHECKPT, btc_net_spv_post_cmd);
     nodegroup->handshake_done_cb = btc_net_spv_node_handshake_done;
+    nodegroup->accept_msg_cb = btc_net_spv_accept_msg;
     nodegroup->node_connection_state_changed_cb = NULL;
-    nodegroup->periodic_timer_cb = btc_net_spv_node_timer_callback;
+    nodegroup->periodic_timer_cb = NULL;
 }
 
 btc_spv_client* btc_spv_client_new(const btc_chainparams *params, btc_bool debug, btc_bool headers_memonly)
@@ -92,18 +114,44 @@ btc_spv_client* btc_spv_client_new(const btc_chainparams *params, btc_bool debug
         client->nodegroup->log_write_cb = net_write_log_printf;
     }
 
+    /* a single state check for all nodes every <n> seconds, turned by the groups timer wheel */
+    btc_timer_init(&client->statecheck_timer, btc_net_spv_statecheck_timer, client);
+    btc_timer_schedule(&client->nodegroup->timer_wheel, &client->statecheck_timer, MIN_TIME_DELTA_FOR_STATE_CHECK * 1000);
+
     if (params == &btc_chainparams_main) {
         client->use_checkpoints = true;
     }
     client->headers_db = &btc_headers_db_interface_file;
     client->headers_db_ctx = client->headers_db->init(params, headers_memonly);
+    /* every client has its own pool, keep it small so that many clients don't oversubscribe the cores */
+    client->header_pool = btc_threadpool_new(btc_threadpool_default_threads(HEADER_POOL_MAX_THREADS));
+
+    client->block_requests = NULL;
+    client->block_requests_first = 0;
+    client->block_requests_len = 0;
+    client->block_requests_alloc = 0;
+    client->max_blocks_in_flight = DEFAULT_MAX_BLOCKS_IN_FLIGHT;
+    client->max_blocks_in_flight_per_node = DEFAULT_MAX_BLOCKS_IN_FLIGHT_PER_NODE;
+
+    client->use_compact_filters = false;
+    client->filter_matcher = btc_blockfilter_matcher_new();
+    client->cfheaders_node = NULL;
+    client->cfcheckpt_node = NULL;
+    client->filter_header_height = 0;
+    client->filter_checkpoints = NULL;
+    client->filter_checkpoints_len = 0;
+    client->filter_checkpoints_height = 0;
+    client->filter_checkpoints_nodeid = -1;
+    client->cfcheckpt_height = 0;
 
     // set callbacks
     client->header_connected = NULL;
     client->called_sync_completed = false;
     client->sync_completed = NULL;
     client->header_message_processed = NULL;
+    client->sync_block = NULL;
     client->sync_transaction = NULL;
+    client->sync_transaction_view = NULL;
 
     return client;
 }
@@ -131,7 +179,25 @@ void btc_spv_client_free(btc_spv_client *client)
         client->headers_db = NULL;
     }
 
+    btc_threadpool_free(client->header_pool);
+    client->header_pool = NULL;
+
+    for (size_t i = 0; i < client->block_requests_len; i++) {
+        btc_spv_block_request *request = &client->block_requests[client->block_requests_first + i];
+        btc_block_free(request->block);
+        if (request->block_data)
+            cstr_free(request->block_data, true);
+    }
+    btc_free(client->block_requests);
+    client->block_requests = NULL;
+
+    btc_blockfilter_matcher_free(client->filter_matcher);
+    client->filter_matcher = NULL;
+    btc_free(client->filter_checkpoints);
+    client->filter_checkpoints = NULL;
+
     if (client->nodegroup) {
+        btc_timer_cancel(&client->nodegroup->timer_wheel, &client->statecheck_timer);
         btc_node_group_free(client->nodegroup);
         client->nodegroup = NULL;
     }
@@ -151,74 +217,600 @@ btc_bool btc_spv_client_load(btc_spv_client *client, const char *file_path)
 
 }
 
-void btc_net_spv_periodic_statecheck(btc_node *node, uint64_t *now)
+static btc_node* btc_net_spv_headersync_node(btc_spv_client *client)
 {
-    /* statecheck logic */
-    /* ================ */
+    for(size_t i =0;i< client->nodegroup->nodes->len; i++)
+    {
+        btc_node *check_node = vector_idx(client->nodegroup->nodes, i);
+        if ((btc_node_get_state(check_node) & NODE_HEADERSYNC) == NODE_HEADERSYNC && (btc_node_get_state(check_node) & NODE_CONNECTED) == NODE_CONNECTED)
+            return check_node;
+    }
+    return NULL;
+}
 
-    btc_spv_client *client = (btc_spv_client*)node->nodegroup->ctx;
+uint64_t btc_net_spv_node_headers_score(const btc_node *node)
+{
+    if (node->headers_response_ms)
+        return node->headers_response_ms;
+    return (node->ping_rtt_ms ? node->ping_rtt_ms : UNKNOWN_LATENCY_MS);
+}
 
-    client->nodegroup->log_write_cb("Statecheck: amount of connected nodes: %d\n", btc_node_group_amount_of_connected_nodes(client->nodegroup, NODE_CONNECTED));
+uint64_t btc_net_spv_node_block_score(const btc_node *node)
+{
+    uint64_t latency = (node->ping_rtt_ms ? node->ping_rtt_ms : UNKNOWN_LATENCY_MS);
+    uint64_t bytes_per_s = (node->block_bytes_per_s ? node->block_bytes_per_s : UNKNOWN_BLOCK_BYTES_PER_S);
+    return latency + BLOCK_SIZE_ESTIMATE * 1000 / bytes_per_s;
+}
 
-    /* check if the node chosen for NODE_HEADERSYNC during SPV_HEADER_SYNC has stalled */
-    if (client->last_headersrequest_time > 0 && *now > client->last_headersrequest_time)
+static btc_bool btc_net_spv_is_slow(uint64_t elapsed_ms, uint64_t expected_ms)
+{
+    return elapsed_ms > SLOW_RESPONSE_MIN_MS && elapsed_ms > expected_ms * SLOW_RESPONSE_FACTOR;
+}
+
+static btc_bool btc_net_spv_is_block_of_interest(btc_spv_client *client, const btc_block_header *header)
+{
+    /* start scanning a few blocks before the oldest item of interest */
+    return (uint64_t)header->timestamp + BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S > client->oldest_item_of_interest;
+}
+
+static void btc_net_spv_queue_block(btc_spv_client *client, const btc_blockindex *pindex)
+{
+    if (client->block_requests_first + client->block_requests_len == client->block_requests_alloc)
     {
-        int64_t timedetla = *now - client->last_headersrequest_time;
-        if (timedetla > HEADERS_MAX_RESPONSE_TIME)
+        if (client->block_requests_first >= client->block_requests_alloc / 2 && client->block_requests_first > 0) {
+            /* reuse the space of already delivered blocks */
+            memmove(client->block_requests, client->block_requests + client->block_requests_first, client->block_requests_len * sizeof(btc_spv_block_request));
+            client->block_requests_first = 0;
+        }
+        else {
+            client->block_requests_alloc = (client->block_requests_alloc > 0 ? client->block_requests_alloc * 2 : 256);
+            client->block_requests = btc_realloc(client->block_requests, client->block_requests_alloc * sizeof(btc_spv_block_request));
+        }
+    }
+
+    btc_spv_block_request *request = &client->block_requests[client->block_requests_first + client->block_requests_len];
+    memset(request, 0, sizeof(*request));
+    memcpy(request->hash, pindex->hash, BTC_HASH_LENGTH);
+    request->height = pindex->height;
+    /* in compact filter mode, the block is only downloaded if its filter matches */
+    request->state = (client->use_compact_filters ? BTC_SPV_REQUEST_FILTER_HEADER : BTC_SPV_REQUEST_BLOCK);
+    client->block_requests_len++;
+
+    client->stateflags |= SPV_FULLBLOCK_SYNC_FLAG;
+}
+
+static size_t btc_net_spv_block_window(btc_spv_client *client)
+{
+    return BTC_MIN(client->block_requests_len, client->max_blocks_in_flight);
+}
+
+static btc_spv_block_request* btc_net_spv_find_block_request(btc_spv_client *client, const uint256 hash)
+{
+    /* blocks are only requested within the download window */
+    for (size_t i = 0; i < btc_net_spv_block_window(client); i++)
+    {
+        btc_spv_block_request *request = &client->block_requests[client->block_requests_first + i];
+        if (memcmp(request->hash, hash, BTC_HASH_LENGTH) == 0)
+            return request;
+    }
+    return NULL;
+}
+
+/* blocks are only accepted from nodes they have been requested from, unsolicited ones get discarded
+   before their payload is buffered
+   runs on the shard workers, it only reads the count the main thread publishes for the node */
+static btc_bool btc_net_spv_accept_msg(btc_node *node, btc_p2p_msg_hdr *hdr)
+{
+    if (hdr->command_id != BTC_CMD_BLOCK)
+        return true;
+    return __atomic_load_n(&node->blocks_expected, __ATOMIC_ACQUIRE) > 0;
+}
+
+/* publish the amount of undelivered block requests of each node for btc_net_spv_accept_msg
+   needs to run after the requests changed and before getdata messages are sent */
+static void btc_net_spv_publish_expected_blocks(btc_spv_client *client)
+{
+    vector *nodes = client->nodegroup->nodes;
+    size_t window = btc_net_spv_block_window(client);
+    for (size_t j = 0; j < nodes->len; j++)
+    {
+        btc_node *check_node = vector_idx(nodes, j);
+        uint32_t expected = 0;
+        for (size_t i = 0; i < window; i++)
         {
-            client->nodegroup->log_write_cb("No header response in time (used %d) for node %d\n", timedetla, node->nodeid);
-            /* disconnect the node if we haven't got a header after requesting some with a getheaders message */
-            node->state &= ~NODE_HEADERSYNC;
-            btc_node_disconnect(node);
-            client->last_headersrequest_time = 0;
-            btc_net_spv_request_headers(client);
+            const btc_spv_block_request *request = &client->block_requests[client->block_requests_first + i];
+            if (!request->block && (request->node == check_node || request->stalled_node == check_node))
+                expected++;
+        }
+        __atomic_store_n(&check_node->blocks_expected, expected, __ATOMIC_RELEASE);
+    }
+}
+
+static btc_spv_block_request* btc_net_spv_find_request_by_height(btc_spv_client *client, uint32_t height)
+{
+    if (client->block_requests_len == 0)
+        return NULL;
+
+    /* queued heights are consecutive unless the chain has been reorganized */
+    btc_spv_block_request *first = &client->block_requests[client->block_requests_first];
+    if (height >= first->height && height - first->height < client->block_requests_len && first[height - first->height].height == height)
+        return &first[height - first->height];
+    for (size_t i = 0; i < client->block_requests_len; i++)
+    {
+        if (first[i].height == height)
+            return &first[i];
+    }
+    return NULL;
+}
+
+/* the chain switched from oldtip to the branch of newtip: drop the requests of blocks no longer
+   on the main chain and queue the blocks of interest of the new branch above the fork point */
+static void btc_net_spv_switch_branch(btc_spv_client *client, btc_blockindex *oldtip, btc_blockindex *newtip)
+{
+    /* lowest header of the new branch, its prev is the fork point (as far as the headers are in memory) */
+    btc_blockindex *branch = newtip;
+    while (branch->prev && btc_blockindex_get_ancestor(oldtip, branch->prev->height) != branch->prev)
+        branch = branch->prev;
+    uint32_t fork_height = branch->height - 1;
+    client->nodegroup->log_write_cb("Chain switched to a branch forking at height %d\n", fork_height);
+
+    btc_spv_block_request *requests = &client->block_requests[client->block_requests_first];
+    size_t kept = 0;
+    for (size_t i = 0; i < client->block_requests_len; i++)
+    {
+        btc_spv_block_request *request = &requests[i];
+        if (request->height > fork_height) {
+            btc_blockindex *on_chain = btc_blockindex_get_ancestor(newtip, request->height);
+            if (!on_chain || memcmp(on_chain->hash, request->hash, BTC_HASH_LENGTH) != 0) {
+                btc_block_free(request->block);
+                if (request->block_data)
+                    cstr_free(request->block_data, true);
+                continue;
+            }
+        }
+        if (kept != i)
+            requests[kept] = *request;
+        kept++;
+    }
+    client->block_requests_len = kept;
+    if (client->block_requests_len == 0)
+        client->block_requests_first = 0;
+
+    /* queue in height order */
+    size_t amount = newtip->height - fork_height;
+    btc_blockindex **blocks = btc_malloc(amount * sizeof(btc_blockindex *));
+    btc_blockindex *walk = newtip;
+    for (size_t i = amount; i > 0; i--, walk = walk->prev)
+        blocks[i - 1] = walk;
+    for (size_t i = 0; i < amount; i++)
+    {
+        btc_spv_block_request *queued = btc_net_spv_find_request_by_height(client, blocks[i]->height);
+        if (queued && memcmp(queued->hash, blocks[i]->hash, BTC_HASH_LENGTH) == 0)
+            continue;
+        if (btc_net_spv_is_block_of_interest(client, &blocks[i]->header))
+            btc_net_spv_queue_block(client, blocks[i]);
+    }
+    btc_free(blocks);
+}
+
+static void btc_net_spv_send(btc_node *node, const char *command, const cstring *payload)
+{
+    btc_node_send_message(node, command, payload->str, payload->len);
+}
+
+static btc_bool btc_net_spv_node_usable(const btc_node *node, btc_bool filters)
+{
+    if ((btc_node_get_state(node) & NODE_CONNECTED) != NODE_CONNECTED || !__atomic_load_n(&node->version_handshake, __ATOMIC_ACQUIRE))
+        return false;
+    return (!filters || (__atomic_load_n(&node->services, __ATOMIC_RELAXED) & BTC_NODE_COMPACT_FILTERS) == BTC_NODE_COMPACT_FILTERS);
+}
+
+/* first usable filter serving node, other than the node with the id exclude_nodeid (-1 = none) */
+static btc_node* btc_net_spv_filter_node(btc_spv_client *client, int exclude_nodeid)
+{
+    for (size_t i = 0; i < client->nodegroup->nodes->len; i++)
+    {
+        btc_node *check_node = vector_idx(client->nodegroup->nodes, i);
+        if (btc_net_spv_node_usable(check_node, true) && check_node->nodeid != exclude_nodeid)
+            return check_node;
+    }
+    return NULL;
+}
+
+static void btc_net_spv_request_filter_headers(btc_spv_client *client)
+{
+    if (client->cfheaders_node && (btc_node_get_state(client->cfheaders_node) & NODE_CONNECTED) != NODE_CONNECTED)
+        client->cfheaders_node = NULL;
+    if (client->cfcheckpt_node && (btc_node_get_state(client->cfcheckpt_node) & NODE_CONNECTED) != NODE_CONNECTED)
+        client->cfcheckpt_node = NULL;
+
+    if (!client->use_compact_filters || client->cfheaders_node || client->cfcheckpt_node)
+        return;
+
+    /* fetch the filter header checkpoints first, they are used to verify the filter headers chain */
+    /* (until a valid cfcheckpt arrives, the checkpoints are requested again after a stall or an invalid response) */
+    btc_blockindex *chaintip = client->headers_db->getchaintip(client->headers_db_ctx);
+    if (chaintip->height / BTC_CFCHECKPT_INTERVAL > client->filter_checkpoints_height / BTC_CFCHECKPT_INTERVAL)
+    {
+        btc_node *node = btc_net_spv_filter_node(client, -1);
+        if (!node)
+            return;
+        cstring *payload = cstr_new_sz(1 + BTC_HASH_LENGTH);
+        btc_p2p_msg_getcfcheckpt(BTC_BLOCKFILTER_TYPE_BASIC, chaintip->hash, payload);
+        btc_net_spv_send(node, BTC_MSG_GETCFCHECKPT, payload);
+        cstr_free(payload, true);
+        client->cfcheckpt_node = node;
+        client->cfcheckpt_height = chaintip->height;
+        memcpy(client->cfcheckpt_stop_hash, chaintip->hash, BTC_HASH_LENGTH);
+        client->filter_request_time = time(NULL);
+        return;
+    }
+
+    /* the filter headers are taken from a different node than the checkpoints,
+       a single node can't forge both the chain and the checkpoints it gets verified against */
+    btc_node *node = btc_net_spv_filter_node(client, (client->filter_checkpoints_len > 0 ? client->filter_checkpoints_nodeid : -1));
+    if (!node)
+        return;
+
+    /* blocks waiting for their filter hash are always at the end of the queue */
+    btc_spv_block_request *first = &client->block_requests[client->block_requests_first];
+    size_t lower = 0, upper = client->block_requests_len;
+    while (lower < upper)
+    {
+        size_t mid = lower + (upper - lower) / 2;
+        if (first[mid].state == BTC_SPV_REQUEST_FILTER_HEADER)
+            upper = mid;
+        else
+            lower = mid + 1;
+    }
+    if (lower == client->block_requests_len)
+        return;
+
+    /* a getcfheaders request covers consecutive heights */
+    size_t count = 1;
+    while (lower + count < client->block_requests_len && count < MAX_GETCFHEADERS_SIZE && first[lower + count].height == first[lower].height + count)
+        count++;
+
+    client->cfheaders_node = node;
+    client->cfheaders_start_height = first[lower].height;
+    client->cfheaders_count = count;
+    memcpy(client->cfheaders_stop_hash, first[lower + count - 1].hash, BTC_HASH_LENGTH);
+    client->filter_request_time = time(NULL);
+
+    client->nodegroup->log_write_cb("Requesting %d filter headers from node %d\n", count, node->nodeid);
+    cstring *payload = cstr_new_sz(5 + BTC_HASH_LENGTH);
+    btc_p2p_msg_getcfilters(BTC_BLOCKFILTER_TYPE_BASIC, client->cfheaders_start_height, client->cfheaders_stop_hash, payload);
+    btc_net_spv_send(node, BTC_MSG_GETCFHEADERS, payload);
+    cstr_free(payload, true);
+}
+
+static ssize_t btc_net_spv_select_node(btc_spv_client *client, const unsigned int *in_flight, const btc_spv_block_request *request, btc_bool filters)
+{
+    vector *nodes = client->nodegroup->nodes;
+
+    /* use the node expected to deliver first (its queue and speed), avoid the node that stalled the request before if possible */
+    ssize_t best = -1;
+    uint64_t best_cost = 0;
+    for (int pass = 0; pass < 2 && best < 0; pass++)
+    {
+        for (size_t j = 0; j < nodes->len; j++)
+        {
+            btc_node *check_node = vector_idx(nodes, j);
+            if (!btc_net_spv_node_usable(check_node, filters))
+                continue;
+            if (pass == 0 && check_node == request->stalled_node)
+                continue;
+            if (in_flight[j] >= client->max_blocks_in_flight_per_node)
+                continue;
+            uint64_t cost = (in_flight[j] + 1) * btc_net_spv_node_block_score(check_node);
+            if (best < 0 || cost < best_cost) {
+                best = j;
+                best_cost = cost;
+            }
         }
     }
-    if (node->time_last_request > 0 && *now > node->time_last_request)
+    return best;
+}
+
+void btc_net_spv_request_blocks(btc_spv_client *client)
+{
+    btc_net_spv_request_filter_headers(client);
+
+    vector *nodes = client->nodegroup->nodes;
+    size_t window = btc_net_spv_block_window(client);
+    unsigned int *in_flight = btc_calloc(nodes->len + 1, sizeof(unsigned int));
+    unsigned int *requested = btc_calloc(nodes->len + 1, sizeof(unsigned int));
+    cstring **getdata = btc_calloc(nodes->len + 1, sizeof(cstring *));
+    uint64_t now = time(NULL);
+    uint64_t now_ms = btc_node_time_ms();
+
+    for (size_t i = 0; i < window; i++)
     {
-        // we are downloading blocks from this peer
-        int64_t timedetla = *now - node->time_last_request;
+        btc_spv_block_request *request = &client->block_requests[client->block_requests_first + i];
+        /* requests of lost nodes need to be reassigned */
+        if (request->node && (btc_node_get_state(request->node) & NODE_CONNECTED) != NODE_CONNECTED)
+            request->node = NULL;
+        if (request->node && !request->block) {
+            ssize_t idx = vector_find(nodes, request->node);
+            if (idx >= 0)
+                in_flight[idx]++;
+        }
+    }
 
-        client->nodegroup->log_write_cb("No block response in time (used %d) for node %d\n", timedetla, node->nodeid);
-        if (timedetla > HEADERS_MAX_RESPONSE_TIME)
+    for (size_t i = 0; i < window; i++)
+    {
+        btc_spv_block_request *request = &client->block_requests[client->block_requests_first + i];
+        if (request->node || request->block)
+            continue;
+        if (request->state == BTC_SPV_REQUEST_FILTER_HEADER || request->state == BTC_SPV_REQUEST_SKIP)
+            continue;
+
+        btc_bool filter = (request->state == BTC_SPV_REQUEST_FILTER);
+        ssize_t best = btc_net_spv_select_node(client, in_flight, request, filter);
+        if (best < 0) {
+            /* all (filter serving) nodes are busy */
+            continue;
+        }
+
+        if (filter)
         {
-            /* disconnect the node if a blockdownload has stalled */
-            btc_node_disconnect(node);
-            node->time_last_request = 0;
-            btc_net_spv_request_headers(client);
+            /* request the filters of consecutive blocks with a single getcfilters message */
+            size_t run = 1;
+            while (i + run < window && run < MAX_GETCFILTERS_SIZE && in_flight[best] + run < client->max_blocks_in_flight_per_node)
+            {
+                btc_spv_block_request *next = &request[run];
+                if (next->node || next->state != BTC_SPV_REQUEST_FILTER || next->height != request->height + run)
+                    break;
+                run++;
+            }
+            for (size_t k = 0; k < run; k++)
+            {
+                request[k].node = vector_idx(nodes, best);
+                request[k].time_requested = now;
+                request[k].time_requested_ms = now_ms;
+            }
+            in_flight[best] += run;
+
+            client->nodegroup->log_write_cb("Requesting %d filters from node %d\n", run, request->node->nodeid);
+            cstring *payload = cstr_new_sz(5 + BTC_HASH_LENGTH);
+            btc_p2p_msg_getcfilters(BTC_BLOCKFILTER_TYPE_BASIC, request->height, request[run - 1].hash, payload);
+            btc_net_spv_send(request->node, BTC_MSG_GETCFILTERS, payload);
+            cstr_free(payload, true);
+            i += run - 1;
+            continue;
         }
+
+        if (!getdata[best])
+            getdata[best] = cstr_new_sz(client->max_blocks_in_flight_per_node * (4 + BTC_HASH_LENGTH));
+        btc_p2p_inv_msg inv;
+        btc_p2p_msg_inv_init(&inv, BTC_INV_TYPE_BLOCK, request->hash);
+        btc_p2p_msg_inv_ser(&inv, getdata[best]);
+
+        request->node = vector_idx(nodes, best);
+        request->time_requested = now;
+        request->time_requested_ms = now_ms;
+        in_flight[best]++;
+        requested[best]++;
     }
 
-    /* check if we need to sync headers from a different peer */
-    if ((client->stateflags & SPV_HEADER_SYNC_FLAG) == SPV_HEADER_SYNC_FLAG)
+    btc_net_spv_publish_expected_blocks(client);
+    for (size_t j = 0; j < nodes->len; j++)
     {
-        btc_net_spv_request_headers(client);
+        btc_node *check_node = vector_idx(nodes, j);
+        if (getdata[j])
+        {
+            cstring *payload = cstr_new_sz(getdata[j]->len + 5);
+            ser_varlen(payload, requested[j]);
+            cstr_append_buf(payload, getdata[j]->str, getdata[j]->len);
+
+            client->nodegroup->log_write_cb("Requesting %d blocks from node %d\n", requested[j], check_node->nodeid);
+            btc_net_spv_send(check_node, BTC_MSG_GETDATA, payload);
+            cstr_free(payload, true);
+            cstr_free(getdata[j], true);
+        }
+        if (in_flight[j] > 0)
+            btc_node_set_state(check_node, NODE_BLOCKSYNC);
+        else
+            btc_node_clear_state(check_node, NODE_BLOCKSYNC);
     }
-    else
+
+    btc_free(getdata);
+    btc_free(requested);
+    btc_free(in_flight);
+}
+
+/* find the best usable node (other than slow_node) expected to respond well within elapsed_ms */
+static btc_node* btc_net_spv_faster_node(btc_spv_client *client, const btc_node *slow_node, uint64_t elapsed_ms, btc_bool filters, uint64_t (*score)(const btc_node *node))
+{
+    btc_node *best = NULL;
+    for (size_t i = 0; i < client->nodegroup->nodes->len; i++)
+    {
+        btc_node *check_node = vector_idx(client->nodegroup->nodes, i);
+        if (check_node == slow_node || !btc_net_spv_node_usable(check_node, filters))
+            continue;
+        if (score(check_node) * SLOW_RESPONSE_FACTOR >= elapsed_ms)
+            continue;
+        if (!best || score(check_node) < score(best))
+            best = check_node;
+    }
+    return best;
+}
+
+static void btc_net_spv_check_block_stalls(btc_spv_client *client, uint64_t now)
+{
+    btc_node *filter_request_node = (client->cfheaders_node ? client->cfheaders_node : client->cfcheckpt_node);
+    if (filter_request_node && now > client->filter_request_time + BLOCK_MAX_RESPONSE_TIME)
+    {
+        /* all filter downloads depend on the filter headers chain */
+        client->nodegroup->log_write_cb("No filter header response in time from node %d\n", filter_request_node->nodeid);
+        btc_node_disconnect(filter_request_node);
+        client->cfheaders_node = NULL;
+        client->cfcheckpt_node = NULL;
+    }
+
+    for (size_t i = 0; i < btc_net_spv_block_window(client); i++)
     {
-        /* headers sync should be done at this point */
+        btc_spv_block_request *request = &client->block_requests[client->block_requests_first + i];
+        if (!request->node || request->block)
+            continue;
 
+        if (i == 0 && !request->stalled_node && now <= request->time_requested + BLOCK_MAX_RESPONSE_TIME)
+        {
+            /* don't wait for the stall timeout if the lowest block is slow and a faster peer is available */
+            btc_node *slow_node = request->node;
+            uint64_t now_ms = btc_node_time_ms();
+            uint64_t elapsed_ms = (now_ms > request->time_requested_ms ? now_ms - request->time_requested_ms : 0);
+            btc_bool filter = (request->state == BTC_SPV_REQUEST_FILTER);
+            if (btc_net_spv_is_slow(elapsed_ms, btc_net_spv_node_block_score(slow_node)) &&
+                btc_net_spv_faster_node(client, slow_node, elapsed_ms, filter, btc_net_spv_node_block_score))
+            {
+                client->nodegroup->log_write_cb("Block at height %d is slow (%d ms) on node %d, moving it to a faster peer\n", request->height, (int)elapsed_ms, slow_node->nodeid);
+                slow_node->block_bytes_per_s = btc_node_smooth(slow_node->block_bytes_per_s, BLOCK_SIZE_ESTIMATE * 1000 / elapsed_ms);
+                request->stalled_node = slow_node;
+                request->node = NULL;
+            }
+            continue;
+        }
+        if (now <= request->time_requested + BLOCK_MAX_RESPONSE_TIME)
+            continue;
+
+        btc_node *stalled_node = request->node;
+        client->nodegroup->log_write_cb("No block response in time for height %d from node %d\n", request->height, stalled_node->nodeid);
+        request->stalled_node = stalled_node;
+        request->node = NULL;
+
+        /* the lowest undelivered block holds back the whole download */
+        if (i == 0)
+            btc_node_disconnect(stalled_node);
     }
+}
 
-    client->last_statecheck_time = *now;
+static void btc_net_spv_scan_block(btc_spv_client *client, btc_spv_block_request *request)
+{
+    btc_block *block = request->block;
+    btc_blockindex blockindex;
+    memset(&blockindex, 0, sizeof(blockindex));
+    blockindex.height = request->height;
+    memcpy(blockindex.hash, request->hash, BTC_HASH_LENGTH);
+    btc_block_header_copy(&blockindex.header, &block->header);
+
+    if (client->header_connected) { client->header_connected(client); }
+    time_t lasttime = blockindex.header.timestamp;
+    client->nodegroup->log_write_cb("Scanning block with %d transactions at height %d (%s)", (int)block->tx_count, blockindex.height, ctime(&lasttime));
+
+    /* send info to possible callbacks */
+    if (client->sync_block) { client->sync_block(client->sync_transaction_ctx, block, &blockindex); }
+
+    /* the view reuses its index for all transactions of the block */
+    btc_tx_view view;
+    btc_tx_view_init(&view);
+    struct const_buffer buf = request->block_payload;
+    uint32_t amount_of_txs;
+    if (request->block_data) {
+        buf.p = request->block_data->str;
+        buf.len = request->block_data->len;
+    }
+    btc_bool has_views = (client->sync_transaction_view && buf.p && deser_skip(&buf, 80) && deser_varlen(&amount_of_txs, &buf));
+    for (unsigned int i=0;i<block->tx_count;i++)
+    {
+        /* the block has been fully parsed before, the views can't fail */
+        if (has_views && btc_tx_view_parse(&view, &buf)) {
+            client->sync_transaction_view(client->sync_transaction_ctx, &view, i, &blockindex);
+        }
+        if (client->sync_transaction && block->txs) { client->sync_transaction(client->sync_transaction_ctx, block->txs[i], i, &blockindex); }
+    }
+    btc_tx_view_free(&view);
+}
+
+static void btc_net_spv_deliver_blocks(btc_spv_client *client)
+{
+    /* hand out the received blocks in height order, skip blocks with a non matching filter */
+    while (client->block_requests_len > 0)
+    {
+        btc_spv_block_request *request = &client->block_requests[client->block_requests_first];
+        if (request->block) {
+            btc_net_spv_scan_block(client, request);
+            btc_block_free(request->block);
+            request->block = NULL;
+            if (request->block_data) {
+                cstr_free(request->block_data, true);
+                request->block_data = NULL;
+            }
+        }
+        else if (request->state != BTC_SPV_REQUEST_SKIP)
+            break;
+        client->block_requests_first++;
+        client->block_requests_len--;
+    }
+    if (client->block_requests_len == 0)
+        client->block_requests_first = 0;
 }
 
-static btc_bool btc_net_spv_node_timer_callback(btc_node *node, uint64_t *now)
+static void btc_net_spv_statecheck(btc_spv_client *client, uint64_t *now)
 {
-    btc_spv_client *client = (btc_spv_client*)node->nodegroup->ctx;
+    /* statecheck logic */
+    /* ================ */
 
-    if (client->last_statecheck_time + MIN_TIME_DELTA_FOR_STATE_CHECK < *now)
+    client->nodegroup->log_write_cb("Statecheck: amount of connected nodes: %d\n", btc_node_group_amount_of_connected_nodes(client->nodegroup, NODE_CONNECTED));
+
+    /* check if the node chosen for NODE_HEADERSYNC during SPV_HEADER_SYNC has stalled */
+    if (client->last_headersrequest_time > 0 && *now > client->last_headersrequest_time)
     {
-        /* do a state check only every <n> seconds */
-        btc_net_spv_periodic_statecheck(node, now);
+        int64_t timedetla = *now - client->last_headersrequest_time;
+        btc_node *headersync_node = btc_net_spv_headersync_node(client);
+        if (timedetla > HEADERS_MAX_RESPONSE_TIME && headersync_node)
+        {
+            client->nodegroup->log_write_cb("No header response in time (used %d) for node %d\n", timedetla, headersync_node->nodeid);
+            /* disconnect the node if we haven't got a header after requesting some with a getheaders message */
+            btc_node_clear_state(headersync_node, NODE_HEADERSYNC);
+            btc_node_disconnect(headersync_node);
+            client->last_headersrequest_time = 0;
+        }
+        else if (headersync_node)
+        {
+            /* switch to a faster peer before the stall timeout if the response is overdue */
+            uint64_t now_ms = btc_node_time_ms();
+            uint64_t elapsed_ms = (now_ms > client->last_headersrequest_ms ? now_ms - client->last_headersrequest_ms : 0);
+            btc_node *faster_node = NULL;
+            if (btc_net_spv_is_slow(elapsed_ms, btc_net_spv_node_headers_score(headersync_node)))
+                faster_node = btc_net_spv_faster_node(client, headersync_node, elapsed_ms, false, btc_net_spv_node_headers_score);
+            if (faster_node && __atomic_load_n(&faster_node->bestknownheight, __ATOMIC_RELAXED) > client->headers_db->getchaintip(client->headers_db_ctx)->height)
+            {
+                client->nodegroup->log_write_cb("Header response is slow (%d ms) on node %d, switching to node %d\n", (int)elapsed_ms, headersync_node->nodeid, faster_node->nodeid);
+                headersync_node->headers_response_ms = btc_node_smooth(headersync_node->headers_response_ms, elapsed_ms);
+                btc_node_clear_state(headersync_node, NODE_HEADERSYNC);
+                btc_net_spv_node_request_headers_or_blocks(faster_node, false);
+            }
+        }
     }
 
-    /* return true = run internal timer logic (ping, disconnect-timeout, etc.) */
-    return true;
+    /* reassign block requests that haven't been answered in time */
+    btc_net_spv_check_block_stalls(client, *now);
+
+    /* check if we need to sync headers from a different peer and fill up the block download window */
+    btc_net_spv_request_headers(client);
+    btc_net_spv_publish_expected_blocks(client);
+
+    client->last_statecheck_time = *now;
+}
+
+void btc_net_spv_periodic_statecheck(btc_node *node, uint64_t *now)
+{
+    btc_net_spv_statecheck((btc_spv_client*)node->nodegroup->ctx, now);
 }
 
-void btc_net_spv_fill_block_locator(btc_spv_client *client, vector *blocklocators)
+static void btc_net_spv_statecheck_timer(btc_timer *timer, void *ctx)
 {
+    btc_spv_client *client = (btc_spv_client*)ctx;
+    btc_timer_schedule(&client->nodegroup->timer_wheel, timer, MIN_TIME_DELTA_FOR_STATE_CHECK * 1000);
+
+    uint64_t now = time(NULL);
+    btc_net_spv_statecheck(client, &now);
+}
+
+size_t btc_net_spv_fill_block_locator(btc_spv_client *client, uint256 *locator, size_t max)
+{
+    size_t count = 0;
     if (client->headers_db->getchaintip(client->headers_db_ctx)->height == 0)
     {
         if (client->use_checkpoints && client->oldest_item_of_interest > BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S) {
@@ -226,53 +818,43 @@ void btc_net_spv_fill_block_locator(btc_spv_client *client, vector *blocklocator
             /* check oldest item of interest and set genesis/checkpoint */
 
             int64_t min_timestamp = client->oldest_item_of_interest - BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S; /* ensure we going back ~144 blocks */
-            for (int i = (sizeof(btc_mainnet_checkpoint_array) / sizeof(btc_mainnet_checkpoint_array[0]))-1; i >= 0 ; i--)
+            for (int i = (sizeof(btc_mainnet_checkpoint_array) / sizeof(btc_mainnet_checkpoint_array[0]))-1; i >= 0 && count < max; i--)
             {
-                const btc_checkpoint *cp = &btc_mainnet_checkpoint_array[i];
                 if ( btc_mainnet_checkpoint_array[i].timestamp < min_timestamp)
                 {
-                    uint256 *hash = btc_calloc(1, sizeof(uint256));
-                    utils_uint256_sethex((char *)btc_mainnet_checkpoint_array[i].hash, (uint8_t *)hash);
-                    vector_add(blocklocators, (void *)hash);
+                    utils_uint256_sethex((char *)btc_mainnet_checkpoint_array[i].hash, locator[count]);
 
                     if (!client->headers_db->has_checkpoint_start(client->headers_db_ctx)) {
-                        client->headers_db->set_checkpoint_start(client->headers_db_ctx, *hash, btc_mainnet_checkpoint_array[i].height);
+                        client->headers_db->set_checkpoint_start(client->headers_db_ctx, locator[count], btc_mainnet_checkpoint_array[i].height);
                     }
+                    count++;
                 }
             }
-            if (blocklocators->len > 0) {
+            if (count > 0) {
                 // return if we could fill up the blocklocator with checkpoints
-                return;
+                return count;
             }
         }
-        uint256 *hash = btc_calloc(1, sizeof(uint256));
-        memcpy(hash, &client->chainparams->genesisblockhash, sizeof(uint256));
-        vector_add(blocklocators, (void *)hash);
+        memcpy(locator[count++], client->chainparams->genesisblockhash, sizeof(uint256));
         client->nodegroup->log_write_cb("Setting blocklocator with genesis block\n");
+        return count;
     }
-    else
-    {
-        client->headers_db->fill_blocklocator_tip(client->headers_db_ctx, blocklocators);
-    }
+    return client->headers_db->fill_blocklocator_tip(client->headers_db_ctx, locator, max);
 }
 
 void btc_net_spv_node_request_headers_or_blocks(btc_node *node, btc_bool blocks)
 {
     // request next headers
-    vector *blocklocators = vector_new(1, free);
+    uint256 locator[BTC_BLOCK_LOCATOR_MAX];
+    size_t locator_len = btc_net_spv_fill_block_locator((btc_spv_client *)node->nodegroup->ctx, locator, BTC_BLOCK_LOCATOR_MAX);
 
-    btc_net_spv_fill_block_locator((btc_spv_client *)node->nodegroup->ctx, blocklocators);
-
-    cstring *getheader_msg = cstr_new_sz(256);
-    btc_p2p_msg_getheaders(blocklocators, NULL, getheader_msg);
-
-    /* create p2p message */
-    cstring *p2p_msg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, (blocks ? "getblocks" : "getheaders"), getheader_msg->str, getheader_msg->len);
-    cstr_free(getheader_msg, true);
+    cstring *getheader_msg = cstr_new_sz(64 + locator_len * BTC_HASH_LENGTH);
+    btc_p2p_msg_getheaders_locator(locator, locator_len, NULL, getheader_msg);
 
     /* send message */
-    btc_node_send(node, p2p_msg);
-    node->state |= ( blocks ? NODE_BLOCKSYNC : NODE_HEADERSYNC);
+    btc_net_spv_send(node, (blocks ? "getblocks" : "getheaders"), getheader_msg);
+    cstr_free(getheader_msg, true);
+    btc_node_set_state(node, blocks ? NODE_BLOCKSYNC : NODE_HEADERSYNC);
 
     /* remember last headers request time */
     if (blocks) {
@@ -280,71 +862,42 @@ void btc_net_spv_node_request_headers_or_blocks(btc_node *node, btc_bool blocks)
     }
     else {
         ((btc_spv_client*)node->nodegroup->ctx)->last_headersrequest_time = time(NULL);
+        ((btc_spv_client*)node->nodegroup->ctx)->last_headersrequest_ms = btc_node_time_ms();
     }
-
-    /* cleanup */
-    vector_free(blocklocators, true);
-    cstr_free(p2p_msg, true);
 }
 
 btc_bool btc_net_spv_request_headers(btc_spv_client *client)
 {
     /* make sure only one node is used for header sync */
+    btc_bool headers_requested = (btc_net_spv_headersync_node(client) != NULL);
+
+    /* request headers from the fastest peer (where the version handshake has been done) that is ahead of us */
+    unsigned int nodes_at_same_height = 0;
+    btc_node *best_node = NULL;
     for(size_t i =0;i< client->nodegroup->nodes->len; i++)
     {
         btc_node *check_node = vector_idx(client->nodegroup->nodes, i);
-        if (  ( (check_node->state & NODE_HEADERSYNC) == NODE_HEADERSYNC
-                 ||
-                (check_node->state & NODE_BLOCKSYNC) == NODE_BLOCKSYNC
-               )
-            &&
-            (check_node->state & NODE_CONNECTED) == NODE_CONNECTED)
-            return true;
-    }
-
-    /* We are not downloading headers at this point */
-    /* try to request headers from a peer where the version handshake has been done */
-    btc_bool new_headers_available = false;
-    unsigned int nodes_at_same_height = 0;
-    if (client->headers_db->getchaintip(client->headers_db_ctx)->header.timestamp > client->oldest_item_of_interest - (BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S) )
-    {
-        // no need to fetch headers;
-    }
-    else {
-        for(size_t i =0;i< client->nodegroup->nodes->len; i++)
+        if ( ((btc_node_get_state(check_node) & NODE_CONNECTED) == NODE_CONNECTED) && __atomic_load_n(&check_node->version_handshake, __ATOMIC_ACQUIRE))
         {
-            btc_node *check_node = vector_idx(client->nodegroup->nodes, i);
-            if ( ((check_node->state & NODE_CONNECTED) == NODE_CONNECTED) && check_node->version_handshake)
-            {
-                if (check_node->bestknownheight > client->headers_db->getchaintip(client->headers_db_ctx)->height) {
-                    btc_net_spv_node_request_headers_or_blocks(check_node, false);
-                    new_headers_available = true;
-                    return true;
-                } else if (check_node->bestknownheight == client->headers_db->getchaintip(client->headers_db_ctx)->height) {
-                    nodes_at_same_height++;
-                }
+            if (__atomic_load_n(&check_node->bestknownheight, __ATOMIC_RELAXED) > client->headers_db->getchaintip(client->headers_db_ctx)->height) {
+                if (!best_node || btc_net_spv_node_headers_score(check_node) < btc_net_spv_node_headers_score(best_node))
+                    best_node = check_node;
+            } else if (__atomic_load_n(&check_node->bestknownheight, __ATOMIC_RELAXED) == client->headers_db->getchaintip(client->headers_db_ctx)->height) {
+                nodes_at_same_height++;
             }
         }
     }
-
-    if (!new_headers_available && btc_node_group_amount_of_connected_nodes(client->nodegroup, NODE_CONNECTED) > 0) {
-        // try to fetch blocks if no new headers are available but connected nodes are reachable
-        for(size_t i =0;i< client->nodegroup->nodes->len; i++)
-        {
-            btc_node *check_node = vector_idx(client->nodegroup->nodes, i);
-            if ( ((check_node->state & NODE_CONNECTED) == NODE_CONNECTED) && check_node->version_handshake)
-            {
-                if (check_node->bestknownheight > client->headers_db->getchaintip(client->headers_db_ctx)->height) {
-                    btc_net_spv_node_request_headers_or_blocks(check_node, true);
-                    return true;
-                } else if (check_node->bestknownheight == client->headers_db->getchaintip(client->headers_db_ctx)->height) {
-                    nodes_at_same_height++;
-                }
-            }
-        }
+    if (!headers_requested && best_node) {
+        btc_net_spv_node_request_headers_or_blocks(best_node, false);
+        headers_requested = true;
     }
 
-    if ( nodes_at_same_height >= COMPLETED_WHEN_NUM_NODES_AT_SAME_HEIGHT &&
+    /* download the blocks of interest from all nodes in parallel to the headers sync */
+    btc_net_spv_request_blocks(client);
+
+    if ( !headers_requested &&
+         client->block_requests_len == 0 &&
+         nodes_at_same_height >= COMPLETED_WHEN_NUM_NODES_AT_SAME_HEIGHT &&
          !client->called_sync_completed &&
          client->sync_completed )
     {
@@ -352,173 +905,303 @@ btc_bool btc_net_spv_request_headers(btc_spv_client *client)
         client->called_sync_completed = true;
     }
 
-    /* we could not request more headers, need more peers to connect to */
-    return false;
+    /* return false if we could not request more headers, need more peers to connect to */
+    return headers_requested;
 }
 void btc_net_spv_node_handshake_done(btc_node *node)
 {
     btc_net_spv_request_headers((btc_spv_client*)node->nodegroup->ctx);
 }
 
-void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+static btc_bool btc_net_spv_check_filter_checkpoint(btc_spv_client *client, uint32_t height, const uint256 filter_header)
+{
+    if (height == 0 || height % BTC_CFCHECKPT_INTERVAL != 0 || height / BTC_CFCHECKPT_INTERVAL > client->filter_checkpoints_len)
+        return true;
+    return (memcmp(client->filter_checkpoints[height / BTC_CFCHECKPT_INTERVAL - 1], filter_header, BTC_HASH_LENGTH) == 0);
+}
+
+static void btc_net_spv_process_cfcheckpt(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    uint8_t filter_type;
+    uint256 stop_hash;
+    uint32_t count;
+    struct const_buffer headers;
+    if (node != client->cfcheckpt_node)
+        return;
+    client->cfcheckpt_node = NULL;
+
+    /* one checkpoint for every full interval up to the requested block */
+    if (!btc_p2p_deser_msg_cfcheckpt(&filter_type, stop_hash, &count, &headers, buf) ||
+        filter_type != BTC_BLOCKFILTER_TYPE_BASIC ||
+        memcmp(stop_hash, client->cfcheckpt_stop_hash, BTC_HASH_LENGTH) != 0 ||
+        count != client->cfcheckpt_height / BTC_CFCHECKPT_INTERVAL) {
+        client->nodegroup->log_write_cb("Got invalid filter checkpoints from node %d\n", node->nodeid);
+        btc_node_missbehave(node);
+        return;
+    }
+    client->filter_checkpoints = btc_realloc(client->filter_checkpoints, (count > 0 ? count : 1) * sizeof(uint256));
+    memcpy(client->filter_checkpoints, headers.p, headers.len);
+    client->filter_checkpoints_len = count;
+    client->filter_checkpoints_height = client->cfcheckpt_height;
+    client->filter_checkpoints_nodeid = node->nodeid;
+}
+
+static void btc_net_spv_process_cfheaders(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    uint8_t filter_type;
+    uint256 stop_hash;
+    uint256 filter_header;
+    uint32_t count;
+    struct const_buffer hashes;
+    if (node != client->cfheaders_node) {
+        client->nodegroup->log_write_cb("Got unrequested filter headers from node %d\n", node->nodeid);
+        return;
+    }
+    client->cfheaders_node = NULL;
+
+    btc_bool valid = btc_p2p_deser_msg_cfheaders(&filter_type, stop_hash, filter_header, &count, &hashes, buf) &&
+                     filter_type == BTC_BLOCKFILTER_TYPE_BASIC &&
+                     count == client->cfheaders_count &&
+                     memcmp(stop_hash, client->cfheaders_stop_hash, BTC_HASH_LENGTH) == 0;
+
+    uint32_t start_height = client->cfheaders_start_height;
+    btc_spv_block_request *first = btc_net_spv_find_request_by_height(client, start_height);
+    if (!first || first->state != BTC_SPV_REQUEST_FILTER_HEADER)
+        return;
+    if (valid && (size_t)(first - &client->block_requests[client->block_requests_first]) + count > client->block_requests_len)
+        valid = false;
+
+    /* the new part of the chain has to continue the verified one and match the checkpoints */
+    if (valid && client->filter_header_height > 0 && client->filter_header_height + 1 == start_height)
+        valid = (memcmp(filter_header, client->filter_header, BTC_HASH_LENGTH) == 0);
+    if (valid)
+        valid = btc_net_spv_check_filter_checkpoint(client, start_height - 1, filter_header);
+    for (uint32_t i = 0; valid && i < count; i++)
+    {
+        btc_blockfilter_header((const uint8_t *)hashes.p + i * BTC_HASH_LENGTH, filter_header, filter_header);
+        valid = (first[i].height == start_height + i && btc_net_spv_check_filter_checkpoint(client, start_height + i, filter_header));
+    }
+    if (!valid)
+    {
+        client->nodegroup->log_write_cb("Got invalid filter headers from node %d\n", node->nodeid);
+        btc_node_missbehave(node);
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        memcpy(first[i].filter_hash, (const uint8_t *)hashes.p + i * BTC_HASH_LENGTH, BTC_HASH_LENGTH);
+        first[i].state = BTC_SPV_REQUEST_FILTER;
+    }
+    memcpy(client->filter_header, filter_header, BTC_HASH_LENGTH);
+    client->filter_header_height = start_height + count - 1;
+}
+
+static void btc_net_spv_process_cfilter(btc_spv_client *client, btc_node *node, struct const_buffer *buf)
+{
+    uint8_t filter_type;
+    uint256 block_hash;
+    struct const_buffer filter;
+    if (!btc_p2p_deser_msg_cfilter(&filter_type, block_hash, &filter, buf))
+        return;
+
+    btc_spv_block_request *request = btc_net_spv_find_block_request(client, block_hash);
+    if (!request || request->node != node || request->state != BTC_SPV_REQUEST_FILTER) {
+        client->nodegroup->log_write_cb("Got unrequested filter from node %d\n", node->nodeid);
+        return;
+    }
+    request->node = NULL;
+
+    /* the filter must be the one committed by the filter headers chain */
+    uint256 filter_hash;
+    btc_blockfilter_hash(filter.p, filter.len, filter_hash);
+    if (filter_type != BTC_BLOCKFILTER_TYPE_BASIC || memcmp(filter_hash, request->filter_hash, BTC_HASH_LENGTH) != 0)
+    {
+        client->nodegroup->log_write_cb("Got invalid filter for height %d from node %d\n", request->height, node->nodeid);
+        request->stalled_node = node;
+        btc_node_missbehave(node);
+        return;
+    }
+
+    if (client->filter_matcher && btc_blockfilter_match_any(client->filter_matcher, block_hash, filter.p, filter.len))
+        request->state = BTC_SPV_REQUEST_BLOCK;
+    else
+        request->state = BTC_SPV_REQUEST_SKIP;
+}
+
+static void btc_net_spv_process_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
 {
     btc_spv_client *client = (btc_spv_client *)node->nodegroup->ctx;
 
-    if (strcmp(hdr->command, BTC_MSG_INV) == 0 && (node->state & NODE_BLOCKSYNC) == NODE_BLOCKSYNC)
+    if (hdr->command_id == BTC_CMD_INV)
     {
-        struct const_buffer original_inv = { buf->p, buf->len };
         uint32_t varlen;
-        deser_varlen(&varlen, buf);
+        if (!deser_varlen(&varlen, buf)) return;
         btc_bool contains_block = false;
 
         client->nodegroup->log_write_cb("Get inv request with %d items\n", varlen);
 
         for (unsigned int i=0;i<varlen;i++)
         {
-            uint32_t type;
-            deser_u32(&type, buf);
-            if (type == BTC_INV_TYPE_BLOCK)
+            btc_p2p_inv_msg inv;
+            if (!btc_p2p_msg_inv_deser(&inv, buf)) return;
+            if (inv.type == BTC_INV_TYPE_BLOCK)
                 contains_block = true;
-
-            /* skip the hash, we are going to directly use the inv-buffer for the getdata */
-            /* this means we don't support invs contanining blocks and txns as a getblock answer */
-            if (type == BTC_INV_TYPE_BLOCK) {
-                deser_u256(node->last_requested_inv, buf);
-            }
-            else {
-                deser_skip(buf, 32);
-            }
         }
 
-        if (contains_block)
+        /* blocks are downloaded along the headers chain, fetch the headers of announced blocks first */
+        if (contains_block && !btc_net_spv_headersync_node(client))
         {
-            node->time_last_request = time(NULL);
-
-            /* request the blocks */
-            client->nodegroup->log_write_cb("Requesting %d blocks\n", varlen);
-            cstring *p2p_msg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_GETDATA, original_inv.p, original_inv.len);
-            btc_node_send(node, p2p_msg);
-            cstr_free(p2p_msg, true);
-
-            if (varlen >= 500) {
-                /* directly request more blocks */
-                /* not sure if this is clever if we want to download, as example, the complete chain */
-                btc_net_spv_node_request_headers_or_blocks(node, true);
-            }
+            btc_net_spv_node_request_headers_or_blocks(node, false);
         }
     }
-    if (strcmp(hdr->command, BTC_MSG_BLOCK) == 0)
+    if (hdr->command_id == BTC_CMD_BLOCK)
     {
-        btc_bool connected;
-        btc_blockindex *pindex = client->headers_db->connect_hdr(client->headers_db_ctx, buf, false, &connected);
-        /* deserialize the p2p header */
-        if (!pindex) {
+        struct const_buffer block = { buf->p, buf->len };
+        btc_block_header header;
+        if (!btc_block_header_deserialize(&header, buf)) {
             /* deserialization failed */
             return;
         }
 
-        uint32_t amount_of_txs;
-        if (!deser_varlen(&amount_of_txs, buf)) {
-            /* deserialization transaction varint failed */
+        uint256 hash;
+        btc_block_header_hash(&header, hash);
+        btc_spv_block_request *request = btc_net_spv_find_block_request(client, hash);
+        if (!request || request->block || request->state != BTC_SPV_REQUEST_BLOCK) {
+            client->nodegroup->log_write_cb("Got unrequested block from node %d\n", node->nodeid);
             return;
         }
 
-        // flag off the block request stall check
-        node->time_last_request = time(NULL);
-
-        // for now, turn of stall checks if we are near the tip
-        if (pindex->header.timestamp > node->time_last_request - 30*60) {
-            node->time_last_request = 0;
+        if (request->node == node)
+        {
+            /* track the download throughput, pipelined blocks are measured from the previous block on */
+            uint64_t now_ms = btc_node_time_ms();
+            uint64_t start_ms = BTC_MAX(request->time_requested_ms, node->last_block_ms);
+            uint64_t elapsed_ms = (now_ms > start_ms ? now_ms - start_ms : 1);
+            node->block_bytes_per_s = btc_node_smooth(node->block_bytes_per_s, (uint64_t)block.len * 1000 / elapsed_ms);
+            node->last_block_ms = now_ms;
         }
 
-        /* for now, only scan if the block could be connected on top */
-        if (connected) {
-            if (client->header_connected) { client->header_connected(client); }
-            time_t lasttime = pindex->header.timestamp;
-            printf("Downloaded new block with size %d at height %d (%s)\n", hdr->data_len, pindex->height, ctime(&lasttime));
-            uint64_t start = time(NULL);
-            printf("Start parsing %d transactions...", amount_of_txs);
-
-            size_t consumedlength = 0;
-            for (unsigned int i=0;i<amount_of_txs;i++)
-            {
-                btc_tx* tx = btc_tx_new();
-                btc_tx_deserialize(buf->p, buf->len, tx, &consumedlength);
-                deser_skip(buf, consumedlength);
-
-                /* send info to possible callback */
-                if (client->sync_transaction) { client->sync_transaction(client->sync_transaction_ctx, tx, i, pindex); }
-
-                btc_tx_free(tx);
-            }
-            printf("done (took %llu secs)\n", time(NULL) - start);
-        }
-        else {
-            fprintf(stderr, "Could not connect block on top of the chain\n");
+        /* decode the block and check its transactions against the merkle root, hashing on the header workers
+           the transactions are only decoded for callbacks that take btc_tx, views are parsed from the message */
+        btc_block *decoded = btc_block_new();
+        struct const_buffer block_buf = { block.p, block.len };
+        btc_bool decode_txs = (client->sync_transaction || client->sync_block);
+        if (!(decode_txs ? btc_block_deserialize(decoded, &block_buf, client->header_pool) : btc_block_deserialize_txids(decoded, &block_buf, client->header_pool)) ||
+            !btc_block_check_merkle_root(decoded, client->header_pool)) {
+            client->nodegroup->log_write_cb("Got block with invalid transactions or merkle root from node %d\n", node->nodeid);
+            btc_block_free(decoded);
+            /* request it from another node */
+            if (request->node == node)
+                request->node = NULL;
+            request->stalled_node = node;
+            btc_node_missbehave(node);
+            return;
         }
 
-        if (btc_hash_equal(node->last_requested_inv, pindex->hash)) {
-            // last requested block reached, consider stop syncing
-            if (!client->called_sync_completed && client->sync_completed) { client->sync_completed(client); client->called_sync_completed = true; }
-        }
+        /* keep the block until all blocks below have been delivered */
+        request->block = decoded;
+        request->node = NULL;
+        request->block_payload = block;
+        btc_net_spv_deliver_blocks(client);
+        /* the message is gone after this call, a block waiting for lower ones needs its own copy for the views */
+        if (request->block && client->sync_transaction_view)
+            request->block_data = cstr_new_buf(block.p, block.len);
+        request->block_payload.p = NULL;
+        request->block_payload.len = 0;
+
+        /* keep the download window filled */
+        btc_net_spv_request_headers(client);
     }
-    if (strcmp(hdr->command, BTC_MSG_HEADERS) == 0)
+    if (hdr->command_id == BTC_CMD_CFCHECKPT)
+    {
+        btc_net_spv_process_cfcheckpt(client, node, buf);
+        btc_net_spv_request_headers(client);
+    }
+    if (hdr->command_id == BTC_CMD_CFHEADERS)
+    {
+        btc_net_spv_process_cfheaders(client, node, buf);
+        btc_net_spv_request_headers(client);
+    }
+    if (hdr->command_id == BTC_CMD_CFILTER)
+    {
+        btc_net_spv_process_cfilter(client, node, buf);
+        btc_net_spv_deliver_blocks(client);
+        btc_net_spv_request_headers(client);
+    }
+    if (hdr->command_id == BTC_CMD_HEADERS)
     {
         uint32_t amount_of_headers;
         if (!deser_varlen(&amount_of_headers, buf)) return;
         uint64_t now = time(NULL);
+        btc_bool headersync = ((btc_node_get_state(node) & NODE_HEADERSYNC) == NODE_HEADERSYNC);
         client->nodegroup->log_write_cb("Got %d headers (took %d s) from node %d\n", amount_of_headers, now - client->last_headersrequest_time, node->nodeid);
 
-        // flag off the request stall check
-        client->last_headersrequest_time = 0;
+        if (headersync && client->last_headersrequest_time > 0)
+        {
+            /* track the time to the headers response */
+            uint64_t now_ms = btc_node_time_ms();
+            if (now_ms >= client->last_headersrequest_ms)
+                node->headers_response_ms = btc_node_smooth(node->headers_response_ms, now_ms - client->last_headersrequest_ms);
+
+            // flag off the request stall check
+            client->last_headersrequest_time = 0;
+        }
+
+        if (amount_of_headers > MAX_HEADERS_RESULTS) {
+            client->nodegroup->log_write_cb("Got too many headers from node %d\n", node->nodeid);
+            btc_node_missbehave(node);
+            return;
+        }
+
+        /* hash and check all headers on the worker pool, connecting them is then only linking */
+        btc_blockindex **prepared = btc_calloc(amount_of_headers + 1, sizeof(btc_blockindex *));
+        size_t amount_prepared = btc_blockindex_prepare_headers(client->header_pool, buf, amount_of_headers, prepared);
+        btc_bool invalid = (amount_prepared < amount_of_headers);
 
         unsigned int connected_headers = 0;
-        for (unsigned int i=0;i<amount_of_headers;i++)
+        for (unsigned int i=0;i<amount_prepared;i++)
         {
+            btc_blockindex *oldtip = client->headers_db->getchaintip(client->headers_db_ctx);
             btc_bool connected;
-            btc_blockindex *pindex = client->headers_db->connect_hdr(client->headers_db_ctx, buf, false, &connected);
-            /* deserialize the p2p header */
-            if (!pindex)
-            {
-                client->nodegroup->log_write_cb("Header deserialization failed (node %d)\n", node->nodeid);
-                return;
-            }
-
-            /* skip tx count */
-            if (!deser_skip(buf, 1)) {
-                client->nodegroup->log_write_cb("Header deserialization (tx count skip) failed (node %d)\n", node->nodeid);
-                return;
-            }
-
+            uintptr_t passed = (uintptr_t)prepared[i];
+            btc_blockindex *pindex = client->headers_db->connect_blockindex(client->headers_db_ctx, prepared[i], false, &connected);
             if (!connected)
             {
-                /* error, header sequence missmatch
-                   mark node as missbehaving */
-                client->nodegroup->log_write_cb("Got invalid headers (not in sequence) from node %d\n", node->nodeid);
-                node->state &= ~NODE_HEADERSYNC;
-                btc_node_missbehave(node);
-
-                /* see if we can fetch headers from a different peer */
-                btc_net_spv_request_headers(client);
+                /* error, header sequence missmatch */
+                invalid = true;
+                break;
             }
-            else {
-                connected_headers++;
-                if (pindex->header.timestamp > client->oldest_item_of_interest - (BLOCK_GAP_TO_DEDUCT_TO_START_SCAN_FROM * BLOCKS_DELTA_IN_S) ) {
-
-                    /* we should start loading block from this point */
-                    client->stateflags &= ~SPV_HEADER_SYNC_FLAG;
-                    client->stateflags |= SPV_FULLBLOCK_SYNC_FLAG;
-                    node->state &= ~NODE_HEADERSYNC;
-                    node->state |= NODE_BLOCKSYNC;
+            /* a known header was freed by the db, its block was queued when it got connected */
+            btc_bool known = ((uintptr_t)pindex != passed);
+            prepared[i] = NULL;
+            if (known)
+                continue;
+            connected_headers++;
+
+            /* queue the blocks of interest on the main chain for download */
+            if (pindex != client->headers_db->getchaintip(client->headers_db_ctx))
+                continue;
+            if (pindex->prev != oldtip)
+                btc_net_spv_switch_branch(client, oldtip, pindex);
+            else if (btc_net_spv_is_block_of_interest(client, &pindex->header))
+                btc_net_spv_queue_block(client, pindex);
+        }
+        for (unsigned int i=0;i<amount_prepared;i++)
+            btc_free(prepared[i]);
+        btc_free(prepared);
 
-                    client->nodegroup->log_write_cb("start loading block from node %d at height %d at time: %ld\n", node->nodeid, client->headers_db->getchaintip(client->headers_db_ctx)->height, client->headers_db->getchaintip(client->headers_db_ctx)->header.timestamp);
-                    btc_net_spv_node_request_headers_or_blocks(node, true);
+        if (invalid)
+        {
+            /* error, malformed headers, invalid proof of work or header sequence missmatch
+               mark node as missbehaving */
+            client->nodegroup->log_write_cb("Got invalid headers (not in sequence or invalid PoW) from node %d\n", node->nodeid);
+            btc_node_clear_state(node, NODE_HEADERSYNC);
+            btc_node_missbehave(node);
 
-                    /* ignore the rest of the headers */
-                    /* we are going to request blocks now */
-                    break;
-                }
-            }
+            /* see if we can fetch headers from a different peer */
+            btc_net_spv_request_headers(client);
+            return;
         }
         btc_blockindex *chaintip = client->headers_db->getchaintip(client->headers_db_ctx);
 
@@ -529,7 +1212,7 @@ void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buf
         if (client->header_message_processed && client->header_message_processed(client, node, chaintip) == false)
             return;
 
-        if (amount_of_headers == MAX_HEADERS_RESULTS && ((node->state & NODE_BLOCKSYNC) != NODE_BLOCKSYNC))
+        if (amount_of_headers == MAX_HEADERS_RESULTS && headersync)
         {
             /* peer sent maximal amount of headers, very likely, there will be more */
             time_t lasttime = chaintip->header.timestamp;
@@ -539,7 +1222,26 @@ void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buf
         else
         {
             /* headers download seems to be completed */
-            /* we should have switched to block request if the oldest_item_of_interest was set correctly */
+            btc_node_clear_state(node, NODE_HEADERSYNC);
         }
+
+        /* start downloading the queued blocks */
+        btc_net_spv_request_headers(client);
+    }
+}
+
+void btc_net_spv_post_cmd(btc_node *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    btc_spv_client *client = (btc_spv_client *)node->nodegroup->ctx;
+
+    /* callers outside the node group may pass a header without a resolved id */
+    hdr->command_id = btc_p2p_command_id(hdr->command);
+
+    /* persist all headers connected by this message with a single commit */
+    client->headers_db->begin_batch(client->headers_db_ctx);
+    btc_net_spv_process_cmd(node, hdr, buf);
+    if (!client->headers_db->commit_batch(client->headers_db_ctx)) {
+        client->nodegroup->log_write_cb("Error writing headers database\n");
     }
+    btc_net_spv_publish_expected_blocks(client);
 }
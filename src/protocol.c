@@ -32,6 +32,7 @@
 #include <btc/utils.h>
 
 #include <assert.h>
+#include <string.h>
 #include <time.h>
 
 enum {
@@ -51,28 +52,32 @@ void btc_p2p_address_init(btc_p2p_address* addr)
     memset(addr, 0, sizeof(*addr));
 }
 
-cstring* btc_p2p_message_new(const unsigned char netmagic[4], const char* command, const void* data, uint32_t data_len)
+void btc_p2p_message_header_ser(const unsigned char netmagic[4], const char* command, const void* data, uint32_t data_len, uint8_t out[24])
 {
-    cstring* s = cstr_new_sz(BTC_P2P_HDRSZ + data_len);
-
     /* network identifier (magic number) */
-    cstr_append_buf(s, netmagic, 4);
+    memcpy(out, netmagic, 4);
 
-    /* command string */
-    char command_null[12];
-    memset(command_null, 0, 12);
-    memcpy(command_null, command, strlen(command));
-    //memset(command_null+strlen(command), 0, 12-strlen(command));
-    cstr_append_buf(s, command_null, 12);
+    /* command string, null padded */
+    memset(out + 4, 0, 12);
+    memcpy(out + 4, command, strlen(command));
 
     /* data length, always 4 bytes */
     uint32_t data_len_le = htole32(data_len);
-    cstr_append_buf(s, &data_len_le, 4);
+    memcpy(out + 16, &data_len_le, 4);
 
     /* data checksum (first 4 bytes of the double sha256 hash of the pl) */
     uint256 msghash;
     btc_hash(data, data_len, msghash);
-    cstr_append_buf(s, &msghash[0], 4);
+    memcpy(out + 20, &msghash[0], 4);
+}
+
+cstring* btc_p2p_message_new(const unsigned char netmagic[4], const char* command, const void* data, uint32_t data_len)
+{
+    cstring* s = cstr_new_sz(BTC_P2P_HDRSZ + data_len);
+
+    uint8_t header[BTC_P2P_HDRSZ];
+    btc_p2p_message_header_ser(netmagic, command, data, data_len, header);
+    cstr_append_buf(s, header, BTC_P2P_HDRSZ);
 
     /* data payload */
     if (data_len > 0)
@@ -93,8 +98,11 @@ btc_bool btc_p2p_deser_addr(unsigned int protocol_version, btc_p2p_address* addr
         return false;
     if (!deser_bytes(&addr->ip, buf, 16))
         return false;
-    if (!deser_u16(&addr->port, buf))
+    /* the port is in network byte order */
+    uint16_t port_be;
+    if (!deser_bytes(&port_be, buf, 2))
         return false;
+    addr->port = ntohs(port_be);
     return true;
 }
 
@@ -104,7 +112,9 @@ void btc_p2p_ser_addr(unsigned int protover, const btc_p2p_address* addr, cstrin
         ser_u32(s, addr->time);
     ser_u64(s, addr->services);
     ser_bytes(s, addr->ip, 16);
-    ser_u16(s, addr->port);
+    /* the port is in network byte order */
+    uint16_t port_be = htons(addr->port);
+    ser_bytes(s, &port_be, 2);
 }
 
 
@@ -131,10 +141,12 @@ void btc_p2paddr_to_addr(btc_p2p_address* p2p_addr, struct sockaddr* addr_out)
     if (!is_ipv4_mapped(p2p_addr->ip)) {
         /* ipv6 */
         struct sockaddr_in6* saddr = (struct sockaddr_in6*)addr_out;
+        saddr->sin6_family = AF_INET6;
         memcpy(&saddr->sin6_addr, p2p_addr->ip, 16);
         saddr->sin6_port = htons(p2p_addr->port);
     } else {
         struct sockaddr_in* saddr = (struct sockaddr_in*)addr_out;
+        saddr->sin_family = AF_INET;
         memcpy(&saddr->sin_addr, &p2p_addr->ip[12], 4);
         saddr->sin_port = htons(p2p_addr->port);
     }
@@ -257,6 +269,14 @@ void btc_p2p_msg_getheaders(vector* blocklocators, uint256 hashstop, cstring* s)
         ser_bytes(s, NULLHASH, BTC_HASH_LENGTH);
 }
 
+void btc_p2p_msg_getheaders_locator(uint256* locator, size_t count, const uint256 hashstop, cstring* s)
+{
+    ser_u32(s, BTC_PROTOCOL_VERSION);
+    ser_varlen(s, count);
+    ser_bytes(s, locator, count * BTC_HASH_LENGTH);
+    ser_bytes(s, (hashstop ? hashstop : NULLHASH), BTC_HASH_LENGTH);
+}
+
 btc_bool btc_p2p_deser_msg_getheaders(vector* blocklocators, uint256 hashstop, struct const_buffer* buf)
 {
     int32_t version;
@@ -279,10 +299,154 @@ btc_bool btc_p2p_deser_msg_getheaders(vector* blocklocators, uint256 hashstop, s
     return true;
 }
 
+void btc_p2p_msg_addr(const btc_p2p_address* addrs, size_t count, cstring* s)
+{
+    ser_varlen(s, (uint32_t)count);
+    for (size_t i = 0; i < count; i++)
+        btc_p2p_ser_addr(BTC_PROTOCOL_VERSION, &addrs[i], s);
+}
+
+btc_bool btc_p2p_deser_msg_addr(btc_p2p_address* addrs_out, size_t* count_out, struct const_buffer* buf)
+{
+    uint32_t count;
+    if (!deser_varlen(&count, buf) || count > MAX_ADDR_SIZE)
+        return false;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!btc_p2p_deser_addr(BTC_PROTOCOL_VERSION, &addrs_out[i], buf))
+            return false;
+    }
+    *count_out = count;
+    return true;
+}
+
+void btc_p2p_msg_getcfilters(uint8_t filter_type, uint32_t start_height, const uint256 stop_hash, cstring* str_out)
+{
+    ser_bytes(str_out, &filter_type, 1);
+    ser_u32(str_out, start_height);
+    ser_u256(str_out, stop_hash);
+}
+
+btc_bool btc_p2p_deser_msg_getcfilters(uint8_t* filter_type, uint32_t* start_height, uint256 stop_hash, struct const_buffer* buf)
+{
+    if (!deser_bytes(filter_type, buf, 1))
+        return false;
+    if (!deser_u32(start_height, buf))
+        return false;
+    if (!deser_u256(stop_hash, buf))
+        return false;
+    return true;
+}
+
+void btc_p2p_msg_getcfcheckpt(uint8_t filter_type, const uint256 stop_hash, cstring* str_out)
+{
+    ser_bytes(str_out, &filter_type, 1);
+    ser_u256(str_out, stop_hash);
+}
+
+btc_bool btc_p2p_deser_msg_cfilter(uint8_t* filter_type, uint256 block_hash, struct const_buffer* filter, struct const_buffer* buf)
+{
+    uint32_t len;
+    if (!deser_bytes(filter_type, buf, 1))
+        return false;
+    if (!deser_u256(block_hash, buf))
+        return false;
+    if (!deser_varlen(&len, buf) || len > buf->len)
+        return false;
+    filter->p = buf->p;
+    filter->len = len;
+    buf->p = (const char*)buf->p + len;
+    buf->len -= len;
+    return true;
+}
+
+/* reads count followed by count hashes, hashes points into buf */
+static btc_bool btc_p2p_deser_hash_list(uint32_t* count, struct const_buffer* hashes, struct const_buffer* buf)
+{
+    if (!deser_varlen(count, buf) || *count > buf->len / BTC_HASH_LENGTH)
+        return false;
+    hashes->p = buf->p;
+    hashes->len = (size_t)*count * BTC_HASH_LENGTH;
+    buf->p = (const char*)buf->p + hashes->len;
+    buf->len -= hashes->len;
+    return true;
+}
+
+btc_bool btc_p2p_deser_msg_cfheaders(uint8_t* filter_type, uint256 stop_hash, uint256 prev_filter_header, uint32_t* count, struct const_buffer* filter_hashes, struct const_buffer* buf)
+{
+    if (!deser_bytes(filter_type, buf, 1))
+        return false;
+    if (!deser_u256(stop_hash, buf))
+        return false;
+    if (!deser_u256(prev_filter_header, buf))
+        return false;
+    return btc_p2p_deser_hash_list(count, filter_hashes, buf);
+}
+
+btc_bool btc_p2p_deser_msg_cfcheckpt(uint8_t* filter_type, uint256 stop_hash, uint32_t* count, struct const_buffer* filter_headers, struct const_buffer* buf)
+{
+    if (!deser_bytes(filter_type, buf, 1))
+        return false;
+    if (!deser_u256(stop_hash, buf))
+        return false;
+    return btc_p2p_deser_hash_list(count, filter_headers, buf);
+}
+
+/* command strings (zero padded like the 12 bytes on the wire), indexed by enum btc_p2p_command */
+static const char btc_p2p_commands[BTC_CMD_MAX][13] = {
+    [BTC_CMD_VERSION] = "version",
+    [BTC_CMD_VERACK] = "verack",
+    [BTC_CMD_PING] = "ping",
+    [BTC_CMD_PONG] = "pong",
+    [BTC_CMD_GETDATA] = "getdata",
+    [BTC_CMD_GETHEADERS] = "getheaders",
+    [BTC_CMD_HEADERS] = "headers",
+    [BTC_CMD_BLOCK] = "block",
+    [BTC_CMD_INV] = "inv",
+    [BTC_CMD_TX] = "tx",
+    [BTC_CMD_GETCFILTERS] = "getcfilters",
+    [BTC_CMD_CFILTER] = "cfilter",
+    [BTC_CMD_GETCFHEADERS] = "getcfheaders",
+    [BTC_CMD_CFHEADERS] = "cfheaders",
+    [BTC_CMD_GETCFCHECKPT] = "getcfcheckpt",
+    [BTC_CMD_CFCHECKPT] = "cfcheckpt",
+    [BTC_CMD_ADDR] = "addr",
+    [BTC_CMD_GETADDR] = "getaddr",
+};
+
+/* resolve a zero padded 12 byte wire command with a linear scan of the (small) registry
+   comparing the first byte rejects most entries before the full compare */
+static enum btc_p2p_command btc_p2p_command_id_padded(const char command[12])
+{
+    for (int i = BTC_CMD_UNKNOWN + 1; i < BTC_CMD_MAX; i++) {
+        if (btc_p2p_commands[i][0] == command[0] && memcmp(btc_p2p_commands[i], command, 12) == 0)
+            return (enum btc_p2p_command)i;
+    }
+    return BTC_CMD_UNKNOWN;
+}
+
+enum btc_p2p_command btc_p2p_command_id(const char* command)
+{
+    char padded[12] = {0};
+    size_t len = strlen(command);
+    if (len > 12)
+        return BTC_CMD_UNKNOWN;
+    memcpy(padded, command, len);
+    return btc_p2p_command_id_padded(padded);
+}
+
+const char* btc_p2p_command_str(enum btc_p2p_command command_id)
+{
+    if (command_id <= BTC_CMD_UNKNOWN || command_id >= BTC_CMD_MAX)
+        return NULL;
+    return btc_p2p_commands[command_id];
+}
+
 void btc_p2p_deser_msghdr(btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
 {
     deser_bytes(hdr->netmagic, buf, 4);
     deser_bytes(hdr->command, buf, 12);
+    hdr->command[12] = 0;
+    hdr->command_id = btc_p2p_command_id_padded(hdr->command);
     deser_u32(&hdr->data_len, buf);
     deser_bytes(hdr->hash, buf, 4);
 }
@@ -46,28 +46,30 @@ void ser_u256(cstring* s, const unsigned char* v_)
     ser_bytes(s, v_, 32);
 }
 
-void ser_varlen(cstring* s, uint32_t vlen)
+/* encode a variable length integer, returns the amount of bytes used (up to 5) */
+static size_t ser_varlen_encode(uint8_t* buf, uint32_t vlen)
 {
-    unsigned char c;
-
     if (vlen < 253) {
-        c = vlen;
-        ser_bytes(s, &c, 1);
-    }
-
-    else if (vlen < 0x10000) {
-        c = 253;
-        ser_bytes(s, &c, 1);
-        ser_u16(s, (uint16_t)vlen);
-    }
-
-    else {
-        c = 254;
-        ser_bytes(s, &c, 1);
-        ser_u32(s, vlen);
+        buf[0] = vlen;
+        return 1;
+    } else if (vlen < 0x10000) {
+        uint16_t v = htole16((uint16_t)vlen);
+        buf[0] = 253;
+        memcpy(buf + 1, &v, sizeof(v));
+        return 1 + sizeof(v);
     }
 
     /* u64 case intentionally not implemented */
+    uint32_t v = htole32(vlen);
+    buf[0] = 254;
+    memcpy(buf + 1, &v, sizeof(v));
+    return 1 + sizeof(v);
+}
+
+void ser_varlen(cstring* s, uint32_t vlen)
+{
+    uint8_t buf[5];
+    ser_bytes(s, buf, ser_varlen_encode(buf, vlen));
 }
 
 void ser_str(cstring* s, const char* s_in, size_t maxlen)
@@ -89,6 +91,74 @@ void ser_varstr(cstring* s, cstring* s_in)
     ser_bytes(s, s_in->str, s_in->len);
 }
 
+void btc_ser_sink_init(btc_ser_sink* sink, cstring* str, SHA256_CTX* hash, FILE* file)
+{
+    sink->str = str;
+    sink->hash = hash;
+    sink->file = file;
+    sink->failed = false;
+}
+
+void ser_sink_bytes(btc_ser_sink* sink, const void* p, size_t len)
+{
+    if (sink->str)
+        cstr_append_buf(sink->str, p, len);
+    if (sink->hash)
+        sha256_Update(sink->hash, (const uint8_t*)p, len);
+    if (sink->file && len > 0 && fwrite(p, len, 1, sink->file) != 1)
+        sink->failed = true;
+}
+
+void ser_sink_u16(btc_ser_sink* sink, uint16_t v_)
+{
+    uint16_t v = htole16(v_);
+    ser_sink_bytes(sink, &v, sizeof(v));
+}
+
+void ser_sink_u32(btc_ser_sink* sink, uint32_t v_)
+{
+    uint32_t v = htole32(v_);
+    ser_sink_bytes(sink, &v, sizeof(v));
+}
+
+void ser_sink_s32(btc_ser_sink* sink, int32_t v_)
+{
+    ser_sink_u32(sink, (uint32_t)v_);
+}
+
+void ser_sink_u64(btc_ser_sink* sink, uint64_t v_)
+{
+    uint64_t v = htole64(v_);
+    ser_sink_bytes(sink, &v, sizeof(v));
+}
+
+void ser_sink_s64(btc_ser_sink* sink, int64_t v_)
+{
+    ser_sink_u64(sink, (uint64_t)v_);
+}
+
+void ser_sink_u256(btc_ser_sink* sink, const unsigned char* v_)
+{
+    ser_sink_bytes(sink, v_, 32);
+}
+
+void ser_sink_varlen(btc_ser_sink* sink, uint32_t vlen)
+{
+    uint8_t buf[5];
+    ser_sink_bytes(sink, buf, ser_varlen_encode(buf, vlen));
+}
+
+void ser_sink_varstr(btc_ser_sink* sink, const cstring* s_in)
+{
+    if (!s_in || !s_in->len) {
+        ser_sink_varlen(sink, 0);
+        return;
+    }
+
+    ser_sink_varlen(sink, s_in->len);
+    ser_sink_bytes(sink, s_in->str, s_in->len);
+}
+
 int deser_skip(struct const_buffer* buf, size_t len)
 {
     char* p;
@@ -245,8 +315,8 @@ int deser_varlen_file(uint32_t* lo, FILE* file, uint8_t* rawdata, size_t* buflen
     unsigned char c;
     const unsigned char bufp[sizeof(uint64_t)];
 
-    /* check min size of the buffer */
-    if (*buflen_inout < sizeof(len))
+    /* the buffer must hold the prefix byte plus a full 64bit length */
+    if (*buflen_inout < 1 + sizeof(uint64_t))
         return false;
 
     if (fread(&c, 1, 1, file) != 1)
@@ -280,8 +350,8 @@ int deser_varlen_file(uint32_t* lo, FILE* file, uint8_t* rawdata, size_t* buflen
         uint64_t v64;
         if (fread((void*)buf.p, 1, sizeof(v64), file) != sizeof(v64))
             return false;
-        memcpy(rawdata + 1, buf.p, sizeof(uint32_t)); /* warning, truncate! */
-        *buflen_inout += sizeof(uint32_t);
+        memcpy(rawdata + 1, buf.p, sizeof(v64));
+        *buflen_inout += sizeof(v64);
         if (!deser_u64(&v64, &buf))
             return false;
         len = (uint32_t)v64; /* WARNING: truncate */
@@ -0,0 +1,161 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#include <btc/threadpool.h>
+
+#include <btc/utils.h>
+
+#include <unistd.h>
+
+static void btc_threadpool_process(btc_threadpool* pool)
+{
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        size_t begin = pool->next;
+        pool->next += pool->chunk;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (begin >= pool->count)
+            break;
+        pool->fn(pool->ctx, begin, BTC_MIN(begin + pool->chunk, pool->count));
+    }
+}
+
+static void* btc_threadpool_worker(void* arg)
+{
+    btc_threadpool* pool = (btc_threadpool*)arg;
+    uint64_t seen_generation = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (!pool->shutdown && pool->generation == seen_generation)
+            pthread_cond_wait(&pool->work_cond, &pool->mutex);
+        if (pool->shutdown)
+            break;
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+
+        btc_threadpool_process(pool);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->active == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+unsigned int btc_threadpool_default_threads(unsigned int max)
+{
+    unsigned int num_threads = 0;
+#ifdef _SC_NPROCESSORS_ONLN
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = (cores > 1 ? (unsigned int)cores - 1 : 0);
+#endif
+    if (max > 0 && num_threads > max)
+        num_threads = max;
+    return num_threads;
+}
+
+btc_threadpool* btc_threadpool_new(unsigned int num_threads)
+{
+    if (num_threads == 0)
+        num_threads = btc_threadpool_default_threads(0);
+
+    btc_threadpool* pool = btc_calloc(1, sizeof(*pool));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->generation = 0;
+    pool->active = 0;
+    pool->shutdown = false;
+
+    if (num_threads > 0)
+        pool->threads = btc_calloc(num_threads, sizeof(pthread_t));
+    for (unsigned int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, btc_threadpool_worker, pool) != 0)
+            break;
+        pool->num_threads++;
+    }
+    return pool;
+}
+
+void btc_threadpool_free(btc_threadpool* pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (unsigned int i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    btc_free(pool->threads);
+    btc_free(pool);
+}
+
+void btc_threadpool_run(btc_threadpool* pool, size_t count, size_t min_chunk, btc_threadpool_range_fn fn, void* ctx)
+{
+    if (count == 0)
+        return;
+    if (min_chunk == 0)
+        min_chunk = 1;
+
+    if (!pool || pool->num_threads == 0 || count <= min_chunk) {
+        /* not worth waking up the workers */
+        fn(ctx, 0, count);
+        return;
+    }
+
+    /* aim for a few chunks per thread to balance uneven work */
+    size_t chunk = count / ((pool->num_threads + 1) * 4);
+    if (chunk < min_chunk)
+        chunk = min_chunk;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->count = count;
+    pool->chunk = chunk;
+    pool->next = 0;
+    pool->active = pool->num_threads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    btc_threadpool_process(pool);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->active > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,172 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2017 libbtc developers
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+*/
+
+#include <btc/timerwheel.h>
+
+#include <string.h>
+
+static const uint64_t BTC_TIMER_WHEEL_MAX_TICKS = (1ULL << (BTC_TIMER_WHEEL_LEVELS * BTC_TIMER_WHEEL_SLOT_BITS)) - 1;
+
+static void btc_timer_link(btc_timer** list, btc_timer* timer)
+{
+    timer->prev = NULL;
+    timer->next = *list;
+    if (*list)
+        (*list)->prev = timer;
+    *list = timer;
+    timer->list = list;
+}
+
+static void btc_timer_unlink(btc_timer* timer)
+{
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        *timer->list = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    timer->list = NULL;
+}
+
+/* link the timer into the slot of the lowest level that can hold its distance */
+static void btc_timer_wheel_insert(btc_timer_wheel* wheel, btc_timer* timer)
+{
+    uint64_t delta = (timer->expires > wheel->current ? timer->expires - wheel->current : 0);
+    if (delta > BTC_TIMER_WHEEL_MAX_TICKS) {
+        timer->expires = wheel->current + BTC_TIMER_WHEEL_MAX_TICKS;
+        delta = BTC_TIMER_WHEEL_MAX_TICKS;
+    }
+    unsigned int level = 0;
+    while (level < BTC_TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * BTC_TIMER_WHEEL_SLOT_BITS)))
+        level++;
+    unsigned int slot = (timer->expires >> (level * BTC_TIMER_WHEEL_SLOT_BITS)) & (BTC_TIMER_WHEEL_SLOTS - 1);
+    btc_timer_link(&wheel->slots[level][slot], timer);
+}
+
+/* move the timers of a higher level slot down to the levels below */
+static void btc_timer_wheel_cascade(btc_timer_wheel* wheel, unsigned int level, unsigned int slot)
+{
+    btc_timer* timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    while (timer) {
+        btc_timer* next = timer->next;
+        btc_timer_wheel_insert(wheel, timer);
+        timer = next;
+    }
+}
+
+void btc_timer_wheel_init(btc_timer_wheel* wheel, uint64_t tick_ms, uint64_t now_ms)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->tick_ms = (tick_ms > 0 ? tick_ms : 1);
+    wheel->start_ms = now_ms;
+    pthread_mutex_init(&wheel->mutex, NULL);
+}
+
+void btc_timer_wheel_deinit(btc_timer_wheel* wheel)
+{
+    pthread_mutex_destroy(&wheel->mutex);
+}
+
+void btc_timer_init(btc_timer* timer, btc_timer_cb cb, void* ctx)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->cb = cb;
+    timer->ctx = ctx;
+}
+
+void btc_timer_schedule(btc_timer_wheel* wheel, btc_timer* timer, uint64_t delay_ms)
+{
+    uint64_t ticks = (delay_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    pthread_mutex_lock(&wheel->mutex);
+    if (timer->list)
+        btc_timer_unlink(timer);
+    else
+        wheel->pending++;
+    timer->expires = wheel->current + (ticks > 0 ? ticks : 1);
+    btc_timer_wheel_insert(wheel, timer);
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+void btc_timer_cancel(btc_timer_wheel* wheel, btc_timer* timer)
+{
+    pthread_mutex_lock(&wheel->mutex);
+    if (timer->list) {
+        btc_timer_unlink(timer);
+        wheel->pending--;
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+}
+
+btc_bool btc_timer_pending(btc_timer_wheel* wheel, const btc_timer* timer)
+{
+    pthread_mutex_lock(&wheel->mutex);
+    btc_bool pending = (timer->list != NULL);
+    pthread_mutex_unlock(&wheel->mutex);
+    return pending;
+}
+
+size_t btc_timer_wheel_advance(btc_timer_wheel* wheel, uint64_t now_ms)
+{
+    uint64_t target = (now_ms > wheel->start_ms ? (now_ms - wheel->start_ms) / wheel->tick_ms : 0);
+    size_t fired = 0;
+
+    pthread_mutex_lock(&wheel->mutex);
+    if (wheel->pending == 0 && target > wheel->current)
+        wheel->current = target; /* nothing to walk through */
+
+    while (wheel->current < target) {
+        wheel->current++;
+
+        /* refill the lower levels once per rotation of the level below */
+        for (unsigned int level = 1; level < BTC_TIMER_WHEEL_LEVELS; level++) {
+            uint64_t lower = wheel->current >> ((level - 1) * BTC_TIMER_WHEEL_SLOT_BITS);
+            if ((lower & (BTC_TIMER_WHEEL_SLOTS - 1)) != 0)
+                break;
+            btc_timer_wheel_cascade(wheel, level, (wheel->current >> (level * BTC_TIMER_WHEEL_SLOT_BITS)) & (BTC_TIMER_WHEEL_SLOTS - 1));
+        }
+
+        /* hand the expired timers over to the callback list, the lock is released for the callbacks */
+        btc_timer** slot = &wheel->slots[0][wheel->current & (BTC_TIMER_WHEEL_SLOTS - 1)];
+        for (btc_timer* timer = *slot; timer; timer = timer->next)
+            timer->list = &wheel->expired;
+        wheel->expired = *slot;
+        *slot = NULL;
+
+        while (wheel->expired) {
+            btc_timer* timer = wheel->expired;
+            btc_timer_unlink(timer);
+            wheel->pending--;
+            pthread_mutex_unlock(&wheel->mutex);
+            timer->cb(timer, timer->ctx);
+            fired++;
+            pthread_mutex_lock(&wheel->mutex);
+        }
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+    return fired;
+}
@@ -160,6 +160,9 @@ struct broadcast_ctx {
     int getdata_from_peers;
     int found_on_non_inved_peers;
     uint64_t start_time;
+    uint256 txhash;
+    btc_node_msg* inv_msg; /* serialized once, shared by all informed peers */
+    btc_node_msg* tx_msg;
 };
 
 static btc_bool broadcast_timer_cb(btc_node* node, uint64_t* now)
@@ -188,7 +191,7 @@ void broadcast_handshake_done(struct btc_node_* node)
 {
     char ipaddr[256];
     struct sockaddr_in *ad = (struct sockaddr_in *) &node->addr;
-    evutil_inet_ntop(node->addr.sa_family, &ad->sin_addr, ipaddr, sizeof(ipaddr));
+    evutil_inet_ntop(node->addr.ss_family, &ad->sin_addr, ipaddr, sizeof(ipaddr));
 
     printf("Successfully connected to peer %d (%s)\n", node->nodeid, ipaddr);
     struct broadcast_ctx* ctx = (struct broadcast_ctx*)node->nodegroup->ctx;
@@ -198,23 +201,8 @@ void broadcast_handshake_done(struct btc_node_* node)
         return;
     }
 
-    /* create a INV */
-    cstring* inv_msg_cstr = cstr_new_sz(256);
-    btc_p2p_inv_msg inv_msg;
-    memset(&inv_msg, 0, sizeof(inv_msg));
-
-    uint256 hash;
-    btc_tx_hash(ctx->tx, hash);
-    btc_p2p_msg_inv_init(&inv_msg, BTC_INV_TYPE_TX, hash);
-
-    /* serialize the inv count (1) */
-    ser_varlen(inv_msg_cstr, 1);
-    btc_p2p_msg_inv_ser(&inv_msg, inv_msg_cstr);
-
-    cstring* p2p_msg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_INV, inv_msg_cstr->str, inv_msg_cstr->len);
-    cstr_free(inv_msg_cstr, true);
-    btc_node_send(node, p2p_msg);
-    cstr_free(p2p_msg, true);
+    /* send the INV */
+    btc_node_send_msg(node, ctx->inv_msg);
 
     /* set hint bit 0 == inv sent */
     node->hints |= (1 << 0);
@@ -234,12 +222,7 @@ btc_bool broadcast_should_connect_more(btc_node* node)
 void broadcast_post_cmd(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct const_buffer* buf)
 {
     struct broadcast_ctx* ctx = (struct broadcast_ctx*)node->nodegroup->ctx;
-    if (strcmp(hdr->command, BTC_MSG_INV) == 0) {
-        /* hash the tx */
-        /* TODO: cache the hash */
-        uint256 hash;
-        btc_tx_hash(ctx->tx, hash);
-
+    if (hdr->command_id == BTC_CMD_INV) {
         //  decompose
         uint32_t vsize;
         if (!deser_varlen(&vsize, buf)) {
@@ -252,7 +235,7 @@ void broadcast_post_cmd(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct con
                 btc_node_missbehave(node);
                 return;
             }
-            if (memcmp(hash, inv_msg.hash, sizeof(hash)) == 0) {
+            if (memcmp(ctx->txhash, inv_msg.hash, sizeof(ctx->txhash)) == 0) {
                 // txfound
                 /* set hint bit 2 == tx found on peer*/
                 node->hints |= (1 << 2);
@@ -261,7 +244,7 @@ void broadcast_post_cmd(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct con
                 printf("tx successfully seen on node %d\n", node->nodeid);
             }
         }
-    } else if (strcmp(hdr->command, BTC_MSG_GETDATA) == 0 && ((node->hints & (1 << 1)) != (1 << 1))) {
+    } else if (hdr->command_id == BTC_CMD_GETDATA && ((node->hints & (1 << 1)) != (1 << 1))) {
         ctx->getdata_from_peers++;
         //only allow a single object in getdata for the broadcaster
         uint32_t vsize;
@@ -278,12 +261,7 @@ void broadcast_post_cmd(struct btc_node_* node, btc_p2p_msg_hdr* hdr, struct con
         };
 
         /* send the tx */
-        cstring* tx_ser = cstr_new_sz(1024);
-        btc_tx_serialize(tx_ser, ctx->tx);
-        cstring* p2p_msg = btc_p2p_message_new(node->nodegroup->chainparams->netmagic, BTC_MSG_TX, tx_ser->str, tx_ser->len);
-        cstr_free(tx_ser, true);
-        btc_node_send(node, p2p_msg);
-        cstr_free(p2p_msg, true);
+        btc_node_send_msg(node, ctx->tx_msg);
 
         /* set hint bit 1 == tx sent */
         node->hints |= (1 << 1);
@@ -322,13 +300,25 @@ btc_bool broadcast_tx(const btc_chainparams* chain, const btc_tx* tx, const char
 
     btc_node_group_add_peers_by_ip_or_seed(group, ips);
 
-    uint256 txhash;
-    btc_tx_hash(tx, txhash);
-    char hexout[sizeof(txhash)*2+1];
-    utils_bin_to_hex(txhash, sizeof(txhash), hexout);
-    hexout[sizeof(txhash)*2] = 0;
+    btc_tx_hash(tx, ctx.txhash);
+    char hexout[sizeof(ctx.txhash)*2+1];
+    utils_bin_to_hex(ctx.txhash, sizeof(ctx.txhash), hexout);
+    hexout[sizeof(ctx.txhash)*2] = 0;
     utils_reverse_hex(hexout, strlen(hexout));
     printf("Start broadcasting transaction: %s with timeout %d seconds\n", hexout, timeout);
+
+    /* serialize the inv and the tx message once for all peers */
+    cstring* payload = cstr_new_sz(1024);
+    btc_p2p_inv_msg inv_msg;
+    btc_p2p_msg_inv_init(&inv_msg, BTC_INV_TYPE_TX, ctx.txhash);
+    ser_varlen(payload, 1);
+    btc_p2p_msg_inv_ser(&inv_msg, payload);
+    ctx.inv_msg = btc_node_msg_new(chain->netmagic, BTC_MSG_INV, payload->str, payload->len);
+    cstr_resize(payload, 0);
+    btc_tx_serialize(payload, tx);
+    ctx.tx_msg = btc_node_msg_new(chain->netmagic, BTC_MSG_TX, payload->str, payload->len);
+    cstr_free(payload, true);
+
     /* connect to the next node */
     ctx.start_time = time(NULL);
     printf("Trying to connect to nodes...\n");
@@ -339,6 +329,8 @@ btc_bool broadcast_tx(const btc_chainparams* chain, const btc_tx* tx, const char
 
     /* cleanup */
     btc_node_group_free(group); //will also free the nodes structures from the heap
+    btc_node_msg_free(ctx.inv_msg);
+    btc_node_msg_free(ctx.tx_msg);
 
     printf("\n\nResult:\n=============\n");
     printf("Max nodes to connect to: %d\n", ctx.max_peers_to_connect);
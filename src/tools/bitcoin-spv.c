@@ -208,6 +208,9 @@ int main(int argc, char* argv[])
             ret = EXIT_FAILURE;
         }
         else {
+            /* known peer addresses from previous runs avoid the DNS seed lookup */
+            if (!dbfile || dbfile[0] != '0')
+                btc_node_group_set_addrman_file(client->nodegroup, "peers.dat");
             printf("Discover peers...");
             btc_spv_client_discover_peers(client, ips);
             printf("done\n");
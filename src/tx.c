@@ -198,25 +198,160 @@ int btc_tx_deserialize(const unsigned char* tx_serialized, size_t inlen, btc_tx*
     return true;
 }
 
-void btc_tx_in_serialize(cstring* s, const btc_tx_in* tx_in)
+/* the arena regions are kept aligned for the int64_t values and the pointers */
+static size_t btc_tx_arena_align(size_t size)
 {
-    ser_u256(s, tx_in->prevout.hash);
-    ser_u32(s, tx_in->prevout.n);
-    ser_varstr(s, tx_in->script_sig);
-    ser_u32(s, tx_in->sequence);
+    return (size + sizeof(int64_t) - 1) & ~(sizeof(int64_t) - 1);
 }
 
-void btc_tx_out_serialize(cstring* s, const btc_tx_out* tx_out)
+static void* btc_tx_arena_take(uint8_t** next, size_t size)
 {
-    ser_s64(s, tx_out->value);
-    ser_varstr(s, tx_out->script_pubkey);
+    void* p = *next;
+    *next += btc_tx_arena_align(size);
+    return p;
 }
 
-void btc_tx_serialize(cstring* s, const btc_tx* tx)
+/* pre-scan, counts the inputs, outputs and script bytes without allocating */
+static btc_bool btc_tx_arena_scan(const unsigned char* tx_serialized, size_t inlen, uint32_t* vin_count, uint32_t* vout_count, size_t* script_bytes, size_t* consumed_length)
 {
-    ser_s32(s, tx->version);
+    struct const_buffer buf = {tx_serialized, inlen};
+    uint32_t script_len;
+    uint32_t i;
 
-    ser_varlen(s, tx->vin ? tx->vin->len : 0);
+    *script_bytes = 0;
+    if (!deser_skip(&buf, 4) || !deser_varlen(vin_count, &buf))
+        return false;
+    for (i = 0; i < *vin_count; i++) {
+        if (!deser_skip(&buf, 32 + 4) || !deser_varlen(&script_len, &buf) || !deser_skip(&buf, script_len) || !deser_skip(&buf, 4))
+            return false;
+        *script_bytes += script_len;
+    }
+    if (!deser_varlen(vout_count, &buf))
+        return false;
+    for (i = 0; i < *vout_count; i++) {
+        if (!deser_skip(&buf, 8) || !deser_varlen(&script_len, &buf) || !deser_skip(&buf, script_len))
+            return false;
+        *script_bytes += script_len;
+    }
+    if (!deser_skip(&buf, 4))
+        return false;
+
+    *consumed_length = inlen - buf.len;
+    return true;
+}
+
+static size_t btc_tx_arena_layout_size(uint32_t vin_count, uint32_t vout_count, size_t script_bytes)
+{
+    size_t count = (size_t)vin_count + vout_count;
+    return btc_tx_arena_align(sizeof(btc_tx)) +
+           2 * btc_tx_arena_align(sizeof(vector)) +
+           btc_tx_arena_align(vin_count * sizeof(void*)) +
+           btc_tx_arena_align(vout_count * sizeof(void*)) +
+           btc_tx_arena_align(vin_count * sizeof(btc_tx_in)) +
+           btc_tx_arena_align(vout_count * sizeof(btc_tx_out)) +
+           btc_tx_arena_align(count * sizeof(cstring)) +
+           script_bytes + count; /* scripts are NUL terminated like any cstring */
+}
+
+/* copies the next var-length script into the arena, the input has already been checked by the pre-scan */
+static void btc_tx_arena_script(cstring* script, uint8_t** script_next, struct const_buffer* buf)
+{
+    uint32_t script_len;
+    deser_varlen(&script_len, buf);
+    script->str = (char*)*script_next;
+    script->len = script_len;
+    script->alloc = script_len + 1;
+    deser_bytes(script->str, buf, script_len);
+    script->str[script_len] = 0;
+    *script_next += script_len + 1;
+}
+
+size_t btc_tx_deserialize_arena_size(const unsigned char* tx_serialized, size_t inlen)
+{
+    uint32_t vin_count, vout_count;
+    size_t script_bytes, consumed;
+    if (!btc_tx_arena_scan(tx_serialized, inlen, &vin_count, &vout_count, &script_bytes, &consumed))
+        return 0;
+    return btc_tx_arena_layout_size(vin_count, vout_count, script_bytes);
+}
+
+btc_tx* btc_tx_deserialize_arena(const unsigned char* tx_serialized, size_t inlen, void* arena, size_t arena_size, size_t* consumed_length)
+{
+    uint32_t vin_count, vout_count;
+    size_t script_bytes, consumed;
+    if (consumed_length)
+        *consumed_length = 0;
+
+    if (!btc_tx_arena_scan(tx_serialized, inlen, &vin_count, &vout_count, &script_bytes, &consumed))
+        return NULL;
+    if (arena_size < btc_tx_arena_layout_size(vin_count, vout_count, script_bytes))
+        return NULL;
+
+    uint8_t* next = arena;
+    btc_tx* tx = btc_tx_arena_take(&next, sizeof(btc_tx));
+    tx->vin = btc_tx_arena_take(&next, sizeof(vector));
+    tx->vout = btc_tx_arena_take(&next, sizeof(vector));
+    tx->vin->data = btc_tx_arena_take(&next, vin_count * sizeof(void*));
+    tx->vout->data = btc_tx_arena_take(&next, vout_count * sizeof(void*));
+    btc_tx_in* tx_ins = btc_tx_arena_take(&next, vin_count * sizeof(btc_tx_in));
+    btc_tx_out* tx_outs = btc_tx_arena_take(&next, vout_count * sizeof(btc_tx_out));
+    cstring* scripts = btc_tx_arena_take(&next, ((size_t)vin_count + vout_count) * sizeof(cstring));
+    uint8_t* script_next = next;
+
+    /* the elements are owned by the arena, the vectors must not free or grow them */
+    tx->vin->len = tx->vin->alloc = vin_count;
+    tx->vin->elem_free_f = NULL;
+    tx->vout->len = tx->vout->alloc = vout_count;
+    tx->vout->elem_free_f = NULL;
+
+    struct const_buffer buf = {tx_serialized, consumed};
+    uint32_t count;
+    deser_s32(&tx->version, &buf);
+    deser_varlen(&count, &buf);
+    uint32_t i;
+    for (i = 0; i < vin_count; i++) {
+        btc_tx_in* tx_in = &tx_ins[i];
+        deser_u256(tx_in->prevout.hash, &buf);
+        deser_u32(&tx_in->prevout.n, &buf);
+        tx_in->script_sig = &scripts[i];
+        btc_tx_arena_script(tx_in->script_sig, &script_next, &buf);
+        deser_u32(&tx_in->sequence, &buf);
+        tx->vin->data[i] = tx_in;
+    }
+    deser_varlen(&count, &buf);
+    for (i = 0; i < vout_count; i++) {
+        btc_tx_out* tx_out = &tx_outs[i];
+        deser_s64(&tx_out->value, &buf);
+        tx_out->script_pubkey = &scripts[vin_count + i];
+        btc_tx_arena_script(tx_out->script_pubkey, &script_next, &buf);
+        tx->vout->data[i] = tx_out;
+    }
+    deser_u32(&tx->locktime, &buf);
+
+    if (consumed_length)
+        *consumed_length = consumed;
+    return tx;
+}
+
+void btc_tx_in_serialize(btc_ser_sink* sink, const btc_tx_in* tx_in)
+{
+    ser_sink_u256(sink, tx_in->prevout.hash);
+    ser_sink_u32(sink, tx_in->prevout.n);
+    ser_sink_varstr(sink, tx_in->script_sig);
+    ser_sink_u32(sink, tx_in->sequence);
+}
+
+void btc_tx_out_serialize(btc_ser_sink* sink, const btc_tx_out* tx_out)
+{
+    ser_sink_s64(sink, tx_out->value);
+    ser_sink_varstr(sink, tx_out->script_pubkey);
+}
+
+void btc_tx_serialize_sink(btc_ser_sink* sink, const btc_tx* tx)
+{
+    ser_sink_s32(sink, tx->version);
+
+    ser_sink_varlen(sink, tx->vin ? tx->vin->len : 0);
 
     unsigned int i;
     if (tx->vin) {
@@ -224,33 +359,42 @@ void btc_tx_serialize(cstring* s, const btc_tx* tx)
             btc_tx_in* tx_in;
 
             tx_in = vector_idx(tx->vin, i);
-            btc_tx_in_serialize(s, tx_in);
+            btc_tx_in_serialize(sink, tx_in);
         }
     }
 
-    ser_varlen(s, tx->vout ? tx->vout->len : 0);
+    ser_sink_varlen(sink, tx->vout ? tx->vout->len : 0);
 
     if (tx->vout) {
         for (i = 0; i < tx->vout->len; i++) {
             btc_tx_out* tx_out;
 
             tx_out = vector_idx(tx->vout, i);
-            btc_tx_out_serialize(s, tx_out);
+            btc_tx_out_serialize(sink, tx_out);
         }
     }
 
-    ser_u32(s, tx->locktime);
+    ser_sink_u32(sink, tx->locktime);
 }
 
-void btc_tx_hash(const btc_tx* tx, uint256 hashout)
+void btc_tx_serialize(cstring* s, const btc_tx* tx)
 {
-    cstring* txser = cstr_new_sz(1024);
-    btc_tx_serialize(txser, tx);
-
+    btc_ser_sink sink;
+    btc_ser_sink_init(&sink, s, NULL, NULL);
+    btc_tx_serialize_sink(&sink, tx);
+}
 
-    sha256_Raw((const uint8_t*)txser->str, txser->len, hashout);
+void btc_tx_hash(const btc_tx* tx, uint256 hashout)
+{
+    /* hash the serialization as it gets produced, without buffering it */
+    SHA256_CTX ctx;
+    btc_ser_sink sink;
+    sha256_Init(&ctx);
+    btc_ser_sink_init(&sink, NULL, &ctx, NULL);
+    btc_tx_serialize_sink(&sink, tx);
+
+    sha256_Final(hashout, &ctx);
     sha256_Raw(hashout, BTC_HASH_LENGTH, hashout);
-    cstr_free(txser, true);
 }
 
 
@@ -332,98 +476,303 @@ void btc_tx_copy(btc_tx* dest, const btc_tx* src)
     }
 }
 
-btc_bool btc_tx_sighash(const btc_tx* tx_to, const cstring* fromPubKey, unsigned int in_num, int hashtype, uint256 hash)
+/* the legacy signature hash serialization is streamed into the hash, without a modified copy of the transaction */
+static const size_t BTC_TX_SIGHASH_BLANK_INPUT_SIZE = BTC_HASH_LENGTH + 4 + 1 + 4;
+
+/* an input not being signed, with an empty script (and a zero sequence unless keep_sequence is set) */
+static void btc_tx_sighash_blank_input(btc_ser_sink* sink, const btc_tx_in* tx_in, btc_bool keep_sequence)
+{
+    ser_sink_u256(sink, tx_in->prevout.hash);
+    ser_sink_u32(sink, tx_in->prevout.n);
+    ser_sink_varlen(sink, 0);
+    ser_sink_u32(sink, (keep_sequence ? tx_in->sequence : 0));
+}
+
+/* true if btc_script_copy_without_op_codeseperator would take the script over unchanged */
+static btc_bool btc_tx_script_code_is_plain(const cstring* script)
+{
+    const uint8_t* p = (const uint8_t*)script->str;
+    size_t i = 0;
+    while (i < script->len) {
+        uint8_t opcode = p[i++];
+        size_t data_len = 0;
+        if (opcode == OP_CODESEPARATOR || opcode == OP_PUSHDATA4)
+            return false;
+        if (opcode < OP_PUSHDATA1 && opcode > OP_0) {
+            data_len = opcode;
+        } else if (opcode == OP_PUSHDATA1) {
+            if (i + 1 > script->len)
+                return false;
+            data_len = p[i];
+            i += 1;
+        } else if (opcode == OP_PUSHDATA2) {
+            if (i + 2 > script->len)
+                return false;
+            data_len = p[i] | (p[i + 1] << 8);
+            i += 2;
+        } else {
+            continue;
+        }
+        if (data_len == 0 || data_len > script->len - i)
+            return false;
+        i += data_len;
+    }
+    return true;
+}
+
+static btc_bool btc_tx_sighash_stream(const btc_tx* tx_to, const btc_tx_sighash_cache* cache, const cstring* fromPubKey, unsigned int in_num, int hashtype, uint256 hash)
 {
     if (in_num >= tx_to->vin->len)
         return false;
 
-    btc_bool ret = true;
-
-    btc_tx* tx_tmp = btc_tx_new();
-    btc_tx_copy(tx_tmp, tx_to);
+    unsigned int i;
+    int base_type = (hashtype & 0x1f);
+    btc_bool anyonecanpay = ((hashtype & SIGHASH_ANYONECANPAY) != 0);
+    /* SIGHASH_NONE and SIGHASH_SINGLE let the others update the sequences of their inputs */
+    btc_bool all = (base_type != SIGHASH_NONE && base_type != SIGHASH_SINGLE);
 
-    cstring* new_script = cstr_new_sz(fromPubKey->len);
-    btc_script_copy_without_op_codeseperator(fromPubKey, new_script);
+    if (base_type == SIGHASH_SINGLE && in_num >= tx_to->vout->len) {
+        /* Only lock-in the txout payee at same index as txin */
+        //TODO: set error code
+        return false;
+    }
 
-    unsigned int i;
-    btc_tx_in* tx_in;
-    for (i = 0; i < tx_tmp->vin->len; i++) {
-        tx_in = vector_idx(tx_tmp->vin, i);
-        cstr_resize(tx_in->script_sig, 0);
-
-        if (i == in_num)
-            cstr_append_buf(tx_in->script_sig,
-                            new_script->str,
-                            new_script->len);
-    }
-    cstr_free(new_script, true);
-    /* Blank out some of the outputs */
-    if ((hashtype & 0x1f) == SIGHASH_NONE) {
-        /* Wildcard payee */
-        if (tx_tmp->vout)
-            vector_free(tx_tmp->vout, true);
+    SHA256_CTX ctx;
+    btc_ser_sink sink;
+    btc_ser_sink_init(&sink, NULL, &ctx, NULL);
+    if (anyonecanpay) {
+        /* Blank out other inputs completely;
+         not recommended for open transactions */
+        sha256_Init(&ctx);
+        ser_sink_s32(&sink, tx_to->version);
+        ser_sink_varlen(&sink, 1);
+    } else if (all && cache) {
+        memcpy(&ctx, &cache->midstates[in_num], sizeof(ctx));
+    } else {
+        sha256_Init(&ctx);
+        ser_sink_s32(&sink, tx_to->version);
+        ser_sink_varlen(&sink, tx_to->vin->len);
+        for (i = 0; i < in_num; i++)
+            btc_tx_sighash_blank_input(&sink, vector_idx(tx_to->vin, i), all);
+    }
 
-        tx_tmp->vout = vector_new(1, btc_tx_out_free_cb);
+    /* the signed input carries the script code */
+    const btc_tx_in* tx_in = vector_idx(tx_to->vin, in_num);
+    ser_sink_u256(&sink, tx_in->prevout.hash);
+    ser_sink_u32(&sink, tx_in->prevout.n);
+    if (btc_tx_script_code_is_plain(fromPubKey)) {
+        ser_sink_varlen(&sink, fromPubKey->len);
+        ser_sink_bytes(&sink, fromPubKey->str, fromPubKey->len);
+    } else {
+        cstring* new_script = cstr_new_sz(fromPubKey->len);
+        btc_script_copy_without_op_codeseperator(fromPubKey, new_script);
+        ser_sink_varlen(&sink, new_script->len);
+        ser_sink_bytes(&sink, new_script->str, new_script->len);
+        cstr_free(new_script, true);
+    }
+    ser_sink_u32(&sink, tx_in->sequence);
 
-        /* Let the others update at will */
-        for (i = 0; i < tx_tmp->vin->len; i++) {
-            tx_in = vector_idx(tx_tmp->vin, i);
-            if (i != in_num)
-                tx_in->sequence = 0;
+    if (!anyonecanpay) {
+        if (all && cache) {
+            ser_sink_bytes(&sink, cache->inputs->str + (in_num + 1) * BTC_TX_SIGHASH_BLANK_INPUT_SIZE, (tx_to->vin->len - in_num - 1) * BTC_TX_SIGHASH_BLANK_INPUT_SIZE);
+        } else {
+            for (i = in_num + 1; i < tx_to->vin->len; i++)
+                btc_tx_sighash_blank_input(&sink, vector_idx(tx_to->vin, i), all);
         }
     }
 
-    else if ((hashtype & 0x1f) == SIGHASH_SINGLE) {
-        /* Only lock-in the txout payee at same index as txin */
-        unsigned int n_out = in_num;
-        if (n_out >= tx_tmp->vout->len) {
-            //TODO: set error code
-            ret = false;
-            goto out;
+    if (base_type == SIGHASH_NONE) {
+        /* Wildcard payee */
+        ser_sink_varlen(&sink, 0);
+    } else if (base_type == SIGHASH_SINGLE) {
+        /* Blank out the outputs before the one at the same index as txin */
+        ser_sink_varlen(&sink, in_num + 1);
+        for (i = 0; i < in_num; i++) {
+            ser_sink_s64(&sink, -1);
+            ser_sink_varlen(&sink, 0);
         }
+        btc_tx_out_serialize(&sink, vector_idx(tx_to->vout, in_num));
+    } else if (cache) {
+        ser_sink_bytes(&sink, cache->outputs->str, cache->outputs->len);
+    } else {
+        ser_sink_varlen(&sink, tx_to->vout->len);
+        for (i = 0; i < tx_to->vout->len; i++)
+            btc_tx_out_serialize(&sink, vector_idx(tx_to->vout, i));
+    }
+    ser_sink_u32(&sink, tx_to->locktime);
+    ser_sink_u32(&sink, (uint32_t)hashtype);
 
-        vector_resize(tx_tmp->vout, n_out + 1);
+    sha256_Final(hash, &ctx);
+    sha256_Raw(hash, BTC_HASH_LENGTH, hash);
+    return true;
+}
 
-        for (i = 0; i < n_out; i++) {
-            btc_tx_out* tx_out;
+btc_bool btc_tx_sighash(const btc_tx* tx_to, const cstring* fromPubKey, unsigned int in_num, int hashtype, uint256 hash)
+{
+    return btc_tx_sighash_stream(tx_to, NULL, fromPubKey, in_num, hashtype, hash);
+}
 
-            tx_out = vector_idx(tx_tmp->vout, i);
-            tx_out->value = -1;
-            if (tx_out->script_pubkey) {
-                cstr_free(tx_out->script_pubkey, true);
-                tx_out->script_pubkey = NULL;
-            }
-        }
+/* BIP143 hashPrevouts, hashSequence and hashOutputs */
+static void btc_tx_hash_prevouts(const btc_tx* tx, uint256 hash)
+{
+    SHA256_CTX ctx;
+    btc_ser_sink sink;
+    btc_ser_sink_init(&sink, NULL, &ctx, NULL);
+    sha256_Init(&ctx);
+    for (unsigned int i = 0; i < tx->vin->len; i++) {
+        const btc_tx_in* tx_in = vector_idx(tx->vin, i);
+        ser_sink_u256(&sink, tx_in->prevout.hash);
+        ser_sink_u32(&sink, tx_in->prevout.n);
+    }
+    sha256_Final(hash, &ctx);
+    sha256_Raw(hash, BTC_HASH_LENGTH, hash);
+}
 
-        /* Let the others update at will */
-        for (i = 0; i < tx_tmp->vin->len; i++) {
-            tx_in = vector_idx(tx_tmp->vin, i);
-            if (i != in_num)
-                tx_in->sequence = 0;
-        }
+static void btc_tx_hash_sequence(const btc_tx* tx, uint256 hash)
+{
+    SHA256_CTX ctx;
+    btc_ser_sink sink;
+    btc_ser_sink_init(&sink, NULL, &ctx, NULL);
+    sha256_Init(&ctx);
+    for (unsigned int i = 0; i < tx->vin->len; i++) {
+        const btc_tx_in* tx_in = vector_idx(tx->vin, i);
+        ser_sink_u32(&sink, tx_in->sequence);
     }
+    sha256_Final(hash, &ctx);
+    sha256_Raw(hash, BTC_HASH_LENGTH, hash);
+}
 
-    /* Blank out other inputs completely;
-     not recommended for open transactions */
-    if (hashtype & SIGHASH_ANYONECANPAY) {
-        if (in_num > 0)
-            vector_remove_range(tx_tmp->vin, 0, in_num);
-        vector_resize(tx_tmp->vin, 1);
+/* hash of all outputs, or of the output at index out_num only (out_num >= 0) */
+static void btc_tx_hash_outputs(const btc_tx* tx, int out_num, uint256 hash)
+{
+    SHA256_CTX ctx;
+    btc_ser_sink sink;
+    btc_ser_sink_init(&sink, NULL, &ctx, NULL);
+    sha256_Init(&ctx);
+    for (unsigned int i = 0; i < tx->vout->len; i++) {
+        if (out_num < 0 || (unsigned int)out_num == i)
+            btc_tx_out_serialize(&sink, vector_idx(tx->vout, i));
     }
+    sha256_Final(hash, &ctx);
+    sha256_Raw(hash, BTC_HASH_LENGTH, hash);
+}
+
+static btc_bool btc_tx_sighash_segwit_stream(const btc_tx* tx_to, const btc_tx_sighash_cache* cache, const cstring* script_code, unsigned int in_num, int64_t amount, int hashtype, uint256 hash)
+{
+    if (in_num >= tx_to->vin->len)
+        return false;
 
-    cstring* s = cstr_new_sz(512);
-    btc_tx_serialize(s, tx_tmp);
-    ser_s32(s, hashtype);
+    int base_type = (hashtype & 0x1f);
+    btc_bool anyonecanpay = ((hashtype & SIGHASH_ANYONECANPAY) != 0);
+    btc_bool all = (base_type != SIGHASH_NONE && base_type != SIGHASH_SINGLE);
+
+    uint256 hash_prevouts, hash_sequence, hash_outputs;
+    btc_hash_clear(hash_prevouts);
+    btc_hash_clear(hash_sequence);
+    btc_hash_clear(hash_outputs);
+    if (!anyonecanpay) {
+        if (cache)
+            memcpy(hash_prevouts, cache->hash_prevouts, BTC_HASH_LENGTH);
+        else
+            btc_tx_hash_prevouts(tx_to, hash_prevouts);
+    }
+    if (!anyonecanpay && all) {
+        if (cache)
+            memcpy(hash_sequence, cache->hash_sequence, BTC_HASH_LENGTH);
+        else
+            btc_tx_hash_sequence(tx_to, hash_sequence);
+    }
+    if (all) {
+        if (cache)
+            memcpy(hash_outputs, cache->hash_outputs, BTC_HASH_LENGTH);
+        else
+            btc_tx_hash_outputs(tx_to, -1, hash_outputs);
+    } else if (base_type == SIGHASH_SINGLE && in_num < tx_to->vout->len) {
+        btc_tx_hash_outputs(tx_to, in_num, hash_outputs);
+    }
 
-    sha256_Raw((const uint8_t*)s->str, s->len, hash);
+    const btc_tx_in* tx_in = vector_idx(tx_to->vin, in_num);
+    SHA256_CTX ctx;
+    btc_ser_sink sink;
+    btc_ser_sink_init(&sink, NULL, &ctx, NULL);
+    sha256_Init(&ctx);
+    ser_sink_s32(&sink, tx_to->version);
+    ser_sink_u256(&sink, hash_prevouts);
+    ser_sink_u256(&sink, hash_sequence);
+    ser_sink_u256(&sink, tx_in->prevout.hash);
+    ser_sink_u32(&sink, tx_in->prevout.n);
+    ser_sink_varlen(&sink, script_code->len);
+    ser_sink_bytes(&sink, script_code->str, script_code->len);
+    ser_sink_s64(&sink, amount);
+    ser_sink_u32(&sink, tx_in->sequence);
+    ser_sink_u256(&sink, hash_outputs);
+    ser_sink_u32(&sink, tx_to->locktime);
+    ser_sink_u32(&sink, (uint32_t)hashtype);
+
+    sha256_Final(hash, &ctx);
     sha256_Raw(hash, BTC_HASH_LENGTH, hash);
+    return true;
+}
+
+btc_bool btc_tx_sighash_segwit(const btc_tx* tx_to, const cstring* script_code, unsigned int in_num, int64_t amount, int hashtype, uint256 hash)
+{
+    return btc_tx_sighash_segwit_stream(tx_to, NULL, script_code, in_num, amount, hashtype, hash);
+}
+
+void btc_tx_sighash_cache_init(btc_tx_sighash_cache* cache, const btc_tx* tx)
+{
+    unsigned int i;
+    cache->tx = tx;
+
+    /* the inputs as serialized for the signature hashes of the other inputs */
+    btc_ser_sink str_sink;
+    cache->inputs = cstr_new_sz(tx->vin->len * BTC_TX_SIGHASH_BLANK_INPUT_SIZE);
+    btc_ser_sink_init(&str_sink, cache->inputs, NULL, NULL);
+    for (i = 0; i < tx->vin->len; i++)
+        btc_tx_sighash_blank_input(&str_sink, vector_idx(tx->vin, i), true);
+
+    /* the hash state in front of each input */
+    cache->midstates = btc_malloc((tx->vin->len > 0 ? tx->vin->len : 1) * sizeof(SHA256_CTX));
+    SHA256_CTX ctx;
+    btc_ser_sink sink;
+    btc_ser_sink_init(&sink, NULL, &ctx, NULL);
+    sha256_Init(&ctx);
+    ser_sink_s32(&sink, tx->version);
+    ser_sink_varlen(&sink, tx->vin->len);
+    for (i = 0; i < tx->vin->len; i++) {
+        memcpy(&cache->midstates[i], &ctx, sizeof(ctx));
+        ser_sink_bytes(&sink, cache->inputs->str + i * BTC_TX_SIGHASH_BLANK_INPUT_SIZE, BTC_TX_SIGHASH_BLANK_INPUT_SIZE);
+    }
+
+    cache->outputs = cstr_new_sz(1024);
+    btc_ser_sink_init(&str_sink, cache->outputs, NULL, NULL);
+    ser_sink_varlen(&str_sink, tx->vout->len);
+    for (i = 0; i < tx->vout->len; i++)
+        btc_tx_out_serialize(&str_sink, vector_idx(tx->vout, i));
 
-    cstr_free(s, true);
+    btc_tx_hash_prevouts(tx, cache->hash_prevouts);
+    btc_tx_hash_sequence(tx, cache->hash_sequence);
+    btc_tx_hash_outputs(tx, -1, cache->hash_outputs);
+}
 
-out:
-    btc_tx_free(tx_tmp);
+void btc_tx_sighash_cache_free(btc_tx_sighash_cache* cache)
+{
+    cstr_free(cache->inputs, true);
+    cstr_free(cache->outputs, true);
+    btc_free(cache->midstates);
+    cache->inputs = NULL;
+    cache->outputs = NULL;
+    cache->midstates = NULL;
+}
+
+btc_bool btc_tx_sighash_cached(const btc_tx_sighash_cache* cache, const cstring* fromPubKey, unsigned int in_num, int hashtype, uint256 hash)
+{
+    return btc_tx_sighash_stream(cache->tx, cache, fromPubKey, in_num, hashtype, hash);
+}
 
-    return ret;
+btc_bool btc_tx_sighash_segwit_cached(const btc_tx_sighash_cache* cache, const cstring* script_code, unsigned int in_num, int64_t amount, int hashtype, uint256 hash)
+{
+    return btc_tx_sighash_segwit_stream(cache->tx, cache, script_code, in_num, amount, hashtype, hash);
 }
 
 btc_bool btc_tx_add_data_out(btc_tx* tx, const int64_t amount, const uint8_t *data, const size_t datalen)
@@ -514,6 +863,105 @@ btc_bool btc_tx_add_p2pkh_out(btc_tx* tx, int64_t amount, const btc_pubkey* pubk
     return btc_tx_add_p2pkh_hash160_out(tx, amount, hash160);
 }
 
+void btc_tx_view_init(btc_tx_view* view)
+{
+    memset(view, 0, sizeof(*view));
+}
+
+void btc_tx_view_free(btc_tx_view* view)
+{
+    btc_free(view->offsets);
+    btc_tx_view_init(view);
+}
+
+btc_bool btc_tx_view_parse(btc_tx_view* view, struct const_buffer* buf)
+{
+    struct const_buffer scan = {buf->p, buf->len};
+    uint32_t script_len;
+
+    if (!deser_s32(&view->version, &scan))
+        return false;
+
+    if (!deser_varlen(&view->vin_count, &scan))
+        return false;
+    /* an input takes at least 41 bytes, prevents allocating for bogus counts */
+    if (view->vin_count > scan.len / 41)
+        return false;
+    size_t required = view->vin_count;
+    if (required > view->offsets_alloc) {
+        view->offsets = btc_realloc(view->offsets, required * sizeof(uint32_t));
+        view->offsets_alloc = required;
+    }
+    for (uint32_t i = 0; i < view->vin_count; i++) {
+        view->offsets[i] = (uint32_t)(buf->len - scan.len);
+        if (!deser_skip(&scan, 32 + 4) || !deser_varlen(&script_len, &scan) || !deser_skip(&scan, script_len) || !deser_skip(&scan, 4))
+            return false;
+    }
+
+    if (!deser_varlen(&view->vout_count, &scan))
+        return false;
+    /* an output takes at least 9 bytes */
+    if (view->vout_count > scan.len / 9)
+        return false;
+    required += view->vout_count;
+    if (required > view->offsets_alloc) {
+        view->offsets = btc_realloc(view->offsets, required * sizeof(uint32_t));
+        view->offsets_alloc = required;
+    }
+    for (uint32_t i = 0; i < view->vout_count; i++) {
+        view->offsets[view->vin_count + i] = (uint32_t)(buf->len - scan.len);
+        if (!deser_skip(&scan, 8) || !deser_varlen(&script_len, &scan) || !deser_skip(&scan, script_len))
+            return false;
+    }
+
+    if (!deser_u32(&view->locktime, &scan))
+        return false;
+
+    view->tx.p = buf->p;
+    view->tx.len = buf->len - scan.len;
+    *buf = scan;
+    return true;
+}
+
+btc_bool btc_tx_view_get_input(const btc_tx_view* view, unsigned int idx, btc_tx_in_view* in)
+{
+    if (idx >= view->vin_count)
+        return false;
+
+    struct const_buffer buf = {(const uint8_t*)view->tx.p + view->offsets[idx], view->tx.len - view->offsets[idx]};
+    uint32_t script_len;
+    in->prevout_hash = buf.p;
+    deser_skip(&buf, 32);
+    deser_u32(&in->prevout_n, &buf);
+    deser_varlen(&script_len, &buf);
+    in->script_sig.p = buf.p;
+    in->script_sig.len = script_len;
+    deser_skip(&buf, script_len);
+    return deser_u32(&in->sequence, &buf);
+}
+
+btc_bool btc_tx_view_get_output(const btc_tx_view* view, unsigned int idx, btc_tx_out_view* out)
+{
+    if (idx >= view->vout_count)
+        return false;
+
+    unsigned int offset = view->offsets[view->vin_count + idx];
+    struct const_buffer buf = {(const uint8_t*)view->tx.p + offset, view->tx.len - offset};
+    uint32_t script_len;
+    deser_s64(&out->value, &buf);
+    if (!deser_varlen(&script_len, &buf))
+        return false;
+    out->script_pubkey.p = buf.p;
+    out->script_pubkey.len = script_len;
+    return true;
+}
+
+void btc_tx_view_hash(const btc_tx_view* view, uint256 hashout)
+{
+    sha256_Raw(view->tx.p, view->tx.len, hashout);
+    sha256_Raw(hashout, BTC_HASH_LENGTH, hashout);
+}
+
 btc_bool btc_tx_outpoint_is_null(btc_tx_outpoint* tx)
 {
     (void)(tx);
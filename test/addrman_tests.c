@@ -0,0 +1,235 @@
+/**********************************************************************
+ * Copyright (c) 2017 Jonas Schnelli                                  *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <btc/addrman.h>
+#include <btc/net.h>
+#include <btc/serialize.h>
+#include <btc/utils.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "utest.h"
+
+static const char* addrman_test_file = "addrman_test.dat";
+
+static void addrman_test_addr(btc_p2p_address* addr, unsigned int i, uint32_t time)
+{
+    btc_p2p_address_init(addr);
+    addr->ip[10] = 0xff;
+    addr->ip[11] = 0xff;
+    /* a distinct /16 group for every address */
+    addr->ip[12] = 10 + (i % 100);
+    addr->ip[13] = (uint8_t)(i / 100);
+    addr->ip[14] = (uint8_t)i;
+    addr->ip[15] = 1;
+    addr->port = 8333;
+    addr->services = BTC_NODE_NETWORK;
+    addr->time = time;
+}
+
+void test_addrman()
+{
+    const uint32_t now = 1500000000;
+    btc_addrman* addrman = btc_addrman_new();
+    btc_p2p_address addr, selected;
+    u_assert_int_eq(btc_addrman_select(addrman, now, BTC_NODE_NETWORK, &selected), false);
+
+    /* learned addresses go to the new table, spread across the buckets */
+    size_t added = 0;
+    for (unsigned int i = 0; i < 200; i++) {
+        addrman_test_addr(&addr, i, now - 3600);
+        added += btc_addrman_add(addrman, &addr, now);
+    }
+    u_assert_int_eq(added > 150, true);
+    u_assert_int_eq(btc_addrman_size(addrman), added);
+    u_assert_int_eq(addrman->tried_count, 0);
+
+    /* known addresses are only refreshed */
+    addrman_test_addr(&addr, 0, now - 60);
+    u_assert_int_eq(btc_addrman_add(addrman, &addr, now), false);
+    u_assert_int_eq(btc_addrman_size(addrman), added);
+
+    /* invalid addresses are ignored */
+    addrman_test_addr(&addr, 1, now);
+    addr.port = 0;
+    u_assert_int_eq(btc_addrman_add(addrman, &addr, now), false);
+
+    /* a successful connection moves the address to the tried table */
+    addrman_test_addr(&addr, 0, now);
+    btc_addrman_attempt(addrman, &addr, now);
+    btc_addrman_good(addrman, &addr, now);
+    u_assert_int_eq(addrman->tried_count, 1);
+    u_assert_int_eq(btc_addrman_size(addrman), added);
+
+    /* unknown peers we connected to are added directly */
+    addrman_test_addr(&addr, 5000, now);
+    btc_addrman_good(addrman, &addr, now);
+    u_assert_int_eq(btc_addrman_size(addrman), added + 1);
+
+    for (unsigned int i = 0; i < 20; i++) {
+        u_assert_int_eq(btc_addrman_select(addrman, now, BTC_NODE_NETWORK, &selected), true);
+        u_assert_int_eq(selected.port, 8333);
+    }
+    /* addresses lacking a required service are never selected */
+    u_assert_int_eq(btc_addrman_select(addrman, now, BTC_NODE_NETWORK | BTC_NODE_COMPACT_FILTERS, &selected), false);
+    btc_addrman* filters = btc_addrman_new();
+    addrman_test_addr(&addr, 6000, now);
+    addr.services |= BTC_NODE_COMPACT_FILTERS;
+    btc_addrman_add(filters, &addr, now);
+    u_assert_int_eq(btc_addrman_select(filters, now, BTC_NODE_NETWORK | BTC_NODE_COMPACT_FILTERS, &selected), true);
+    u_assert_mem_eq(selected.ip, addr.ip, sizeof(addr.ip));
+    btc_addrman_free(filters);
+
+    btc_p2p_address sample[MAX_ADDR_SIZE];
+    size_t sampled = btc_addrman_get_addr(addrman, now, sample, MAX_ADDR_SIZE);
+    u_assert_int_eq(sampled, btc_addrman_size(addrman) * 23 / 100 + 1);
+    u_assert_int_eq(btc_addrman_get_addr(addrman, now, sample, 5), 5);
+
+    /* addresses failing repeatedly become terrible and are not handed out anymore */
+    btc_addrman* small = btc_addrman_new();
+    addrman_test_addr(&addr, 7, now);
+    btc_addrman_add(small, &addr, now);
+    u_assert_int_eq(btc_addrman_get_addr(small, now, sample, MAX_ADDR_SIZE), 1);
+    for (int i = 0; i < 3; i++)
+        btc_addrman_attempt(small, &addr, now - 3600);
+    u_assert_int_eq(btc_addrman_get_addr(small, now, sample, MAX_ADDR_SIZE), 0);
+    btc_addrman_free(small);
+
+    /* persist and load */
+    unlink(addrman_test_file);
+    u_assert_int_eq(btc_addrman_load(addrman, addrman_test_file), false);
+    u_assert_int_eq(btc_addrman_write(addrman, addrman_test_file), true);
+    btc_addrman* loaded = btc_addrman_new();
+    u_assert_int_eq(btc_addrman_load(loaded, addrman_test_file), true);
+    u_assert_int_eq(btc_addrman_size(loaded), btc_addrman_size(addrman));
+    u_assert_int_eq(loaded->tried_count, addrman->tried_count);
+    u_assert_mem_eq(loaded->key, addrman->key, sizeof(addrman->key));
+    addrman_test_addr(&addr, 0, now);
+    u_assert_int_eq(btc_addrman_add(loaded, &addr, now), false);
+    btc_addrman_free(loaded);
+
+    /* corrupted files are rejected */
+    FILE* file = fopen(addrman_test_file, "r+b");
+    fseek(file, 0, SEEK_END);
+    fputc(0, file);
+    fclose(file);
+    loaded = btc_addrman_new();
+    u_assert_int_eq(btc_addrman_load(loaded, addrman_test_file), false);
+    u_assert_int_eq(btc_addrman_size(loaded), 0);
+    btc_addrman_free(loaded);
+    unlink(addrman_test_file);
+
+    btc_addrman_free(addrman);
+}
+
+void test_addrman_messages()
+{
+    btc_node_group* group = btc_node_group_new(NULL);
+    btc_node* node = btc_node_new();
+    btc_node_group_add_node(group, node);
+    node->state |= NODE_CONNECTED;
+    node->event_bev = bufferevent_socket_new(group->event_base, -1, 0);
+
+    /* addr messages feed the address manager */
+    btc_p2p_address addrs[10];
+    uint32_t now = (uint32_t)time(NULL);
+    for (unsigned int i = 0; i < 10; i++)
+        addrman_test_addr(&addrs[i], i, now - 600);
+    addrs[3].port = 18444;
+    cstring* payload = cstr_new_sz(512);
+    btc_p2p_msg_addr(addrs, 10, payload);
+
+    btc_p2p_address check[MAX_ADDR_SIZE];
+    size_t count = 0;
+    struct const_buffer buf = {payload->str, payload->len};
+    u_assert_int_eq(btc_p2p_deser_msg_addr(check, &count, &buf), true);
+    u_assert_int_eq(count, 10);
+    u_assert_int_eq(check[3].port, 18444);
+    /* ports are big endian on the wire */
+    u_assert_int_eq(((const uint8_t*)payload->str)[1 + 3 * 30 + 28], 18444 >> 8);
+
+    btc_p2p_msg_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.netmagic, group->chainparams->netmagic, 4);
+    strcpy(hdr.command, BTC_MSG_ADDR);
+    hdr.command_id = BTC_CMD_ADDR;
+    buf.p = payload->str;
+    buf.len = payload->len;
+    btc_node_parse_message(node, &hdr, &buf);
+    u_assert_int_eq(btc_addrman_size(group->addrman) > 5, true);
+
+    /* getaddr is answered once per connection with an addr message */
+    struct evbuffer* output = bufferevent_get_output(node->event_bev);
+    strcpy(hdr.command, BTC_MSG_GETADDR);
+    hdr.command_id = BTC_CMD_GETADDR;
+    buf.p = NULL;
+    buf.len = 0;
+    btc_node_parse_message(node, &hdr, &buf);
+    size_t sent = evbuffer_get_length(output);
+    u_assert_int_eq(sent > 24, true);
+    btc_node_parse_message(node, &hdr, &buf);
+    u_assert_int_eq(evbuffer_get_length(output), sent);
+
+    unsigned char* msg = evbuffer_pullup(output, sent);
+    struct const_buffer msg_buf = {msg, sent};
+    btc_p2p_msg_hdr reply;
+    btc_p2p_deser_msghdr(&reply, &msg_buf);
+    u_assert_int_eq(reply.command_id, BTC_CMD_ADDR);
+    u_assert_int_eq(btc_p2p_deser_msg_addr(check, &count, &msg_buf), true);
+    u_assert_int_eq(count > 0, true);
+
+    /* peers without the required services are dropped before the handshake completes */
+    btc_node* limited = btc_node_new();
+    btc_node_group_add_node(group, limited);
+    limited->state |= NODE_CONNECTED;
+    limited->event_bev = bufferevent_socket_new(group->event_base, -1, 0);
+    btc_p2p_version_msg version;
+    btc_p2p_msg_version_init(&version, NULL, NULL, "limited", false);
+    version.services = 0;
+    version.start_height = 1000;
+    cstring* version_payload = cstr_new_sz(256);
+    btc_p2p_msg_version_ser(&version, version_payload);
+    strcpy(hdr.command, BTC_MSG_VERSION);
+    hdr.command_id = BTC_CMD_VERSION;
+    buf.p = version_payload->str;
+    buf.len = version_payload->len;
+    btc_node_parse_message(limited, &hdr, &buf);
+    u_assert_int_eq((btc_node_get_state(limited) & (NODE_CONNECTED | NODE_DISCONNECTED)), NODE_DISCONNECTED);
+    u_assert_int_eq(limited->bestknownheight, 0);
+    u_assert_int_eq(limited->services, 0);
+    cstr_free(version_payload, true);
+
+    /* oversized addr messages get the peer disconnected */
+    cstr_resize(payload, 0);
+    ser_varlen(payload, MAX_ADDR_SIZE + 1);
+    strcpy(hdr.command, BTC_MSG_ADDR);
+    hdr.command_id = BTC_CMD_ADDR;
+    buf.p = payload->str;
+    buf.len = payload->len;
+    btc_node_parse_message(node, &hdr, &buf);
+    u_assert_int_eq((node->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED, true);
+
+    /* connect_next_nodes picks candidates from the address manager (connections fail later),
+       dead nodes are never reused, references to them can still be around */
+    group->desired_amount_connected_nodes = 1;
+    size_t nodes_before = group->nodes->len;
+    int nodeid = node->nodeid;
+    btc_node_group_connect_next_nodes(group);
+    u_assert_int_eq(node->nodeid, nodeid);
+    u_assert_int_eq((btc_node_get_state(node) & NODE_CONNECTING), 0);
+    btc_node* added = vector_idx(group->nodes, group->nodes->len - 1);
+    u_assert_int_eq(added->nodeid > nodeid, true);
+    u_assert_int_eq(group->nodes->len > nodes_before, true);
+
+    cstr_free(payload, true);
+    btc_node_group_free(group);
+}
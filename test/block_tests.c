@@ -68,6 +68,9 @@ void test_block_header()
         utils_reverse_hex(hexbuf, BTC_HASH_LENGTH*2);
         assert(memcmp(hexbuf, test->hexhash, BTC_HASH_LENGTH*2) == 0);
 
+        // Check the proof of work
+        u_assert_int_eq(btc_block_header_check_pow(header, blockhash), true);
+
         // Check version, ts, bits, nonce
         assert(header->version == test->version);
         assert(header->timestamp == test->timestamp);
@@ -150,4 +153,143 @@ void test_block_header()
 
     btc_block_header_hash(&bheaderprev, (uint8_t *)&checkhash);
     u_assert_mem_eq(&checkhash, &bheader.prev_block, sizeof(checkhash));
+
+    /* proof of work */
+    btc_block_header_hash(&bheader, (uint8_t *)&checkhash);
+    u_assert_int_eq(btc_block_header_check_pow(&bheader, checkhash), true);
+    bheader.nonce++;
+    btc_block_header_hash(&bheader, (uint8_t *)&checkhash);
+    u_assert_int_eq(btc_block_header_check_pow(&bheader, checkhash), false);
+    bheader.nonce--;
+    btc_block_header_hash(&bheader, (uint8_t *)&checkhash);
+    bheader.bits = 0x1d00ffff; /* easier target than the block was mined for */
+    u_assert_int_eq(btc_block_header_check_pow(&bheader, checkhash), true);
+    bheader.bits = 0x18000000; /* zero target */
+    u_assert_int_eq(btc_block_header_check_pow(&bheader, checkhash), false);
+    bheader.bits = 0x1d80ffff; /* negative target */
+    u_assert_int_eq(btc_block_header_check_pow(&bheader, checkhash), false);
+    bheader.bits = 0x2300ffff; /* overflowing target */
+    u_assert_int_eq(btc_block_header_check_pow(&bheader, checkhash), false);
+}
+
+static btc_tx* block_test_tx(uint32_t n)
+{
+    btc_tx* tx = btc_tx_new();
+    tx->version = 1;
+    tx->locktime = n;
+    btc_tx_in* tx_in = btc_tx_in_new();
+    tx_in->prevout.n = n;
+    tx_in->script_sig = cstr_new_buf(&n, sizeof(n));
+    vector_add(tx->vin, tx_in);
+    uint8_t data[4] = {0};
+    btc_tx_add_data_out(tx, n, data, sizeof(data));
+    return tx;
+}
+
+void test_block_merkle()
+{
+    /* block 100000 */
+    const char* txids_hex[] = {
+        "8c14f0db3df150123e6f3dbbf30f8b955a8249b62ac1d1ff16284aefa3d06d87",
+        "fff2525b8931402dd09222c50775608f75787bd2b87e56995a7bdd30f79702c4",
+        "6359f0868171b1d194cbee1af2f16ea598ae8fad666d9b012c8ed2b79a236ec4",
+        "e9a66845e05d5abc0ad04ec80f774a7e585c6e8db975962d069a522137b80c1d"};
+    uint256 txids[4];
+    uint256 root;
+    btc_bool mutated;
+    int outlen;
+    for (unsigned int i = 0; i < 4; i++) {
+        char hex[65];
+        memcpy(hex, txids_hex[i], sizeof(hex));
+        utils_reverse_hex(hex, 64);
+        utils_hex_to_bin(hex, txids[i], 64, &outlen);
+    }
+    btc_block_merkle_root((const uint256*)txids, 4, NULL, root, &mutated);
+    u_assert_int_eq(mutated, false);
+    char root_hex[65];
+    utils_bin_to_hex(root, BTC_HASH_LENGTH, root_hex);
+    utils_reverse_hex(root_hex, 64);
+    u_assert_str_eq(root_hex, "f3e94742aca4b5ef85488dc37c06c3282295ffec960994b2c0d5ac2a25a95766");
+
+    /* a duplicated last transaction results in the same root but is detected (CVE-2012-2459) */
+    uint256 root_odd;
+    memcpy(txids[3], txids[2], BTC_HASH_LENGTH);
+    btc_block_merkle_root((const uint256*)txids, 3, NULL, root_odd, &mutated);
+    u_assert_int_eq(mutated, false);
+    btc_block_merkle_root((const uint256*)txids, 4, NULL, root, &mutated);
+    u_assert_int_eq(mutated, true);
+    u_assert_mem_eq(root, root_odd, BTC_HASH_LENGTH);
+
+    /* a block with enough transactions to be spread across the pool */
+    const uint32_t amount = 1001;
+    btc_threadpool* pool = btc_threadpool_new(3);
+    uint256* hashes = btc_malloc(amount * sizeof(uint256));
+    cstring* txs = cstr_new_sz(amount * 100);
+    for (uint32_t i = 0; i < amount; i++) {
+        btc_tx* tx = block_test_tx(i);
+        btc_tx_hash(tx, hashes[i]);
+        btc_tx_serialize(txs, tx);
+        btc_tx_free(tx);
+    }
+    btc_block_header header;
+    memset(&header, 0, sizeof(header));
+    header.version = 4;
+    header.bits = 0x207fffff;
+    btc_block_merkle_root((const uint256*)hashes, amount, pool, header.merkle_root, &mutated);
+    u_assert_int_eq(mutated, false);
+    btc_block_merkle_root((const uint256*)hashes, amount, NULL, root, NULL);
+    u_assert_mem_eq(root, header.merkle_root, BTC_HASH_LENGTH);
+
+    cstring* serialized = cstr_new_sz(txs->len + 100);
+    btc_block_header_serialize(serialized, &header);
+    ser_varlen(serialized, amount);
+    cstr_append_buf(serialized, txs->str, txs->len);
+
+    btc_block* block = btc_block_new();
+    struct const_buffer buf = {serialized->str, serialized->len};
+    u_assert_int_eq(btc_block_deserialize(block, &buf, pool), true);
+    u_assert_int_eq(buf.len, 0);
+    u_assert_int_eq(block->tx_count, amount);
+    uint256 hash;
+    btc_block_header_hash(&header, hash);
+    u_assert_mem_eq(block->hash, hash, BTC_HASH_LENGTH);
+    u_assert_int_eq(btc_block_check_merkle_root(block, pool), true);
+    cstring* reserialized = cstr_new_sz(txs->len);
+    for (uint32_t i = 0; i < amount; i++) {
+        u_assert_mem_eq(block->txids[i], hashes[i], BTC_HASH_LENGTH);
+        u_assert_int_eq(block->txs[i]->locktime, i);
+        btc_tx_serialize(reserialized, block->txs[i]);
+    }
+    u_assert_int_eq(cstr_equal(reserialized, txs), true);
+
+    /* hashing only leaves the transactions undecoded */
+    btc_block* hashed = btc_block_new();
+    buf.p = serialized->str;
+    buf.len = serialized->len;
+    u_assert_int_eq(btc_block_deserialize_txids(hashed, &buf, pool), true);
+    u_assert_int_eq(buf.len, 0);
+    u_assert_is_null(hashed->txs);
+    u_assert_int_eq(hashed->tx_count, amount);
+    u_assert_mem_eq(hashed->txids, block->txids, amount * sizeof(uint256));
+    u_assert_int_eq(btc_block_check_merkle_root(hashed, pool), true);
+    btc_block_free(hashed);
+
+    /* a header not committing to the transactions is rejected */
+    block->header.merkle_root[0] ^= 1;
+    u_assert_int_eq(btc_block_check_merkle_root(block, NULL), false);
+    btc_block_free(block);
+
+    /* truncated blocks are rejected */
+    block = btc_block_new();
+    buf.p = serialized->str;
+    buf.len = serialized->len - 1;
+    u_assert_int_eq(btc_block_deserialize(block, &buf, NULL), false);
+    u_assert_int_eq(buf.len, serialized->len - 1);
+    btc_block_free(block);
+
+    cstr_free(reserialized, true);
+    cstr_free(serialized, true);
+    cstr_free(txs, true);
+    btc_free(hashes);
+    btc_threadpool_free(pool);
 }
@@ -0,0 +1,89 @@
+/**********************************************************************
+ * Copyright (c) 2017 Jonas Schnelli                                  *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/blockfilter.h>
+#include <btc/utils.h>
+
+#include "utest.h"
+
+void test_blockfilter()
+{
+    /* siphash-2-4 reference vectors */
+    uint8_t msg[15];
+    for (unsigned int i = 0; i < sizeof(msg); i++)
+        msg[i] = i;
+    const uint64_t k0 = 0x0706050403020100ULL, k1 = 0x0f0e0d0c0b0a0908ULL;
+    u_assert_int_eq(btc_siphash(k0, k1, msg, 0) == 0x726fdb47dd0e0e31ULL, true);
+    u_assert_int_eq(btc_siphash(k0, k1, msg, 15) == 0xa129ca6149be45e5ULL, true);
+
+    /* BIP158 test vector, testnet genesis block */
+    uint256 block_hash;
+    utils_uint256_sethex("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943", block_hash);
+    uint8_t script[67];
+    int outlen;
+    utils_hex_to_bin("4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac", script, 134, &outlen);
+    struct const_buffer element = {script, sizeof(script)};
+
+    cstring* filter = cstr_new_sz(16);
+    btc_blockfilter_build(filter, block_hash, &element, 1);
+    char hex[1024];
+    utils_bin_to_hex((unsigned char*)filter->str, filter->len, hex);
+    u_assert_str_eq(hex, "019dfca8");
+
+    uint256 filter_hash, header, prev_header;
+    memset(prev_header, 0, sizeof(prev_header));
+    btc_blockfilter_hash((const uint8_t*)filter->str, filter->len, filter_hash);
+    btc_blockfilter_header(filter_hash, prev_header, header);
+    utils_bin_to_hex(header, BTC_HASH_LENGTH, hex);
+    utils_reverse_hex(hex, BTC_HASH_LENGTH * 2);
+    u_assert_str_eq(hex, "21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750");
+
+    /* match the filter against a set of unrelated scripts and the genesis script */
+    btc_blockfilter_matcher* matcher = btc_blockfilter_matcher_new();
+    uint8_t other[25];
+    memset(other, 0, sizeof(other));
+    for (unsigned int i = 0; i < 1000; i++) {
+        other[0] = i & 0xff;
+        other[1] = (i >> 8) & 0xff;
+        btc_blockfilter_matcher_add(matcher, other, sizeof(other));
+    }
+    u_assert_int_eq(btc_blockfilter_match_any(matcher, block_hash, (const uint8_t*)filter->str, filter->len), false);
+    btc_blockfilter_matcher_add(matcher, script, sizeof(script));
+    u_assert_int_eq(btc_blockfilter_match_any(matcher, block_hash, (const uint8_t*)filter->str, filter->len), true);
+    cstr_free(filter, true);
+
+    /* larger filter with duplicates */
+    struct const_buffer elements[301];
+    uint8_t data[300][20];
+    for (unsigned int i = 0; i < 300; i++) {
+        memset(data[i], 0xab, sizeof(data[i]));
+        data[i][0] = i & 0xff;
+        data[i][1] = (i >> 8) & 0xff;
+        elements[i].p = data[i];
+        elements[i].len = sizeof(data[i]);
+    }
+    elements[300] = elements[17];
+    filter = cstr_new_sz(1024);
+    btc_blockfilter_build(filter, block_hash, elements, 301);
+    u_assert_int_eq((uint8_t)filter->str[0], 0xfd);
+    u_assert_int_eq((uint8_t)filter->str[1] | ((uint8_t)filter->str[2] << 8), 300);
+    u_assert_int_eq(btc_blockfilter_match_any(matcher, block_hash, (const uint8_t*)filter->str, filter->len), false);
+
+    btc_blockfilter_matcher* single = btc_blockfilter_matcher_new();
+    btc_blockfilter_matcher_add(single, data[299], sizeof(data[299]));
+    u_assert_int_eq(btc_blockfilter_match_any(single, block_hash, (const uint8_t*)filter->str, filter->len), true);
+
+    /* a truncated filter never matches */
+    u_assert_int_eq(btc_blockfilter_match_any(single, block_hash, (const uint8_t*)filter->str, 3), false);
+    cstr_free(filter, true);
+
+    btc_blockfilter_matcher_free(single);
+    btc_blockfilter_matcher_free(matcher);
+}
@@ -0,0 +1,57 @@
+/**********************************************************************
+ * Copyright (c) 2017 Jonas Schnelli                                  *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/blockindex_map.h>
+#include <btc/hash.h>
+#include <btc/utils.h>
+
+#include "utest.h"
+
+void test_blockindex_map()
+{
+    const unsigned int amount = 1000;
+    btc_blockindex* indexes = btc_calloc(amount, sizeof(btc_blockindex));
+    btc_blockindex_map* map = btc_blockindex_map_new(0);
+
+    for (unsigned int i = 0; i < amount; i++) {
+        uint32_t seed = i;
+        btc_hash((const unsigned char*)&seed, sizeof(seed), indexes[i].hash);
+        /* force colliding keys for some entries (same first 8 bytes) */
+        if (i % 10 == 1)
+            memcpy(indexes[i].hash, indexes[i - 1].hash, 8);
+        indexes[i].height = i;
+        u_assert_int_eq(btc_blockindex_map_insert(map, &indexes[i]), true);
+    }
+    u_assert_int_eq(map->count, amount);
+    u_assert_int_eq(btc_blockindex_map_insert(map, &indexes[5]), false);
+
+    for (unsigned int i = 0; i < amount; i++) {
+        btc_blockindex* found = btc_blockindex_map_find(map, indexes[i].hash);
+        u_assert_int_eq(found == &indexes[i], true);
+    }
+
+    uint256 unknown;
+    memset(unknown, 0xAB, sizeof(unknown));
+    u_assert_int_eq(btc_blockindex_map_find(map, unknown) == NULL, true);
+    u_assert_int_eq(btc_blockindex_map_remove(map, unknown), false);
+
+    /* remove every second entry, the others must remain reachable */
+    for (unsigned int i = 0; i < amount; i += 2) {
+        u_assert_int_eq(btc_blockindex_map_remove(map, indexes[i].hash), true);
+    }
+    u_assert_int_eq(map->count, amount / 2);
+    for (unsigned int i = 0; i < amount; i++) {
+        btc_blockindex* found = btc_blockindex_map_find(map, indexes[i].hash);
+        u_assert_int_eq(found == ((i % 2) ? &indexes[i] : NULL), true);
+    }
+
+    btc_blockindex_map_free(map, NULL);
+    btc_free(indexes);
+}
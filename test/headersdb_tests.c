@@ -0,0 +1,454 @@
+/**********************************************************************
+ * Copyright (c) 2017 Jonas Schnelli                                  *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <btc/block.h>
+#include <btc/blockchain.h>
+#include <btc/blockindex_map.h>
+#include <btc/chainparams.h>
+#include <btc/headersdb_file.h>
+#include <btc/memory.h>
+#include <btc/serialize.h>
+#include <btc/utils.h>
+
+#include "utest.h"
+
+static const char* headersdb_test_file = "headersdb_test.db";
+
+/* creates a chain of amount headers on top of the mainnet genesis block */
+static cstring* create_test_chain(unsigned int amount, uint256* hashes)
+{
+    cstring* chain = cstr_new_sz(amount * 80);
+    uint256 prev;
+    memcpy(prev, btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+    for (unsigned int i = 0; i < amount; i++) {
+        btc_block_header header;
+        memset(&header, 0, sizeof(header));
+        header.version = 1;
+        memcpy(header.prev_block, prev, BTC_HASH_LENGTH);
+        header.merkle_root[0] = i & 0xff;
+        header.merkle_root[1] = (i >> 8) & 0xff;
+        header.timestamp = 1231006505 + i * 600;
+        header.bits = 0x1d00ffff;
+        header.nonce = i;
+        btc_block_header_serialize(chain, &header);
+        btc_block_header_hash(&header, prev);
+        memcpy(hashes[i], prev, BTC_HASH_LENGTH);
+    }
+    return chain;
+}
+
+/* mainnet block 1 and 2 as entries of a headers message */
+static const char* headers_msg_entries[] = {
+    "010000006fe28c0ab6f1b372c1a6a246ae63f74f931e8365e15a089c68d6190000000000982051fd1e4ba744bbbe680e1fee14677ba1a3c3540bf7b1cdb606e857233e0e61bc6649ffff001d01e3629900",
+    "010000004860eb18bf1b1620e37e9490fc8a427514416fd75159ab86688e9a8300000000d5fdcc541e25de1c7a5addedf24858b8bb665c9f36ef744ee42c316022c90f9bb0bc6649ffff001d08d2bd6100"};
+
+static void test_headersdb_prepare()
+{
+    uint8_t msg[3 * BTC_HEADERS_MSG_ENTRY_SIZE];
+    int outlen;
+    for (unsigned int i = 0; i < 2; i++)
+        utils_hex_to_bin(headers_msg_entries[i], msg + i * BTC_HEADERS_MSG_ENTRY_SIZE, BTC_HEADERS_MSG_ENTRY_SIZE * 2, &outlen);
+    /* third entry doesn't link to the second one */
+    memcpy(msg + 2 * BTC_HEADERS_MSG_ENTRY_SIZE, msg, BTC_HEADERS_MSG_ENTRY_SIZE);
+
+    btc_threadpool* pool = btc_threadpool_new(2);
+    btc_blockindex* prepared[3];
+    struct const_buffer buf = {msg, sizeof(msg)};
+    u_assert_int_eq(btc_blockindex_prepare_headers(pool, &buf, 3, prepared), 2);
+    u_assert_int_eq(buf.len, 0);
+    u_assert_mem_eq(prepared[0]->header.prev_block, btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+    u_assert_mem_eq(prepared[1]->header.prev_block, prepared[0]->hash, BTC_HASH_LENGTH);
+    u_assert_int_eq(prepared[2] == NULL, true);
+
+    /* connecting prepared headers only links them */
+    btc_headers_db* db = btc_headers_db_new(&btc_chainparams_main, true);
+    for (unsigned int i = 0; i < 2; i++) {
+        btc_bool connected = false;
+        btc_headers_db_connect_blockindex(db, prepared[i], false, &connected);
+        u_assert_int_eq(connected, true);
+    }
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, 2);
+    btc_headers_db_free(db);
+
+    /* a broken proof of work invalidates the header and all following */
+    msg[BTC_HEADERS_MSG_ENTRY_SIZE + 76]++;
+    buf.p = msg;
+    buf.len = 2 * BTC_HEADERS_MSG_ENTRY_SIZE;
+    u_assert_int_eq(btc_blockindex_prepare_headers(NULL, &buf, 2, prepared), 1);
+    u_assert_int_eq(prepared[1] == NULL, true);
+    btc_free(prepared[0]);
+    btc_threadpool_free(pool);
+}
+
+static void test_headersdb_ancestors(const cstring* chain, uint256* hashes, unsigned int amount)
+{
+    /* keep all headers in memory */
+    btc_headers_db* db = btc_headers_db_new(&btc_chainparams_main, true);
+    db->max_hdr_in_mem = 0;
+    struct const_buffer buf = {chain->str, chain->len};
+    for (unsigned int i = 0; i < amount; i++) {
+        btc_bool connected = false;
+        btc_headers_db_connect_hdr(db, &buf, false, &connected);
+        u_assert_int_eq(connected, true);
+    }
+    btc_blockindex* tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(tip->pskip != NULL, true);
+    for (unsigned int height = 1; height <= amount; height++)
+        u_assert_mem_eq(btc_blockindex_get_ancestor(tip, height)->hash, hashes[height - 1], BTC_HASH_LENGTH);
+    u_assert_int_eq(btc_blockindex_get_ancestor(tip, 0) == &db->genesis, true);
+    u_assert_int_eq(btc_blockindex_get_ancestor(tip, amount + 1) == NULL, true);
+
+    /* dense entries, then exponential steps back to the genesis block */
+    uint256 locator[BTC_BLOCK_LOCATOR_MAX];
+    size_t count = btc_headers_db_fill_block_locator(db, locator, BTC_BLOCK_LOCATOR_MAX);
+    u_assert_int_eq(count, 20);
+    const unsigned int heights[] = {300, 299, 298, 297, 296, 295, 294, 293, 292, 291, 290, 289, 287, 283, 275, 259, 227, 163, 35};
+    for (unsigned int i = 0; i < count - 1; i++)
+        u_assert_mem_eq(locator[i], hashes[heights[i] - 1], BTC_HASH_LENGTH);
+    u_assert_mem_eq(locator[count - 1], btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+
+    /* the locator is bounded by the caller's buffer, genesis stays the last entry */
+    u_assert_int_eq(btc_headers_db_fill_block_locator(db, locator, 5), 5);
+    u_assert_mem_eq(locator[3], hashes[296], BTC_HASH_LENGTH);
+    u_assert_mem_eq(locator[4], btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+    btc_headers_db_free(db);
+
+    /* with a limited in-memory window, ancestors stop at the lowest kept header */
+    db = btc_headers_db_new(&btc_chainparams_main, true);
+    buf.p = chain->str;
+    buf.len = chain->len;
+    for (unsigned int i = 0; i < amount; i++) {
+        btc_bool connected = false;
+        btc_headers_db_connect_hdr(db, &buf, false, &connected);
+    }
+    tip = btc_headersdb_getchaintip(db);
+    u_assert_int_eq(btc_headersdb_get_ancestor(db, tip, 10) == NULL, true);
+    u_assert_mem_eq(btc_headersdb_get_ancestor(db, tip, db->chainbottom->height)->hash, db->chainbottom->hash, BTC_HASH_LENGTH);
+    count = btc_headers_db_fill_block_locator(db, locator, BTC_BLOCK_LOCATOR_MAX);
+    u_assert_mem_eq(locator[count - 2], db->chainbottom->hash, BTC_HASH_LENGTH);
+    u_assert_mem_eq(locator[count - 1], btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+    btc_headers_db_free(db);
+}
+
+/* live allocations made through btc_malloc & co. */
+static long headersdb_test_allocations = 0;
+
+static void* headersdb_test_malloc(size_t size)
+{
+    headersdb_test_allocations++;
+    return malloc(size);
+}
+
+static void* headersdb_test_calloc(size_t count, size_t size)
+{
+    headersdb_test_allocations++;
+    return calloc(count, size);
+}
+
+static void* headersdb_test_realloc(void* ptr, size_t size)
+{
+    if (!ptr)
+        headersdb_test_allocations++;
+    return realloc(ptr, size);
+}
+
+static void headersdb_test_free(void* ptr)
+{
+    if (ptr)
+        headersdb_test_allocations--;
+    free(ptr);
+}
+
+/* connects a header competing with the main chain header at prev's height + 1 */
+static void connect_fork_header(btc_headers_db* db, const uint256 prev, uint32_t nonce, uint256 hash_out)
+{
+    btc_block_header header;
+    memset(&header, 0, sizeof(header));
+    header.version = 1;
+    memcpy(header.prev_block, prev, BTC_HASH_LENGTH);
+    header.bits = 0x1d00ffff;
+    header.nonce = 0x80000000 | nonce;
+    cstring* ser = cstr_new_sz(80);
+    btc_block_header_serialize(ser, &header);
+    btc_block_header_hash(&header, hash_out);
+    struct const_buffer buf = {ser->str, ser->len};
+    btc_bool connected = false;
+    btc_headers_db_connect_hdr(db, &buf, false, &connected);
+    u_assert_int_eq(connected, true);
+    cstr_free(ser, true);
+}
+
+static void test_headersdb_forks(const cstring* chain, uint256* hashes, unsigned int amount)
+{
+    btc_mem_mapper mapper = {headersdb_test_malloc, headersdb_test_calloc, headersdb_test_realloc, headersdb_test_free};
+    btc_mem_set_mapper(mapper);
+    headersdb_test_allocations = 0;
+
+    btc_headers_db* db = btc_headers_db_new(&btc_chainparams_main, true);
+    struct const_buffer buf = {chain->str, chain->len};
+    uint256 first_fork, fork_hash;
+    long allocations[2] = {0, 0};
+    for (unsigned int i = 0; i < amount; i++) {
+        btc_bool connected = false;
+        btc_headers_db_connect_hdr(db, &buf, false, &connected);
+        u_assert_int_eq(connected, true);
+        if (i == 0)
+            continue;
+
+        /* a competing header of the same height on every block */
+        connect_fork_header(db, hashes[i - 1], i, fork_hash);
+        if (i == 1)
+            memcpy(first_fork, fork_hash, BTC_HASH_LENGTH);
+        if (i % 50 != 1)
+            u_assert_mem_eq(btc_headersdb_getchaintip(db)->hash, hashes[i], BTC_HASH_LENGTH);
+
+        /* every 50 blocks a longer fork replaces the tip until the main chain takes over again (one block later) */
+        if (i % 50 == 0) {
+            connect_fork_header(db, fork_hash, i, fork_hash);
+            u_assert_mem_eq(btc_headersdb_getchaintip(db)->hash, fork_hash, BTC_HASH_LENGTH);
+        }
+        if (i == 150 || i == 250)
+            allocations[i / 100 - 1] = headersdb_test_allocations;
+    }
+    u_assert_mem_eq(btc_headersdb_getchaintip(db)->hash, hashes[amount - 1], BTC_HASH_LENGTH);
+
+    /* forks and replaced headers behind the window have been released */
+    u_assert_int_eq(btc_headersdb_find(db, first_fork) == NULL, true);
+    u_assert_int_eq(allocations[1], allocations[0]);
+    u_assert_int_eq(db->hash_index->count <= 2 * (db->max_hdr_in_mem + 1) + 2, true);
+
+    btc_headers_db_free(db);
+    u_assert_int_eq(headersdb_test_allocations, 0);
+    btc_mem_set_mapper_default();
+}
+
+static void test_headersdb_duplicates(const cstring* chain, unsigned int amount)
+{
+    btc_mem_mapper mapper = {headersdb_test_malloc, headersdb_test_calloc, headersdb_test_realloc, headersdb_test_free};
+    btc_mem_set_mapper(mapper);
+    headersdb_test_allocations = 0;
+
+    for (unsigned int keep_all = 0; keep_all < 2; keep_all++) {
+        btc_headers_db* db = btc_headers_db_new(&btc_chainparams_main, true);
+        if (keep_all)
+            db->max_hdr_in_mem = 0;
+        struct const_buffer buf = {chain->str, chain->len};
+        for (unsigned int i = 0; i < amount; i++) {
+            btc_bool connected = false;
+            btc_blockindex* pindex = btc_headers_db_connect_hdr(db, &buf, false, &connected);
+            u_assert_int_eq(connected, true);
+
+            /* resending the last two headers returns the known indexes without linking them again */
+            long allocations = headersdb_test_allocations;
+            size_t count = db->hash_index->count;
+            for (unsigned int back = 0; back < 2 && back <= i; back++) {
+                struct const_buffer resend = {chain->str + (i - back) * 80, 80};
+                btc_blockindex* known = btc_headers_db_connect_hdr(db, &resend, false, &connected);
+                u_assert_int_eq(connected, true);
+                u_assert_int_eq(known == (back == 0 ? pindex : pindex->prev), true);
+            }
+            u_assert_int_eq(headersdb_test_allocations, allocations);
+            u_assert_int_eq(db->hash_index->count, count);
+            u_assert_int_eq(btc_headersdb_getchaintip(db) == pindex, true);
+        }
+        /* main chain headers are still found by hash */
+        btc_blockindex* walk = btc_headersdb_getchaintip(db);
+        for (; walk && walk->height > 0; walk = walk->prev)
+            u_assert_int_eq(btc_headersdb_find(db, walk->hash) == walk, true);
+        btc_headers_db_free(db);
+        u_assert_int_eq(headersdb_test_allocations, 0);
+    }
+    btc_mem_set_mapper_default();
+}
+
+/* tries to connect a header claiming bits on top of prev */
+static btc_bool connect_header_bits(btc_headers_db* db, const uint256 prev, uint32_t bits)
+{
+    btc_block_header header;
+    memset(&header, 0, sizeof(header));
+    header.version = 1;
+    memcpy(header.prev_block, prev, BTC_HASH_LENGTH);
+    header.bits = bits;
+    cstring* ser = cstr_new_sz(80);
+    btc_block_header_serialize(ser, &header);
+    struct const_buffer buf = {ser->str, ser->len};
+    btc_bool connected = false;
+    btc_blockindex* blockindex = btc_headers_db_connect_hdr(db, &buf, false, &connected);
+    if (!connected)
+        btc_free(blockindex);
+    cstr_free(ser, true);
+    return connected;
+}
+
+static void test_headersdb_bits()
+{
+    /* compact encoding round trips */
+    uint256 target;
+    u_assert_int_eq(btc_block_bits_to_target(0x1d00ffff, target), true);
+    u_assert_int_eq(btc_block_target_to_bits(target), 0x1d00ffff);
+    u_assert_int_eq(btc_block_bits_to_target(0x1b0404cb, target), true);
+    u_assert_int_eq(btc_block_target_to_bits(target), 0x1b0404cb);
+    u_assert_int_eq(btc_block_bits_to_target(0x01003456, target), false);
+
+    /* easier than the pow limit or changed between adjustments */
+    btc_headers_db* db = btc_headers_db_new(&btc_chainparams_main, true);
+    u_assert_int_eq(connect_header_bits(db, btc_chainparams_main.genesisblockhash, 0x1d01ffff), false);
+    u_assert_int_eq(connect_header_bits(db, btc_chainparams_main.genesisblockhash, 0x1c00ffff), false);
+    u_assert_int_eq(connect_header_bits(db, btc_chainparams_main.genesisblockhash, 0x1d00ffff), true);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, 1);
+    u_assert_int_eq(connect_header_bits(db, btc_headersdb_getchaintip(db)->hash, 0x1d00fffe), false);
+    btc_headers_db_free(db);
+
+    /* testnet allows minimum difficulty blocks, regtest never retargets */
+    btc_blockindex prev;
+    memset(&prev, 0, sizeof(prev));
+    prev.height = 2015;
+    prev.header.bits = 0x1b0404cb;
+    btc_block_header header;
+    memset(&header, 0, sizeof(header));
+    header.bits = 0x1d00ffff;
+    u_assert_int_eq(btc_blockindex_check_bits(&btc_chainparams_main, &prev, &header, 2015), false);
+    u_assert_int_eq(btc_blockindex_check_bits(&btc_chainparams_test, &prev, &header, 2015), true);
+    header.bits = 0x207fffff;
+    u_assert_int_eq(btc_blockindex_check_bits(&btc_chainparams_regtest, &prev, &header, 2015), false);
+
+    /* an adjustment moves the target by at most a factor of 4 */
+    header.bits = 0x1d00ffff;
+    u_assert_int_eq(btc_blockindex_check_bits(&btc_chainparams_main, &prev, &header, 2016), false);
+    header.bits = 0x1b10132c;
+    u_assert_int_eq(btc_blockindex_check_bits(&btc_chainparams_main, &prev, &header, 2016), true);
+    header.bits = 0x1b10132d;
+    u_assert_int_eq(btc_blockindex_check_bits(&btc_chainparams_main, &prev, &header, 2016), false);
+    header.bits = 0x1b0404cb;
+    u_assert_int_eq(btc_blockindex_check_bits(&btc_chainparams_main, &prev, &header, 2016), true);
+    header.bits = 0x1b010132;
+    u_assert_int_eq(btc_blockindex_check_bits(&btc_chainparams_main, &prev, &header, 2016), true);
+    header.bits = 0x1b010131;
+    u_assert_int_eq(btc_blockindex_check_bits(&btc_chainparams_main, &prev, &header, 2016), false);
+
+    /* a predecessor with unknown bits (checkpoint start) only checks the limit */
+    prev.header.bits = 0;
+    header.bits = 0x1d00ffff;
+    u_assert_int_eq(btc_blockindex_check_bits(&btc_chainparams_main, &prev, &header, 2015), true);
+}
+
+void test_headersdb()
+{
+    test_headersdb_prepare();
+
+    const unsigned int amount = 300;
+    uint256 hashes[300];
+    cstring* chain = create_test_chain(amount, hashes);
+    test_headersdb_ancestors(chain, hashes, amount);
+    test_headersdb_forks(chain, hashes, amount);
+    test_headersdb_duplicates(chain, amount);
+    test_headersdb_bits();
+
+    /* create a new database and connect the chain */
+    unlink(headersdb_test_file);
+    btc_headers_db* db = btc_headers_db_new(&btc_chainparams_main, false);
+    u_assert_int_eq(btc_headers_db_load(db, headersdb_test_file), true);
+    struct const_buffer buf = {chain->str, chain->len};
+    btc_headers_db_begin_batch(db);
+    for (unsigned int i = 0; i < amount; i++) {
+        btc_bool connected = false;
+        btc_headers_db_connect_hdr(db, &buf, false, &connected);
+        u_assert_int_eq(connected, true);
+    }
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, amount);
+
+    /* only the window stays in memory, older headers are served from the pending records */
+    u_assert_int_eq(db->hash_index->count, db->max_hdr_in_mem + 1);
+    u_assert_int_eq(db->chainbottom->height, amount - db->max_hdr_in_mem);
+    u_assert_int_eq(db->chainbottom->prev == NULL, true);
+    btc_blockindex record;
+    u_assert_int_eq(btc_headersdb_get_main_chain_header(db, 10, &record), true);
+    u_assert_mem_eq(record.hash, hashes[9], BTC_HASH_LENGTH);
+    u_assert_int_eq(btc_headersdb_get_main_chain_header(db, amount - 1, &record), true);
+    u_assert_mem_eq(record.hash, hashes[amount - 2], BTC_HASH_LENGTH);
+    u_assert_int_eq(btc_headersdb_get_main_chain_header(db, amount + 1, &record), false);
+
+    /* records are only written once the batch gets committed */
+    struct stat st;
+    u_assert_int_eq(stat(headersdb_test_file, &st), 0);
+    u_assert_int_eq(st.st_size, 8 + 12);
+    u_assert_int_eq(btc_headers_db_commit_batch(db), true);
+    u_assert_int_eq(stat(headersdb_test_file, &st), 0);
+    u_assert_int_eq(st.st_size, 8 + amount * 116 + 12);
+
+    /* the locator reaches below the window through the file */
+    uint256 locator[BTC_BLOCK_LOCATOR_MAX];
+    size_t count = btc_headers_db_fill_block_locator(db, locator, BTC_BLOCK_LOCATOR_MAX);
+    u_assert_int_eq(count, 21);
+    u_assert_mem_eq(locator[count - 3], hashes[34], BTC_HASH_LENGTH);
+    u_assert_mem_eq(locator[count - 2], hashes[0], BTC_HASH_LENGTH);
+    u_assert_mem_eq(locator[count - 1], btc_chainparams_main.genesisblockhash, BTC_HASH_LENGTH);
+    u_assert_int_eq(btc_headersdb_get_main_chain_header(db, 1, &record), true);
+    u_assert_mem_eq(record.hash, hashes[0], BTC_HASH_LENGTH);
+    btc_headers_db_free(db);
+
+    /* reload, only the tip window is kept in memory */
+    db = btc_headers_db_new(&btc_chainparams_main, false);
+    u_assert_int_eq(btc_headers_db_load(db, headersdb_test_file), true);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, amount);
+    u_assert_mem_eq(btc_headersdb_getchaintip(db)->hash, hashes[amount - 1], BTC_HASH_LENGTH);
+    u_assert_int_eq(db->chainbottom->height, amount - db->max_hdr_in_mem);
+    u_assert_int_eq(btc_headersdb_find(db, hashes[amount - 100]) != NULL, true);
+    u_assert_int_eq(btc_headersdb_find(db, hashes[10]) == NULL, true);
+
+    /* disconnecting the tip removes the record from the file */
+    u_assert_int_eq(btc_headersdb_disconnect_tip(db), true);
+    btc_headers_db_free(db);
+
+    db = btc_headers_db_new(&btc_chainparams_main, false);
+    u_assert_int_eq(btc_headers_db_load(db, headersdb_test_file), true);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, amount - 1);
+
+    /* reconnect the tip on top of the loaded window */
+    buf.p = chain->str + (amount - 1) * 80;
+    buf.len = 80;
+    btc_bool connected = false;
+    btc_headers_db_connect_hdr(db, &buf, false, &connected);
+    u_assert_int_eq(connected, true);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, amount);
+    btc_headers_db_free(db);
+
+    /* write a legacy (version 1) file and make sure it gets migrated */
+    unlink(headersdb_test_file);
+    FILE* legacy = fopen(headersdb_test_file, "wb");
+    const unsigned char legacy_hdr[8] = {0xA8, 0xF0, 0x11, 0xC5, 0x01, 0x00, 0x00, 0x00};
+    fwrite(legacy_hdr, sizeof(legacy_hdr), 1, legacy);
+    for (unsigned int i = 0; i < amount; i++) {
+        cstring* rec = cstr_new_sz(116);
+        ser_u256(rec, hashes[i]);
+        ser_u32(rec, i + 1);
+        ser_bytes(rec, chain->str + i * 80, 80);
+        fwrite(rec->str, rec->len, 1, legacy);
+        cstr_free(rec, true);
+    }
+    fclose(legacy);
+
+    db = btc_headers_db_new(&btc_chainparams_main, false);
+    u_assert_int_eq(btc_headers_db_load(db, headersdb_test_file), true);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, amount);
+    btc_headers_db_free(db);
+
+    db = btc_headers_db_new(&btc_chainparams_main, false);
+    u_assert_int_eq(btc_headers_db_load(db, headersdb_test_file), true);
+    u_assert_int_eq(db->file_records, amount);
+    u_assert_int_eq(btc_headersdb_getchaintip(db)->height, amount);
+    u_assert_mem_eq(btc_headersdb_getchaintip(db)->hash, hashes[amount - 1], BTC_HASH_LENGTH);
+    btc_headers_db_free(db);
+
+    unlink(headersdb_test_file);
+    cstr_free(chain, true);
+}
@@ -1,10 +1,26 @@
 #include "utest.h"
 #include <btc/block.h>
+#include <btc/memory.h>
 #include <btc/net.h>
 #include <btc/utils.h>
 #include <btc/serialize.h>
 #include <btc/tx.h>
 
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* libevent read callback of the nodes (src/net.c) */
+extern void read_cb(struct bufferevent* bev, void* ctx);
+
 static btc_bool timer_cb(btc_node *node, uint64_t *now)
 {
     if (node->time_started_con + 300 < *now)
@@ -199,3 +215,575 @@ void test_net_basics_plus_download_block()
     /* cleanup */
     btc_node_group_free(group); //will also free the nodes structures from the heap
 }
+
+static unsigned int framed_messages = 0;
+static size_t framed_len = 0;
+static uint8_t framed_first = 0;
+static uint8_t framed_last = 0;
+
+static btc_bool framing_parse_cmd(struct btc_node_ *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    (void)(node);
+    (void)(hdr);
+    framed_messages++;
+    framed_len = buf->len;
+    if (buf->len > 0) {
+        framed_first = ((const uint8_t *)buf->p)[0];
+        framed_last = ((const uint8_t *)buf->p)[buf->len - 1];
+    }
+    /* skip the internal message logic */
+    return false;
+}
+
+static unsigned int framed_block_handler_calls = 0;
+
+static void framing_block_handler(struct btc_node_ *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    (void)(node);
+    (void)(buf);
+    if (hdr->command_id == BTC_CMD_BLOCK)
+        framed_block_handler_calls++;
+}
+
+static void framing_feed(btc_node *node, const char *data, size_t len)
+{
+    struct evbuffer *input = bufferevent_get_input(node->event_bev);
+    evbuffer_unfreeze(input, 0);
+    evbuffer_add(input, data, len);
+    evbuffer_freeze(input, 0);
+    read_cb(node->event_bev, node);
+}
+
+void test_net_read_framing()
+{
+    btc_node_group* group = btc_node_group_new(NULL);
+    group->parse_cmd_cb = framing_parse_cmd;
+    u_assert_int_eq(btc_node_group_register_cmd_handler(group, BTC_CMD_UNKNOWN, framing_block_handler), false);
+    u_assert_int_eq(btc_node_group_register_cmd_handler(group, BTC_CMD_BLOCK, framing_block_handler), true);
+    btc_node *node = btc_node_new();
+    btc_node_group_add_node(group, node);
+    node->state |= NODE_CONNECTED;
+    node->event_bev = bufferevent_socket_new(group->event_base, -1, 0);
+
+    /* a large message arriving in small chunks followed by a message without payload */
+    const size_t payload_len = 1024 * 1024;
+    char *payload = btc_malloc(payload_len);
+    for (size_t i = 0; i < payload_len; i++)
+        payload[i] = (char)(i % 251);
+    cstring *msg = btc_p2p_message_new(group->chainparams->netmagic, "block", payload, payload_len);
+    cstring *verack = btc_p2p_message_new(group->chainparams->netmagic, "custom", NULL, 0);
+    cstr_append_buf(msg, verack->str, verack->len);
+
+    size_t offset = 0;
+    while (offset + 4096 < msg->len - verack->len) {
+        framing_feed(node, msg->str + offset, 4096);
+        offset += 4096;
+        u_assert_int_eq(framed_messages, 0);
+    }
+    framing_feed(node, msg->str + offset, msg->len - offset);
+    u_assert_int_eq(framed_messages, 2);
+    u_assert_int_eq(framed_len, 0);
+    /* only the block message reaches the registered handler */
+    u_assert_int_eq(framed_block_handler_calls, 1);
+    u_assert_int_eq(evbuffer_get_length(bufferevent_get_input(node->event_bev)), 0);
+
+    /* payload handed over in one piece */
+    framed_messages = 0;
+    cstr_resize(msg, msg->len - verack->len);
+    framing_feed(node, msg->str, msg->len);
+    u_assert_int_eq(framed_messages, 1);
+    u_assert_int_eq(framed_len, payload_len);
+    u_assert_int_eq(framed_first, 0);
+    u_assert_int_eq(framed_last, (payload_len - 1) % 251);
+
+    /* corrupted payload of a streamed message must fail the checksum verification */
+    framed_messages = 0;
+    msg->str[msg->len - 10] ^= 0x01;
+    for (offset = 0; offset < msg->len; offset += 4096)
+        framing_feed(node, msg->str + offset, (msg->len - offset < 4096 ? msg->len - offset : 4096));
+    u_assert_int_eq(framed_messages, 0);
+    u_assert_int_eq((node->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED, 1);
+    u_assert_int_eq(node->event_bev == NULL, 1);
+
+    cstr_free(verack, true);
+    cstr_free(msg, true);
+    btc_free(payload);
+    btc_node_group_free(group);
+}
+
+/* threaded node group against local stand-in peers */
+#define THREADED_TEST_PEERS 4
+
+static pthread_t threaded_main_thread;
+static unsigned int threaded_handshakes = 0;
+static unsigned int threaded_invs = 0;
+static btc_bool threaded_foreign_callback = false;
+
+static void* threaded_peer_thread(void* ctx)
+{
+    int listen_fd = *(int*)ctx;
+    int fds[THREADED_TEST_PEERS];
+
+    btc_p2p_version_msg version;
+    btc_p2p_msg_version_init(&version, NULL, NULL, "peer", false);
+    version.services = BTC_NODE_NETWORK;
+    cstring* version_payload = cstr_new_sz(256);
+    btc_p2p_msg_version_ser(&version, version_payload);
+    cstring* msgs = btc_p2p_message_new(btc_chainparams_main.netmagic, BTC_MSG_VERSION, version_payload->str, version_payload->len);
+    cstring* verack = btc_p2p_message_new(btc_chainparams_main.netmagic, BTC_MSG_VERACK, NULL, 0);
+    uint8_t empty_inv = 0;
+    cstring* inv = btc_p2p_message_new(btc_chainparams_main.netmagic, BTC_MSG_INV, &empty_inv, 1);
+    cstr_append_buf(msgs, verack->str, verack->len);
+    cstr_append_buf(msgs, inv->str, inv->len);
+
+    for (int i = 0; i < THREADED_TEST_PEERS; i++) {
+        fds[i] = accept(listen_fd, NULL, NULL);
+        if (fds[i] >= 0 && send(fds[i], msgs->str, msgs->len, 0) != (ssize_t)msgs->len) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+    /* consume whatever the nodes send until they disconnect */
+    for (int i = 0; i < THREADED_TEST_PEERS; i++) {
+        char buf[1024];
+        while (fds[i] >= 0 && recv(fds[i], buf, sizeof(buf), 0) > 0) {
+        }
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    cstr_free(inv, true);
+    cstr_free(verack, true);
+    cstr_free(msgs, true);
+    cstr_free(version_payload, true);
+    return NULL;
+}
+
+static void threaded_check_done(btc_node* node)
+{
+    if (!pthread_equal(pthread_self(), threaded_main_thread))
+        threaded_foreign_callback = true;
+    if (threaded_handshakes == THREADED_TEST_PEERS && threaded_invs == THREADED_TEST_PEERS) {
+        u_assert_int_eq(btc_node_group_amount_of_connected_nodes(node->nodegroup, NODE_CONNECTED), THREADED_TEST_PEERS);
+        btc_node_group_shutdown(node->nodegroup);
+    }
+}
+
+static void threaded_handshake_done(struct btc_node_ *node)
+{
+    threaded_handshakes++;
+    threaded_check_done(node);
+}
+
+static void threaded_inv_handler(struct btc_node_ *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    uint32_t amount = 1;
+    if (hdr->command_id == BTC_CMD_INV && deser_varlen(&amount, buf) && amount == 0)
+        threaded_invs++;
+    threaded_check_done(node);
+}
+
+void test_net_threaded_group()
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    u_assert_int_eq(listen_fd >= 0, 1);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addr_len = sizeof(addr);
+    u_assert_int_eq(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)), 0);
+    u_assert_int_eq(listen(listen_fd, THREADED_TEST_PEERS), 0);
+    u_assert_int_eq(getsockname(listen_fd, (struct sockaddr*)&addr, &addr_len), 0);
+
+    pthread_t peer_thread;
+    u_assert_int_eq(pthread_create(&peer_thread, NULL, threaded_peer_thread, &listen_fd), 0);
+
+    btc_node_group* group = btc_node_group_new_threaded(NULL, 2);
+    u_assert_int_eq(group != NULL, 1);
+    u_assert_int_eq(group->num_shards, 2);
+    group->desired_amount_connected_nodes = THREADED_TEST_PEERS;
+    group->handshake_done_cb = threaded_handshake_done;
+    btc_node_group_register_cmd_handler(group, BTC_CMD_INV, threaded_inv_handler);
+
+    char ipport[32];
+    sprintf(ipport, "127.0.0.1:%d", ntohs(addr.sin_port));
+    for (int i = 0; i < THREADED_TEST_PEERS; i++) {
+        btc_node *node = btc_node_new();
+        u_assert_int_eq(btc_node_set_ipport(node, ipport), true);
+        btc_node_group_add_node(group, node);
+    }
+    /* nodes are spread across the workers */
+    u_assert_int_eq(((btc_node*)vector_idx(group->nodes, 0))->shard == &group->shards[0], 1);
+    u_assert_int_eq(((btc_node*)vector_idx(group->nodes, 1))->shard == &group->shards[1], 1);
+    u_assert_int_eq(((btc_node*)vector_idx(group->nodes, 2))->shard == &group->shards[0], 1);
+
+    threaded_main_thread = pthread_self();
+    btc_node_group_connect_next_nodes(group);
+    btc_node_group_event_loop(group);
+
+    u_assert_int_eq(threaded_handshakes, THREADED_TEST_PEERS);
+    u_assert_int_eq(threaded_invs, THREADED_TEST_PEERS);
+    u_assert_int_eq(threaded_foreign_callback, false);
+
+    btc_node_group_free(group);
+    pthread_join(peer_thread, NULL);
+    close(listen_fd);
+}
+
+/* live allocations made through btc_malloc & co. */
+static long net_test_allocations = 0;
+
+static void* net_test_malloc(size_t size)
+{
+    net_test_allocations++;
+    return malloc(size);
+}
+
+static void* net_test_calloc(size_t count, size_t size)
+{
+    net_test_allocations++;
+    return calloc(count, size);
+}
+
+static void* net_test_realloc(void* ptr, size_t size)
+{
+    if (!ptr)
+        net_test_allocations++;
+    return realloc(ptr, size);
+}
+
+static void net_test_free(void* ptr)
+{
+    if (ptr)
+        net_test_allocations--;
+    free(ptr);
+}
+
+void test_net_threaded_free_jobs()
+{
+    btc_mem_mapper mapper = {net_test_malloc, net_test_calloc, net_test_realloc, net_test_free};
+    btc_mem_set_mapper(mapper);
+    net_test_allocations = 0;
+
+    btc_node_group* group = btc_node_group_new_threaded(NULL, 1);
+    btc_node *node = btc_node_new();
+    btc_node_group_add_node(group, node);
+    btc_node_set_state(node, NODE_CONNECTED);
+    node->event_bev = bufferevent_socket_new(group->shards[0].event_base, -1, 0);
+
+    /* a send from the event loop thread while the worker runs is queued on the workers event base */
+    __atomic_store_n(&group->shards[0].running, true, __ATOMIC_RELEASE);
+    btc_node_send_message(node, BTC_MSG_PING, NULL, 0);
+    u_assert_int_eq(event_base_get_num_events(group->shards[0].event_base, EVENT_BASE_COUNT_ACTIVE), 1);
+    __atomic_store_n(&group->shards[0].running, false, __ATOMIC_RELEASE);
+
+    /* freeing the stopped group releases the job that never ran */
+    btc_node_group_free(group);
+    u_assert_int_eq(net_test_allocations, 0);
+    btc_mem_set_mapper_default();
+}
+
+void test_net_ping_latency()
+{
+    btc_node_group* group = btc_node_group_new(NULL);
+    btc_node *node = btc_node_new();
+    btc_node_group_add_node(group, node);
+    node->state |= NODE_CONNECTED;
+    node->event_bev = bufferevent_socket_new(group->event_base, -1, 0);
+
+    /* the handshake completion starts a latency measurement */
+    cstring *verack = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_VERACK, NULL, 0);
+    framing_feed(node, verack->str, verack->len);
+    cstr_free(verack, true);
+    u_assert_int_eq(node->version_handshake, true);
+    u_assert_int_eq(node->ping_nonce != 0, true);
+    u_assert_int_eq(node->ping_rtt_ms, 0);
+
+    /* pongs with an unknown nonce are ignored */
+    uint64_t nonce = node->ping_nonce + 1;
+    cstring *pong = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_PONG, &nonce, sizeof(nonce));
+    framing_feed(node, pong->str, pong->len);
+    cstr_free(pong, true);
+    u_assert_int_eq(node->ping_rtt_ms, 0);
+
+    /* the matching pong records the round trip time */
+    node->ping_sent_ms -= 200;
+    nonce = node->ping_nonce;
+    pong = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_PONG, &nonce, sizeof(nonce));
+    framing_feed(node, pong->str, pong->len);
+    cstr_free(pong, true);
+    u_assert_int_eq(node->ping_nonce, 0);
+    u_assert_int_eq(node->ping_rtt_ms >= 200 && node->ping_rtt_ms < 10000, true);
+    u_assert_int_eq(node->bytes_received, 3 * BTC_P2P_HDRSZ + 2 * sizeof(nonce));
+
+    /* smoothing */
+    u_assert_int_eq(btc_node_smooth(0, 100), 100);
+    u_assert_int_eq(btc_node_smooth(100, 500), 200);
+    u_assert_int_eq(btc_node_smooth(0, 0) != 0, true);
+
+    btc_node_group_free(group);
+}
+
+static void send_check_output(btc_node *node, const cstring *expected)
+{
+    struct evbuffer *output = bufferevent_get_output(node->event_bev);
+    u_assert_int_eq(evbuffer_get_length(output), expected->len);
+    u_assert_mem_eq(evbuffer_pullup(output, -1), expected->str, expected->len);
+}
+
+void test_net_send_message()
+{
+    btc_node_group* group = btc_node_group_new(NULL);
+    btc_node *nodes[3];
+    for (unsigned int i = 0; i < 3; i++) {
+        nodes[i] = btc_node_new();
+        btc_node_group_add_node(group, nodes[i]);
+        nodes[i]->state |= NODE_CONNECTED;
+        nodes[i]->version_handshake = (i < 2);
+        nodes[i]->event_bev = bufferevent_socket_new(group->event_base, -1, 0);
+    }
+
+    char payload[300];
+    for (size_t i = 0; i < sizeof(payload); i++)
+        payload[i] = (char)i;
+    cstring *expected = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_TX, payload, sizeof(payload));
+
+    /* directly serialized into the output buffer */
+    btc_node_send_message(nodes[2], BTC_MSG_TX, payload, sizeof(payload));
+    send_check_output(nodes[2], expected);
+
+    /* a shared message is sent to all nodes with a completed handshake, the payload gets referenced */
+    btc_node_msg *msg = btc_node_msg_new(group->chainparams->netmagic, BTC_MSG_TX, payload, sizeof(payload));
+    u_assert_mem_eq(msg->header, expected->str, BTC_P2P_HDRSZ);
+    memset(payload, 0, sizeof(payload));
+    u_assert_int_eq(btc_node_group_broadcast(group, msg), 2);
+    u_assert_int_eq(msg->refcount, 3);
+    btc_node_msg_free(msg);
+    send_check_output(nodes[0], expected);
+    send_check_output(nodes[1], expected);
+    u_assert_int_eq(evbuffer_get_length(bufferevent_get_output(nodes[2]->event_bev)), expected->len);
+
+    /* messages without payload, nodes not connected are skipped */
+    cstr_free(expected, true);
+    msg = btc_node_msg_new(group->chainparams->netmagic, BTC_MSG_VERACK, NULL, 0);
+    nodes[0]->state &= ~NODE_CONNECTED;
+    btc_node_send_msg(nodes[0], msg);
+    btc_node_send_msg(nodes[2], msg);
+    btc_node_msg_free(msg);
+    u_assert_int_eq(evbuffer_get_length(bufferevent_get_output(nodes[0]->event_bev)), BTC_P2P_HDRSZ + sizeof(payload));
+    u_assert_int_eq(evbuffer_get_length(bufferevent_get_output(nodes[2]->event_bev)), BTC_P2P_HDRSZ * 2 + sizeof(payload));
+
+    /* the output buffers release the shared payload */
+    btc_node_group_free(group);
+}
+
+static unsigned int budget_txs = 0;
+
+static void budget_tx_handler(struct btc_node_ *node, btc_p2p_msg_hdr *hdr, struct const_buffer *buf)
+{
+    (void)(node);
+    (void)(hdr);
+    (void)(buf);
+    budget_txs++;
+}
+
+static btc_bool budget_accept_msg(struct btc_node_ *node, btc_p2p_msg_hdr *hdr)
+{
+    (void)(node);
+    return (hdr->command_id != BTC_CMD_BLOCK);
+}
+
+void test_net_recv_budget()
+{
+    btc_node_group* group = btc_node_group_new(NULL);
+    group->recv_budget_node = 0x20000;
+    group->recv_budget_group = 0x20000;
+    group->accept_msg_cb = budget_accept_msg;
+    btc_node_group_register_cmd_handler(group, BTC_CMD_TX, budget_tx_handler);
+    btc_node *nodes[3];
+    for (unsigned int i = 0; i < 3; i++) {
+        nodes[i] = btc_node_new();
+        btc_node_group_add_node(group, nodes[i]);
+        nodes[i]->state |= NODE_CONNECTED;
+        nodes[i]->event_bev = bufferevent_socket_new(group->event_base, -1, 0);
+    }
+    char *payload = btc_calloc(1, 0x20000);
+
+    /* two partially received messages exceeding the groups budget, the second node pauses reading */
+    cstring *tx_a = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_TX, payload, 0x18000);
+    cstring *tx_b = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_TX, payload, 0x10000);
+    framing_feed(nodes[0], tx_a->str, 1000);
+    u_assert_int_eq(group->recv_reserved, tx_a->len);
+    size_t low = 0, high = 0;
+    bufferevent_getwatermark(nodes[0]->event_bev, EV_READ, &low, &high);
+    u_assert_int_eq(high, group->recv_budget_node);
+    framing_feed(nodes[1], tx_b->str, 1000);
+    u_assert_int_eq(nodes[1]->recv_paused, true);
+    u_assert_int_eq(group->recv_paused, 1);
+    u_assert_int_eq(group->recv_reserved, tx_a->len);
+
+    /* completing the first message releases its share and resumes the paused node */
+    framing_feed(nodes[0], tx_a->str + 1000, tx_a->len - 1000);
+    u_assert_int_eq(budget_txs, 1);
+    u_assert_int_eq(group->recv_reserved, 0);
+    event_base_loop(group->event_base, EVLOOP_NONBLOCK);
+    u_assert_int_eq(nodes[1]->recv_paused, false);
+    u_assert_int_eq(group->recv_paused, 0);
+    framing_feed(nodes[1], tx_b->str + 1000, tx_b->len - 1000);
+    u_assert_int_eq(budget_txs, 2);
+    u_assert_int_eq(group->recv_reserved, 0);
+
+    /* an unsolicited block is dropped as it arrives, the following message gets processed */
+    cstring *block = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_BLOCK, payload, 0x10000);
+    cstring *tx = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_TX, payload, 100);
+    cstr_append_buf(block, tx->str, tx->len);
+    framing_feed(nodes[2], block->str, 5000);
+    u_assert_int_eq(evbuffer_get_length(bufferevent_get_input(nodes[2]->event_bev)), 0);
+    u_assert_int_eq(nodes[2]->recv_skip, BTC_P2P_HDRSZ + 0x10000 - 5000);
+    u_assert_int_eq(group->recv_reserved, 0);
+    framing_feed(nodes[2], block->str + 5000, block->len - 5000);
+    u_assert_int_eq(budget_txs, 3);
+    u_assert_int_eq(nodes[2]->bytes_received, block->len);
+
+    /* oversized messages are rejected from their header */
+    cstr_free(tx, true);
+    tx = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_TX, payload, 0x20000);
+    framing_feed(nodes[0], tx->str, BTC_P2P_HDRSZ);
+    u_assert_int_eq((nodes[0]->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED, 1);
+    u_assert_int_eq(nodes[0]->event_bev == NULL, 1);
+    cstring *ping = btc_p2p_message_new(group->chainparams->netmagic, BTC_MSG_PING, payload, 5000);
+    framing_feed(nodes[1], ping->str, BTC_P2P_HDRSZ);
+    u_assert_int_eq((nodes[1]->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED, 1);
+    u_assert_int_eq(budget_txs, 3);
+
+    cstr_free(ping, true);
+    cstr_free(tx, true);
+    cstr_free(block, true);
+    cstr_free(tx_b, true);
+    cstr_free(tx_a, true);
+    btc_free(payload);
+    btc_node_group_free(group);
+}
+
+/* minimal dns server answering the seed lookups (A and AAAA) on the loopback */
+static unsigned int dns_stub_answered = 0;
+
+static void dns_stub_read(evutil_socket_t fd, short event, void* ctx)
+{
+    (void)(event);
+    uint8_t query[512];
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t len = recvfrom(fd, (char*)query, sizeof(query), 0, (struct sockaddr*)&from, &fromlen);
+    if (len < 17)
+        return;
+
+    /* the question ends after the zero length label and qtype/qclass */
+    size_t pos = 12;
+    while (pos < (size_t)len && query[pos] != 0)
+        pos += query[pos] + 1;
+    if (pos + 5 > (size_t)len)
+        return;
+    uint16_t qtype = (query[pos + 1] << 8) | query[pos + 2];
+    size_t question_end = pos + 5;
+    /* evdns randomizes the case of the queried names */
+    btc_bool seed1 = (query[12] == 5 && strncasecmp((const char*)&query[13], "seed1", 5) == 0);
+
+    uint8_t answer[512];
+    memcpy(answer, query, question_end);
+    answer[2] = 0x81; /* response, recursion desired */
+    answer[3] = 0x80; /* recursion available, no error */
+    memset(&answer[6], 0, 6);
+    size_t answer_len = question_end;
+    uint8_t rdata[3][16];
+    unsigned int amount = 0;
+    size_t rdlen = (qtype == 28 ? 16 : 4);
+    memset(rdata, 0, sizeof(rdata));
+    if (qtype == 1) {
+        /* seed2 returns an address seed1 knows as well */
+        uint8_t last[3] = {2, 3, 4};
+        for (unsigned int i = (seed1 ? 0 : 1); i < (seed1 ? 2 : 3); i++) {
+            rdata[amount][0] = 127;
+            rdata[amount][3] = last[i];
+            amount++;
+        }
+        if (!seed1) {
+            rdata[amount][0] = 127;
+            rdata[amount][3] = 2;
+            amount++;
+        }
+    } else if (qtype == 28 && seed1) {
+        rdata[amount++][15] = 1;
+    } else {
+        answer[3] = 0x83; /* NXDOMAIN */
+    }
+    for (unsigned int i = 0; i < amount; i++) {
+        const uint8_t record[12] = {0xc0, 0x0c, 0, (uint8_t)qtype, 0, 1, 0, 0, 0, 60, 0, (uint8_t)rdlen};
+        memcpy(&answer[answer_len], record, sizeof(record));
+        memcpy(&answer[answer_len + sizeof(record)], rdata[i], rdlen);
+        answer_len += sizeof(record) + rdlen;
+    }
+    answer[7] = amount;
+    sendto(fd, (const char*)answer, answer_len, 0, (struct sockaddr*)&from, fromlen);
+
+    /* stop serving once all four lookups have been answered, the event loop can then return */
+    if (++dns_stub_answered == 4)
+        event_del((struct event*)ctx);
+}
+
+void test_net_dns_seeding()
+{
+    /* blocking lookups respect the family */
+    vector *ips = vector_new(2, free);
+    u_assert_int_eq(btc_get_peers_from_dns("127.0.0.1", ips, 8333, AF_INET), 1);
+    u_assert_str_eq((char*)vector_idx(ips, 0), "127.0.0.1:8333");
+    u_assert_int_eq(btc_get_peers_from_dns("127.0.0.1", ips, 8333, AF_INET6), 0);
+    u_assert_int_eq(ips->len, 1);
+    u_assert_int_eq(btc_get_peers_from_dns("::1", ips, 8333, AF_INET6), 2);
+    u_assert_str_eq((char*)vector_idx(ips, 1), "[::1]:8333");
+    vector_free(ips, true);
+
+    btc_chainparams params = btc_chainparams_regtest;
+    memset(params.dnsseeds, 0, sizeof(params.dnsseeds));
+    strcpy(params.dnsseeds[0].domain, "seed1.test");
+    strcpy(params.dnsseeds[1].domain, "seed2.test");
+    btc_node_group* group = btc_node_group_new(&params);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    u_assert_int_eq(bind(fd, (struct sockaddr*)&addr, sizeof(addr)), 0);
+    u_assert_int_eq(getsockname(fd, (struct sockaddr*)&addr, &addrlen), 0);
+    struct event* stub_ev = event_new(group->event_base, fd, EV_READ | EV_PERSIST, dns_stub_read, event_self_cbarg());
+    event_add(stub_ev, NULL);
+
+    char nameserver[32];
+    sprintf(nameserver, "127.0.0.1:%d", ntohs(addr.sin_port));
+    u_assert_int_eq(btc_node_group_set_dns_nameserver(group, nameserver), true);
+
+    /* all seeds get queried at once, the peers are added (and connected, the loopback
+       refuses) while the event loop runs */
+    u_assert_int_eq(btc_node_group_seed_dns(group), 4);
+    u_assert_int_eq(group->nodes->len, 0);
+    btc_node_group_event_loop(group);
+    u_assert_int_eq(dns_stub_answered, 4);
+    u_assert_int_eq(group->dns_pending, 0);
+    u_assert_int_eq(group->nodes->len, 4);
+    unsigned int ipv6 = 0;
+    for (size_t i = 0; i < group->nodes->len; i++) {
+        btc_node* node = vector_idx(group->nodes, i);
+        if (node->addr.ss_family == AF_INET6)
+            ipv6++;
+        u_assert_int_eq(ntohs(((struct sockaddr_in*)&node->addr)->sin_port), params.default_port);
+        u_assert_int_eq((node->state & NODE_ERRORED) == NODE_ERRORED, true);
+    }
+    u_assert_int_eq(ipv6, 1);
+
+    event_free(stub_ev);
+    evutil_closesocket(fd);
+    btc_node_group_free(group);
+}
@@ -1,11 +1,15 @@
 #include "utest.h"
 #include <btc/block.h>
+#include <btc/blockfilter.h>
 #include <btc/net.h>
 #include <btc/netspv.h>
 #include <btc/utils.h>
 #include <btc/serialize.h>
 #include <btc/tx.h>
 
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+
 #include <unistd.h>
 
 void test_spv_sync_completed(btc_spv_client* client) {
@@ -38,3 +42,638 @@ void test_netspv()
     btc_spv_client_runloop(client);
     btc_spv_client_free(client);
 }
+
+static uint32_t scanned_heights[100];
+static unsigned int scanned_amount = 0;
+
+static void test_spv_sync_transaction(void *ctx, btc_tx *tx, unsigned int pos, btc_blockindex *blockindex) {
+    UNUSED(ctx);
+    UNUSED(pos);
+    u_assert_int_eq(tx->version, (int32_t)blockindex->height);
+    scanned_heights[scanned_amount++] = blockindex->height;
+}
+
+static unsigned int scanned_blocks = 0;
+
+static void test_spv_sync_block(void *ctx, const btc_block *block, btc_blockindex *blockindex) {
+    UNUSED(ctx);
+    uint256 txid;
+    u_assert_int_eq(block->tx_count, 1);
+    u_assert_mem_eq(block->hash, blockindex->hash, BTC_HASH_LENGTH);
+    btc_tx_hash(block->txs[0], txid);
+    u_assert_mem_eq(block->txids[0], txid, BTC_HASH_LENGTH);
+    scanned_blocks++;
+}
+
+static unsigned int scanned_views = 0;
+
+static void test_spv_sync_transaction_view(void *ctx, const btc_tx_view *tx, unsigned int pos, btc_blockindex *blockindex) {
+    UNUSED(ctx);
+    UNUSED(pos);
+    btc_tx_out_view out;
+    u_assert_int_eq(tx->version, (int32_t)blockindex->height);
+    u_assert_int_eq(btc_tx_view_get_output(tx, 0, &out), true);
+    scanned_views++;
+}
+
+/* the only transaction of the test block at height */
+static btc_tx* test_spv_block_tx(uint32_t height) {
+    btc_tx *tx = btc_tx_new();
+    tx->version = height;
+    vector_add(tx->vin, btc_tx_in_new());
+    uint8_t data[4] = {0};
+    btc_tx_add_data_out(tx, 0, data, sizeof(data));
+    return tx;
+}
+
+static void test_spv_post_block(btc_node *node, const btc_block_header *header, uint32_t height) {
+    btc_tx *tx = test_spv_block_tx(height);
+
+    cstring *block = cstr_new_sz(256);
+    btc_block_header_serialize(block, header);
+    ser_varlen(block, 1);
+    btc_tx_serialize(block, tx);
+    btc_tx_free(tx);
+
+    btc_p2p_msg_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    strcpy(hdr.command, BTC_MSG_BLOCK);
+    hdr.command_id = BTC_CMD_BLOCK;
+    hdr.data_len = block->len;
+    struct const_buffer buf = {block->str, block->len};
+    btc_net_spv_post_cmd(node, &hdr, &buf);
+    cstr_free(block, true);
+}
+
+static unsigned int test_spv_requested_blocks(btc_spv_client *client, btc_node *node) {
+    unsigned int amount = 0;
+    for (size_t i = 0; i < BTC_MIN(client->block_requests_len, client->max_blocks_in_flight); i++) {
+        btc_spv_block_request *request = &client->block_requests[client->block_requests_first + i];
+        if (request->node && (!node || request->node == node))
+            amount++;
+    }
+    return amount;
+}
+
+/* mine regtest headers on top of prev_hash (at first_height - 1) committing to the transaction block_tx builds
+   for each height and serialize them as headers message */
+static cstring* test_spv_mine_branch(btc_block_header *headers, const uint256 prev_hash, uint32_t first_height, unsigned int amount, btc_tx* (*block_tx)(uint32_t height))
+{
+    cstring *msg = cstr_new_sz(amount * 81 + 3);
+    ser_varlen(msg, amount);
+    uint256 prev;
+    memcpy(prev, prev_hash, BTC_HASH_LENGTH);
+    for (unsigned int i = 0; i < amount; i++) {
+        btc_block_header *header = &headers[i];
+        memset(header, 0, sizeof(*header));
+        header->version = 4;
+        memcpy(header->prev_block, prev, BTC_HASH_LENGTH);
+        header->timestamp = 1296688602 + (first_height - 1 + i) * 600;
+        header->bits = 0x207fffff;
+        /* the merkle root of a single transaction is its txid */
+        btc_tx *tx = block_tx(first_height + i);
+        btc_tx_hash(tx, header->merkle_root);
+        btc_tx_free(tx);
+        do {
+            header->nonce++;
+            btc_block_header_hash(header, prev);
+        } while (!btc_block_header_check_pow(header, prev));
+        btc_block_header_serialize(msg, header);
+        ser_varlen(msg, 0);
+    }
+    return msg;
+}
+
+/* mine a regtest headers chain on top of genesis */
+static cstring* test_spv_mine_headers(btc_block_header *headers, unsigned int amount, btc_tx* (*block_tx)(uint32_t height))
+{
+    return test_spv_mine_branch(headers, btc_chainparams_regtest.genesisblockhash, 1, amount, block_tx);
+}
+
+static void test_spv_post_msg(btc_node *node, const char *command, const cstring *payload)
+{
+    btc_p2p_msg_hdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    strcpy(hdr.command, command);
+    hdr.command_id = btc_p2p_command_id(command);
+    hdr.data_len = payload->len;
+    struct const_buffer buf = {payload->str, payload->len};
+    btc_net_spv_post_cmd(node, &hdr, &buf);
+}
+
+void test_netspv_block_download()
+{
+    const unsigned int amount = 100;
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->oldest_item_of_interest = 0;
+    client->sync_transaction = test_spv_sync_transaction;
+    client->sync_transaction_view = test_spv_sync_transaction_view;
+    client->sync_block = test_spv_sync_block;
+
+    btc_node *nodes[3];
+    for (unsigned int i = 0; i < 3; i++) {
+        nodes[i] = btc_node_new();
+        btc_node_group_add_node(client->nodegroup, nodes[i]);
+        nodes[i]->state |= NODE_CONNECTED;
+        nodes[i]->version_handshake = true;
+        /* unconnected bufferevent, outgoing messages stay in its output buffer */
+        nodes[i]->event_bev = bufferevent_socket_new(client->nodegroup->event_base, -1, 0);
+    }
+
+    /* mine a regtest headers chain and send it as headers message */
+    btc_block_header headers[100];
+    cstring *msg = test_spv_mine_headers(headers, amount, test_spv_block_tx);
+    test_spv_post_msg(nodes[0], BTC_MSG_HEADERS, msg);
+    cstr_free(msg, true);
+    u_assert_int_eq(client->headers_db->getchaintip(client->headers_db_ctx)->height, amount);
+
+    /* all blocks are queued, the window is spread evenly across the nodes */
+    u_assert_int_eq(client->block_requests_len, amount);
+    for (unsigned int i = 0; i < 3; i++) {
+        u_assert_int_eq(test_spv_requested_blocks(client, nodes[i]), client->max_blocks_in_flight_per_node);
+        u_assert_int_eq(evbuffer_get_length(bufferevent_get_output(nodes[i]->event_bev)) > 0, true);
+    }
+
+    /* blocks received out of order are delivered in height order */
+    for (unsigned int i = 3 * client->max_blocks_in_flight_per_node; i > 1; i--)
+        test_spv_post_block(nodes[1], &headers[i - 1], i);
+    u_assert_int_eq(scanned_amount, 0);
+    test_spv_post_block(nodes[1], &headers[0], 1);
+    u_assert_int_eq(scanned_amount, 3 * client->max_blocks_in_flight_per_node);
+
+    /* the window moved on */
+    u_assert_int_eq(client->block_requests_len, amount - scanned_amount);
+    u_assert_int_eq(test_spv_requested_blocks(client, NULL), 3 * client->max_blocks_in_flight_per_node);
+
+    /* block messages are only accepted (from their header) from nodes with requests in flight */
+    btc_p2p_msg_hdr block_hdr;
+    memset(&block_hdr, 0, sizeof(block_hdr));
+    block_hdr.command_id = BTC_CMD_BLOCK;
+    btc_node *idle = btc_node_new();
+    idle->nodegroup = client->nodegroup;
+    u_assert_int_eq(client->nodegroup->accept_msg_cb(nodes[0], &block_hdr), true);
+    u_assert_int_eq(client->nodegroup->accept_msg_cb(idle, &block_hdr), false);
+    block_hdr.command_id = BTC_CMD_HEADERS;
+    u_assert_int_eq(client->nodegroup->accept_msg_cb(idle, &block_hdr), true);
+    btc_node_free(idle);
+
+    /* unrequested blocks are ignored */
+    test_spv_post_block(nodes[1], &headers[0], 1);
+    u_assert_int_eq(scanned_amount, 3 * client->max_blocks_in_flight_per_node);
+
+    /* a node stalling the lowest block gets disconnected and its requests are reassigned */
+    btc_node *stalling = client->block_requests[client->block_requests_first].node;
+    uint64_t later = time(NULL) + 1000;
+    btc_net_spv_periodic_statecheck(nodes[0], &later);
+    u_assert_int_eq((stalling->state & NODE_CONNECTED) == NODE_CONNECTED, false);
+    u_assert_int_eq(test_spv_requested_blocks(client, stalling), 0);
+    u_assert_int_eq(client->block_requests[client->block_requests_first].node != NULL, true);
+
+    /* a block not matching the merkle root of its header gets the node marked as missbehaving and is requested elsewhere */
+    btc_spv_block_request *lowest = &client->block_requests[client->block_requests_first];
+    btc_node *sender = lowest->node;
+    test_spv_post_block(sender, &headers[lowest->height - 1], lowest->height + 1);
+    u_assert_int_eq(scanned_amount, 3 * client->max_blocks_in_flight_per_node);
+    u_assert_int_eq((sender->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED, true);
+    u_assert_is_null(lowest->block);
+    u_assert_is_null(lowest->node);
+    u_assert_int_eq(lowest->stalled_node == sender, true);
+
+    /* deliver the rest */
+    for (unsigned int i = scanned_amount; i < amount; i++)
+        test_spv_post_block(nodes[2], &headers[i], i + 1);
+    u_assert_int_eq(scanned_amount, amount);
+    for (unsigned int i = 0; i < amount; i++)
+        u_assert_int_eq(scanned_heights[i], i + 1);
+    u_assert_int_eq(client->block_requests_len, 0);
+    u_assert_int_eq(scanned_views, amount);
+    u_assert_int_eq(scanned_blocks, amount);
+
+    btc_spv_client_free(client);
+
+    /* a client with only the view callback gets the transactions without decoding them */
+    client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->oldest_item_of_interest = 0;
+    client->sync_transaction_view = test_spv_sync_transaction_view;
+    btc_node *node = btc_node_new();
+    btc_node_group_add_node(client->nodegroup, node);
+    node->state |= NODE_CONNECTED;
+    node->version_handshake = true;
+    node->event_bev = bufferevent_socket_new(client->nodegroup->event_base, -1, 0);
+    msg = test_spv_mine_headers(headers, 10, test_spv_block_tx);
+    test_spv_post_msg(node, BTC_MSG_HEADERS, msg);
+    cstr_free(msg, true);
+
+    /* the blocks above the lowest one wait (with a copy), the lowest is scanned straight from the message */
+    scanned_views = 0;
+    for (unsigned int i = 10; i > 0; i--)
+        test_spv_post_block(node, &headers[i - 1], i);
+    u_assert_int_eq(scanned_views, 10);
+    u_assert_int_eq(scanned_amount, amount);
+    u_assert_int_eq(client->block_requests_len, 0);
+    btc_spv_client_free(client);
+}
+
+void test_netspv_reorg()
+{
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->oldest_item_of_interest = 0;
+    btc_node *node = btc_node_new();
+    btc_node_group_add_node(client->nodegroup, node);
+    node->state |= NODE_CONNECTED;
+    node->version_handshake = true;
+    node->event_bev = bufferevent_socket_new(client->nodegroup->event_base, -1, 0);
+
+    btc_block_header chain[6];
+    cstring *msg = test_spv_mine_headers(chain, 6, test_spv_block_tx);
+    test_spv_post_msg(node, BTC_MSG_HEADERS, msg);
+    cstr_free(msg, true);
+    u_assert_int_eq(client->block_requests_len, 6);
+
+    /* a longer branch forking at height 3 replaces the queued blocks above the fork */
+    btc_block_header branch[5];
+    uint256 fork_hash, hash;
+    btc_block_header_hash(&chain[2], fork_hash);
+    msg = test_spv_mine_branch(branch, fork_hash, 4, 5, test_spv_block_tx);
+    test_spv_post_msg(node, BTC_MSG_HEADERS, msg);
+    cstr_free(msg, true);
+    u_assert_int_eq(client->headers_db->getchaintip(client->headers_db_ctx)->height, 8);
+    u_assert_int_eq(client->block_requests_len, 8);
+    for (unsigned int i = 0; i < 8; i++) {
+        btc_spv_block_request *request = &client->block_requests[client->block_requests_first + i];
+        btc_block_header_hash(i < 3 ? &chain[i] : &branch[i - 3], hash);
+        u_assert_int_eq(request->height, i + 1);
+        u_assert_mem_eq(request->hash, hash, BTC_HASH_LENGTH);
+    }
+    btc_spv_client_free(client);
+}
+
+/* stand-in peer serving blocks, filters and filter headers from fixtures */
+#define FILTER_TEST_BLOCKS 1010
+static btc_block_header filter_test_headers[FILTER_TEST_BLOCKS];
+static uint256 filter_test_hashes[FILTER_TEST_BLOCKS + 1];
+static uint256 filter_test_filter_hashes[FILTER_TEST_BLOCKS + 1];
+static uint256 filter_test_filter_headers[FILTER_TEST_BLOCKS + 1];
+static cstring *filter_test_filters[FILTER_TEST_BLOCKS + 1];
+static const uint8_t filter_test_wallet_script[25] = {0x76, 0xa9, 0x14, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x88, 0xac};
+static unsigned int filter_test_served_blocks = 0;
+static unsigned int filter_test_served_filters = 0;
+static uint32_t filter_scanned_heights[FILTER_TEST_BLOCKS];
+static unsigned int filter_scanned_amount = 0;
+static btc_node *filter_test_cfcheckpt_server = NULL;
+static btc_node *filter_test_cfheaders_server = NULL;
+
+/* ways the stand-in peer misbehaves */
+#define FILTER_TEST_DROP_CFCHECKPT 1 /* getcfcheckpt stays unanswered */
+#define FILTER_TEST_BAD_CFCHECKPT 2 /* cfcheckpt for a different block */
+#define FILTER_TEST_BAD_CFHEADERS 4 /* forged filter hash in front of the checkpoint */
+#define FILTER_TEST_BAD_CFILTERS 8 /* filters not committed by the filter headers */
+
+static btc_bool filter_test_is_wallet_block(uint32_t height) {
+    return (height == 10 || height == 50 || height == 77 || height == 1005);
+}
+
+static void filter_test_output_script(uint32_t height, uint8_t *script) {
+    memcpy(script, filter_test_wallet_script, sizeof(filter_test_wallet_script));
+    if (!filter_test_is_wallet_block(height)) {
+        /* unique script per block */
+        script[3] = 0xff;
+        script[4] = height & 0xff;
+    }
+}
+
+static btc_tx* filter_test_block_tx(uint32_t height) {
+    btc_tx *tx = btc_tx_new();
+    tx->version = height;
+    vector_add(tx->vin, btc_tx_in_new());
+    uint8_t script[25];
+    filter_test_output_script(height, script);
+    btc_tx_out *out = btc_tx_out_new();
+    out->value = 5000000000;
+    out->script_pubkey = cstr_new_buf(script, sizeof(script));
+    vector_add(tx->vout, out);
+    return tx;
+}
+
+static void filter_test_serialize_block(uint32_t height, cstring *block) {
+    btc_tx *tx = filter_test_block_tx(height);
+
+    btc_block_header_serialize(block, &filter_test_headers[height - 1]);
+    ser_varlen(block, 1);
+    btc_tx_serialize(block, tx);
+    btc_tx_free(tx);
+}
+
+static void filter_test_sync_transaction(void *ctx, btc_tx *tx, unsigned int pos, btc_blockindex *blockindex) {
+    UNUSED(ctx);
+    UNUSED(pos);
+    UNUSED(tx);
+    filter_scanned_heights[filter_scanned_amount++] = blockindex->height;
+}
+
+static void filter_test_respond(btc_node *node, const char *command, struct const_buffer *payload, int faults) {
+    cstring *response = cstr_new_sz(1024);
+    if (strcmp(command, BTC_MSG_GETCFCHECKPT) == 0) {
+        uint8_t filter_type;
+        uint256 stop_hash;
+        u_assert_int_eq(deser_bytes(&filter_type, payload, 1), true);
+        u_assert_int_eq(deser_u256(stop_hash, payload), true);
+        uint32_t stop_height = 0;
+        while (stop_height <= FILTER_TEST_BLOCKS && memcmp(filter_test_hashes[stop_height], stop_hash, BTC_HASH_LENGTH) != 0)
+            stop_height++;
+        u_assert_int_eq(stop_height <= FILTER_TEST_BLOCKS, true);
+        filter_test_cfcheckpt_server = node;
+        if (faults & FILTER_TEST_DROP_CFCHECKPT) {
+            cstr_free(response, true);
+            return;
+        }
+        if (faults & FILTER_TEST_BAD_CFCHECKPT)
+            stop_hash[0] ^= 1;
+
+        ser_bytes(response, &filter_type, 1);
+        ser_u256(response, stop_hash);
+        ser_varlen(response, stop_height / BTC_CFCHECKPT_INTERVAL);
+        for (uint32_t h = BTC_CFCHECKPT_INTERVAL; h <= stop_height; h += BTC_CFCHECKPT_INTERVAL)
+            ser_u256(response, filter_test_filter_headers[h]);
+        test_spv_post_msg(node, BTC_MSG_CFCHECKPT, response);
+    } else if (strcmp(command, BTC_MSG_GETCFHEADERS) == 0 || strcmp(command, BTC_MSG_GETCFILTERS) == 0) {
+        uint8_t filter_type;
+        uint32_t start_height;
+        uint256 stop_hash;
+        u_assert_int_eq(btc_p2p_deser_msg_getcfilters(&filter_type, &start_height, stop_hash, payload), true);
+        uint32_t stop_height = start_height;
+        while (stop_height <= FILTER_TEST_BLOCKS && memcmp(filter_test_hashes[stop_height], stop_hash, BTC_HASH_LENGTH) != 0)
+            stop_height++;
+        u_assert_int_eq(stop_height <= FILTER_TEST_BLOCKS, true);
+
+        if (strcmp(command, BTC_MSG_GETCFHEADERS) == 0) {
+            ser_bytes(response, &filter_type, 1);
+            ser_u256(response, stop_hash);
+            ser_u256(response, filter_test_filter_headers[start_height - 1]);
+            ser_varlen(response, stop_height - start_height + 1);
+            for (uint32_t h = start_height; h <= stop_height; h++) {
+                uint256 filter_hash;
+                memcpy(filter_hash, filter_test_filter_hashes[h], BTC_HASH_LENGTH);
+                if ((faults & FILTER_TEST_BAD_CFHEADERS) && h == start_height)
+                    filter_hash[0] ^= 1;
+                ser_u256(response, filter_hash);
+            }
+            filter_test_cfheaders_server = node;
+            test_spv_post_msg(node, BTC_MSG_CFHEADERS, response);
+        } else {
+            /* peer with a filter header chain must only be asked by filter serving nodes */
+            u_assert_int_eq((node->services & BTC_NODE_COMPACT_FILTERS) == BTC_NODE_COMPACT_FILTERS, true);
+            for (uint32_t h = start_height; h <= stop_height; h++) {
+                cstr_resize(response, 0);
+                ser_bytes(response, &filter_type, 1);
+                ser_u256(response, filter_test_hashes[h]);
+                ser_varlen(response, filter_test_filters[h]->len);
+                ser_bytes(response, filter_test_filters[h]->str, filter_test_filters[h]->len);
+                if (faults & FILTER_TEST_BAD_CFILTERS)
+                    response->str[response->len - 1] ^= 1;
+                filter_test_served_filters++;
+                test_spv_post_msg(node, BTC_MSG_CFILTER, response);
+            }
+        }
+    } else if (strcmp(command, BTC_MSG_GETDATA) == 0) {
+        uint32_t amount;
+        u_assert_int_eq(deser_varlen(&amount, payload), true);
+        for (uint32_t i = 0; i < amount; i++) {
+            btc_p2p_inv_msg inv;
+            u_assert_int_eq(btc_p2p_msg_inv_deser(&inv, payload), true);
+            for (uint32_t h = 1; h <= FILTER_TEST_BLOCKS; h++) {
+                if (memcmp(filter_test_hashes[h], inv.hash, BTC_HASH_LENGTH) == 0) {
+                    cstr_resize(response, 0);
+                    filter_test_serialize_block(h, response);
+                    filter_test_served_blocks++;
+                    test_spv_post_msg(node, BTC_MSG_BLOCK, response);
+                }
+            }
+        }
+    }
+    cstr_free(response, true);
+}
+
+/* answer the requests queued in the nodes output buffers until all nodes are idle */
+static void filter_test_serve(btc_node **nodes, unsigned int amount, int faults) {
+    btc_bool idle = false;
+    while (!idle) {
+        idle = true;
+        for (unsigned int i = 0; i < amount; i++) {
+            if (!nodes[i]->event_bev)
+                continue;
+            struct evbuffer *output = bufferevent_get_output(nodes[i]->event_bev);
+            size_t len = evbuffer_get_length(output);
+            if (len == 0)
+                continue;
+            idle = false;
+            /* socket bufferevents don't allow draining their output buffer from outside */
+            evbuffer_unfreeze(output, 1);
+            cstring *data = cstr_new_sz(len);
+            data->len = evbuffer_remove(output, data->str, len);
+            evbuffer_freeze(output, 1);
+            struct const_buffer buf = {data->str, data->len};
+            while (buf.len >= BTC_P2P_HDRSZ) {
+                btc_p2p_msg_hdr hdr;
+                btc_p2p_deser_msghdr(&hdr, &buf);
+                struct const_buffer payload = {buf.p, hdr.data_len};
+                buf.p = (const char *)buf.p + hdr.data_len;
+                buf.len -= hdr.data_len;
+                filter_test_respond(nodes[i], hdr.command, &payload, faults);
+            }
+            cstr_free(data, true);
+        }
+    }
+}
+
+/* reconnect nodes marked as disconnected or missbehaving */
+static void filter_test_reconnect(btc_spv_client *client, btc_node **nodes, unsigned int amount) {
+    for (unsigned int i = 0; i < amount; i++) {
+        if ((nodes[i]->state & NODE_CONNECTED) == NODE_CONNECTED)
+            continue;
+        nodes[i]->state = NODE_CONNECTED;
+        nodes[i]->event_bev = bufferevent_socket_new(client->nodegroup->event_base, -1, 0);
+    }
+}
+
+void test_netspv_compact_filters()
+{
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->oldest_item_of_interest = 0;
+    client->use_compact_filters = true;
+    client->sync_transaction = filter_test_sync_transaction;
+    btc_blockfilter_matcher_add(client->filter_matcher, filter_test_wallet_script, sizeof(filter_test_wallet_script));
+
+    /* fixtures, the filter headers chain starts at the regtest genesis block (BIP158) */
+    cstring *msg = test_spv_mine_headers(filter_test_headers, FILTER_TEST_BLOCKS, filter_test_block_tx);
+    memcpy(filter_test_hashes[0], btc_chainparams_regtest.genesisblockhash, BTC_HASH_LENGTH);
+    uint8_t genesis_script[67];
+    int outlen;
+    utils_hex_to_bin("4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac", genesis_script, 134, &outlen);
+    struct const_buffer genesis_element = {genesis_script, sizeof(genesis_script)};
+    uint256 zero_header;
+    memset(zero_header, 0, sizeof(zero_header));
+    filter_test_filters[0] = cstr_new_sz(16);
+    btc_blockfilter_build(filter_test_filters[0], filter_test_hashes[0], &genesis_element, 1);
+    btc_blockfilter_hash((const uint8_t *)filter_test_filters[0]->str, filter_test_filters[0]->len, filter_test_filter_hashes[0]);
+    btc_blockfilter_header(filter_test_filter_hashes[0], zero_header, filter_test_filter_headers[0]);
+    for (uint32_t h = 1; h <= FILTER_TEST_BLOCKS; h++) {
+        btc_block_header_hash(&filter_test_headers[h - 1], filter_test_hashes[h]);
+        uint8_t script[25];
+        filter_test_output_script(h, script);
+        struct const_buffer element = {script, sizeof(script)};
+        filter_test_filters[h] = cstr_new_sz(64);
+        btc_blockfilter_build(filter_test_filters[h], filter_test_hashes[h], &element, 1);
+        btc_blockfilter_hash((const uint8_t *)filter_test_filters[h]->str, filter_test_filters[h]->len, filter_test_filter_hashes[h]);
+        btc_blockfilter_header(filter_test_filter_hashes[h], filter_test_filter_headers[h - 1], filter_test_filter_headers[h]);
+    }
+
+    /* two filter serving nodes and a full node without filters */
+    btc_node *nodes[3];
+    for (unsigned int i = 0; i < 3; i++) {
+        nodes[i] = btc_node_new();
+        btc_node_group_add_node(client->nodegroup, nodes[i]);
+        nodes[i]->state |= NODE_CONNECTED;
+        nodes[i]->version_handshake = true;
+        nodes[i]->services = BTC_NODE_NETWORK | (i < 2 ? BTC_NODE_COMPACT_FILTERS : 0);
+        nodes[i]->event_bev = bufferevent_socket_new(client->nodegroup->event_base, -1, 0);
+    }
+
+    test_spv_post_msg(nodes[0], BTC_MSG_HEADERS, msg);
+    cstr_free(msg, true);
+    u_assert_int_eq(client->block_requests_len, FILTER_TEST_BLOCKS);
+
+    /* the chain crosses a checkpoint interval, the checkpoints are requested before any filter headers */
+    u_assert_int_eq(client->cfcheckpt_node == nodes[0], true);
+    u_assert_is_null(client->cfheaders_node);
+
+    /* an unanswered getcfcheckpt times out and the checkpoints are requested from another node */
+    filter_test_serve(nodes, 3, FILTER_TEST_DROP_CFCHECKPT);
+    u_assert_int_eq(client->filter_checkpoints_height, 0);
+    uint64_t later = time(NULL) + 1000;
+    btc_net_spv_periodic_statecheck(nodes[2], &later);
+    u_assert_int_eq((nodes[0]->state & NODE_CONNECTED) == NODE_CONNECTED, false);
+    u_assert_int_eq(client->cfcheckpt_node == nodes[1], true);
+    u_assert_is_null(client->cfheaders_node);
+
+    /* an invalid cfcheckpt gets the node marked as missbehaving, the checkpoints are requested again */
+    filter_test_serve(nodes, 3, FILTER_TEST_BAD_CFCHECKPT);
+    u_assert_int_eq((nodes[1]->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED, true);
+    u_assert_int_eq(client->filter_checkpoints_height, 0);
+    u_assert_int_eq(client->filter_checkpoints_len, 0);
+    u_assert_is_null(client->cfheaders_node);
+    filter_test_reconnect(client, nodes, 3);
+    btc_net_spv_request_blocks(client);
+    u_assert_int_eq(client->cfcheckpt_node == nodes[0], true);
+
+    /* filter headers not matching the checkpoint at height 1000 are rejected,
+       they are requested from a different node than the checkpoints */
+    filter_test_serve(nodes, 3, FILTER_TEST_BAD_CFHEADERS);
+    u_assert_int_eq(client->filter_checkpoints_height, FILTER_TEST_BLOCKS);
+    u_assert_int_eq(client->filter_checkpoints_len, 1);
+    u_assert_int_eq(filter_test_cfcheckpt_server == nodes[0], true);
+    u_assert_int_eq(filter_test_cfheaders_server == nodes[1], true);
+    u_assert_int_eq((nodes[1]->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED, true);
+    u_assert_int_eq((nodes[0]->state & NODE_CONNECTED) == NODE_CONNECTED, true);
+    u_assert_int_eq(client->filter_header_height, 0);
+    /* the node that provided the checkpoints alone doesn't get asked for the filter headers */
+    u_assert_is_null(client->cfheaders_node);
+
+    /* a filter not committed by the filter headers chain gets the node marked as missbehaving */
+    filter_test_reconnect(client, nodes, 3);
+    btc_net_spv_request_blocks(client);
+    filter_test_serve(nodes, 3, FILTER_TEST_BAD_CFILTERS);
+    u_assert_int_eq(filter_scanned_amount, 0);
+    u_assert_int_eq(client->filter_header_height, FILTER_TEST_BLOCKS);
+    u_assert_int_eq(filter_test_cfheaders_server == nodes[1], true);
+    u_assert_int_eq((nodes[0]->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED, true);
+    u_assert_int_eq((nodes[1]->state & NODE_MISSBEHAVED) == NODE_MISSBEHAVED, true);
+
+    /* reconnect the filter serving nodes */
+    filter_test_reconnect(client, nodes, 3);
+    filter_test_served_filters = 0;
+    btc_net_spv_request_blocks(client);
+    filter_test_serve(nodes, 3, 0);
+
+    /* all filters are checked, only the matching blocks are downloaded and scanned in order */
+    u_assert_int_eq(filter_test_served_filters, FILTER_TEST_BLOCKS);
+    u_assert_int_eq(filter_test_served_blocks, 4);
+    u_assert_int_eq(filter_scanned_amount, 4);
+    u_assert_int_eq(filter_scanned_heights[0], 10);
+    u_assert_int_eq(filter_scanned_heights[1], 50);
+    u_assert_int_eq(filter_scanned_heights[2], 77);
+    u_assert_int_eq(filter_scanned_heights[3], 1005);
+    u_assert_int_eq(client->block_requests_len, 0);
+
+    for (uint32_t h = 0; h <= FILTER_TEST_BLOCKS; h++)
+        cstr_free(filter_test_filters[h], true);
+    btc_spv_client_free(client);
+}
+
+void test_netspv_peer_scoring()
+{
+    btc_spv_client* client = btc_spv_client_new(&btc_chainparams_regtest, false, true);
+    client->oldest_item_of_interest = 0;
+
+    /* a slow, a fast and a not yet measured node */
+    btc_node *nodes[3];
+    for (unsigned int i = 0; i < 3; i++) {
+        nodes[i] = btc_node_new();
+        btc_node_group_add_node(client->nodegroup, nodes[i]);
+        nodes[i]->state |= NODE_CONNECTED;
+        nodes[i]->version_handshake = true;
+        nodes[i]->bestknownheight = 20;
+        nodes[i]->event_bev = bufferevent_socket_new(client->nodegroup->event_base, -1, 0);
+    }
+    nodes[0]->ping_rtt_ms = 800;
+    nodes[1]->ping_rtt_ms = 50;
+    u_assert_int_eq(btc_net_spv_node_headers_score(nodes[1]) < btc_net_spv_node_headers_score(nodes[0]), true);
+    u_assert_int_eq(btc_net_spv_node_headers_score(nodes[0]) < btc_net_spv_node_headers_score(nodes[2]), true);
+    u_assert_int_eq(btc_net_spv_node_block_score(nodes[1]) < btc_net_spv_node_block_score(nodes[0]), true);
+
+    /* headers are requested from the fastest peer */
+    btc_net_spv_request_headers(client);
+    u_assert_int_eq((nodes[1]->state & NODE_HEADERSYNC) == NODE_HEADERSYNC, true);
+    u_assert_int_eq((nodes[0]->state & NODE_HEADERSYNC) == NODE_HEADERSYNC, false);
+
+    /* an overdue response moves the header sync to the next best peer long before the stall timeout */
+    client->last_headersrequest_ms -= 20000;
+    uint64_t now = time(NULL) + 1;
+    btc_net_spv_periodic_statecheck(nodes[0], &now);
+    u_assert_int_eq((nodes[1]->state & NODE_HEADERSYNC) == NODE_HEADERSYNC, false);
+    u_assert_int_eq((nodes[1]->state & NODE_CONNECTED) == NODE_CONNECTED, true);
+    u_assert_int_eq(nodes[1]->headers_response_ms >= 20000, true);
+    u_assert_int_eq((nodes[0]->state & NODE_HEADERSYNC) == NODE_HEADERSYNC, true);
+
+    /* the response time of the new header sync peer gets tracked */
+    btc_block_header headers[20];
+    cstring *msg = test_spv_mine_headers(headers, 20, test_spv_block_tx);
+    test_spv_post_msg(nodes[0], BTC_MSG_HEADERS, msg);
+    cstr_free(msg, true);
+    u_assert_int_eq(client->headers_db->getchaintip(client->headers_db_ctx)->height, 20);
+    u_assert_int_eq(nodes[0]->headers_response_ms > 0, true);
+    u_assert_int_eq(client->last_headersrequest_time, 0);
+
+    /* the blocks are spread by the expected delivery time, the fastest peer gets the lowest block */
+    u_assert_int_eq(client->block_requests_len, 20);
+    u_assert_int_eq(test_spv_requested_blocks(client, nodes[1]) > test_spv_requested_blocks(client, nodes[2]), true);
+    btc_spv_block_request *request = &client->block_requests[client->block_requests_first];
+    u_assert_int_eq(request->node == nodes[1], true);
+
+    /* a slow lowest block is moved to a faster peer without waiting for the stall timeout */
+    request->time_requested_ms -= 20000;
+    btc_net_spv_periodic_statecheck(nodes[0], &now);
+    u_assert_int_eq(request->stalled_node == nodes[1], true);
+    u_assert_int_eq(request->node != NULL && request->node != nodes[1], true);
+    u_assert_int_eq((nodes[1]->state & NODE_CONNECTED) == NODE_CONNECTED, true);
+    u_assert_int_eq(nodes[1]->block_bytes_per_s > 0, true);
+
+    /* the delivery updates the throughput of the peer */
+    btc_node *block_node = request->node;
+    u_assert_int_eq(block_node->block_bytes_per_s, 0);
+    test_spv_post_block(block_node, &headers[0], 1);
+    u_assert_int_eq(block_node->block_bytes_per_s > 0, true);
+    u_assert_int_eq(client->block_requests[client->block_requests_first].height, 2);
+
+    btc_spv_client_free(client);
+}
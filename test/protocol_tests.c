@@ -85,6 +85,7 @@ void test_protocol()
 
     u_assert_mem_eq(hdr.netmagic, &btc_chainparams_main.netmagic, 4);
     u_assert_str_eq(hdr.command, BTC_MSG_VERSION);
+    u_assert_int_eq(hdr.command_id, BTC_CMD_VERSION);
     u_assert_int_eq(hdr.data_len, version_msg_cstr->len);
     u_assert_int_eq(buf.len, hdr.data_len);
     u_assert_int_eq(buf.len, hdr.data_len);
@@ -100,6 +101,16 @@ void test_protocol()
     cstr_free(p2p_msg, true);
     cstr_free(version_msg_cstr, true);
 
+    /* command registry */
+    u_assert_int_eq(btc_p2p_command_id(BTC_MSG_GETCFCHECKPT), BTC_CMD_GETCFCHECKPT);
+    u_assert_int_eq(btc_p2p_command_id(BTC_MSG_TX), BTC_CMD_TX);
+    u_assert_int_eq(btc_p2p_command_id("txx"), BTC_CMD_UNKNOWN);
+    u_assert_int_eq(btc_p2p_command_id("getcfcheckpts"), BTC_CMD_UNKNOWN);
+    u_assert_str_eq(btc_p2p_command_str(BTC_CMD_CFHEADERS), BTC_MSG_CFHEADERS);
+    u_assert_int_eq(btc_p2p_command_str(BTC_CMD_UNKNOWN) == NULL, 1);
+    for (int i = BTC_CMD_UNKNOWN + 1; i < BTC_CMD_MAX; i++)
+        u_assert_int_eq(btc_p2p_command_id(btc_p2p_command_str(i)), i);
+
     /* getheaders */
     uint256 genesis_hash = {0x00, 0x00, 0x00, 0x00, 0x00, 0x19, 0xd6, 0x68, 0x9c, 0x08, 0x5a, 0xe1, 0x65, 0x83, 0x1e, 0x93, 0x4f, 0xf7, 0x63, 0xae, 0x46, 0xa2, 0xa6, 0xc1, 0x72, 0xb3, 0xf1, 0xb6, 0x0a, 0x8c, 0xe2, 0x6f};
     vector *blocklocators = vector_new(1, NULL);
@@ -113,6 +124,7 @@ void test_protocol()
     buf.len = p2p_msg->len;
     btc_p2p_deser_msghdr(&hdr, &buf);
     u_assert_str_eq(hdr.command, BTC_MSG_GETHEADERS);
+    u_assert_int_eq(hdr.command_id, BTC_CMD_GETHEADERS);
     u_assert_int_eq(hdr.data_len, getheader_msg->len);
 
 
@@ -85,5 +85,52 @@ void test_serialize()
     assert(deser_u32(&u32, &buf3) == false);
     assert(deser_u64(&u64, &buf3) == false);
     assert(deser_s32(&i32, &buf3) == false);
+
+    /* a sink serializes into a buffer, a running hash and a file at once */
+    cstring* expected = cstr_new_sz(200);
+    cstring* str = cstr_new("foo");
+    ser_u16(expected, 0xAAFF);
+    ser_s32(expected, -2);
+    ser_u64(expected, 0x99FF99FFDDBBAAFF);
+    ser_varlen(expected, 100000000);
+    ser_varstr(expected, str);
+    ser_varstr(expected, NULL);
+    ser_u256(expected, hash);
+
+    cstring* s4 = cstr_new_sz(200);
+    SHA256_CTX ctx;
+    sha256_Init(&ctx);
+    FILE* file = tmpfile();
+    btc_ser_sink sink;
+    btc_ser_sink_init(&sink, s4, &ctx, file);
+    ser_sink_u16(&sink, 0xAAFF);
+    ser_sink_s32(&sink, -2);
+    ser_sink_u64(&sink, 0x99FF99FFDDBBAAFF);
+    ser_sink_varlen(&sink, 100000000);
+    ser_sink_varstr(&sink, str);
+    ser_sink_varstr(&sink, NULL);
+    ser_sink_u256(&sink, hash);
+
+    assert(s4->len == expected->len);
+    assert(memcmp(s4->str, expected->str, expected->len) == 0);
+    uint8_t digest[SHA256_DIGEST_LENGTH], digest_expected[SHA256_DIGEST_LENGTH];
+    sha256_Final(digest, &ctx);
+    sha256_Raw((const uint8_t*)expected->str, expected->len, digest_expected);
+    assert(memcmp(digest, digest_expected, sizeof(digest)) == 0);
+    char filebuf[200];
+    rewind(file);
+    assert(fread(filebuf, 1, sizeof(filebuf), file) == expected->len);
+    assert(memcmp(filebuf, expected->str, expected->len) == 0);
+    assert(sink.failed == false);
+    fclose(file);
+
+    /* short writes are recorded in the sink */
+    file = fopen("/dev/null", "r");
+    btc_ser_sink_init(&sink, NULL, NULL, file);
+    ser_sink_u32(&sink, 1);
+    assert(sink.failed == true);
+    cstr_free(s4, true);
+    cstr_free(str, true);
+    cstr_free(expected, true);
 }
 
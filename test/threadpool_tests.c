@@ -0,0 +1,54 @@
+/**********************************************************************
+ * Copyright (c) 2017 Jonas Schnelli                                  *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/threadpool.h>
+#include <btc/utils.h>
+
+#include "utest.h"
+
+static void mark_range(void* ctx, size_t begin, size_t end)
+{
+    uint32_t* items = (uint32_t*)ctx;
+    for (size_t i = begin; i < end; i++)
+        items[i] += (uint32_t)i + 1;
+}
+
+void test_threadpool()
+{
+    const size_t amount = 10000;
+    uint32_t* items = btc_calloc(amount, sizeof(uint32_t));
+
+    /* every item must be processed exactly once, also over multiple jobs */
+    btc_threadpool* pool = btc_threadpool_new(3);
+    u_assert_int_eq(pool->num_threads, 3);
+    for (unsigned int run = 0; run < 5; run++) {
+        btc_threadpool_run(pool, amount, 16, mark_range, items);
+    }
+    for (size_t i = 0; i < amount; i++)
+        u_assert_int_eq(items[i], (i + 1) * 5);
+
+    /* small jobs run on the calling thread */
+    memset(items, 0, amount * sizeof(uint32_t));
+    btc_threadpool_run(pool, 10, 16, mark_range, items);
+    u_assert_int_eq(items[9], 10);
+    u_assert_int_eq(items[10], 0);
+    btc_threadpool_free(pool);
+
+    /* no pool */
+    memset(items, 0, amount * sizeof(uint32_t));
+    btc_threadpool_run(NULL, amount, 1, mark_range, items);
+    u_assert_int_eq(items[amount - 1], amount);
+
+    /* auto sized pool */
+    pool = btc_threadpool_new(0);
+    btc_threadpool_free(pool);
+
+    btc_free(items);
+}
@@ -0,0 +1,113 @@
+/**********************************************************************
+ * Copyright (c) 2017 Jonas Schnelli                                  *
+ * Distributed under the MIT software license, see the accompanying   *
+ * file COPYING or http://www.opensource.org/licenses/mit-license.php.*
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <btc/timerwheel.h>
+
+#include "utest.h"
+
+#define TIMER_TEST_AMOUNT 500
+
+static btc_timer_wheel test_wheel;
+static uint64_t test_fired_at[TIMER_TEST_AMOUNT];
+static unsigned int test_fired = 0;
+
+static void test_timer_cb(btc_timer* timer, void* ctx)
+{
+    (void)(timer);
+    uint64_t* fired_at = (uint64_t*)ctx;
+    *fired_at = test_wheel.current;
+    test_fired++;
+}
+
+static unsigned int test_periodic_runs = 0;
+
+static void test_periodic_cb(btc_timer* timer, void* ctx)
+{
+    (void)(ctx);
+    test_periodic_runs++;
+    if (test_periodic_runs < 5)
+        btc_timer_schedule(&test_wheel, timer, 1000);
+}
+
+void test_timerwheel()
+{
+    /* 100ms ticks */
+    uint64_t start = 1000000;
+    btc_timer_wheel_init(&test_wheel, 100, start);
+
+    btc_timer timers[TIMER_TEST_AMOUNT];
+    uint64_t expected[TIMER_TEST_AMOUNT];
+    const uint64_t delays[6] = {1, 250, 6400, 6500, 500000, 30ULL * 24 * 3600 * 1000};
+    for (unsigned int i = 0; i < 6; i++) {
+        btc_timer_init(&timers[i], test_timer_cb, &test_fired_at[i]);
+        btc_timer_schedule(&test_wheel, &timers[i], delays[i]);
+        expected[i] = (delays[i] + 99) / 100;
+    }
+    /* timers beyond the wheels range fire at its end */
+    expected[5] = (1ULL << (BTC_TIMER_WHEEL_LEVELS * BTC_TIMER_WHEEL_SLOT_BITS)) - 1;
+    u_assert_int_eq(test_wheel.pending, 6);
+
+    /* nothing expires before the first tick */
+    u_assert_int_eq(btc_timer_wheel_advance(&test_wheel, start + 99), 0);
+    u_assert_int_eq(btc_timer_wheel_advance(&test_wheel, start + 100), 1);
+    u_assert_int_eq(test_fired_at[0], 1);
+
+    /* canceled timers don't fire, rescheduling moves a timer */
+    btc_timer_cancel(&test_wheel, &timers[1]);
+    u_assert_int_eq(btc_timer_pending(&test_wheel, &timers[1]), false);
+    btc_timer_cancel(&test_wheel, &timers[1]);
+    btc_timer_schedule(&test_wheel, &timers[3], 200);
+    expected[3] = 3;
+    u_assert_int_eq(btc_timer_wheel_advance(&test_wheel, start + 1000), 1);
+    u_assert_int_eq(test_fired_at[3], 3);
+
+    /* cascaded from the higher levels at the exact tick */
+    u_assert_int_eq(btc_timer_wheel_advance(&test_wheel, start + 6399), 0);
+    u_assert_int_eq(btc_timer_wheel_advance(&test_wheel, start + 6400), 1);
+    u_assert_int_eq(test_fired_at[2], expected[2]);
+    u_assert_int_eq(btc_timer_wheel_advance(&test_wheel, start + 500000 - 100), 0);
+    u_assert_int_eq(btc_timer_wheel_advance(&test_wheel, start + 500000), 1);
+    u_assert_int_eq(test_fired_at[4], expected[4]);
+    u_assert_int_eq(test_wheel.pending, 1);
+    btc_timer_cancel(&test_wheel, &timers[5]);
+    u_assert_int_eq(test_wheel.pending, 0);
+
+    /* an idle wheel jumps ahead, timers rescheduling themselves in their callback */
+    btc_timer_wheel_advance(&test_wheel, start + 10000000);
+    u_assert_int_eq(test_wheel.current, 100000);
+    btc_timer periodic;
+    btc_timer_init(&periodic, test_periodic_cb, NULL);
+    btc_timer_schedule(&test_wheel, &periodic, 1000);
+    u_assert_int_eq(btc_timer_wheel_advance(&test_wheel, start + 10000000 + 60000), 5);
+    u_assert_int_eq(test_periodic_runs, 5);
+    u_assert_int_eq(btc_timer_pending(&test_wheel, &periodic), false);
+    btc_timer_wheel_deinit(&test_wheel);
+
+    /* random delays and steps, every timer fires exactly at its tick */
+    btc_timer_wheel_init(&test_wheel, 10, 0);
+    test_fired = 0;
+    srand(42);
+    for (unsigned int i = 0; i < TIMER_TEST_AMOUNT; i++) {
+        uint64_t delay = (uint64_t)rand() % (i % 2 ? 2000000 : 5000);
+        btc_timer_init(&timers[i], test_timer_cb, &test_fired_at[i]);
+        btc_timer_schedule(&test_wheel, &timers[i], delay);
+        expected[i] = (delay > 0 ? (delay + 9) / 10 : 1);
+        test_fired_at[i] = 0;
+    }
+    uint64_t now = 0;
+    while (test_fired < TIMER_TEST_AMOUNT && now < 3000000) {
+        now += (uint64_t)rand() % 50000;
+        btc_timer_wheel_advance(&test_wheel, now);
+    }
+    u_assert_int_eq(test_fired, TIMER_TEST_AMOUNT);
+    for (unsigned int i = 0; i < TIMER_TEST_AMOUNT; i++)
+        u_assert_int_eq(test_fired_at[i], expected[i]);
+    u_assert_int_eq(test_wheel.pending, 0);
+    btc_timer_wheel_deinit(&test_wheel);
+}
@@ -720,6 +720,15 @@ void test_tx_sighash()
         memset(sighash, 0, sizeof(sighash));
         btc_tx_sighash(tx, script, test->inputindex, test->hashtype, sighash);
 
+        /* same hash with the precomputed transaction data */
+        btc_tx_sighash_cache cache;
+        btc_tx_sighash_cache_init(&cache, tx);
+        uint256 sighash_cached;
+        memset(sighash_cached, 0, sizeof(sighash_cached));
+        btc_tx_sighash_cached(&cache, script, test->inputindex, test->hashtype, sighash_cached);
+        assert(memcmp(sighash, sighash_cached, sizeof(sighash)) == 0);
+        btc_tx_sighash_cache_free(&cache);
+
         vector* vec = vector_new(10, btc_script_op_free_cb);
         btc_script_get_ops(script, vec);
         enum btc_tx_out_type type = btc_script_classify_ops(vec);
@@ -739,9 +748,122 @@ void test_tx_sighash()
 
         btc_tx_free(tx);
     }
+
+    /* consolidation transaction, all inputs and hash types */
+    btc_tx* tx = btc_tx_new();
+    for (i = 0; i < 300; i++) {
+        btc_tx_in* tx_in = btc_tx_in_new();
+        memset(tx_in->prevout.hash, i & 0xff, sizeof(tx_in->prevout.hash));
+        tx_in->prevout.n = i;
+        tx_in->sequence = 0xfffffffe - i;
+        vector_add(tx->vin, tx_in);
+    }
+    uint8_t data[4] = {0x01, 0x02, 0x03, 0x04};
+    btc_tx_add_data_out(tx, 0, data, sizeof(data));
+    btc_tx_add_data_out(tx, 1000, data, sizeof(data));
+    tx->locktime = 500000;
+
+    uint8_t script_data[25] = {OP_DUP, OP_HASH160, 20};
+    script_data[23] = OP_EQUALVERIFY;
+    script_data[24] = OP_CHECKSIG;
+    cstring* script = cstr_new_buf(script_data, sizeof(script_data));
+    btc_tx_sighash_cache cache;
+    btc_tx_sighash_cache_init(&cache, tx);
+    const int hashtypes[] = {SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY};
+    for (unsigned int j = 0; j < sizeof(hashtypes) / sizeof(hashtypes[0]); j++) {
+        for (i = 0; i < tx->vin->len; i++) {
+            uint256 sighash, sighash_cached;
+            btc_bool ret = btc_tx_sighash(tx, script, i, hashtypes[j], sighash);
+            assert(ret == btc_tx_sighash_cached(&cache, script, i, hashtypes[j], sighash_cached));
+            /* SIGHASH_SINGLE is only defined for inputs with an output at the same index */
+            assert(ret == ((hashtypes[j] & 0x1f) != SIGHASH_SINGLE || i < tx->vout->len));
+            if (ret)
+                assert(memcmp(sighash, sighash_cached, sizeof(sighash)) == 0);
+        }
+    }
+    btc_tx_sighash_cache_free(&cache);
+    cstr_free(script, true);
+    btc_tx_free(tx);
 }
 
 
+/* native P2WPKH and P2SH-P2WPKH examples from BIP143 */
+struct sighash_segwit_test {
+    const char* txhex;
+    unsigned int inputindex;
+    int64_t amount;
+    const char* script_code;
+    const char* hash_prevouts;
+    const char* hash_sequence;
+    const char* hash_outputs;
+    const char* hashhex;
+};
+
+static const struct sighash_segwit_test sighash_segwit_tests[] = {
+    {"0100000002fff7f7881a8099afa6940d42d1e7f6362bec38171ea3edf433541db4e4ad969f0000000000eeffffffef51e1b804cc89d182d279655c3aa89e815b1b309fe287d9b2b55d57b90ec68a0100000000ffffffff02202cb206000000001976a9148280b37df378db99f66f85c95a783a76ac7a6d5988ac9093510d000000001976a9143bde42dbee7e4dbe6a21b2d50ce2f0167faa815988ac11000000",
+     1, 600000000, "76a9141d0f172a0ecb48aee1be1f2687d2963ae33f71a188ac",
+     "96b827c8483d4e9b96712b6713a7b68d6e8003a781feba36c31143470b4efd37",
+     "52b0a642eea2fb7ae638c36f6252b6750293dbe574a806984b8e4d8548339a3b",
+     "863ef3e1a92afbfdb97f31ad0fc7683ee943e9abcf2501590ff8f6551f47e5e5",
+     "c37af31116d1b27caf68aae9e3ac82f1477929014d5b917657d0eb49478cb670"},
+    {"0100000001db6b1b20aa0fd7b23880be2ecbd4a98130974cf4748fb66092ac4d3ceb1a54770100000000feffffff02b8b4eb0b000000001976a914a457b684d7f0d539a46a45bbc043f35b59d0d96388ac0008af2f000000001976a914fd270b1ee6abcaea97fea7ad0402e8bd8ad6d77c88ac92040000",
+     0, 1000000000, "76a91479091972186c449eb1ded22b78e40d009bdf008988ac",
+     "b0287b4a252ac05af83d2dcef00ba313af78a3e9c329afa216eb3aa2a7b4613a",
+     "18606b350cd8bf565266bc352f0caddcf01e8fa789dd8a15386327cf8cabe198",
+     "de984f44532e2173ca0d64314fcefe6d30da6f8cf27bafa706da61df8a226c83",
+     "64f3b0f4dd2bb3aa1ce8566d220cc74dda9df97d8490cc81d89d735c92e59fb6"},
+};
+
+void test_tx_sighash_segwit()
+{
+    unsigned int i;
+    for (i = 0; i < (sizeof(sighash_segwit_tests) / sizeof(sighash_segwit_tests[0])); i++) {
+        const struct sighash_segwit_test* test = &sighash_segwit_tests[i];
+        int outlen;
+        uint8_t tx_data[512];
+        utils_hex_to_bin(test->txhex, tx_data, strlen(test->txhex), &outlen);
+        btc_tx* tx = btc_tx_new();
+        u_assert_int_eq(btc_tx_deserialize(tx_data, outlen, tx, NULL), true);
+
+        uint8_t script_data[64];
+        utils_hex_to_bin(test->script_code, script_data, strlen(test->script_code), &outlen);
+        cstring* script_code = cstr_new_buf(script_data, outlen);
+
+        btc_tx_sighash_cache cache;
+        btc_tx_sighash_cache_init(&cache, tx);
+        uint256 expected;
+        utils_hex_to_bin(test->hash_prevouts, expected, 64, &outlen);
+        u_assert_mem_eq(cache.hash_prevouts, expected, BTC_HASH_LENGTH);
+        utils_hex_to_bin(test->hash_sequence, expected, 64, &outlen);
+        u_assert_mem_eq(cache.hash_sequence, expected, BTC_HASH_LENGTH);
+        utils_hex_to_bin(test->hash_outputs, expected, 64, &outlen);
+        u_assert_mem_eq(cache.hash_outputs, expected, BTC_HASH_LENGTH);
+
+        uint256 sighash;
+        utils_hex_to_bin(test->hashhex, expected, 64, &outlen);
+        u_assert_int_eq(btc_tx_sighash_segwit(tx, script_code, test->inputindex, test->amount, SIGHASH_ALL, sighash), true);
+        u_assert_mem_eq(sighash, expected, BTC_HASH_LENGTH);
+        memset(sighash, 0, sizeof(sighash));
+        u_assert_int_eq(btc_tx_sighash_segwit_cached(&cache, script_code, test->inputindex, test->amount, SIGHASH_ALL, sighash), true);
+        u_assert_mem_eq(sighash, expected, BTC_HASH_LENGTH);
+
+        /* the other hash types (with partially zeroed hashes) match the uncached computation */
+        const int hashtypes[] = {SIGHASH_NONE, SIGHASH_SINGLE, SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY};
+        for (unsigned int j = 0; j < sizeof(hashtypes) / sizeof(hashtypes[0]); j++) {
+            uint256 sighash_cached;
+            btc_tx_sighash_segwit(tx, script_code, test->inputindex, test->amount, hashtypes[j], sighash);
+            btc_tx_sighash_segwit_cached(&cache, script_code, test->inputindex, test->amount, hashtypes[j], sighash_cached);
+            u_assert_mem_eq(sighash, sighash_cached, BTC_HASH_LENGTH);
+            u_assert_int_eq(memcmp(sighash, expected, BTC_HASH_LENGTH) != 0, true);
+        }
+        u_assert_int_eq(btc_tx_sighash_segwit_cached(&cache, script_code, tx->vin->len, test->amount, SIGHASH_ALL, sighash), false);
+
+        btc_tx_sighash_cache_free(&cache);
+        cstr_free(script_code, true);
+        btc_tx_free(tx);
+    }
+}
+
 void test_tx_negative_version()
 {
     char txhex[] =   "ffffffff0100000000000000000000000000000000000000000000000000000000000000000000000000ffffffff0100e1f505000000000000000000";
@@ -980,3 +1102,135 @@ void test_invalid_tx_deser()
 }
 
 
+
+void test_tx_view()
+{
+    btc_tx_view view;
+    btc_tx_view_init(&view);
+
+    /* the same view is reused for all transactions */
+    unsigned int i;
+    for (i = 0; i < (sizeof(txvalid) / sizeof(txvalid[0])); i++) {
+        const struct txtest* one_test = &txvalid[i];
+        uint8_t tx_data[sizeof(one_test->hextx) / 2];
+        int outlen;
+        utils_hex_to_bin(one_test->hextx, tx_data, strlen(one_test->hextx), &outlen);
+
+        btc_tx* tx = btc_tx_new();
+        btc_tx_deserialize(tx_data, outlen, tx, NULL);
+
+        struct const_buffer buf = {tx_data, outlen};
+        u_assert_int_eq(btc_tx_view_parse(&view, &buf), true);
+        u_assert_int_eq(buf.len, 0);
+        u_assert_int_eq(view.tx.len, outlen);
+        u_assert_int_eq(view.version, tx->version);
+        u_assert_int_eq(view.locktime, tx->locktime);
+        u_assert_int_eq(view.vin_count, tx->vin->len);
+        u_assert_int_eq(view.vout_count, tx->vout->len);
+
+        size_t j;
+        for (j = 0; j < tx->vin->len; j++) {
+            btc_tx_in* tx_in = vector_idx(tx->vin, j);
+            btc_tx_in_view in;
+            u_assert_int_eq(btc_tx_view_get_input(&view, j, &in), true);
+            u_assert_mem_eq(in.prevout_hash, tx_in->prevout.hash, 32);
+            u_assert_int_eq(in.prevout_n, tx_in->prevout.n);
+            u_assert_int_eq(in.script_sig.len, tx_in->script_sig->len);
+            u_assert_mem_eq(in.script_sig.p, tx_in->script_sig->str, in.script_sig.len);
+            u_assert_int_eq(in.sequence, tx_in->sequence);
+        }
+        for (j = 0; j < tx->vout->len; j++) {
+            btc_tx_out* tx_out = vector_idx(tx->vout, j);
+            btc_tx_out_view out;
+            u_assert_int_eq(btc_tx_view_get_output(&view, j, &out), true);
+            u_assert_int_eq(out.value == tx_out->value, true);
+            u_assert_int_eq(out.script_pubkey.len, tx_out->script_pubkey->len);
+            u_assert_mem_eq(out.script_pubkey.p, tx_out->script_pubkey->str, out.script_pubkey.len);
+        }
+        btc_tx_in_view in;
+        btc_tx_out_view out;
+        u_assert_int_eq(btc_tx_view_get_input(&view, tx->vin->len, &in), false);
+        u_assert_int_eq(btc_tx_view_get_output(&view, tx->vout->len, &out), false);
+
+        uint256 hash, hash_view;
+        btc_tx_hash(tx, hash);
+        btc_tx_view_hash(&view, hash_view);
+        u_assert_mem_eq(hash, hash_view, sizeof(hash));
+
+        /* truncated transactions are rejected */
+        buf.p = tx_data;
+        buf.len = outlen - 1;
+        u_assert_int_eq(btc_tx_view_parse(&view, &buf), false);
+        u_assert_int_eq(buf.len, (size_t)outlen - 1);
+
+        btc_tx_free(tx);
+    }
+    btc_tx_view_free(&view);
+}
+
+void test_tx_deserialize_arena()
+{
+    unsigned int i;
+    for (i = 0; i < (sizeof(txvalid) / sizeof(txvalid[0])); i++) {
+        const struct txtest* one_test = &txvalid[i];
+        uint8_t tx_data[sizeof(one_test->hextx) / 2];
+        int outlen;
+        utils_hex_to_bin(one_test->hextx, tx_data, strlen(one_test->hextx), &outlen);
+
+        btc_tx* tx = btc_tx_new();
+        btc_tx_deserialize(tx_data, outlen, tx, NULL);
+
+        size_t arena_size = btc_tx_deserialize_arena_size(tx_data, outlen);
+        u_assert_int_eq(arena_size > 0, true);
+        void* arena = btc_malloc(arena_size);
+        size_t consumed = 0;
+
+        /* a too small arena is rejected */
+        u_assert_is_null(btc_tx_deserialize_arena(tx_data, outlen, arena, arena_size - 1, &consumed));
+        u_assert_int_eq(consumed, 0);
+
+        btc_tx* tx_arena = btc_tx_deserialize_arena(tx_data, outlen, arena, arena_size, &consumed);
+        u_assert_not_null(tx_arena);
+        u_assert_int_eq(consumed, (size_t)outlen);
+        u_assert_int_eq(tx_arena->version, tx->version);
+        u_assert_int_eq(tx_arena->locktime, tx->locktime);
+        u_assert_int_eq(tx_arena->vin->len, tx->vin->len);
+        u_assert_int_eq(tx_arena->vout->len, tx->vout->len);
+
+        size_t j;
+        for (j = 0; j < tx->vin->len; j++) {
+            btc_tx_in* tx_in = vector_idx(tx->vin, j);
+            btc_tx_in* tx_in_arena = vector_idx(tx_arena->vin, j);
+            u_assert_int_eq(cstr_equal(tx_in->script_sig, tx_in_arena->script_sig), true);
+            u_assert_int_eq(tx_in_arena->script_sig->str[tx_in_arena->script_sig->len], 0);
+        }
+        for (j = 0; j < tx->vout->len; j++) {
+            btc_tx_out* tx_out = vector_idx(tx->vout, j);
+            btc_tx_out* tx_out_arena = vector_idx(tx_arena->vout, j);
+            u_assert_int_eq(tx_out->value == tx_out_arena->value, true);
+            u_assert_int_eq(cstr_equal(tx_out->script_pubkey, tx_out_arena->script_pubkey), true);
+        }
+
+        cstring* ser = cstr_new_sz(outlen);
+        btc_tx_serialize(ser, tx_arena);
+        u_assert_int_eq(ser->len, (size_t)outlen);
+        u_assert_mem_eq(ser->str, tx_data, outlen);
+        cstr_free(ser, true);
+
+        /* a copy is an ordinary transaction that outlives the arena */
+        btc_tx* tx_copy = btc_tx_new();
+        btc_tx_copy(tx_copy, tx_arena);
+        btc_free(arena);
+
+        uint256 hash, hash_copy;
+        btc_tx_hash(tx, hash);
+        btc_tx_hash(tx_copy, hash_copy);
+        u_assert_mem_eq(hash, hash_copy, sizeof(hash));
+
+        /* truncated transactions are rejected */
+        u_assert_int_eq(btc_tx_deserialize_arena_size(tx_data, outlen - 1), 0);
+
+        btc_tx_free(tx_copy);
+        btc_tx_free(tx);
+    }
+}
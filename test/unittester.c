@@ -37,6 +37,7 @@
 extern void test_sha_256();
 extern void test_sha_512();
 extern void test_sha_hmac();
+extern void test_threadpool();
 extern void test_cstr();
 extern void test_buffer();
 extern void test_utils();
@@ -46,13 +47,18 @@ extern void test_random();
 extern void test_bitcoin_hash();
 extern void test_base58check();
 extern void test_block_header();
+extern void test_block_merkle();
+extern void test_blockfilter();
 extern void test_bip32();
 extern void test_ecc();
 extern void test_vector();
 extern void test_aes();
 extern void test_tx_serialization();
 extern void test_tx_sighash();
+extern void test_tx_sighash_segwit();
 extern void test_tx_negative_version();
+extern void test_tx_view();
+extern void test_tx_deserialize_arena();
 extern void test_script_parse();
 extern void test_script_op_codeseperator();
 extern void test_invalid_tx_deser();
@@ -61,6 +67,8 @@ extern void test_txref();
 
 #ifdef WITH_WALLET
 extern void test_wallet();
+extern void test_logdb_memdb();
+extern void test_logdb_rbtree();
 #endif
 
 #ifdef WITH_TOOLS
@@ -69,8 +77,24 @@ extern void test_tool();
 
 #ifdef WITH_NET
 extern void test_net_basics_plus_download_block();
+extern void test_net_read_framing();
+extern void test_net_ping_latency();
+extern void test_net_send_message();
+extern void test_net_recv_budget();
+extern void test_net_dns_seeding();
+extern void test_addrman();
+extern void test_addrman_messages();
+extern void test_timerwheel();
+extern void test_net_threaded_group();
+extern void test_net_threaded_free_jobs();
 extern void test_protocol();
+extern void test_netspv_block_download();
+extern void test_netspv_reorg();
+extern void test_netspv_compact_filters();
+extern void test_netspv_peer_scoring();
 extern void test_netspv();
+extern void test_blockindex_map();
+extern void test_headersdb();
 #endif
 
 extern void btc_ecc_start();
@@ -86,6 +110,7 @@ int main()
     u_run_test(test_sha_256);
     u_run_test(test_sha_512);
     u_run_test(test_sha_hmac);
+    u_run_test(test_threadpool);
     u_run_test(test_utils);
     u_run_test(test_cstr);
     u_run_test(test_buffer);
@@ -103,8 +128,13 @@ int main()
     u_run_test(test_tx_serialization);
     u_run_test(test_invalid_tx_deser);
     u_run_test(test_tx_sighash);
+    u_run_test(test_tx_sighash_segwit);
     u_run_test(test_tx_negative_version);
+    u_run_test(test_tx_view);
+    u_run_test(test_tx_deserialize_arena);
     u_run_test(test_block_header);
+    u_run_test(test_block_merkle);
+    u_run_test(test_blockfilter);
     u_run_test(test_script_parse);
     u_run_test(test_script_op_codeseperator);
 
@@ -114,6 +144,8 @@ int main()
 
 #ifdef WITH_WALLET
     //u_run_test(test_wallet);
+    u_run_test(test_logdb_memdb);
+    u_run_test(test_logdb_rbtree);
 #endif
 
 #ifdef WITH_TOOLS
@@ -121,6 +153,22 @@ int main()
 #endif
 
 #ifdef WITH_NET
+    u_run_test(test_blockindex_map);
+    u_run_test(test_headersdb);
+    u_run_test(test_addrman);
+    u_run_test(test_addrman_messages);
+    u_run_test(test_timerwheel);
+    u_run_test(test_net_read_framing);
+    u_run_test(test_net_ping_latency);
+    u_run_test(test_net_send_message);
+    u_run_test(test_net_recv_budget);
+    u_run_test(test_net_dns_seeding);
+    u_run_test(test_net_threaded_group);
+    u_run_test(test_net_threaded_free_jobs);
+    u_run_test(test_netspv_block_download);
+    u_run_test(test_netspv_reorg);
+    u_run_test(test_netspv_compact_filters);
+    u_run_test(test_netspv_peer_scoring);
     u_run_test(test_netspv);
 
     u_run_test(test_protocol);